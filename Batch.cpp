@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <QDir>
+#include <QFileInfo>
+#include <QRegExp>
+#include <QSet>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QtConcurrentMap>
+#include "Batch.h"
+#include "ImportExport.h"
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+namespace
+{
+  // Times are in ms since the batch started, from one shared clock so jobs
+  // on different threads can be compared
+  struct BatchFile
+  {
+    QString input;
+    Importer *importer;     // NULL for project files
+    const QElapsedTimer *clock;
+
+    SproxelProjectPtr project;
+    qint64 start, loaded, end;
+
+    BatchFile() : importer(NULL), clock(NULL), start(0), loaded(0), end(0) {}
+  };
+
+
+  struct BatchSprite
+  {
+    BatchFile *file;
+    VoxelGridGroupPtr sprite;   // private copy, its lazy caches are built by one worker only
+    const QList<Exporter*> *exporters;
+    QStringList outputs;    // one per exporter
+    QVector<bool> ok;
+    qint64 start, end;
+
+    BatchSprite() : file(NULL), exporters(NULL), start(0), end(0) {}
+  };
+}
+
+
+static void print_batch_usage()
+{
+  fprintf(stderr,
+    "usage: sproxel --batch [options] files...\n"
+    "\n"
+    "Converts .sxl/.sxb projects and importable files without a display.\n"
+    "Every sprite is exported with each chosen exporter.\n"
+    "\n"
+    "  -f, --format F   exporter name or file extension, may be repeated\n"
+    "  -o, --output D   output directory, default is next to each input\n"
+    "  -j, --jobs N     worker threads, default is one per core\n"
+    "  -l, --list       list the available exporters\n"
+    "  -h, --help       this text\n");
+}
+
+
+// Extension of the first pattern of the exporter filter, like ".obj"
+static QString exporter_ext(Exporter *exp)
+{
+  QStringList patterns=exp->filter().split(' ', QString::SkipEmptyParts);
+  if (patterns.isEmpty()) return QString();
+
+  QString ext=patterns[0];
+  if (ext.startsWith('*')) ext.remove(0, 1);
+  return ext;
+}
+
+
+static Exporter* find_exporter(const QString &format)
+{
+  const QList<Exporter*> &exporters=get_exporters();
+
+  foreach (Exporter *exp, exporters)
+    if (exp->name().compare(format, Qt::CaseInsensitive)==0) return exp;
+
+  const QString ext=format.startsWith('.') ? format : "."+format;
+  foreach (Exporter *exp, exporters)
+    if (exporter_ext(exp).compare(ext, Qt::CaseInsensitive)==0) return exp;
+
+  return NULL;
+}
+
+
+static Importer* find_importer(const QString &filename)
+{
+  const QString name=QFileInfo(filename).fileName();
+
+  foreach (Importer *imp, get_importers())
+    foreach (const QString &pattern, imp->filter().split(' ', QString::SkipEmptyParts))
+      if (QRegExp(pattern, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(name)) return imp;
+
+  return NULL;
+}
+
+
+static bool is_project_file(const QString &filename)
+{
+  return filename.endsWith(".sxl", Qt::CaseInsensitive) || filename.endsWith(".sxb", Qt::CaseInsensitive);
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+static void load_batch_file(BatchFile &f)
+{
+  f.start=f.clock->elapsed();
+
+  if (!f.importer)
+    f.project=load_project(f.input);
+  else
+  {
+    SproxelProjectPtr project(new SproxelProject());
+    UndoManager um;
+    if (f.importer->doImport(f.input, &um, project, VoxelGridGroupPtr())) f.project=project;
+  }
+
+  f.loaded=f.end=f.clock->elapsed();
+}
+
+
+// Sprites of a project may share layers, so each deferred layer is decoded
+// by exactly one job
+static void load_batch_layer(VoxelGridLayerPtr &layer)
+{
+  layer->load();
+}
+
+
+static void export_batch_sprite(BatchSprite &s)
+{
+  s.start=s.file->clock->elapsed();
+
+  s.ok.resize(s.exporters->size());
+  for (int i=0; i<s.exporters->size(); ++i)
+    s.ok[i]=(*s.exporters)[i]->doExport(s.outputs[i], s.file->project, s.sprite);
+
+  s.end=s.file->clock->elapsed();
+}
+
+
+// Output path without extension, the sprite name is added for projects
+// with several sprites
+static QString output_base(const BatchFile &f, int i, const QString &outDir, QSet<QString> &used)
+{
+  QFileInfo fi(f.input);
+  QString base=fi.completeBaseName();
+
+  if (f.project->sprites.size()>1)
+  {
+    QString name=f.project->sprites[i]->name();
+    name.replace(QRegExp("[^A-Za-z0-9_.-]"), "_");
+    if (name.isEmpty() || used.contains(name)) name+=QString::number(i);
+    used.insert(name);
+    base+="_"+name;
+  }
+
+  return QDir(outDir.isEmpty() ? fi.absolutePath() : outDir).filePath(base);
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+int run_batch(const QStringList &args)
+{
+  QList<Exporter*> exporters;
+  QStringList inputs;
+  QString outDir;
+
+  for (int i=1; i<args.size(); ++i)
+  {
+    const QString &a=args[i];
+
+    if (a=="--batch") continue;
+
+    if (a=="-h" || a=="--help")
+    {
+      print_batch_usage();
+      return 0;
+    }
+
+    if (a=="-l" || a=="--list")
+    {
+      foreach (Exporter *exp, get_exporters())
+        printf("%s (%s)\n", qPrintable(exp->name()), qPrintable(exp->filter()));
+      return 0;
+    }
+
+    if (a=="-f" || a=="--format" || a=="-o" || a=="--output" || a=="-j" || a=="--jobs")
+    {
+      if (i+1>=args.size())
+      {
+        fprintf(stderr, "sproxel: %s needs a value\n", qPrintable(a));
+        return 2;
+      }
+      const QString v=args[++i];
+
+      if (a=="-f" || a=="--format")
+      {
+        Exporter *exp=find_exporter(v);
+        if (!exp)
+        {
+          fprintf(stderr, "sproxel: no exporter for \"%s\", see --list\n", qPrintable(v));
+          return 2;
+        }
+
+        // outputs are told apart by extension only
+        foreach (Exporter *other, exporters)
+          if (exporter_ext(other).compare(exporter_ext(exp), Qt::CaseInsensitive)==0)
+          {
+            fprintf(stderr, "sproxel: \"%s\" and \"%s\" both write %s files\n",
+              qPrintable(other->name()), qPrintable(exp->name()), qPrintable(exporter_ext(exp)));
+            return 2;
+          }
+
+        exporters.append(exp);
+      }
+      else if (a=="-o" || a=="--output")
+        outDir=v;
+      else
+      {
+        bool ok=false;
+        const int n=v.toInt(&ok);
+        if (!ok || n<1)
+        {
+          fprintf(stderr, "sproxel: bad job count \"%s\"\n", qPrintable(v));
+          return 2;
+        }
+        QThreadPool::globalInstance()->setMaxThreadCount(n);
+      }
+      continue;
+    }
+
+    if (a.startsWith('-'))
+    {
+      fprintf(stderr, "sproxel: unknown option %s\n", qPrintable(a));
+      print_batch_usage();
+      return 2;
+    }
+
+    inputs.append(a);
+  }
+
+  if (exporters.isEmpty() || inputs.isEmpty())
+  {
+    print_batch_usage();
+    return 2;
+  }
+
+  if (!outDir.isEmpty() && !QDir().mkpath(outDir))
+  {
+    fprintf(stderr, "sproxel: can't create %s\n", qPrintable(outDir));
+    return 1;
+  }
+
+  QElapsedTimer clock;
+  clock.start();
+
+  // pick loaders up front, the importer list is not thread-safe
+  QList<BatchFile> files;
+  int failures=0;
+  foreach (const QString &input, inputs)
+  {
+    BatchFile f;
+    f.input=input;
+    f.clock=&clock;
+
+    if (!is_project_file(input))
+    {
+      f.importer=find_importer(input);
+      if (!f.importer)
+      {
+        fprintf(stderr, "%s: no importer for this file type\n", qPrintable(input));
+        ++failures;
+        continue;
+      }
+    }
+
+    files.append(f);
+  }
+
+  QtConcurrent::blockingMap(files, load_batch_file);
+
+  QList<VoxelGridLayerPtr> deferred;
+  QSet<VoxelGridLayer*> seen;
+  foreach (const BatchFile &f, files)
+  {
+    if (!f.project) continue;
+    foreach (VoxelGridGroupPtr spr, f.project->sprites)
+      for (int i=0; i<spr->numLayers(); ++i)
+      {
+        VoxelGridLayerPtr layer=spr->layer(i);
+        if (layer->isLoaded() || seen.contains(layer.data())) continue;
+        seen.insert(layer.data());
+        deferred.append(layer);
+      }
+  }
+
+  QtConcurrent::blockingMap(deferred, load_batch_layer);
+
+  QList<BatchSprite> sprites;
+  for (int fi=0; fi<files.size(); ++fi)
+  {
+    BatchFile &f=files[fi];
+    if (!f.project) continue;
+
+    QSet<QString> used;
+    for (int i=0; i<f.project->sprites.size(); ++i)
+    {
+      BatchSprite s;
+      s.file=&f;
+      // the copy shares bricks with the project but not the occupancy
+      // and composite caches that reads may rebuild
+      s.sprite=new VoxelGridGroup(*f.project->sprites[i]);
+      s.exporters=&exporters;
+
+      const QString base=output_base(f, i, outDir, used);
+      foreach (Exporter *exp, exporters) s.outputs.append(base+exporter_ext(exp));
+
+      sprites.append(s);
+    }
+  }
+
+  QtConcurrent::blockingMap(sprites, export_batch_sprite);
+
+  // report in input order
+  int si=0;
+  for (int fi=0; fi<files.size(); ++fi)
+  {
+    BatchFile &f=files[fi];
+    if (!f.project)
+    {
+      fprintf(stderr, "%s: failed to load\n", qPrintable(f.input));
+      ++failures;
+      continue;
+    }
+
+    qint64 exportTime=0;
+    QStringList lines;
+    for (; si<sprites.size() && sprites[si].file==&f; ++si)
+    {
+      const BatchSprite &s=sprites[si];
+      exportTime+=s.end-s.start;
+      if (s.end>f.end) f.end=s.end;
+
+      for (int i=0; i<s.outputs.size(); ++i)
+      {
+        if (!s.ok[i]) ++failures;
+        lines.append(QString("  %1 -> %2%3").arg(s.sprite->name(), s.outputs[i], s.ok[i] ? "" : "  FAILED"));
+      }
+      lines.last().append(QString("  %1 ms").arg(s.end-s.start));
+    }
+
+    printf("%s: %d sprites, load %d ms, export %d ms, wall %d ms\n", qPrintable(f.input),
+      f.project->sprites.size(), int(f.loaded-f.start), int(exportTime), int(f.end-f.start));
+    foreach (const QString &line, lines) printf("%s\n", qPrintable(line));
+  }
+
+  printf("%d files, %d sprites, %d failures, %d ms total on %d threads\n", files.size(), sprites.size(),
+    failures, int(clock.elapsed()), QThreadPool::globalInstance()->maxThreadCount());
+
+  return failures ? 1 : 0;
+}
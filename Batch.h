@@ -0,0 +1,16 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+
+#include <QStringList>
+
+
+// Headless conversion, "sproxel --batch [options] files...".
+// Loads projects and importable files, runs the chosen exporters over every
+// sprite and prints per-file timings.  Files are loaded and sprites exported
+// in parallel on the global thread pool.  Needs only a QCoreApplication and
+// the registered importers and exporters.  Returns the process exit code.
+int run_batch(const QStringList &args);
+
+
+#endif
@@ -0,0 +1,431 @@
+#include <string.h>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryFile>
+#include <QDataStream>
+#include <QtEndian>
+#include "SproxelProject.h"
+
+
+// Binary project files (.sxb).  Layers are stored as zlib-compressed bricks
+// in native cell layout, so opening a project only reads the index and
+// each layer is decoded straight from the memory-mapped file the first
+// time it is needed.
+//
+//   header     magic, version, byte order mark, index offset and size
+//   layers     one block per layer, starting at a page boundary:
+//              compressed bricks, then the brick table
+//   index      palettes, layers and sprites, written with QDataStream
+//
+// Brick table records are fixed size: x, y, z (qint32), compressed size
+// (quint32), file offset (quint64), all little-endian.  Brick coordinates
+// are in layer storage space.
+
+static const char SXB_MAGIC[4]={ 'S', 'X', 'B', '1' };
+
+#define SXB_VERSION      1
+#define SXB_BYTE_ORDER   0x01020304
+#define SXB_HEADER_SIZE  32
+#define SXB_RECORD_SIZE  24
+#define SXB_LAYER_ALIGN  4096
+#define SXB_BRICK_ALIGN  16
+#define SXB_MAX_COLORS   256  // indices are bytes
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+static bool pad_to(QFile &file, qint64 align)
+{
+  const qint64 pos=file.pos();
+  const qint64 n=(align-pos%align)%align;
+  if (!n) return true;
+  return file.write(QByteArray(int(n), 0))==n;
+}
+
+
+static void setup_stream(QDataStream &ds)
+{
+  ds.setVersion(QDataStream::Qt_4_6);
+  ds.setByteOrder(QDataStream::LittleEndian);
+  ds.setFloatingPointPrecision(QDataStream::SinglePrecision);
+}
+
+
+static void write_v3i(QDataStream &ds, const Imath::V3i &v)
+{
+  ds << qint32(v.x) << qint32(v.y) << qint32(v.z);
+}
+
+
+static Imath::V3i read_v3i(QDataStream &ds)
+{
+  qint32 x, y, z;
+  ds >> x >> y >> z;
+  return Imath::V3i(x, y, z);
+}
+
+
+// Writes the layer bricks and table, returns table offset or -1 on error
+static qint64 write_layer_bricks(QFile &file, VoxelGridLayerPtr layer, qint32 &numBricks)
+{
+  numBricks=0;
+  if (!pad_to(file, SXB_LAYER_ALIGN)) return -1;
+
+  QByteArray table;
+  const Imath::Box3i bounds=layer->bounds();
+
+  if (!bounds.isEmpty())
+  {
+    QByteArray raw(layer->brickDataSize(), 0);
+    const Imath::V3i bmin=layer->storageBrickOf(bounds.min);
+    const Imath::V3i bmax=layer->storageBrickOf(bounds.max);
+
+    for (int x=bmin.x; x<=bmax.x; ++x)
+      for (int y=bmin.y; y<=bmax.y; ++y)
+        for (int z=bmin.z; z<=bmax.z; ++z)
+        {
+          const Imath::V3i bc(x, y, z);
+          if (!layer->readBrick(bc, raw.data())) continue;
+
+          if (!pad_to(file, SXB_BRICK_ALIGN)) return -1;
+          const qint64 offset=file.pos();
+          const QByteArray packed=qCompress(raw, 1);
+          if (file.write(packed)!=packed.size()) return -1;
+
+          uchar rec[SXB_RECORD_SIZE];
+          qToLittleEndian<qint32>(bc.x, rec);
+          qToLittleEndian<qint32>(bc.y, rec+4);
+          qToLittleEndian<qint32>(bc.z, rec+8);
+          qToLittleEndian<quint32>(packed.size(), rec+12);
+          qToLittleEndian<quint64>(offset, rec+16);
+          table.append((const char*)rec, SXB_RECORD_SIZE);
+          ++numBricks;
+        }
+  }
+
+  if (!pad_to(file, SXB_BRICK_ALIGN)) return -1;
+  const qint64 tableOffset=file.pos();
+  if (file.write(table)!=table.size()) return -1;
+  return tableOffset;
+}
+
+
+bool save_brick_project(QString filename, SproxelProjectPtr project)
+{
+  if (!project) return false;
+
+  // gather layers, they can be shared between sprites
+  QVector<VoxelGridLayerPtr> layers;
+  foreach (VoxelGridGroupPtr spr, project->sprites)
+    for (int i=0; i<spr->numLayers(); ++i)
+      if (!layers.contains(spr->layer(i))) layers.push_back(spr->layer(i));
+
+  QVector<ColorPalettePtr> palettes=project->palettes;
+  if (project->mainPalette && !palettes.contains(project->mainPalette))
+    palettes.push_back(project->mainPalette);
+  foreach (VoxelGridLayerPtr l, layers)
+    if (l->palette() && !palettes.contains(l->palette())) palettes.push_back(l->palette());
+
+  // Layers kept by the undo history may still be mapped from the file
+  // being replaced, so it isn't truncated: the project goes to a new file
+  // that takes its name at the end.
+  QTemporaryFile file(filename+".XXXXXX");
+  if (!file.open()) return false;
+
+  // header is rewritten at the end
+  if (file.write(QByteArray(SXB_HEADER_SIZE, 0))!=SXB_HEADER_SIZE) return false;
+
+  QVector<qint64> tableOffsets(layers.size());
+  QVector<qint32> brickCounts(layers.size());
+  for (int i=0; i<layers.size(); ++i)
+  {
+    tableOffsets[i]=write_layer_bricks(file, layers[i], brickCounts[i]);
+    if (tableOffsets[i]<0) return false;
+  }
+
+  // index
+  QByteArray index;
+  {
+    QDataStream ds(&index, QIODevice::WriteOnly);
+    setup_stream(ds);
+
+    ds << qint32(palettes.size());
+    foreach (ColorPalettePtr pal, palettes)
+    {
+      ds << pal->name() << qint32(pal->numColors());
+      for (int i=0; i<pal->numColors(); ++i)
+      {
+        const SproxelColor c=pal->color(i);
+        ds << c.r << c.g << c.b << c.a;
+      }
+    }
+    ds << qint32(palettes.indexOf(project->mainPalette));
+
+    ds << qint32(layers.size());
+    for (int i=0; i<layers.size(); ++i)
+    {
+      VoxelGridLayerPtr l=layers[i];
+      const bool empty=l->bounds().isEmpty();
+
+      ds << l->name();
+      write_v3i(ds, l->offset());
+      write_v3i(ds, l->size());
+      write_v3i(ds, l->dataOrigin());
+      ds << l->isVisible() << l->isCompact();
+      ds << qint32(l->palette() ? palettes.indexOf(l->palette()) : -1);
+      ds << qint32(empty ? -1 : int(l->dataType()));
+      ds << quint64(tableOffsets[i]) << brickCounts[i];
+    }
+
+    ds << qint32(project->sprites.size());
+    foreach (VoxelGridGroupPtr spr, project->sprites)
+    {
+      ds << spr->name() << qint32(spr->numLayers());
+      for (int i=0; i<spr->numLayers(); ++i) ds << qint32(layers.indexOf(spr->layer(i)));
+      ds << qint32(spr->curLayerIndex());
+    }
+  }
+
+  if (!pad_to(file, SXB_BRICK_ALIGN)) return false;
+  const qint64 indexOffset=file.pos();
+  if (file.write(index)!=index.size()) return false;
+
+  // header
+  uchar header[SXB_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, SXB_MAGIC, 4);
+  qToLittleEndian<quint32>(SXB_VERSION, header+4);
+  const quint32 bom=SXB_BYTE_ORDER;
+  memcpy(header+8, &bom, 4); // native, cells are stored as in memory
+  qToLittleEndian<quint64>(indexOffset, header+16);
+  qToLittleEndian<quint64>(index.size(), header+24);
+
+  if (!file.seek(0)) return false;
+  if (file.write((const char*)header, SXB_HEADER_SIZE)!=SXB_HEADER_SIZE) return false;
+
+  if (!file.flush()) return false;
+
+  // temporary files are private, use what the old file had
+  QFileInfo old(filename);
+  file.setPermissions(old.exists() ? old.permissions() :
+    QFile::ReadOwner|QFile::WriteOwner|QFile::ReadGroup|QFile::ReadOther);
+
+  // an open mapping doesn't stop the old file from being unlinked on Unix,
+  // on Windows the remove fails and the old file is kept
+  if (old.exists() && !QFile::remove(filename)) return false;
+
+  // QTemporaryFile removes whatever name it has, keep the saved data even
+  // if it can't be renamed
+  file.setAutoRemove(false);
+  return file.rename(filename);
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// File mapping shared by the layers loaded from it, unmapped when the last
+// layer is decoded.
+class MappedProjectFile : public QSharedData
+{
+public:
+  QFile file;
+  const uchar *data;
+  qint64 size;
+
+  MappedProjectFile(const QString &filename) : file(filename), data(NULL), size(0)
+  {
+    if (!file.open(QIODevice::ReadOnly)) return;
+    size=file.size();
+    data=file.map(0, size);
+    if (!data) size=0;
+  }
+
+  ~MappedProjectFile()
+  {
+    if (data) file.unmap((uchar*)data);
+  }
+
+  bool contains(quint64 offset, quint64 len) const
+  {
+    return offset<=quint64(size) && len<=quint64(size)-offset;
+  }
+};
+
+typedef QExplicitlySharedDataPointer<MappedProjectFile> MappedProjectFilePtr;
+
+
+class BrickLayerSource : public VoxelLayerSource
+{
+public:
+  MappedProjectFilePtr file;
+  VoxelGridLayer::DataType type;
+  Imath::Box3i box;
+  Imath::V3i origin;
+  quint64 tableOffset;
+  int numBricks;
+
+  virtual void load(VoxelGridLayer &layer)
+  {
+    layer.resetStorage(type, box, origin);
+    if (box.isEmpty()) return;
+
+    const int brickSize=layer.brickDataSize();
+    int numBad=0;
+
+    for (int i=0; i<numBricks; ++i)
+    {
+      const uchar *rec=file->data+tableOffset+quint64(i)*SXB_RECORD_SIZE;
+      const Imath::V3i bc(
+        qFromLittleEndian<qint32>(rec),
+        qFromLittleEndian<qint32>(rec+4),
+        qFromLittleEndian<qint32>(rec+8));
+      const quint32 size=qFromLittleEndian<quint32>(rec+12);
+      const quint64 offset=qFromLittleEndian<quint64>(rec+16);
+
+      if (!file->contains(offset, size)) { ++numBad; continue; }
+
+      const QByteArray raw=qUncompress(
+        QByteArray::fromRawData((const char*)file->data+offset, int(size)));
+      if (raw.size()!=brickSize) { ++numBad; continue; }
+
+      layer.writeBrick(bc, raw.constData());
+    }
+
+    // the layer is loaded on first use, long after the file was opened
+    if (numBad)
+      qWarning("Project file %s: %d of %d bricks of layer \"%s\" are damaged, left empty",
+        qPrintable(file->file.fileName()), numBad, numBricks, qPrintable(layer.name()));
+  }
+};
+
+
+SproxelProjectPtr load_brick_project(QString filename)
+{
+  MappedProjectFilePtr file(new MappedProjectFile(filename));
+  if (!file->data || file->size<SXB_HEADER_SIZE) return SproxelProjectPtr();
+
+  const uchar *header=file->data;
+  if (memcmp(header, SXB_MAGIC, 4)!=0) return SproxelProjectPtr();
+  if (qFromLittleEndian<quint32>(header+4)!=SXB_VERSION) return SproxelProjectPtr();
+
+  quint32 bom;
+  memcpy(&bom, header+8, 4);
+  if (bom!=SXB_BYTE_ORDER) return SproxelProjectPtr();
+
+  const quint64 indexOffset=qFromLittleEndian<quint64>(header+16);
+  const quint64 indexSize=qFromLittleEndian<quint64>(header+24);
+  if (!file->contains(indexOffset, indexSize)) return SproxelProjectPtr();
+
+  const QByteArray index=QByteArray::fromRawData((const char*)file->data+indexOffset, int(indexSize));
+  QDataStream ds(index);
+  setup_stream(ds);
+
+  SproxelProjectPtr prj(new SproxelProject());
+
+  // palettes
+  prj->palettes.clear();
+  qint32 numPalettes;
+  ds >> numPalettes;
+  for (int p=0; p<numPalettes && ds.status()==QDataStream::Ok; ++p)
+  {
+    QString name;
+    qint32 numColors;
+    ds >> name >> numColors;
+    if (numColors<0 || numColors>SXB_MAX_COLORS) return SproxelProjectPtr();
+
+    ColorPalettePtr pal(new ColorPalette());
+    pal->setName(name);
+    pal->resize(numColors);
+    for (int i=0; i<numColors; ++i)
+    {
+      SproxelColor c;
+      ds >> c.r >> c.g >> c.b >> c.a;
+      pal->setColor(i, c);
+    }
+    prj->palettes.push_back(pal);
+  }
+
+  qint32 mainPal;
+  ds >> mainPal;
+  if (mainPal>=0 && mainPal<prj->palettes.size())
+    prj->mainPalette=prj->palettes[mainPal];
+  else if (!prj->palettes.isEmpty())
+    prj->mainPalette=prj->palettes[0];
+  else
+    prj->mainPalette=new ColorPalette();
+
+  // layers, only the descriptions are read here
+  QVector<VoxelGridLayerPtr> layers;
+  qint32 numLayers;
+  ds >> numLayers;
+  for (int i=0; i<numLayers && ds.status()==QDataStream::Ok; ++i)
+  {
+    QString name;
+    bool visible, compact;
+    qint32 pi, type, numBricks;
+    quint64 tableOffset;
+
+    ds >> name;
+    const Imath::V3i offset=read_v3i(ds);
+    const Imath::V3i size=read_v3i(ds);
+    const Imath::V3i origin=read_v3i(ds);
+    ds >> visible >> compact >> pi >> type >> tableOffset >> numBricks;
+
+    if (numBricks<0 || !file->contains(tableOffset, quint64(numBricks)*SXB_RECORD_SIZE))
+      return SproxelProjectPtr();
+
+    VoxelGridLayerPtr l(new VoxelGridLayer());
+    l->setName(name);
+    l->setOffset(offset);
+    l->setVisible(visible);
+    l->setCompact(compact);
+    l->setPalette((pi>=0 && pi<prj->palettes.size()) ? prj->palettes[pi] : ColorPalettePtr());
+
+    if (type>=0 && size.x>0 && size.y>0 && size.z>0)
+    {
+      BrickLayerSource *src=new BrickLayerSource();
+      src->file=file;
+      src->type=VoxelGridLayer::DataType(type);
+      src->box=Imath::Box3i(offset, offset+size-Imath::V3i(1));
+      src->origin=origin;
+      src->tableOffset=tableOffset;
+      src->numBricks=numBricks;
+      l->setSource(VoxelLayerSourcePtr(src));
+    }
+
+    l->takeDirtyBox();
+    layers.push_back(l);
+  }
+
+  // sprites
+  prj->sprites.clear();
+  qint32 numSprites;
+  ds >> numSprites;
+  for (int s=0; s<numSprites && ds.status()==QDataStream::Ok; ++s)
+  {
+    QString name;
+    qint32 n;
+    ds >> name >> n;
+
+    VoxelGridGroupPtr spr(new VoxelGridGroup());
+    spr->setName(name);
+    for (int i=0; i<n; ++i)
+    {
+      qint32 li;
+      ds >> li;
+      if (li>=0 && li<layers.size()) spr->insertLayerAbove(spr->numLayers(), layers[li]);
+    }
+
+    qint32 cur;
+    ds >> cur;
+    spr->setCurLayer(cur);
+    spr->takeDirtyBox();
+    prj->sprites.push_back(spr);
+  }
+
+  if (ds.status()!=QDataStream::Ok) return SproxelProjectPtr();
+
+  return prj;
+}
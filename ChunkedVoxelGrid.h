@@ -0,0 +1,313 @@
+#ifndef __CHUNKED_VOXEL_GRID_H__
+#define __CHUNKED_VOXEL_GRID_H__
+
+#include <vector>
+#include <algorithm>
+
+#include <ImathBox.h>
+#include <ImathVec.h>
+
+#include <QAtomicInt>
+
+
+//-*****************************************************************************
+// Sparse voxel grid made of fixed-size cubic bricks.
+// Cells are addressed by signed integer coordinates, any cell that does not
+// belong to an allocated brick reads as the empty value.  The brick table is
+// a dense array of pointers over the brick-space bounding box, so growing the
+// grid only reallocates the table and never copies voxel data.
+// Inside a brick cells are laid out like GameVoxelGrid: Z fastest, then Y, X.
+// Bricks are reference counted and shared between copies of a grid, a shared
+// brick is copied on the first write.  Copying a grid only copies the table.
+template <class T>
+class ChunkedVoxelGrid
+{
+public:
+    enum { BRICK_BITS  = 4,
+           BRICK_SIZE  = 1<<BRICK_BITS,
+           BRICK_MASK  = BRICK_SIZE-1,
+           BRICK_CELLS = BRICK_SIZE*BRICK_SIZE*BRICK_SIZE };
+
+    struct Brick
+    {
+        T cells[BRICK_CELLS];
+    };
+
+    ChunkedVoxelGrid(const T& empty=T()) : m_empty(empty), m_numBricks(0) {}
+
+    ChunkedVoxelGrid(const ChunkedVoxelGrid& from)
+        : m_empty(from.m_empty), m_numBricks(0)
+    {
+        copyFrom(from);
+    }
+
+    ~ChunkedVoxelGrid() { clear(); }
+
+    ChunkedVoxelGrid& operator=(const ChunkedVoxelGrid& from)
+    {
+        if (this != &from)
+        {
+            clear();
+            m_empty = from.m_empty;
+            copyFrom(from);
+        }
+        return *this;
+    }
+
+    const T& emptyValue() const { return m_empty; }
+
+    // Brick coordinate containing the cell
+    static Imath::V3i brickOf(const Imath::V3i& cell)
+    {
+        return Imath::V3i(cell.x>>BRICK_BITS, cell.y>>BRICK_BITS, cell.z>>BRICK_BITS);
+    }
+
+    // Index of the cell inside its brick
+    static int cellIndex(const Imath::V3i& cell)
+    {
+        return (((cell.x&BRICK_MASK)<<BRICK_BITS) + (cell.y&BRICK_MASK))*BRICK_SIZE + (cell.z&BRICK_MASK);
+    }
+
+    // Cell-space box covered by the brick
+    static Imath::Box3i brickBox(const Imath::V3i& bc)
+    {
+        Imath::V3i mn(bc.x<<BRICK_BITS, bc.y<<BRICK_BITS, bc.z<<BRICK_BITS);
+        return Imath::Box3i(mn, mn+Imath::V3i(BRICK_MASK));
+    }
+
+    T get(const Imath::V3i& cell) const
+    {
+        const Brick* b = brick(brickOf(cell));
+        return b ? b->cells[cellIndex(cell)] : m_empty;
+    }
+
+    void set(const Imath::V3i& cell, const T& value)
+    {
+        const Imath::V3i bc = brickOf(cell);
+        const Brick* cb = constBrick(bc);
+        if (!cb)
+        {
+            // writing empty into unallocated space is a no-op
+            if (value == m_empty) return;
+        }
+        else if (cb->cells[cellIndex(cell)] == value)
+            return; // don't unshare for nothing
+
+        allocBrick(bc)->cells[cellIndex(cell)] = value;
+    }
+
+    // Brick access, returns NULL for unallocated bricks
+    const Brick* brick(const Imath::V3i& bc) const { return constBrick(bc); }
+
+    const Brick* constBrick(const Imath::V3i& bc) const
+    {
+        if (!m_table.intersects(bc)) return NULL;
+        const Node* n = m_bricks[tableIndex(bc)];
+        return n ? &n->brick : NULL;
+    }
+
+    // Writable access, unshares the brick
+    Brick* brick(const Imath::V3i& bc)
+    {
+        if (!m_table.intersects(bc)) return NULL;
+        Node*& n = m_bricks[tableIndex(bc)];
+        if (!n) return NULL;
+        detach(n);
+        return &n->brick;
+    }
+
+    // Returns existing brick or allocates a new empty one, unshared
+    Brick* allocBrick(const Imath::V3i& bc)
+    {
+        if (!m_table.intersects(bc)) growTable(bc);
+
+        Node*& n = m_bricks[tableIndex(bc)];
+        if (!n)
+        {
+            n = new Node;
+            std::fill(n->brick.cells, n->brick.cells+BRICK_CELLS, m_empty);
+            ++m_numBricks;
+        }
+        else
+            detach(n);
+        return &n->brick;
+    }
+
+    void freeBrick(const Imath::V3i& bc)
+    {
+        if (!m_table.intersects(bc)) return;
+        Node*& n = m_bricks[tableIndex(bc)];
+        if (n) { release(n); n = NULL; --m_numBricks; }
+    }
+
+    // True if the brick is allocated and also used by another grid
+    bool isShared(const Imath::V3i& bc) const
+    {
+        if (!m_table.intersects(bc)) return false;
+        const Node* n = m_bricks[tableIndex(bc)];
+        return n && int(n->ref) > 1;
+    }
+
+    // Brick-space box covered by the brick table
+    const Imath::Box3i& brickBounds() const { return m_table; }
+
+    int numBricks() const { return m_numBricks; }
+
+    // Bytes used by this grid.  A shared brick is split evenly between the
+    // grids using it, so summing over several grids gives the real total.
+    size_t memoryUsage() const
+    {
+        size_t bytes = m_bricks.size()*sizeof(Node*);
+        for (size_t i=0; i<m_bricks.size(); ++i)
+            if (m_bricks[i]) bytes += sizeof(Node)/std::max(int(m_bricks[i]->ref), 1);
+        return bytes;
+    }
+
+    // Bytes used by bricks no other grid refers to
+    size_t unsharedMemoryUsage() const
+    {
+        size_t bytes = 0;
+        for (size_t i=0; i<m_bricks.size(); ++i)
+            if (m_bricks[i] && int(m_bricks[i]->ref) == 1) bytes += sizeof(Node);
+        return bytes;
+    }
+
+    void clear()
+    {
+        for (size_t i=0; i<m_bricks.size(); ++i) if (m_bricks[i]) release(m_bricks[i]);
+        m_bricks.clear();
+        m_table.makeEmpty();
+        m_numBricks = 0;
+    }
+
+    // Discard all data outside of the cell-space box and shrink the table
+    void crop(const Imath::Box3i& box)
+    {
+        if (box.isEmpty()) { clear(); return; }
+        if (m_table.isEmpty()) return;
+
+        const Imath::Box3i keep(brickOf(box.min), brickOf(box.max));
+        const Imath::Box3i& t = m_table;
+
+        for (int x=t.min.x; x<=t.max.x; ++x)
+          for (int y=t.min.y; y<=t.max.y; ++y)
+            for (int z=t.min.z; z<=t.max.z; ++z)
+            {
+              const Imath::V3i bc(x, y, z);
+              if (!m_bricks[tableIndex(bc)]) continue;
+
+              if (!keep.intersects(bc)) { freeBrick(bc); continue; }
+
+              // clear the part of a border brick that falls outside
+              const Imath::Box3i bb = brickBox(bc);
+              if (box.intersects(bb.min) && box.intersects(bb.max)) continue;
+
+              Brick* b = brick(bc);
+              for (int cx=bb.min.x; cx<=bb.max.x; ++cx)
+                for (int cy=bb.min.y; cy<=bb.max.y; ++cy)
+                  for (int cz=bb.min.z; cz<=bb.max.z; ++cz)
+                  {
+                    const Imath::V3i c(cx, cy, cz);
+                    if (!box.intersects(c)) b->cells[cellIndex(c)] = m_empty;
+                  }
+            }
+
+        Imath::Box3i newTable = keep;
+        newTable.min.x = std::max(newTable.min.x, t.min.x); newTable.max.x = std::min(newTable.max.x, t.max.x);
+        newTable.min.y = std::max(newTable.min.y, t.min.y); newTable.max.y = std::min(newTable.max.y, t.max.y);
+        newTable.min.z = std::max(newTable.min.z, t.min.z); newTable.max.z = std::min(newTable.max.z, t.max.z);
+        rebuildTable(newTable);
+    }
+
+
+private:
+    struct Node
+    {
+        QAtomicInt ref;
+        Brick brick;
+
+        Node() : ref(1) {}
+        Node(const Node& from) : ref(1), brick(from.brick) {}
+    };
+
+    T m_empty;
+    Imath::Box3i m_table;
+    std::vector<Node*> m_bricks;
+    int m_numBricks;
+
+    static void release(Node* n)
+    {
+        if (!n->ref.deref()) delete n;
+    }
+
+    // Make n a private copy if it's shared
+    static void detach(Node*& n)
+    {
+        if (int(n->ref) == 1) return;
+        Node* copy = new Node(*n);
+        release(n);
+        n = copy;
+    }
+
+    size_t tableIndex(const Imath::V3i& bc) const
+    {
+        const Imath::V3i ts = m_table.size()+Imath::V3i(1);
+        return (size_t(bc.x-m_table.min.x)*ts.y + (bc.y-m_table.min.y))*ts.z + (bc.z-m_table.min.z);
+    }
+
+    void growTable(const Imath::V3i& bc)
+    {
+        Imath::Box3i newTable = m_table;
+        newTable.extendBy(bc);
+        rebuildTable(newTable);
+    }
+
+    // Move brick pointers into a table covering newTable, bricks outside are freed
+    void rebuildTable(const Imath::Box3i& newTable)
+    {
+        if (newTable == m_table) return;
+
+        std::vector<Node*> newBricks;
+        if (!newTable.isEmpty())
+        {
+            const Imath::V3i ts = newTable.size()+Imath::V3i(1);
+            newBricks.resize(size_t(ts.x)*ts.y*ts.z, NULL);
+        }
+
+        const Imath::Box3i& t = m_table;
+        if (!t.isEmpty())
+          for (int x=t.min.x; x<=t.max.x; ++x)
+            for (int y=t.min.y; y<=t.max.y; ++y)
+              for (int z=t.min.z; z<=t.max.z; ++z)
+              {
+                const Imath::V3i bc(x, y, z);
+                Node* n = m_bricks[tableIndex(bc)];
+                if (!n) continue;
+
+                if (newTable.intersects(bc))
+                {
+                  const Imath::V3i ts = newTable.size()+Imath::V3i(1);
+                  newBricks[(size_t(x-newTable.min.x)*ts.y + (y-newTable.min.y))*ts.z + (z-newTable.min.z)] = n;
+                }
+                else
+                {
+                  release(n);
+                  --m_numBricks;
+                }
+              }
+
+        m_bricks.swap(newBricks);
+        m_table = newTable;
+    }
+
+    void copyFrom(const ChunkedVoxelGrid& from)
+    {
+        m_table = from.m_table;
+        m_bricks = from.m_bricks;
+        for (size_t i=0; i<m_bricks.size(); ++i)
+            if (m_bricks[i]) m_bricks[i]->ref.ref();
+        m_numBricks = from.m_numBricks;
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef __FLOOD_FILL_H__
+#define __FLOOD_FILL_H__
+
+
+#include <vector>
+#include <ImathVec.h>
+#include <ImathBox.h>
+
+
+inline size_t flood_index(const Imath::Box3i &box, const Imath::V3i &size, const Imath::V3i &p)
+{
+  return (size_t(p.x-box.min.x)*size.y+(p.y-box.min.y))*size.z+(p.z-box.min.z);
+}
+
+
+// Working buffers of flood_fill(), keep one around to reuse the memory
+// between fills
+struct FloodFillScratch
+{
+  std::vector<bool> visited;
+  std::vector<Imath::V3i> stack;
+};
+
+
+// Iterative scanline flood fill.
+// Starting from seed, collects every cell of box that is 6-connected to it
+// through cells for which inside(cell) is true.  Spans are filled along the
+// longest axis of the box, a flat box gives a 2D fill.  Each cell is tested
+// at most a few times and the explicit stack keeps the depth independent of
+// the filled volume.  Returns false if the seed itself is not inside.
+template<class Inside>
+bool flood_fill(const Imath::Box3i &box, const Imath::V3i &seed, Inside inside,
+  std::vector<Imath::V3i> &filled, FloodFillScratch &scratch)
+{
+  if (box.isEmpty() || !box.intersects(seed) || !inside(seed)) return false;
+
+  const Imath::V3i size=box.size()+Imath::V3i(1);
+
+  // span axis a, other axes b and c
+  int a=0;
+  if (size.y>size[a]) a=1;
+  if (size.z>size[a]) a=2;
+  const int b=(a+1)%3, c=(a+2)%3;
+
+  std::vector<bool> &visited=scratch.visited;
+  visited.assign(size_t(size.x)*size.y*size.z, false);
+
+  std::vector<Imath::V3i> &stack=scratch.stack;
+  stack.clear();
+  stack.push_back(seed);
+
+  while (!stack.empty())
+  {
+    Imath::V3i p=stack.back();
+    stack.pop_back();
+
+    if (visited[flood_index(box, size, p)] || !inside(p)) continue;
+
+    // grow the span both ways
+    Imath::V3i lo=p, hi=p;
+    for (;;)
+    {
+      Imath::V3i q=lo; --q[a];
+      if (q[a]<box.min[a] || visited[flood_index(box, size, q)] || !inside(q)) break;
+      lo=q;
+    }
+    for (;;)
+    {
+      Imath::V3i q=hi; ++q[a];
+      if (q[a]>box.max[a] || visited[flood_index(box, size, q)] || !inside(q)) break;
+      hi=q;
+    }
+
+    for (Imath::V3i q=lo; q[a]<=hi[a]; ++q[a])
+    {
+      visited[flood_index(box, size, q)]=true;
+      filled.push_back(q);
+    }
+
+    // seed the four neighbouring rows, one entry per run
+    for (int n=0; n<4; ++n)
+    {
+      Imath::V3i r=lo;
+      const int axis = (n<2) ? b : c;
+      r[axis] += (n&1) ? 1 : -1;
+      if (r[axis]<box.min[axis] || r[axis]>box.max[axis]) continue;
+
+      bool inRun=false;
+      for (; r[a]<=hi[a]; ++r[a])
+      {
+        if (!visited[flood_index(box, size, r)] && inside(r))
+        {
+          if (!inRun) stack.push_back(r);
+          inRun=true;
+        }
+        else
+          inRun=false;
+      }
+    }
+  }
+
+  return true;
+}
+
+
+template<class Inside>
+bool flood_fill(const Imath::Box3i &box, const Imath::V3i &seed, Inside inside,
+  std::vector<Imath::V3i> &filled)
+{
+  FloodFillScratch scratch;
+  return flood_fill(box, seed, inside, filled, scratch);
+}
+
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <cmath>
+#include <cstddef>
 #include <iostream>
 #include <algorithm>
 
@@ -22,6 +23,8 @@ GLModelWidget::GLModelWidget(QWidget* parent, QSettings* appSettings, UndoManage
       m_cameraSnapDelta(m_cameraSnapStep/2.0, m_cameraSnapStep/2.0),
       m_gvg(sprite),
       m_previews(),
+      m_previewLinesValid(false),
+      m_previewSerial(0),
       p_undoManager(undoManager),
       m_activeVoxel(-1,-1,-1),
       m_activeColor(1.0f, 1.0f, 1.0f, 1.0f),
@@ -37,7 +40,8 @@ GLModelWidget::GLModelWidget(QWidget* parent, QSettings* appSettings, UndoManage
       m_activeTool(NULL),
       p_appSettings(appSettings),
       m_minBoundOffset(0),
-      m_maxBoundOffset(0)
+      m_maxBoundOffset(0),
+      m_meshDirty(true)
 {
     m_drawGrid=p_appSettings->value("GLModelWidget/drawGrid", true).toBool();
     m_drawVoxelGrid=p_appSettings->value("GLModelWidget/drawVoxelGrid", false).toBool();
@@ -50,8 +54,8 @@ GLModelWidget::GLModelWidget(QWidget* parent, QSettings* appSettings, UndoManage
     // Always shoot rays through the scene - even when a mouse button isn't pressed
     setMouseTracking(true);
 
-    connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr)),
-      this, SLOT(onSpriteChanged(VoxelGridGroupPtr)));
+    connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr, const Imath::Box3i&)),
+      this, SLOT(onSpriteChanged(VoxelGridGroupPtr, const Imath::Box3i&)));
 
     connect(p_undoManager, SIGNAL(paletteChanged(ColorPalettePtr)),
       this, SLOT(onPaletteChanged(ColorPalettePtr)));
@@ -60,8 +64,8 @@ GLModelWidget::GLModelWidget(QWidget* parent, QSettings* appSettings, UndoManage
 
 GLModelWidget::~GLModelWidget()
 {
-	//makeCurrent();
-	//glDeleteLists(object, 1);
+	makeCurrent();
+	clearMeshChunks();
 
 	delete m_activeTool;
 }
@@ -108,7 +112,9 @@ Imath::Box3i GLModelWidget::editBounds()
 
 void GLModelWidget::setSprite(VoxelGridGroupPtr sprite)
 {
+	if (sprite) sprite->load();
 	m_gvg=sprite;
+	m_meshDirty=true;
 	//centerGrid();
 	updateGL();
 }
@@ -166,6 +172,7 @@ void GLModelWidget::resizeAndClearVoxelGrid(const Imath::V3i& size)
 
 	m_gvg->clear();
 	m_gvg->insertLayerAbove(0, layer);
+	m_meshDirty=true;
 
 	centerGrid();
 	updateGL();
@@ -436,59 +443,37 @@ void GLModelWidget::paintGL()
     bool drawOutlines=p_appSettings->value("GLModelWidget/drawVoxelOutlines", 0).toBool();
     bool drawSmoothCubes=p_appSettings->value("GLModelWidget/drawSmoothVoxels", 0).toBool();
 
-    const Imath::Box3i dim = editBounds();
-    for (int x = dim.min.x; x <= dim.max.x; x++)
-    {
-        for (int y = dim.min.y; y <= dim.max.y; y++)
-        {
-            for (int z = dim.min.z; z <= dim.max.z; z++)
-            {
-                const Imath::V3i index = Imath::V3i(x,y,z);
-                Imath::Color4f cellColor = m_gvg->get(index);
-                const Imath::M44d mat = m_gvg->voxelTransform(index);
-
-                if (cellColor.a != 0.0)
-                {
-                    glColor4f(cellColor.r, cellColor.g, cellColor.b, 0.2f);
-
-                    glPushMatrix();
-                    glMultMatrixd(glMatrix(mat));
+    // Merged faces would hide voxel edges, so outlines and smooth cubes are
+    // meshed one face per voxel.
+    updateMeshChunks(editBounds(), drawSmoothCubes, !drawOutlines && !drawSmoothCubes);
 
-                    CubeFaceMask mask = computeVoxelFaceMask(index, dim);
-
-                    if (drawOutlines)
-                    {
-                        // TODO: Make line width a setting
-                        // TODO: Learn how to fix these polygon offset values to work properly.
-                        glEnable(GL_POLYGON_OFFSET_FILL);
-                        glPolygonOffset(1.0, 1.0);
-                        glDrawCubePoly(mask, drawSmoothCubes);
-                        glDisable(GL_POLYGON_OFFSET_FILL);
-
-                        //glLineWidth(1.5);
-                        glDisable(GL_LIGHTING);
-                        glEnable(GL_POLYGON_OFFSET_LINE);
-                        glPolygonOffset(1.0, -5.0);
-                        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-                        glColor3f(1.0f - cellColor.r,
-                                  1.0f - cellColor.g,
-                                  1.0f - cellColor.b);
-                        glDrawCubePoly(mask, false);
-                        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-                        glDisable(GL_POLYGON_OFFSET_LINE);
-                        glEnable(GL_LIGHTING);
-                        //glLineWidth(1.0);
-                    }
-                    else
-                    {
-                        glDrawCubePoly(mask, drawSmoothCubes);
-                    }
-
-                    glPopMatrix();
-                }
-            }
-        }
+    if (drawOutlines)
+    {
+        // TODO: Make line width a setting
+        // TODO: Learn how to fix these polygon offset values to work properly.
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(1.0, 1.0);
+        glDrawMeshChunks();
+        glDisable(GL_POLYGON_OFFSET_FILL);
+
+        // Inverted vertex colors, same as drawing with 1-color
+        glDisable(GL_LIGHTING);
+        glEnable(GL_POLYGON_OFFSET_LINE);
+        glPolygonOffset(1.0, -5.0);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        glEnable(GL_COLOR_LOGIC_OP);
+        glLogicOp(GL_COPY_INVERTED);
+        glDrawMeshChunks();
+        glDisable(GL_COLOR_LOGIC_OP);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glDisable(GL_POLYGON_OFFSET_LINE);
+        glEnable(GL_LIGHTING);
     }
+    else
+    {
+        glDrawMeshChunks();
+    }
+
     glDisable(GL_LIGHT0);
     glDisable(GL_COLOR_MATERIAL);
     glDisable(GL_LIGHTING);
@@ -650,46 +635,6 @@ void GLModelWidget::glDrawGrid(const int size,
 }
 
 
-GLModelWidget::CubeFaceMask GLModelWidget::computeVoxelFaceMask(const Imath::V3i& index, const Imath::Box3i &bounds)
-{
-    CubeFaceMask returnMask = FACE_NONE;
-
-    const Imath::Color4f& cellColor = m_gvg->get(index);
-    if (cellColor.a == 0.0f)
-        return returnMask;
-
-    Imath::V3i at;
-
-    // Positive
-    at=index; at.x++;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_POSX);
-
-    at=index; at.y++;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_POSY);
-
-    at=index; at.z++;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_POSZ);
-
-    // Negative
-    at=index; at.x--;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_NEGX);
-
-    at=index; at.y--;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_NEGY);
-
-    at=index; at.z--;
-    if (!bounds.intersects(at) || m_gvg->get(at).a == 0.0)
-        returnMask = (CubeFaceMask)(returnMask | FACE_NEGZ);
-
-    return returnMask;
-}
-
-
 void GLModelWidget::glDrawAxes()
 {
     // A little heavy-handed, but it gets the job done.
@@ -755,180 +700,51 @@ void GLModelWidget::glDrawCubeWire()
 }
 
 
-void GLModelWidget::glDrawCubePoly(const CubeFaceMask mask, bool smooth)
-{
-  glBegin(GL_QUADS);
-
-  if (smooth)
-  {
-    float ns=0.07f, nf=sqrtf(1.0f-ns*ns*2);
-
-    if (mask & FACE_POSY)
-    {
-      glNormal3f(   ns,   nf,-  ns);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-      glNormal3f(-  ns,   nf,-  ns);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glNormal3f(-  ns,   nf,   ns);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glNormal3f(   ns,   nf,   ns);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-    }
-
-    if (mask & FACE_NEGY)
-    {
-      glNormal3f(   ns,-  nf,   ns);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-      glNormal3f(-  ns,-  nf,   ns);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-      glNormal3f(-  ns,-  nf,-  ns);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glNormal3f(   ns,-  nf,-  ns);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-    }
-
-    if (mask & FACE_POSZ)
-    {
-      glNormal3f(   ns,   ns,   nf);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-      glNormal3f(-  ns,   ns,   nf);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glNormal3f(-  ns,-  ns,   nf);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-      glNormal3f(   ns,-  ns,   nf);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-    }
-
-    if (mask & FACE_NEGZ)
-    {
-      glNormal3f(   ns,-  ns,-  nf);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-      glNormal3f(-  ns,-  ns,-  nf);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glNormal3f(-  ns,   ns,-  nf);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glNormal3f(   ns,   ns,-  nf);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-    }
-
-    if (mask & FACE_POSX)
-    {
-      glNormal3f(   nf,   ns,-  ns);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-      glNormal3f(   nf,   ns,   ns);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-      glNormal3f(   nf,-  ns,   ns);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-      glNormal3f(   nf,-  ns,-  ns);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-    }
-
-    if (mask & FACE_NEGX)
-    {
-      glNormal3f(-  nf,   ns,   ns);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glNormal3f(-  nf,   ns,-  ns);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glNormal3f(-  nf,-  ns,-  ns);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glNormal3f(-  nf,-  ns,   ns);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-    }
-  }
-  else
-  {
-    if (mask & FACE_POSY)
-    {
-      glNormal3f( 0.0f, 1.0f, 0.0f);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-    }
-
-    if (mask & FACE_NEGY)
-    {
-      glNormal3f( 0.0f,-1.0f, 0.0f);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-    }
-
-    if (mask & FACE_POSZ)
-    {
-      glNormal3f( 0.0f, 0.0f, 1.0f);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-    }
-
-    if (mask & FACE_NEGZ)
-    {
-      glNormal3f( 0.0f, 0.0f,-1.0f);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-    }
-
-    if (mask & FACE_POSX)
-    {
-      glNormal3f( 1.0f, 0.0f, 0.0f);
-      glVertex3f( 0.5f, 0.5f,-0.5f);
-      glVertex3f( 0.5f, 0.5f, 0.5f);
-      glVertex3f( 0.5f,-0.5f, 0.5f);
-      glVertex3f( 0.5f,-0.5f,-0.5f);
-    }
-
-    if (mask & FACE_NEGX)
-    {
-      glNormal3f(-1.0f, 0.0f, 0.0f);
-      glVertex3f(-0.5f, 0.5f, 0.5f);
-      glVertex3f(-0.5f, 0.5f,-0.5f);
-      glVertex3f(-0.5f,-0.5f,-0.5f);
-      glVertex3f(-0.5f,-0.5f, 0.5f);
-    }
-  }
-
-  glEnd();
-}
-
 #if 1
 /* Much, much, MUCH quicker version of glDrawVoxelGrid  / Emil
  */
 void GLModelWidget::glDrawVoxelGrid()
 {
 	const Imath::Box3i dim = m_gvg->bounds();
-	glPushMatrix();
-	auto mat = m_gvg->transform();
-	glMultMatrixd(glMatrix(mat));
+	if (dim.isEmpty()) return;
 
-	int other[3][2] = {{1,2},{0,2},{1,2}};
-
-	glBegin(GL_LINES);
-
-	// for each axis...
-	for (int a0=0; a0<3; ++a0) {
-		int a1 = other[a0][0];
-		int a2 = other[a0][1];
-		for (int i1 = dim.min[a1]; i1 <= dim.max[a1]+1 ; ++i1) {
-			for (int i2 = dim.min[a2]; i2 <= dim.max[a2]+1 ; ++i2) {
-				Imath::V3i v_min;
-				v_min[a1] = i1;
-				v_min[a2] = i2;
-				Imath::V3i v_max = v_min;
-				v_min[a0] = dim.min[a0];
-				v_max[a0] = dim.max[a0]+1;
-
-				glVertex3f(v_min.x, v_min.y, v_min.z);
-				glVertex3f(v_max.x, v_max.y, v_max.z);
+	// the lattice only changes with the bounds
+	if (m_gridLines.empty() || dim != m_gridLinesBox)
+	{
+		m_gridLines.clear();
+		m_gridLinesBox = dim;
+
+		int other[3][2] = {{1,2},{0,2},{0,1}};
+
+		// for each axis...
+		for (int a0=0; a0<3; ++a0) {
+			int a1 = other[a0][0];
+			int a2 = other[a0][1];
+			for (int i1 = dim.min[a1]; i1 <= dim.max[a1]+1 ; ++i1) {
+				for (int i2 = dim.min[a2]; i2 <= dim.max[a2]+1 ; ++i2) {
+					Imath::V3i v_min;
+					v_min[a1] = i1;
+					v_min[a2] = i2;
+					Imath::V3i v_max = v_min;
+					v_min[a0] = dim.min[a0];
+					v_max[a0] = dim.max[a0]+1;
+
+					for (int a=0; a<3; ++a) m_gridLines.push_back(v_min[a]);
+					for (int a=0; a<3; ++a) m_gridLines.push_back(v_max[a]);
+				}
 			}
 		}
 	}
 
-	glEnd();
+	glPushMatrix();
+	auto mat = m_gvg->transform();
+	glMultMatrixd(glMatrix(mat));
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, &m_gridLines[0]);
+	glDrawArrays(GL_LINES, 0, GLsizei(m_gridLines.size()/3));
+	glDisableClientState(GL_VERTEX_ARRAY);
+
 	glPopMatrix();
 }
 #else
@@ -945,16 +761,16 @@ void GLModelWidget::glDrawVoxelGrid()
             {
                 if (p_appSettings->value("GLModelWidget/previewEnabled", 1).toBool())
                 {
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y-1,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y-1,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y,z-1)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y,z-1)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y-1,z-1)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y-1,z-1)))
                         continue;
                 }
 
@@ -987,16 +803,16 @@ void GLModelWidget::glDrawVoxelGrid()
             {
                 if (p_appSettings->value("GLModelWidget/previewEnabled", 1).toBool())
                 {
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x-1,y,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x-1,y,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y,z-1)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y,z-1)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x-1,y,z-1)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x-1,y,z-1)))
                         continue;
                 }
 
@@ -1029,16 +845,16 @@ void GLModelWidget::glDrawVoxelGrid()
             {
                 if (p_appSettings->value("GLModelWidget/previewEnabled", 1).toBool())
                 {
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x-1,y,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x-1,y,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x,y-1,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x,y-1,z)))
                         continue;
 
-                    if (std::find(m_previews.begin(), m_previews.end(), Imath::V3i(x-1,y-1,z)) != m_previews.end())
+                    if (isPreview(Imath::V3i(x-1,y-1,z)))
                         continue;
                 }
 
@@ -1075,28 +891,104 @@ void GLModelWidget::glDrawActiveVoxel()
 }
 
 
-void GLModelWidget::glDrawPreviewVoxels()
+// Shows the active tool's preview.  A list the tool made from the one
+// shown only changes the mask by its delta, others rebuild it.  The wire
+// lines depend on the draw order and neighbours, they are rebuilt on draw.
+void GLModelWidget::updatePreviews()
 {
-    Imath::Color4f curColor;
-    glGetFloatv(GL_CURRENT_COLOR, (float*)&curColor);
+    const std::vector<Imath::V3i> &cells = m_activeTool->preview();
+    const unsigned serial = m_activeTool->previewSerial();
+    if (serial == m_previewSerial) return;
 
-    for (unsigned int i = 0; i < m_previews.size(); i++)
+    if (m_activeTool->previewIsDelta() && m_activeTool->previewBase() == m_previewSerial)
+    {
+        const std::vector<Imath::V3i> &removed = m_activeTool->previewRemoved();
+        const std::vector<Imath::V3i> &added = m_activeTool->previewAdded();
+
+        for (size_t i = 0; i < removed.size(); i++)
+            m_previewMask.set(removed[i], false);
+        for (size_t i = 0; i < added.size(); i++)
+            m_previewMask.set(added[i], true);
+    }
+    else
+    {
+        m_previewMask.clear();
+        for (size_t i = 0; i < cells.size(); i++)
+            m_previewMask.set(cells[i], true);
+    }
+
+    m_previews = cells;
+    m_previewSerial = serial;
+    m_previewLinesValid = false;
+}
+
+
+void GLModelWidget::buildPreviewLines(const Imath::Color4f &color)
+{
+    static const int edges[12][2][3] = {
+        {{0,0,0},{1,0,0}}, {{1,0,0},{1,0,1}}, {{1,0,1},{0,0,1}}, {{0,0,1},{0,0,0}},
+        {{0,1,0},{1,1,0}}, {{1,1,0},{1,1,1}}, {{1,1,1},{0,1,1}}, {{0,1,1},{0,1,0}},
+        {{0,0,0},{0,1,0}}, {{1,0,0},{1,1,0}}, {{1,0,1},{1,1,1}}, {{0,0,1},{0,1,1}} };
+
+    m_previewLines.clear();
+    m_previewColors.clear();
+    m_previewLinesColor = color;
+    m_previewLinesValid = true;
+
+    // Each cube fades a little more than the one before it
+    Imath::Color4f curColor = color;
+    for (size_t i = 0; i < m_previews.size(); i++)
     {
         float scalar = 1.0f - ((float)i / (float)(m_previews.size()));
         curColor.r = curColor.r * scalar;
         curColor.g = curColor.g * scalar;
         curColor.b = curColor.b * scalar;
 
-        const Imath::M44d mat = m_gvg->voxelTransform(m_previews[i]);
-        glPushMatrix();
-        glMultMatrixd(glMatrix(mat));
-        glColor4f(curColor.r, curColor.g, curColor.b, curColor.a);
-        glDrawCubeWire();
-        glPopMatrix();
+        // Cubes buried inside the set only add clutter
+        const Imath::V3i &v = m_previews[i];
+        if (isPreview(v+Imath::V3i(1,0,0)) && isPreview(v-Imath::V3i(1,0,0)) &&
+            isPreview(v+Imath::V3i(0,1,0)) && isPreview(v-Imath::V3i(0,1,0)) &&
+            isPreview(v+Imath::V3i(0,0,1)) && isPreview(v-Imath::V3i(0,0,1)))
+            continue;
+
+        for (int e = 0; e < 12; e++)
+            for (int k = 0; k < 2; k++)
+            {
+                for (int a = 0; a < 3; a++) m_previewLines.push_back(float(v[a] + edges[e][k][a]));
+                m_previewColors.push_back(curColor.r);
+                m_previewColors.push_back(curColor.g);
+                m_previewColors.push_back(curColor.b);
+                m_previewColors.push_back(curColor.a);
+            }
     }
 }
 
 
+void GLModelWidget::glDrawPreviewVoxels()
+{
+    Imath::Color4f curColor;
+    glGetFloatv(GL_CURRENT_COLOR, (float*)&curColor);
+
+    if (!m_previewLinesValid || curColor != m_previewLinesColor)
+        buildPreviewLines(curColor);
+
+    if (m_previewLines.empty()) return;
+
+    glPushMatrix();
+    glMultMatrixd(glMatrix(m_gvg->transform()));
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, &m_previewLines[0]);
+    glColorPointer(4, GL_FLOAT, 0, &m_previewColors[0]);
+    glDrawArrays(GL_LINES, 0, GLsizei(m_previewLines.size()/3));
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    glPopMatrix();
+}
+
+
 void GLModelWidget::glDrawVoxelCenter(const size_t x, const size_t y, const size_t z)
 {
     const Imath::V3d location = m_gvg->voxelTransform(Imath::V3i(x,y,z)).translation();
@@ -1109,6 +1001,172 @@ void GLModelWidget::glDrawVoxelCenter(const size_t x, const size_t y, const size
 }
 
 
+void GLModelWidget::updateMeshChunks(const Imath::Box3i& clip, bool smooth, bool greedy)
+{
+    if (smooth != m_mesher.smooth() || greedy != m_mesher.greedy())
+    {
+        // hashes only cover the voxel data, so a mode change needs a rebuild
+        m_mesher.setSmooth(smooth);
+        m_mesher.setGreedy(greedy);
+        clearMeshChunks();
+        m_meshDirty = true;
+    }
+
+    if (clip != m_meshClip)
+    {
+        m_meshClip = clip;
+        m_meshDirty = true;
+    }
+
+    if (!m_meshDirty && m_meshDirtyBox.isEmpty()) return;
+
+    Imath::Box3i range;
+    if (!clip.isEmpty())
+        range = Imath::Box3i(VoxelMesher::chunkOf(clip.min), VoxelMesher::chunkOf(clip.max));
+
+    // chunks to re-sample, faces of voxels next to the changes may flip too
+    Imath::Box3i todo = range;
+    if (!m_meshDirty)
+    {
+        const Imath::Box3i changed(VoxelMesher::chunkOf(m_meshDirtyBox.min-Imath::V3i(1)),
+                                   VoxelMesher::chunkOf(m_meshDirtyBox.max+Imath::V3i(1)));
+        for (int a = 0; a < 3; a++)
+        {
+            todo.min[a] = std::max(todo.min[a], changed.min[a]);
+            todo.max[a] = std::min(todo.max[a], changed.max[a]);
+        }
+    }
+
+    m_meshDirty = false;
+    m_meshDirtyBox.makeEmpty();
+
+    // drop chunks that are no longer visible
+    for (MeshChunkMap::iterator it = m_meshChunks.begin(); it != m_meshChunks.end(); )
+    {
+        if (range.intersects(it->first)) { ++it; continue; }
+        delete it->second;
+        m_meshChunks.erase(it++);
+    }
+
+    if (todo.isEmpty()) return;
+
+    for (int x = todo.min.x; x <= todo.max.x; x++)
+        for (int y = todo.min.y; y <= todo.max.y; y++)
+            for (int z = todo.min.z; z <= todo.max.z; z++)
+            {
+                const Imath::V3i c(x, y, z);
+                m_mesher.sample(*m_gvg, c, clip);
+
+                MeshChunkMap::iterator it = m_meshChunks.find(c);
+
+                if (m_mesher.samplesEmpty())
+                {
+                    if (it != m_meshChunks.end())
+                    {
+                        delete it->second;
+                        m_meshChunks.erase(it);
+                    }
+                    continue;
+                }
+
+                const unsigned long long hash = m_mesher.samplesHash();
+                if (it != m_meshChunks.end() && it->second->hash == hash) continue;
+
+                MeshChunk* chunk;
+                if (it != m_meshChunks.end())
+                    chunk = it->second;
+                else
+                    chunk = m_meshChunks[c] = new MeshChunk();
+
+                m_mesher.build(m_meshScratch);
+                uploadMeshChunk(chunk, m_meshScratch);
+                chunk->hash = hash;
+            }
+}
+
+
+void GLModelWidget::uploadMeshChunk(MeshChunk* chunk, const VoxelMesh& mesh)
+{
+    chunk->numIndices = (int)mesh.indices.size();
+    if (mesh.isEmpty()) return;
+
+    if ((chunk->vertexBuffer.isCreated() || chunk->vertexBuffer.create()) &&
+        (chunk->indexBuffer .isCreated() || chunk->indexBuffer .create()))
+    {
+        chunk->vertexBuffer.bind();
+        chunk->vertexBuffer.allocate(&mesh.vertices[0], int(mesh.vertices.size()*sizeof(VoxelMeshVertex)));
+        chunk->vertexBuffer.release();
+
+        chunk->indexBuffer.bind();
+        chunk->indexBuffer.allocate(&mesh.indices[0], int(mesh.indices.size()*sizeof(unsigned int)));
+        chunk->indexBuffer.release();
+    }
+    else
+    {
+        chunk->cpuMesh = mesh;
+    }
+}
+
+
+void GLModelWidget::clearMeshChunks()
+{
+    for (MeshChunkMap::iterator it = m_meshChunks.begin(); it != m_meshChunks.end(); ++it)
+        delete it->second;
+    m_meshChunks.clear();
+}
+
+
+void GLModelWidget::glDrawMeshChunks()
+{
+    glPushMatrix();
+    Imath::M44d mat = m_gvg->transform();
+    glMultMatrixd(glMatrix(mat));
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+
+    const GLsizei stride = sizeof(VoxelMeshVertex);
+
+    for (MeshChunkMap::iterator it = m_meshChunks.begin(); it != m_meshChunks.end(); ++it)
+    {
+        MeshChunk* chunk = it->second;
+        if (!chunk->numIndices) continue;
+
+        const char* vertices = NULL;
+        const char* indices = NULL;
+
+        if (chunk->vertexBuffer.isCreated())
+        {
+            chunk->vertexBuffer.bind();
+            chunk->indexBuffer.bind();
+        }
+        else
+        {
+            vertices = (const char*)&chunk->cpuMesh.vertices[0];
+            indices = (const char*)&chunk->cpuMesh.indices[0];
+        }
+
+        glVertexPointer(3, GL_FLOAT, stride, vertices+offsetof(VoxelMeshVertex, pos));
+        glNormalPointer(GL_FLOAT, stride, vertices+offsetof(VoxelMeshVertex, normal));
+        glColorPointer(4, GL_UNSIGNED_BYTE, stride, vertices+offsetof(VoxelMeshVertex, color));
+        glDrawElements(GL_QUADS, chunk->numIndices, GL_UNSIGNED_INT, indices);
+
+        if (chunk->vertexBuffer.isCreated())
+        {
+            chunk->vertexBuffer.release();
+            chunk->indexBuffer.release();
+        }
+    }
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    glPopMatrix();
+}
+
+
 void GLModelWidget::mousePressEvent(QMouseEvent *event)
 {
     const bool altDown = event->modifiers() & Qt::AltModifier;
@@ -1316,7 +1374,7 @@ void GLModelWidget::mouseMoveEvent(QMouseEvent *event)
             if (m_activeTool->supportsDrag())
             {
                 // You want your preview to update even when you're tooling
-                m_previews = m_activeTool->voxelsAffected();
+                updatePreviews();
 
                 // Tool execution
                 m_activeTool->execute();
@@ -1342,7 +1400,7 @@ void GLModelWidget::mouseMoveEvent(QMouseEvent *event)
                 if (m_activeTool->type() == TOOL_SLAB)
                     dynamic_cast<SlabToolState*>(m_activeTool)->setAxis(currentAxis());
 
-                m_previews = m_activeTool->voxelsAffected();
+                updatePreviews();
                 updateGL();
             }
         }
@@ -1360,22 +1418,10 @@ Imath::Box3d GLModelWidget::dataBounds()
 {
     Imath::Box3d retBox;
 
-    Imath::Box3i dim=m_gvg->bounds();
-
-    for (int x = dim.min.x; x <= dim.max.x; x++)
-    {
-        for (int y = dim.min.y; y <= dim.max.y; y++)
-        {
-            for (int z = dim.min.z; z <= dim.max.z; z++)
-            {
-                if (m_gvg->get(Imath::V3i(x,y,z)).a != 0.0f)
-                {
-                    retBox.extendBy(Imath::V3d(x,  y,  z));
-                    retBox.extendBy(Imath::V3d(x+1,y+1,z+1));
-                }
-            }
-        }
-    }
+    // Tight bounds of the filled voxels, straight from the occupancy masks
+    const Imath::Box3i occ = m_gvg->occupiedBounds();
+    if (!occ.isEmpty())
+        retBox = Imath::Box3d(occ.min, occ.max+Imath::V3i(1));
 
     // (ImathBoxAlgo) This properly computes the world bounding box
     return Imath::transform(retBox, m_gvg->transform());
@@ -1570,7 +1616,7 @@ void GLModelWidget::shiftVoxels(const SproxelAxis axis, const bool up, const boo
     if (up) std::swap(backupIndex, clearIndex);
 
 
-    p_undoManager->beginMacro("Shift");
+    VoxelRegionEdit edit(m_gvg);
 
     // Backup the necessary slice
     Imath::Color4f* sliceBackup = NULL;
@@ -1608,9 +1654,9 @@ void GLModelWidget::shiftVoxels(const SproxelAxis axis, const bool up, const boo
                     Imath::V3i nextIndex(-1, -1, -1);
                     switch (axis)
                     {
-                        case X_AXIS: setVoxelColor(Imath::V3i(a, b, c), m_gvg->get(Imath::V3i(a-1, b, c)), m_gvg->getInd(Imath::V3i(a-1, b, c))); break;
-                        case Y_AXIS: setVoxelColor(Imath::V3i(b, a, c), m_gvg->get(Imath::V3i(b, a-1, c)), m_gvg->getInd(Imath::V3i(b, a-1, c))); break;
-                        case Z_AXIS: setVoxelColor(Imath::V3i(b, c, a), m_gvg->get(Imath::V3i(b, c, a-1)), m_gvg->getInd(Imath::V3i(b, c, a-1))); break;
+                        case X_AXIS: edit.set(Imath::V3i(a, b, c), m_gvg->get(Imath::V3i(a-1, b, c)), m_gvg->getInd(Imath::V3i(a-1, b, c))); break;
+                        case Y_AXIS: edit.set(Imath::V3i(b, a, c), m_gvg->get(Imath::V3i(b, a-1, c)), m_gvg->getInd(Imath::V3i(b, a-1, c))); break;
+                        case Z_AXIS: edit.set(Imath::V3i(b, c, a), m_gvg->get(Imath::V3i(b, c, a-1)), m_gvg->getInd(Imath::V3i(b, c, a-1))); break;
                     }
 
                 }
@@ -1628,9 +1674,9 @@ void GLModelWidget::shiftVoxels(const SproxelAxis axis, const bool up, const boo
                     Imath::V3i nextIndex(-1, -1, -1);
                     switch (axis)
                     {
-                        case X_AXIS: setVoxelColor(Imath::V3i(a, b, c), m_gvg->get(Imath::V3i(a+1, b, c)), m_gvg->getInd(Imath::V3i(a+1, b, c))); break;
-                        case Y_AXIS: setVoxelColor(Imath::V3i(b, a, c), m_gvg->get(Imath::V3i(b, a+1, c)), m_gvg->getInd(Imath::V3i(b, a+1, c))); break;
-                        case Z_AXIS: setVoxelColor(Imath::V3i(b, c, a), m_gvg->get(Imath::V3i(b, c, a+1)), m_gvg->getInd(Imath::V3i(b, c, a+1))); break;
+                        case X_AXIS: edit.set(Imath::V3i(a, b, c), m_gvg->get(Imath::V3i(a+1, b, c)), m_gvg->getInd(Imath::V3i(a+1, b, c))); break;
+                        case Y_AXIS: edit.set(Imath::V3i(b, a, c), m_gvg->get(Imath::V3i(b, a+1, c)), m_gvg->getInd(Imath::V3i(b, a+1, c))); break;
+                        case Z_AXIS: edit.set(Imath::V3i(b, c, a), m_gvg->get(Imath::V3i(b, c, a+1)), m_gvg->getInd(Imath::V3i(b, c, a+1))); break;
                     }
                 }
             }
@@ -1651,16 +1697,16 @@ void GLModelWidget::shiftVoxels(const SproxelAxis axis, const bool up, const boo
             }
 
             if (wrap)
-                setVoxelColor(workIndex, sliceBackup[a + (b * tan0AxisDim)], sliceBackupInd[a + (b * tan0AxisDim)]);
+                edit.set(workIndex, sliceBackup[a + (b * tan0AxisDim)], sliceBackupInd[a + (b * tan0AxisDim)]);
             else
-                setVoxelColor(workIndex, Imath::Color4f(0.0f, 0.0f, 0.0f, 0.0f), 0);
+                edit.set(workIndex, Imath::Color4f(0.0f, 0.0f, 0.0f, 0.0f), 0);
         }
     }
 
     if (sliceBackup   ) delete[] sliceBackup   ;
     if (sliceBackupInd) delete[] sliceBackupInd;
 
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Shift");
     updateGL();
 }
 
@@ -1720,7 +1766,7 @@ void GLModelWidget::mirrorVoxels(const SproxelAxis axis)
     //== FIXME: current implementation collapses all layers, should be per-layer operation
     VoxelGridGroupPtr backup(new VoxelGridGroup(*m_gvg));
 
-    p_undoManager->beginMacro("Mirror");
+    VoxelRegionEdit edit(m_gvg);
 
     Imath::Box3i dim=m_gvg->bounds();
 
@@ -1737,12 +1783,12 @@ void GLModelWidget::mirrorVoxels(const SproxelAxis axis)
                     case Y_AXIS: oldLocation = Imath::V3i(x, dim.max.y+dim.min.y-y, z); break;
                     case Z_AXIS: oldLocation = Imath::V3i(x, y, dim.max.z+dim.min.z-z); break;
                 }
-                setVoxelColor(Imath::V3i(x,y,z), backup->get(oldLocation), backup->getInd(oldLocation));
+                edit.set(Imath::V3i(x,y,z), backup->get(oldLocation), backup->getInd(oldLocation));
             }
         }
     }
 
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Mirror");
     updateGL();
 }
 
@@ -1,9 +1,11 @@
 #ifndef __GL_MODEL_WIDGET_H__
 #define __GL_MODEL_WIDGET_H__
 
+#include <map>
 #include <vector>
 
 #include <QGLWidget>
+#include <QGLBuffer>
 #include <QSettings>
 
 #include "Tools.h"
@@ -11,6 +13,7 @@
 #include "GLCamera.h"
 #include "UndoManager.h"
 #include "VoxelGridGroup.h"
+#include "VoxelMesher.h"
 
 #include <ImathBox.h>
 #include <ImathVec.h>
@@ -20,12 +23,6 @@ class GLModelWidget : public QGLWidget
 {
     Q_OBJECT
 
-public:
-    enum CubeFaceMask { FACE_POSY = 0x01, FACE_NEGY = 0x02,
-                        FACE_POSX = 0x04, FACE_NEGX = 0x08,
-                        FACE_POSZ = 0x10, FACE_NEGZ = 0x20,
-                        FACE_NONE = 0x00, FACE_ALL  = 0x3f };
-
 public:
     GLModelWidget(QWidget* parent, QSettings* appSettings, UndoManager *undoManager, VoxelGridGroupPtr sprite);
     ~GLModelWidget();
@@ -79,8 +76,14 @@ public slots:
     void setAxisZ() { setCurrentAxis(Z_AXIS); }
     void setActiveColor(const Imath::Color4f& c, int i) { m_activeColor = c; m_activeIndex=i; }
     void setLightColor(const Imath::Color4f& c) { m_lightColor = c; update(); }
-    void onSpriteChanged(VoxelGridGroupPtr spr) { if (spr==m_gvg) update(); }
-    void onPaletteChanged(ColorPalettePtr pal) { if (m_gvg && m_gvg->hasPalette(pal)) update(); }
+    void onSpriteChanged(VoxelGridGroupPtr spr, const Imath::Box3i& box)
+    {
+        if (spr!=m_gvg) return;
+        m_meshDirtyBox.extendBy(box);
+        if (m_activeTool) m_activeTool->invalidatePreview();
+        update();
+    }
+    void onPaletteChanged(ColorPalettePtr pal) { if (m_gvg && m_gvg->hasPalette(pal)) { m_meshDirty = true; if (m_activeTool) m_activeTool->invalidatePreview(); update(); } }
     void frameFull() { frame(true); }
     void frameData() { frame(false); }
 
@@ -102,7 +105,20 @@ private:
     Imath::V2d m_cameraSnapDelta;
 
     VoxelGridGroupPtr m_gvg;
+
+    // Tool preview cells in draw order, with a bit mask for membership tests.
+    // The wire lines are cached until the set or the color changes.
     std::vector<Imath::V3i> m_previews;
+    OccupancyMask m_previewMask;
+    std::vector<float> m_previewLines;   // xyz per vertex, sprite space
+    std::vector<float> m_previewColors;  // rgba per vertex
+    Imath::Color4f m_previewLinesColor;
+    bool m_previewLinesValid;
+    unsigned m_previewSerial;            // ToolState::previewSerial() shown
+
+    // Voxel grid overlay lines, rebuilt when the sprite bounds change
+    std::vector<float> m_gridLines;
+    Imath::Box3i m_gridLinesBox;
 
     UndoManager *p_undoManager;
 
@@ -124,6 +140,33 @@ private:
 
     Imath::V3i m_minBoundOffset, m_maxBoundOffset;
 
+    // Cached viewport geometry, one buffer pair per mesher chunk
+    struct MeshChunk
+    {
+        QGLBuffer vertexBuffer;
+        QGLBuffer indexBuffer;
+        VoxelMesh cpuMesh;      // used when buffer objects are not available
+        int numIndices;
+        unsigned long long hash;
+
+        MeshChunk() : vertexBuffer(QGLBuffer::VertexBuffer),
+                      indexBuffer(QGLBuffer::IndexBuffer),
+                      numIndices(0), hash(0) {}
+    };
+    typedef std::map<Imath::V3i, MeshChunk*, VoxelChunkLess> MeshChunkMap;
+
+    MeshChunkMap m_meshChunks;
+    VoxelMesher m_mesher;
+    VoxelMesh m_meshScratch;
+    Imath::Box3i m_meshClip;
+    Imath::Box3i m_meshDirtyBox;    // voxels changed since the last update
+    bool m_meshDirty;               // everything needs re-sampling
+
+    void updateMeshChunks(const Imath::Box3i& clip, bool smooth, bool greedy);
+    void uploadMeshChunk(MeshChunk* chunk, const VoxelMesh& mesh);
+    void clearMeshChunks();
+    void glDrawMeshChunks();
+
     Imath::Box3i editBounds();
 
     double* glMatrix(const Imath::M44d& m);
@@ -133,8 +176,6 @@ private:
     Imath::Box3d dataBounds();
     void centerGrid();
 
-    CubeFaceMask computeVoxelFaceMask(const Imath::V3i& index, const Imath::Box3i &bounds);
-
     void glDrawAxes();
     void glDrawGrid(const int size,
                     const int gridCellSize,
@@ -142,11 +183,13 @@ private:
                     const Imath::Color4f& bgColor);
 
     void glDrawCubeWire();
-    void glDrawCubePoly(const CubeFaceMask mask, bool smooth);
 
     void glDrawVoxelGrid();
     void glDrawActiveVoxel();
     void glDrawPreviewVoxels();
+    void updatePreviews();
+    bool isPreview(const Imath::V3i &v) const { return m_previewMask.get(v); }
+    void buildPreviewLines(const Imath::Color4f &color);
     void glDrawVoxelCenter(const size_t sx, const size_t sy, const size_t sz);
 
     void glDrawBounds(const Imath::Box3i &bounds, QColor color);
@@ -14,6 +14,10 @@
 
 
 //-*****************************************************************************
+// Dense voxel grid stored in a single contiguous buffer.
+// Cells are laid out with Z varying fastest, then Y, then X:
+//   index(x,y,z) = (x*dim.y + y)*dim.z + z
+// so row(x,y) is a contiguous run of dim.z cells.
 template <class T>
 class GameVoxelGrid
 {
@@ -30,9 +34,9 @@ public:
     }
 
     GameVoxelGrid(const GameVoxelGrid& gvg)
+        : m_cellDimensions(gvg.m_cellDimensions),
+          m_data(gvg.m_data)
     {
-        m_cellDimensions = gvg.m_cellDimensions;
-        m_data = gvg.m_data;
     }
     ~GameVoxelGrid() { }
 
@@ -57,22 +61,41 @@ public:
         return retBox;
     }
 
+    // Raw storage access
+    size_t numCells() const { return m_data.size(); }
+    size_t strideX() const { return size_t(m_cellDimensions.y)*m_cellDimensions.z; }
+    size_t strideY() const { return m_cellDimensions.z; }
+    size_t strideZ() const { return 1; }
+
+    size_t index(const Imath::V3i& cell) const
+    {
+        return (size_t(cell.x)*m_cellDimensions.y + cell.y)*m_cellDimensions.z + cell.z;
+    }
+
+    T* data() { return m_data.empty() ? NULL : &m_data[0]; }
+    const T* data() const { return m_data.empty() ? NULL : &m_data[0]; }
+
+    // Contiguous run of cellDimensions().z cells at (x, y, 0..z-1)
+    T* row(int x, int y) { return data()+index(Imath::V3i(x, y, 0)); }
+    const T* row(int x, int y) const { return data()+index(Imath::V3i(x, y, 0)); }
+
+    // Contiguous YZ slab of strideX() cells at x
+    T* slab(int x) { return data()+x*strideX(); }
+    const T* slab(int x) const { return data()+x*strideX(); }
+
     void set(const Imath::V3i& cell, const T& value)
     {
-        m_data[cell.x][cell.y][cell.z] = value;
+        m_data[index(cell)] = value;
     }
 
     void setAll(const T& value)
     {
-        for (int x = 0; x < m_cellDimensions.x; x++)
-            for (int y = 0; y < m_cellDimensions.y; y++)
-                for (int z = 0; z < m_cellDimensions.z; z++)
-                    m_data[x][y][z] = value;
+        std::fill(m_data.begin(), m_data.end(), value);
     }
 
-    T get(const Imath::V3i& cell)
+    T get(const Imath::V3i& cell) const
     {
-        return m_data[cell.x][cell.y][cell.z];
+        return m_data[index(cell)];
     }
 
     std::vector<Imath::V3i> rayIntersection(Imath::Line3d worldRay)
@@ -84,23 +107,18 @@ public:
     {
         if (this != &other)
         {
-            m_cellDimensions = other.cellDimensions();
-            resizeData();
-
-            for (int x = 0; x < m_cellDimensions.x; x++)
-            {
-                for (int y = 0; y < m_cellDimensions.y; y++)
-                {
-                    for (int z = 0; z < m_cellDimensions.z; z++)
-                    {
-                        m_data[x][y][z] = other.m_data[x][y][z];
-                    }
-                }
-            }
+            m_cellDimensions = other.m_cellDimensions;
+            m_data = other.m_data;
         }
         return *this;
     }
 
+    void swap(GameVoxelGrid& other)
+    {
+        std::swap(m_cellDimensions, other.m_cellDimensions);
+        m_data.swap(other.m_data);
+    }
+
     void resize(const Imath::V3i &size, const Imath::V3i &offset, const T &value)
     {
         GameVoxelGrid<T> newGrid(size);
@@ -114,18 +132,22 @@ public:
         int y1=offset.y+m_cellDimensions.y; if (y1>size.y) y1=size.y;
         int z1=offset.z+m_cellDimensions.z; if (z1>size.z) z1=size.z;
 
-        for (int x=x0; x<x1; ++x)
-          for (int y=y0; y<y1; ++y)
-            for (int z=z0; z<z1; ++z)
-              newGrid.set(Imath::V3i(x, y, z), get(Imath::V3i(x, y, z)-offset));
+        // copy whole Z rows at a time
+        if (z1>z0)
+          for (int x=x0; x<x1; ++x)
+            for (int y=y0; y<y1; ++y)
+            {
+              const T *src=row(x-offset.x, y-offset.y)+(z0-offset.z);
+              std::copy(src, src+(z1-z0), newGrid.row(x, y)+z0);
+            }
 
-        *this=newGrid;
+        swap(newGrid);
     }
 
 
 private:
     Imath::V3i m_cellDimensions;
-    std::vector< std::vector < std::vector< T > > > m_data;
+    std::vector<T> m_data;
 
     Imath::V3d voxelCenter(const Imath::V3i& v) const
     {
@@ -136,16 +158,11 @@ private:
 
     void resizeData()
     {
-        // Does not lose existing data
-        m_data.resize(m_cellDimensions.x);
-        for (int x = 0; x < m_cellDimensions.x; x++)
-        {
-            m_data[x].resize(m_cellDimensions.y);
-            for (int y = 0; y < m_cellDimensions.y; y++)
-            {
-                m_data[x][y].resize(m_cellDimensions.z);
-            }
-        }
+        // Existing data is not preserved in place - use resize() for that
+        if (m_cellDimensions.x<=0 || m_cellDimensions.y<=0 || m_cellDimensions.z<=0)
+            m_data.clear();
+        else
+            m_data.resize(size_t(m_cellDimensions.x)*m_cellDimensions.y*m_cellDimensions.z);
     }
 };
 
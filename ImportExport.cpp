@@ -1,5 +1,12 @@
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
 #include <QImage>
+#include <QBuffer>
+#include <QtEndian>
 #include <QColor>
 #include <QFileInfo>
 #include "ImportExport.h"
@@ -97,52 +104,167 @@ public:
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
+// Buffered reader for the CSV importer, scanf per value is far too slow
+// for large grids.
+class CsvReader
+{
+public:
+  CsvReader(FILE *fp) : m_fp(fp), m_pos(0), m_end(0) {}
+
+  int get()
+  {
+    if (m_pos==m_end && !fill()) return EOF;
+    return (unsigned char)m_buf[m_pos++];
+  }
+
+  int peek()
+  {
+    if (m_pos==m_end && !fill()) return EOF;
+    return (unsigned char)m_buf[m_pos];
+  }
+
+  bool readInt(int &v)
+  {
+    skipSpace();
+    bool neg=false;
+    if (peek()=='-') { neg=true; get(); }
+    if (peek()<'0' || peek()>'9') return false;
+    v=0;
+    while (peek()>='0' && peek()<='9') v=v*10+(get()-'0');
+    if (neg) v=-v;
+    return true;
+  }
+
+  // Reads the next #RRGGBBAA value, skipping separators
+  bool readColor(SproxelRgba8 &c)
+  {
+    int ch;
+    while ((ch=get())!='#')
+      if (ch==EOF) return false;
+
+    unsigned v=0;
+    for (int i=0; i<8; ++i)
+    {
+      const int d=hexDigit(get());
+      if (d<0) return false;
+      v=(v<<4)|d;
+    }
+
+    c=(v>>8)|(v<<24); // RRGGBBAA -> AARRGGBB
+    return true;
+  }
+
+  void skipSpace()
+  {
+    for (;;)
+    {
+      const int ch=peek();
+      if (ch==',' || ch==' ' || ch=='\t' || ch=='\r' || ch=='\n') get();
+      else break;
+    }
+  }
+
+private:
+  FILE *m_fp;
+  char m_buf[1<<16];
+  size_t m_pos, m_end;
+
+  bool fill()
+  {
+    m_pos=0;
+    m_end=fread(m_buf, 1, sizeof(m_buf), m_fp);
+    return m_end>0;
+  }
+
+  static int hexDigit(int ch)
+  {
+    if (ch>='0' && ch<='9') return ch-'0';
+    if (ch>='A' && ch<='F') return ch-'A'+10;
+    if (ch>='a' && ch<='f') return ch-'a'+10;
+    return -1;
+  }
+};
+
+
 class SproxelCsvImporter : public Importer
 {
 public:
   virtual QString name() { return "Sproxel CSV files"; }
   virtual QString filter() { return "*.csv"; }
 
+  // Writes a slab of whole brick rows (BRICK_SIZE Y planes) into the layer
+  static void flushSlab(VoxelGridLayerPtr layer, const std::vector<SproxelRgba8> &slab,
+    const Imath::V3i &size, int by)
+  {
+    const int B=RgbBrickGrid::BRICK_SIZE;
+    RgbBrickGrid::Brick brick;
+
+    for (int bx=0; bx*B<size.x; ++bx)
+      for (int bz=0; bz*B<size.z; ++bz)
+      {
+        bool empty=true;
+        std::fill(brick.cells, brick.cells+RgbBrickGrid::BRICK_CELLS, SproxelColor(0, 0, 0, 0));
+
+        for (int y=by*B; y<std::min(by*B+B, size.y); ++y)
+          for (int z=bz*B; z<std::min(bz*B+B, size.z); ++z)
+          {
+            const SproxelRgba8 *row=&slab[(size_t(y-by*B)*size.z+z)*size.x];
+            for (int x=bx*B; x<std::min(bx*B+B, size.x); ++x)
+            {
+              if (!row[x]) continue;
+              brick.cells[RgbBrickGrid::cellIndex(Imath::V3i(x, y, z))]=unpack_color(row[x]);
+              empty=false;
+            }
+          }
+
+        if (!empty) layer->writeBrick(Imath::V3i(bx, by, bz), &brick);
+      }
+  }
+
   virtual bool doImport(const QString &filename, UndoManager *um,
     SproxelProjectPtr project, VoxelGridGroupPtr)
   {
-    int fscanfStatus = 0;
     FILE* fp = fopen(qPrintable(filename), "rb");
     if (!fp) return false;
 
+    CsvReader in(fp);
+
     // Read the dimensions
     Imath::V3i size(0);
-    fscanfStatus = fscanf(fp, "%d,%d,%d\n", &size.x, &size.y, &size.z);
+    if (!in.readInt(size.x) || !in.readInt(size.y) || !in.readInt(size.z)
+      || size.x<=0 || size.y<=0 || size.z<=0)
+    {
+      fclose(fp);
+      return false;
+    }
 
-    VoxelGridGroupPtr spr(new VoxelGridGroup(size, ColorPalettePtr()));
+    VoxelGridLayerPtr layer(new VoxelGridLayer());
+    layer->setName("main layer");
+    layer->resetStorage(VoxelGridLayer::TYPE_RGB, Imath::Box3i(Imath::V3i(0), size-Imath::V3i(1)), Imath::V3i(0));
 
-    // Read the data
-    Imath::Color4f color;
-    const Imath::V3i& cellDim = size;
-    for (int y = cellDim.y-1; y >= 0; y--)
-    {
-      for (int z = 0; z < cellDim.z; z++)
-      {
-        for (int x = 0; x < cellDim.x; x++)
-        {
-          int r, g, b, a;
-          fscanfStatus = fscanf(fp, "#%02X%02X%02X%02X,", &r, &g, &b, &a);
+    // Rows come top to bottom (Y), then Z, then X.  They are collected
+    // one brick row of Y planes at a time and written as whole bricks.
+    const int B=RgbBrickGrid::BRICK_SIZE;
+    std::vector<SproxelRgba8> slab(size_t(B)*size.z*size.x, 0);
 
-          color.r = r / (float)0xff;
-          color.g = g / (float)0xff;
-          color.b = b / (float)0xff;
-          color.a = a / (float)0xff;
-          spr->set(Imath::V3i(x,y,z), color);
+    bool eof=false;
+    for (int y = size.y-1; y >= 0; y--)
+    {
+      SproxelRgba8 *plane=&slab[size_t(y&RgbBrickGrid::BRICK_MASK)*size.z*size.x];
+      for (size_t i=0, n=size_t(size.z)*size.x; i<n; ++i)
+        if (eof || !in.readColor(plane[i])) { plane[i]=0; eof=true; }
 
-          if (x != cellDim.x-1)
-            fscanfStatus = fscanf(fp, ",");
-        }
-        fscanfStatus = fscanf(fp, "\n");
+      if (!(y&RgbBrickGrid::BRICK_MASK))
+      {
+        flushSlab(layer, slab, size, y>>RgbBrickGrid::BRICK_BITS);
+        std::fill(slab.begin(), slab.end(), 0);
       }
-      fscanfStatus = fscanf(fp, "\n");
     }
     fclose(fp);
 
+    layer->takeDirtyBox();
+
+    VoxelGridGroupPtr spr(new VoxelGridGroup(layer));
     spr->setName(QFileInfo(filename).baseName());
     um->addSprite(project, -1, spr);
 
@@ -197,59 +319,329 @@ public:
     const Imath::V3i cellDim = dim.size()+Imath::V3i(1);
     fprintf(fp, "%d,%d,%d\n", cellDim.x, cellDim.y, cellDim.z);
 
+    // Each row is formatted by hand into one buffer and written at once
+    static const char hex[]="0123456789ABCDEF";
+    std::vector<char> line(size_t(cellDim.x)*10+1);
+    bool ok=true;
+
     // The csv is laid out human-readable (top->bottom, Y-up, XZ, etc)
-    for (int y = cellDim.y-1; y >= 0; y--)
+    for (int y = cellDim.y-1; y >= 0 && ok; y--)
     {
         for (int z = 0; z < cellDim.z; z++)
         {
+            char *p=&line[0];
             for (int x = 0; x < cellDim.x; x++)
             {
                 const Imath::V3i curLoc=Imath::V3i(x,y,z)+dim.min;
-                Imath::Color4f col = spr->get(curLoc);
-                fprintf(fp, "#%02X%02X%02X%02X",
-                        (int)(col.r*0xff),
-                        (int)(col.g*0xff),
-                        (int)(col.b*0xff),
-                        (int)(col.a*0xff));
+                const SproxelRgba8 col = spr->getPacked(curLoc);
+                const SproxelRgba8 rgba = (col<<8) | (col>>24);
+                *p++='#';
+                for (int s=28; s>=0; s-=4) *p++=hex[(rgba>>s)&0xF];
                 if (x != cellDim.x-1)
-                    fprintf(fp, ",");
+                    *p++=',';
             }
-            fprintf(fp, "\n");
+            *p++='\n';
+            const size_t n=p-&line[0];
+            if (fwrite(&line[0], 1, n, fp)!=n) { ok=false; break; }
         }
-        fprintf(fp, "\n");
+        if (fputc('\n', fp)==EOF) ok=false;
     }
 
-    fclose(fp);
+    if (fclose(fp)!=0) ok=false;
 
-    return true;
+    return ok;
+  }
+};
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// Buffered text output for the exporters, with printf-free number
+// formatting.
+class TextOutput
+{
+public:
+  TextOutput(FILE *fp) : m_fp(fp), m_pos(0), m_ok(true) { m_buf.resize(1<<20); }
+  ~TextOutput() { flush(); }
+
+  bool isOk() const { return m_ok; }
+
+  void flush()
+  {
+    if (m_pos && fwrite(&m_buf[0], 1, m_pos, m_fp)!=m_pos) m_ok=false;
+    m_pos=0;
   }
+
+  // Makes room for at least n more chars
+  char* reserve(size_t n)
+  {
+    if (m_pos+n>m_buf.size()) flush();
+    return &m_buf[m_pos];
+  }
+
+  void commit(char *end) { m_pos=end-&m_buf[0]; }
+
+  void text(const char *t)
+  {
+    const size_t n=strlen(t);
+    char *p=reserve(n);
+    memcpy(p, t, n);
+    commit(p+n);
+  }
+
+  static char* writeUInt(char *p, unsigned long long v)
+  {
+    char tmp[24];
+    int n=0;
+    do { tmp[n++]=char('0'+v%10); v/=10; } while (v);
+    while (n) *p++=tmp[--n];
+    return p;
+  }
+
+  // Same as %f: six decimals
+  static char* writeFloat(char *p, double v)
+  {
+    if (!(fabs(v)<1e12)) return p+sprintf(p, "%f", v);
+
+    long long n=(long long)floor(fabs(v)*1e6+0.5);
+    if (v<0 && n) *p++='-';
+    p=writeUInt(p, n/1000000);
+    *p++='.';
+    int frac=int(n%1000000);
+    for (int d=100000; d; d/=10) { *p++=char('0'+frac/d); frac%=d; }
+    return p;
+  }
+
+private:
+  FILE *m_fp;
+  std::vector<char> m_buf;
+  size_t m_pos;
+  bool m_ok;
 };
 
 
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
+// Flattened copy of a sprite for the mesh exporters, read once so the
+// meshing never goes through the layer stack.  Cells are indexed x fastest,
+// then z, then y.
+struct VoxelSnapshot
+{
+  Imath::V3i size;
+  std::vector<SproxelRgba8> colors;
+  std::vector<SproxelIndex> indices; // only with a single shared palette
+  ColorPalettePtr palette;
+
+  size_t index(int x, int y, int z) const { return (size_t(y)*size.z+z)*size.x+x; }
+
+  void build(const VoxelGridGroup &spr, const Imath::Box3i &dim)
+  {
+    size=dim.size()+Imath::V3i(1);
+
+    palette=NULL;
+    bool indexed=spr.numLayers()>0;
+    for (int i=0; i<spr.numLayers(); ++i)
+    {
+      VoxelGridLayerPtr l=spr.layer(i);
+      if (!l->isIndexed() || !l->palette() || (palette && l->palette()!=palette)) indexed=false;
+      palette=l->palette();
+    }
+    if (!indexed) palette=NULL;
+
+    colors.assign(size_t(size.x)*size.y*size.z, 0);
+    if (palette) indices.assign(colors.size(), 0);
+
+    // only cells marked in the occupancy masks are read, 64 at a time
+    for (int y=0; y<size.y; ++y)
+      for (int x=0; x<size.x; ++x)
+        for (int z0=0; z0<size.z; z0+=OccupancyMask::WORD_SIZE)
+        {
+          OccupancyMask::Word occ=spr.occupiedRow(Imath::V3i(x, y, z0)+dim.min);
+          if (size.z-z0<OccupancyMask::WORD_SIZE) occ&=(OccupancyMask::Word(1)<<(size.z-z0))-1;
+
+          while (occ)
+          {
+            const int z=z0+OccupancyMask::lowestBit(occ);
+            occ&=occ-1;
+
+            const Imath::V3i at=Imath::V3i(x, y, z)+dim.min;
+            const size_t i=index(x, y, z);
+            colors[i]=spr.getPacked(at);
+            if (palette) indices[i]=SproxelIndex(spr.getInd(at));
+          }
+        }
+  }
+
+  // Materials are keyed by palette index, or by color with or without alpha
+  unsigned key(size_t i, bool withAlpha) const
+  {
+    if (palette) return indices[i];
+    return withAlpha ? colors[i] : (colors[i]&0xFFFFFF);
+  }
+
+  SproxelColor keyColor(unsigned key) const
+  {
+    return palette ? palette->color(key) : unpack_color(key);
+  }
+
+  // Sorted keys of all opaque cells
+  void collectKeys(bool withAlpha, std::vector<unsigned> &keys) const
+  {
+    keys.clear();
+    if (palette || !withAlpha)
+    {
+      std::vector<bool> used(palette ? 256 : (1<<24), false);
+      for (size_t i=0; i<colors.size(); ++i)
+        if (colors[i]>>24) used[key(i, withAlpha)]=true;
+      for (size_t k=0; k<used.size(); ++k)
+        if (used[k]) keys.push_back(unsigned(k));
+    }
+    else
+    {
+      for (size_t i=0; i<colors.size(); ++i)
+        if (colors[i]>>24 && (keys.empty() || keys.back()!=colors[i])) keys.push_back(colors[i]);
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+  }
+};
+
+
+// Quad on the surface of a snapshot.  Corners are lattice points, the
+// corner of voxel (x,y,z) nearest to the origin is (x,y,z), and they are
+// wound counter-clockwise seen from outside.
+struct SurfaceQuad
+{
+  int material; // index into the key list
+  int axis;     // normal axis
+  bool positive;
+  Imath::V3i corner[4];
+};
+
+
+// Emits a quad wherever an opaque voxel meets a voxel of different alpha or
+// the grid border.  With merge, coplanar quads of the same material are
+// greedily joined into rectangles.
+static void build_surface_quads(const VoxelSnapshot &snap, const std::vector<unsigned> &keys,
+  bool withAlpha, bool merge, std::vector<SurfaceQuad> &quads)
+{
+  const Imath::V3i size=snap.size;
+
+  // planes are walked with the smallest snapshot stride innermost
+  static const int innerAxis[3]={ 2, 0, 0 }, outerAxis[3]={ 1, 2, 1 };
+  const size_t stride[3]={ 1, size_t(size.x)*size.z, size_t(size.x) };
+
+  // quad corners in (u, v) for a cyclic (axis, u, v)
+  static const int negUV[4][2]={ {0,0}, {0,1}, {1,1}, {1,0} };
+  static const int posUV[4][2]={ {0,0}, {1,0}, {1,1}, {0,1} };
+
+  std::vector<int> mask;
+  for (int d=0; d<3; ++d)
+  {
+    const int u=innerAxis[d], v=outerAxis[d];
+    const bool flip = u!=(d+1)%3;
+    mask.resize(size_t(size[u])*size[v]);
+
+    for (int side=0; side<2; ++side)
+      for (int plane=0; plane<size[d]; ++plane)
+      {
+        const bool border = side ? plane==size[d]-1 : plane==0;
+        const ptrdiff_t nofs = side ? ptrdiff_t(stride[d]) : -ptrdiff_t(stride[d]);
+
+        // material+1 of every face on this plane, 0 for none
+        bool any=false;
+        for (int j=0; j<size[v]; ++j)
+          for (int i=0; i<size[u]; ++i)
+          {
+            const size_t ci=plane*stride[d]+j*stride[v]+i*stride[u];
+            const unsigned a=snap.colors[ci]>>24;
+            int m=0;
+            if (a && (border || (snap.colors[ci+nofs]>>24)!=a))
+            {
+              m=int(std::lower_bound(keys.begin(), keys.end(), snap.key(ci, withAlpha))-keys.begin())+1;
+              any=true;
+            }
+            mask[size_t(j)*size[u]+i]=m;
+          }
+        if (!any) continue;
+
+        const int (*uv)[2] = (side!=0)!=flip ? posUV : negUV;
+
+        for (int j=0; j<size[v]; ++j)
+          for (int i=0; i<size[u]; )
+          {
+            const int m=mask[size_t(j)*size[u]+i];
+            if (!m) { ++i; continue; }
+
+            // grow along u, then along v while the whole row matches
+            int w=1, h=1;
+            if (merge)
+            {
+              while (i+w<size[u] && mask[size_t(j)*size[u]+i+w]==m) ++w;
+              for (; j+h<size[v]; ++h)
+              {
+                int k=0;
+                while (k<w && mask[size_t(j+h)*size[u]+i+k]==m) ++k;
+                if (k<w) break;
+              }
+              for (int jj=j; jj<j+h; ++jj)
+                std::fill(&mask[size_t(jj)*size[u]+i], &mask[size_t(jj)*size[u]+i]+w, 0);
+            }
+
+            SurfaceQuad q;
+            q.material=m-1;
+            q.axis=d;
+            q.positive=side!=0;
+            for (int k=0; k<4; ++k)
+            {
+              q.corner[k][d]=plane+side;
+              q.corner[k][u]=i+uv[k][0]*w;
+              q.corner[k][v]=j+uv[k][1]*h;
+            }
+            quads.push_back(q);
+
+            i+=w;
+          }
+      }
+  }
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
 class ObjExporter : public Exporter
 {
 public:
   bool asTriangles;
+  bool mergeFaces;
 
-  ObjExporter() : asTriangles(false) {}
+  ObjExporter() : asTriangles(false), mergeFaces(false) {}
 
   virtual QString name() { return "OBJ files"; }
   virtual QString filter() { return "*.obj"; }
 
-  static void objWritePoly(FILE* fp, bool asTriangles,
-    int v0, int v1, int v2, int v3)
+  static void writeMaterials(FILE *fp, const VoxelSnapshot &snap, const std::vector<unsigned> &keys)
   {
-    if (!asTriangles)
-    {
-      fprintf(fp, "f %d %d %d %d\n", v0, v1, v2, v3);
-    }
-    else
+    TextOutput out(fp);
+    char line[256];
+    for (size_t i=0; i<keys.size(); ++i)
     {
-      fprintf(fp, "f %d %d %d\n", v0, v1, v2);
-      fprintf(fp, "f %d %d %d\n", v2, v3, v0);
+      const SproxelColor color = snap.keyColor(keys[i]);
+      if (snap.palette)
+        sprintf(line, "newmtl pal%u\n", keys[i]);
+      else
+        sprintf(line, "newmtl mtl%d\n", int(i));
+      out.text(line);
+      out.text("illum 4\n");
+      sprintf(line, "Kd %.4f %.4f %.4f\n", color.r, color.g, color.b);
+      out.text(line);
+      out.text("Ka 0.00 0.00 0.00\n");
+      out.text("Tf 1.00 1.00 1.00\n");
+      out.text("Ni 1.00\n");
+      out.text("\n");
     }
   }
 
@@ -262,213 +654,123 @@ public:
       QString basename = fi.completeBaseName();
       QString basedir = fi.absolutePath();
 
-      // Shorthand
       const Imath::Box3i dim=spr->bounds();
-      const Imath::V3i cellDim=dim.size()+Imath::V3i(1);
-      const int sx = cellDim.x;
-      const int sy = cellDim.y;
-      const int sz = cellDim.z;
+      if (dim.isEmpty()) return false;
 
-      // Create and write the material file
-      std::map<std::string, std::string> mtlMap;
+      VoxelSnapshot snap;
+      snap.build(*spr, dim);
+      const Imath::V3i size=snap.size;
 
-      // Build up the material lists
-      for (int y = 0; y < sy; y++)
-      {
-          for (int z = 0; z < sz; z++)
-          {
-              for (int x = 0; x < sx; x++)
-              {
-                  const Imath::Color4f& color = spr->get(Imath::V3i(x, y, z)+dim.min);
-
-                  if (color.a == 0.0f) continue;
-
-                  char mtlName[64];
-                  sprintf(mtlName, "mtl%d", (int)mtlMap.size());
-
-                  char colorString[64];
-                  sprintf(colorString, "Kd %.4f %.4f %.4f", color.r, color.g, color.b);
-                  mtlMap.insert(std::pair<std::string, std::string>(std::string(colorString), std::string(mtlName)));
-              }
-          }
-      }
+      // Collect the materials in use
+      std::vector<unsigned> keys;
+      snap.collectKeys(false, keys);
 
       // Write .mtl file
       QString mtlFilename = basedir + "/" + basename + ".mtl";
-	  FILE* fp = fopen(mtlFilename.toLocal8Bit().constData(), "wb");
+      FILE* fp = fopen(mtlFilename.toLocal8Bit().constData(), "wb");
       if (!fp) return false;
+      writeMaterials(fp, snap, keys);
+      fclose(fp);
 
-      for(std::map<std::string, std::string>::iterator p = mtlMap.begin();
-          p != mtlMap.end();
-          ++p)
+      std::vector<SurfaceQuad> quads;
+      build_surface_quads(snap, keys, false, mergeFaces, quads);
+
+      // Weld vertices by sorting the corner keys, they end up in lattice order
+      std::vector<std::pair<quint64, int> > corners(quads.size()*4); // lattice key, quad*4+corner
+      for (size_t i=0; i<quads.size(); ++i)
+        for (int k=0; k<4; ++k)
+        {
+          const Imath::V3i &l=quads[i].corner[k];
+          corners[i*4+k]=std::make_pair((quint64(l.y)*(size.z+1)+l.z)*(size.x+1)+l.x, int(i*4+k));
+        }
+      std::sort(corners.begin(), corners.end());
+
+      std::vector<int> faceVerts(corners.size());
+      std::vector<quint64> verts;
+      for (size_t i=0; i<corners.size(); ++i)
       {
-          fprintf(fp, "newmtl %s\n", p->second.c_str());
-          fprintf(fp, "illum 4\n");
-          fprintf(fp, "%s\n", p->first.c_str());
-          fprintf(fp, "Ka 0.00 0.00 0.00\n");
-          fprintf(fp, "Tf 1.00 1.00 1.00\n");
-          fprintf(fp, "Ni 1.00\n");
-          fprintf(fp, "\n");
+        if (verts.empty() || verts.back()!=corners[i].first) verts.push_back(corners[i].first);
+        faceVerts[corners[i].second]=int(verts.size());
       }
-      fclose(fp);
+      std::vector<std::pair<quint64, int> >().swap(corners);
 
+      // Group faces by material
+      std::vector<int> firstFace(keys.size()+1, 0);
+      for (size_t i=0; i<quads.size(); ++i) ++firstFace[quads[i].material+1];
+      for (size_t m=1; m<firstFace.size(); ++m) firstFace[m]+=firstFace[m-1];
+      std::vector<int> order(quads.size());
+      {
+        std::vector<int> next(firstFace.begin(), firstFace.end()-1);
+        for (size_t i=0; i<quads.size(); ++i) order[next[quads[i].material]++]=int(i);
+      }
 
       // Create and write the obj file
-	  fp = fopen(filename.toLocal8Bit().constData(), "wb");
+      fp = fopen(filename.toLocal8Bit().constData(), "wb");
       if (!fp) return false;
 
-      // Geometry
-      const int vertListLength = (sx+1) * (sy+1) * (sz+1);
-      int* vertList = new int[vertListLength];
-      memset(vertList, 0, sizeof(int)*vertListLength);
+      bool ok;
+      {
+        TextOutput out(fp);
 
-      // Material library
-	  fprintf(fp, "mtllib %s.mtl\n", basename.toLocal8Bit().constData());
+        // Material library
+        out.text("mtllib "); out.text(basename.toLocal8Bit().constData()); out.text(".mtl\n");
 
-      // The object's name
-	  fprintf(fp, "g %s\n", basename.toLocal8Bit().constData());
+        // The object's name
+        out.text("g "); out.text(basename.toLocal8Bit().constData()); out.text("\n");
 
-      // Populate the vert list
-      int vertIndex = 1;
-      for (int y = 0; y < (sy+1); y++)
-      {
-          for (int z = 0; z < (sz+1); z++)
-          {
-              for (int x = 0; x < (sx+1); x++)
-              {
-                  int neighbors = 0;
-                  if ((x!=0)  && (y!=0)  && (z!=0)  && (spr->get(Imath::V3i(x-1, y-1, z-1)+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=0)  && (y!=0)  && (z!=sz) && (spr->get(Imath::V3i(x-1, y-1, z  )+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=0)  && (y!=sy) && (z!=0)  && (spr->get(Imath::V3i(x-1, y,   z-1)+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=0)  && (y!=sy) && (z!=sz) && (spr->get(Imath::V3i(x-1, y,   z  )+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=sx) && (y!=0)  && (z!=0)  && (spr->get(Imath::V3i(x,   y-1, z-1)+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=sx) && (y!=0)  && (z!=sz) && (spr->get(Imath::V3i(x,   y-1, z  )+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=sx) && (y!=sy) && (z!=0)  && (spr->get(Imath::V3i(x,   y,   z-1)+dim.min).a != 0.0f)) neighbors++;
-                  if ((x!=sx) && (y!=sy) && (z!=sz) && (spr->get(Imath::V3i(x,   y,   z  )+dim.min).a != 0.0f)) neighbors++;
-
-                  if (neighbors == 0 || neighbors == 8)
-                      continue;
-
-                  const int vlIndex = (y*(sz+1)*(sx+1)) + (z*(sx+1)) + (x);
-                  vertList[vlIndex] = vertIndex;
-                  vertIndex++;
-              }
-          }
-      }
+        const Imath::M44d &mat=spr->transform();
+        for (size_t i=0; i<verts.size(); ++i)
+        {
+          const quint64 x=verts[i]%(size.x+1), z=verts[i]/(size.x+1)%(size.z+1), y=verts[i]/(size.x+1)/(size.z+1);
+          Imath::V3d pos;
+          mat.multVecMatrix(Imath::V3d(Imath::V3i(int(x), int(y), int(z))+dim.min), pos);
+
+          char *p=out.reserve(128);
+          *p++='v';
+          for (int k=0; k<3; ++k) { *p++=' '; p=TextOutput::writeFloat(p, pos[k]); }
+          *p++='\n';
+          out.commit(p);
+        }
 
-      // Write the verts to the OBJ
-      for (int y = 0; y < (sy+1); y++)
-      {
-          for (int z = 0; z < (sz+1); z++)
-          {
-              for (int x = 0; x < (sx+1); x++)
-              {
-                  Imath::V3i voxelToCheck = Imath::V3i(x,y,z);
-                  if (x == sx) voxelToCheck.x--;
-                  if (y == sy) voxelToCheck.y--;
-                  if (z == sz) voxelToCheck.z--;
-
-                  const Imath::M44d mat = spr->voxelTransform(voxelToCheck+dim.min);
-
-                  Imath::V3d vert;
-                  mat.multVecMatrix(Imath::V3d((x == sx) ? 0.5f : -0.5f,
-                                               (y == sy) ? 0.5f : -0.5f,
-                                               (z == sz) ? 0.5f : -0.5f), vert);
-
-                  const int vlIndex = (y*(sz+1)*(sx+1)) + (z*(sx+1)) + (x);
-                  if (vertList[vlIndex] != 0)
-                  {
-                      fprintf(fp, "v %f %f %f\n", vert.x, vert.y, vert.z);
-                  }
-              }
-          }
-      }
+        char name[32];
+        for (size_t m=0; m<keys.size(); ++m)
+        {
+          if (firstFace[m]==firstFace[m+1]) continue;
 
-      // Create all faces
-      for (int y = 0; y < sy; y++)
-      {
-          for (int z = 0; z < sz; z++)
+          if (snap.palette) sprintf(name, "usemtl pal%u\n", keys[m]);
+          else sprintf(name, "usemtl mtl%d\n", int(m));
+          out.text(name);
+
+          for (int fi=firstFace[m]; fi<firstFace[m+1]; ++fi)
           {
-              for (int x = 0; x < sx; x++)
+            const int *fv=&faceVerts[size_t(order[fi])*4];
+            char *p=out.reserve(128);
+            if (!asTriangles)
+            {
+              *p++='f';
+              for (int k=0; k<4; ++k) { *p++=' '; p=TextOutput::writeUInt(p, fv[k]); }
+              *p++='\n';
+            }
+            else
+            {
+              static const int tri[6]={ 0, 1, 2, 2, 3, 0 };
+              for (int t=0; t<6; t+=3)
               {
-                  const Imath::Color4f& color = spr->get(Imath::V3i(x, y, z)+dim.min);
-                  if (color.a == 0.0f)
-                      continue;
-
-                  // Check for crossings
-                  bool crossNegX = false;
-                  bool crossPosX = false;
-                  if (x == 0)
-                      crossNegX = true;
-                  else if (color.a != spr->get(Imath::V3i(x-1,y,z)+dim.min).a)
-                      crossNegX = true;
-
-                  if (x == sx-1)
-                      crossPosX = true;
-                  else if (color.a != spr->get(Imath::V3i(x+1,y,z)+dim.min).a)
-                      crossPosX = true;
-
-                  bool crossNegY = false;
-                  bool crossPosY = false;
-                  if (y == 0)
-                      crossNegY = true;
-                  else if (color.a != spr->get(Imath::V3i(x,y-1,z)+dim.min).a)
-                      crossNegY = true;
-
-                  if (y == sy-1)
-                      crossPosY = true;
-                  else if (color.a != spr->get(Imath::V3i(x,y+1,z)+dim.min).a)
-                      crossPosY = true;
-
-                  bool crossNegZ = false;
-                  bool crossPosZ = false;
-                  if (z == 0)
-                      crossNegZ = true;
-                  else if (color.a != spr->get(Imath::V3i(x,y,z-1)+dim.min).a)
-                      crossNegZ = true;
-
-                  if (z == sz-1)
-                      crossPosZ = true;
-                  else if (color.a != spr->get(Imath::V3i(x,y,z+1)+dim.min).a)
-                      crossPosZ = true;
-
-                  // If there are any crossings, you will need a material
-                  if (crossNegX || crossPosX || crossNegY || crossPosY || crossNegZ || crossPosZ)
-                  {
-                      char colorString[64];
-                      sprintf(colorString, "Kd %.4f %.4f %.4f", color.r, color.g, color.b);
-                      const std::string mtl = mtlMap.find(colorString)->second;
-                      fprintf(fp, "usemtl %s\n", mtl.c_str());
-                  }
-
-                  // Fill in the voxels
-                  const int* vl = vertList;
-                  const int  vi       = ((y)  *(sz+1)*(sx+1)) + ((z)  *(sx+1)) + (x);
-                  const int  viNextZ  = ((y)  *(sz+1)*(sx+1)) + ((z+1)*(sx+1)) + (x);
-                  const int  viNextY  = ((y+1)*(sz+1)*(sx+1)) + ((z)  *(sx+1)) + (x);
-                  const int  viNextZY = ((y+1)*(sz+1)*(sx+1)) + ((z+1)*(sx+1)) + (x);
-
-                  if (crossNegX)
-                      objWritePoly(fp, asTriangles, vl[vi],   vl[viNextZ],   vl[viNextZY],   vl[viNextY]);
-                  if (crossPosX)
-                      objWritePoly(fp, asTriangles, vl[vi+1], vl[viNextY+1], vl[viNextZY+1], vl[viNextZ+1]);
-
-                  if (crossNegY)
-                      objWritePoly(fp, asTriangles, vl[vi],      vl[vi+1],     vl[viNextZ+1],  vl[viNextZ]);
-                  if (crossPosY)
-                      objWritePoly(fp, asTriangles, vl[viNextY], vl[viNextZY], vl[viNextZY+1], vl[viNextY+1]);
-
-                  if (crossNegZ)
-                      objWritePoly(fp, asTriangles, vl[vi],      vl[viNextY],  vl[viNextY+1],  vl[vi+1]);
-                  if (crossPosZ)
-                      objWritePoly(fp, asTriangles, vl[viNextZ], vl[viNextZ+1], vl[viNextZY+1], vl[viNextZY]);
+                *p++='f';
+                for (int k=t; k<t+3; ++k) { *p++=' '; p=TextOutput::writeUInt(p, fv[tri[k]]); }
+                *p++='\n';
               }
+            }
+            out.commit(p);
           }
+        }
+
+        out.flush();
+        ok=out.isOk();
       }
 
-      delete[] vertList;
-      fclose(fp);
-      return true;
+      if (fclose(fp)!=0) ok=false;
+      return ok;
   }
 };
 
@@ -484,6 +786,220 @@ public:
 };
 
 
+class ObjMergedExporter : public ObjExporter
+{
+public:
+  ObjMergedExporter() { mergeFaces=true; }
+  virtual QString name() { return "OBJ files with merged faces"; }
+};
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// Binary glTF 2.0.  The sprite becomes a single mesh with one material:
+// greedy-merged quads whose texture coordinates point into a small palette
+// texture holding one texel per colour.  Positions are in voxel units, the
+// sprite transform goes to the node.
+class GlbExporter : public Exporter
+{
+public:
+  virtual QString name() { return "glTF binary files"; }
+  virtual QString filter() { return "*.glb"; }
+
+  // Appends a 4-byte aligned block to the binary chunk, returns its offset
+  static int appendView(QByteArray &bin, const void *data, int size)
+  {
+    const int offset=bin.size();
+    bin.append((const char*)data, size);
+    while (bin.size()&3) bin.append(char(0));
+    return offset;
+  }
+
+  static void appendU32(QByteArray &out, quint32 v)
+  {
+    uchar b[4];
+    qToLittleEndian<quint32>(v, b);
+    out.append((const char*)b, 4);
+  }
+
+  virtual bool doExport(const QString &in_filename, SproxelProjectPtr, VoxelGridGroupPtr spr)
+  {
+    QString filename=ensure_ext(in_filename, ".glb");
+
+    const Imath::Box3i dim=spr->bounds();
+    if (dim.isEmpty()) return false;
+
+    VoxelSnapshot snap;
+    snap.build(*spr, dim);
+
+    std::vector<unsigned> keys;
+    snap.collectKeys(true, keys);
+    if (keys.empty()) return false;
+
+    std::vector<SurfaceQuad> quads;
+    build_surface_quads(snap, keys, true, true, quads);
+    if (quads.empty()) return false;
+
+    // Palette texture, square power of two
+    int side=1;
+    while (size_t(side)*side<keys.size()) side*=2;
+
+    QImage tex(side, side, QImage::Format_ARGB32);
+    tex.fill(0);
+    bool translucent=false;
+    for (size_t i=0; i<keys.size(); ++i)
+    {
+      const SproxelRgba8 c=pack_color(snap.keyColor(keys[i]));
+      if ((c>>24)!=0xFF) translucent=true;
+      tex.setPixel(int(i%side), int(i/side), c);
+    }
+
+    QByteArray png;
+    {
+      QBuffer buf(&png);
+      buf.open(QIODevice::WriteOnly);
+      if (!tex.save(&buf, "PNG")) return false;
+    }
+
+    // Vertex data, four vertices per quad since normals and texture
+    // coordinates differ between faces.  glTF buffers are little-endian,
+    // the arrays are written as they are in memory.
+    const size_t numVerts=quads.size()*4;
+    std::vector<float> positions(numVerts*3), normals(numVerts*3), uvs(numVerts*2);
+    Imath::V3f pmin(FLT_MAX), pmax(-FLT_MAX);
+
+    for (size_t q=0; q<quads.size(); ++q)
+    {
+      const SurfaceQuad &quad=quads[q];
+      const int m=quad.material;
+      const float u=(m%side+0.5f)/side, v=(m/side+0.5f)/side;
+
+      for (int k=0; k<4; ++k)
+      {
+        const size_t vi=q*4+k;
+        const Imath::V3f p(quad.corner[k]+dim.min);
+        pmin.x=std::min(pmin.x, p.x); pmax.x=std::max(pmax.x, p.x);
+        pmin.y=std::min(pmin.y, p.y); pmax.y=std::max(pmax.y, p.y);
+        pmin.z=std::min(pmin.z, p.z); pmax.z=std::max(pmax.z, p.z);
+
+        positions[vi*3  ]=p.x;
+        positions[vi*3+1]=p.y;
+        positions[vi*3+2]=p.z;
+
+        normals[vi*3  ]=0;
+        normals[vi*3+1]=0;
+        normals[vi*3+2]=0;
+        normals[vi*3+quad.axis]=quad.positive ? 1.0f : -1.0f;
+
+        uvs[vi*2  ]=u;
+        uvs[vi*2+1]=v;
+      }
+    }
+
+    QByteArray bin;
+    const int posView=appendView(bin, &positions[0], int(positions.size()*sizeof(float)));
+    const int nrmView=appendView(bin, &normals[0], int(normals.size()*sizeof(float)));
+    const int uvView=appendView(bin, &uvs[0], int(uvs.size()*sizeof(float)));
+
+    const bool wideIndices=numVerts>65535;
+    const size_t numIndices=quads.size()*6;
+    int idxView, idxSize;
+    {
+      static const int tri[6]={ 0, 1, 2, 2, 3, 0 };
+      if (wideIndices)
+      {
+        std::vector<quint32> idx(numIndices);
+        for (size_t i=0; i<numIndices; ++i) idx[i]=quint32(i/6*4+tri[i%6]);
+        idxSize=int(idx.size()*4);
+        idxView=appendView(bin, &idx[0], idxSize);
+      }
+      else
+      {
+        std::vector<quint16> idx(numIndices);
+        for (size_t i=0; i<numIndices; ++i) idx[i]=quint16(i/6*4+tri[i%6]);
+        idxSize=int(idx.size()*2);
+        idxView=appendView(bin, &idx[0], idxSize);
+      }
+    }
+
+    const int pngView=appendView(bin, png.constData(), png.size());
+
+    // JSON chunk
+    QString meshName=QFileInfo(filename).completeBaseName();
+    meshName.replace('\\', "\\\\").replace('"', "\\\"");
+    QString node=QString("{\"mesh\":0,\"name\":\"%1\"").arg(meshName);
+    const Imath::M44d &mat=spr->transform();
+    if (mat!=Imath::M44d())
+    {
+      // row-vector Imath matrices are the transpose of glTF column-major ones
+      node+=",\"matrix\":[";
+      for (int i=0; i<16; ++i) node+=QString(i ? ",%1" : "%1").arg(mat[i/4][i%4], 0, 'g', 17);
+      node+="]";
+    }
+    node+="}";
+
+    QString json;
+    json+="{\"asset\":{\"version\":\"2.0\",\"generator\":\"Sproxel\"},";
+    json+="\"scene\":0,\"scenes\":[{\"nodes\":[0]}],";
+    json+="\"nodes\":["+node+"],";
+    json+="\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2},\"indices\":3,\"material\":0}]}],";
+    json+=QString("\"materials\":[{\"pbrMetallicRoughness\":{\"baseColorTexture\":{\"index\":0},"
+      "\"metallicFactor\":0,\"roughnessFactor\":1}%1}],").arg(translucent ? ",\"alphaMode\":\"BLEND\"" : "");
+    json+="\"samplers\":[{\"magFilter\":9728,\"minFilter\":9728,\"wrapS\":33071,\"wrapT\":33071}],";
+    json+="\"textures\":[{\"sampler\":0,\"source\":0}],";
+    json+="\"images\":[{\"bufferView\":4,\"mimeType\":\"image/png\"}],";
+    json+=QString("\"buffers\":[{\"byteLength\":%1}],").arg(bin.size());
+    json+=QString("\"bufferViews\":["
+      "{\"buffer\":0,\"byteOffset\":%1,\"byteLength\":%2,\"target\":34962},"
+      "{\"buffer\":0,\"byteOffset\":%3,\"byteLength\":%4,\"target\":34962},"
+      "{\"buffer\":0,\"byteOffset\":%5,\"byteLength\":%6,\"target\":34962},"
+      "{\"buffer\":0,\"byteOffset\":%7,\"byteLength\":%8,\"target\":34963},")
+      .arg(posView).arg(positions.size()*sizeof(float))
+      .arg(nrmView).arg(normals.size()*sizeof(float))
+      .arg(uvView).arg(uvs.size()*sizeof(float))
+      .arg(idxView).arg(idxSize);
+    json+=QString("{\"buffer\":0,\"byteOffset\":%1,\"byteLength\":%2}],").arg(pngView).arg(png.size());
+    json+=QString("\"accessors\":["
+      "{\"bufferView\":0,\"componentType\":5126,\"count\":%1,\"type\":\"VEC3\",\"min\":[%2,%3,%4],\"max\":[%5,%6,%7]},"
+      "{\"bufferView\":1,\"componentType\":5126,\"count\":%1,\"type\":\"VEC3\"},"
+      "{\"bufferView\":2,\"componentType\":5126,\"count\":%1,\"type\":\"VEC2\"},")
+      .arg(numVerts)
+      .arg(pmin.x).arg(pmin.y).arg(pmin.z)
+      .arg(pmax.x).arg(pmax.y).arg(pmax.z);
+    json+=QString("{\"bufferView\":3,\"componentType\":%1,\"count\":%2,\"type\":\"SCALAR\"}]")
+      .arg(wideIndices ? 5125 : 5123).arg(numIndices);
+    json+="}";
+
+    QByteArray jsonChunk=json.toUtf8();
+    while (jsonChunk.size()&3) jsonChunk.append(' ');
+
+    // GLB container
+    QByteArray header;
+    appendU32(header, 0x46546C67); // "glTF"
+    appendU32(header, 2);
+    appendU32(header, 12+8+jsonChunk.size()+8+bin.size());
+    appendU32(header, jsonChunk.size());
+    appendU32(header, 0x4E4F534A); // "JSON"
+
+    QByteArray binHeader;
+    appendU32(binHeader, bin.size());
+    appendU32(binHeader, 0x004E4942); // "BIN"
+
+    FILE *fp=fopen(filename.toLocal8Bit().constData(), "wb");
+    if (!fp) return false;
+
+    bool ok = fwrite(header.constData(), 1, header.size(), fp)==size_t(header.size())
+      && fwrite(jsonChunk.constData(), 1, jsonChunk.size(), fp)==size_t(jsonChunk.size())
+      && fwrite(binHeader.constData(), 1, binHeader.size(), fp)==size_t(binHeader.size())
+      && fwrite(bin.constData(), 1, bin.size(), fp)==size_t(bin.size());
+
+    if (fclose(fp)!=0) ok=false;
+    return ok;
+  }
+};
+
+
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
@@ -586,6 +1102,8 @@ void register_builtin_importers_exporters()
   #define REG(name) static name s_##name; register_exporter(& s_##name);
   REG(ObjExporter)
   REG(ObjTriangleExporter)
+  REG(ObjMergedExporter)
+  REG(GlbExporter)
   REG(SproxelPngExporter)
   REG(SproxelCsvExporter)
   REG(PalExporter)
@@ -10,6 +10,7 @@
 #include "ConsoleWidget.h"
 #include "pyConsole.h"
 #include "ImportExport.h"
+#include "Quantize.h"
 
 #include <QFileDialog>
 #include <QColorDialog>
@@ -70,6 +71,8 @@ MainWindow::MainWindow(const QString& initialFilename, QWidget *parent) :
 					 m_paletteWidget, SLOT(setActiveColor(Imath::Color4f, int)));
 	QObject::connect(&m_undoManager, SIGNAL(cleanChanged(bool)),
 					 this, SLOT(reactToModified(bool)));
+	QObject::connect(&m_undoManager, SIGNAL(historyLost()),
+					 this, SLOT(reactToHistoryLost()));
 
 	QObject::connect(m_projectWidget, SIGNAL(spriteSelected(VoxelGridGroupPtr)),
 					 m_glModelWidget, SLOT(setSprite(VoxelGridGroupPtr)));
@@ -258,6 +261,11 @@ MainWindow::MainWindow(const QString& initialFilename, QWidget *parent) :
 	connect(m_actDownRes, SIGNAL(triggered()),
 			this, SLOT(downRes()));
 
+	m_actConvertToIndexed = new QAction("Convert to indexed colors", this);
+	m_menuGrid->addAction(m_actConvertToIndexed);
+	connect(m_actConvertToIndexed, SIGNAL(triggered()),
+			this, SLOT(convertToIndexed()));
+
 
 	// ------ view menu
 	m_menuView = menuBar()->addMenu("&View");
@@ -419,6 +427,8 @@ MainWindow::MainWindow(const QString& initialFilename, QWidget *parent) :
 		//m_layersDocker->setVisible(m_appSettings.value("layersWindow/visibility", true).toBool());
 	}
 
+	m_undoManager.setMemoryBudget(size_t(m_appSettings.value("undoMemoryBudget", 1024).toInt())<<20);
+
 	// Load the commandline supplied filename
 	if (initialFilename != "")
 	{
@@ -597,7 +607,7 @@ void MainWindow::newGrid()
 		// create new project
 		m_project=new SproxelProject();
 		VoxelGridGroupPtr sprite(new VoxelGridGroup(dlg.getVoxelSize(),
-													dlg.isIndexed()?m_project->mainPalette:ColorPalettePtr()));
+													dlg.isIndexed()?m_project->mainPalette:ColorPalettePtr(), dlg.isCompact()));
 		sprite->setName("unnamed");
 		m_project->sprites.push_back(sprite);
 
@@ -616,11 +626,7 @@ void MainWindow::saveFile()
 	if (m_activeFilename == "")
 		return saveFileAs();
 
-#ifdef SPROXEL_USE_PYTHON
 	bool success = save_project(m_activeFilename, m_project);
-#else
-	bool success = false;
-#endif
 	if (success)
 		m_undoManager.setClean();
 	else
@@ -631,7 +637,10 @@ void MainWindow::saveFile()
 void MainWindow::saveFileAs()
 {
 	QFileDialog fd(this, "Save voxel file as...");
-	fd.setNameFilter(tr("Sproxel project (*.sxl)"));
+	QStringList saveFilters;
+	saveFilters += tr("Sproxel project (*.sxl)");
+	saveFilters += tr("Sproxel binary project (*.sxb)");
+	fd.setNameFilters(saveFilters);
 	fd.setAcceptMode(QFileDialog::AcceptSave);
 	fd.exec();
 	QStringList qsl = fd.selectedFiles();
@@ -643,12 +652,10 @@ void MainWindow::saveFileAs()
 
 	// Switch on save type
 	bool success = false;
-	if (!filename.endsWith(".sxl", Qt::CaseInsensitive))
-		filename.append(".sxl");
+	if (!filename.endsWith(".sxl", Qt::CaseInsensitive) && !filename.endsWith(".sxb", Qt::CaseInsensitive))
+		filename.append(activeFilter.contains("*.sxb") ? ".sxb" : ".sxl");
 
-#ifdef SPROXEL_USE_PYTHON
 	success = save_project(filename, m_project);
-#endif
 
 	if (success)
 	{
@@ -673,7 +680,7 @@ void MainWindow::openFile()
 	const QList<Importer*> &importers=get_importers();
 
 	QStringList filters;
-	filters += tr("Sproxel projects (*.sxl)");
+	filters += tr("Sproxel projects (*.sxl *.sxb)");
 	foreach (Importer *imp, importers) filters += imp->name()+" ("+imp->filter()+")";
 
 	QFileDialog fd(this, "Select file to Open...");
@@ -708,23 +715,28 @@ void MainWindow::openFile(QString filename)
 	}
 
 	bool success = false;
-#ifdef SPROXEL_USE_PYTHON
-	SproxelProjectPtr project = load_project(filename);
-#else
-	SproxelProjectPtr project = SproxelProjectPtr(new SproxelProject());
+	SproxelProjectPtr project;
+	if (filename.endsWith(".sxl", Qt::CaseInsensitive) || filename.endsWith(".sxb", Qt::CaseInsensitive))
+	{
+		project = load_project(filename);
+	}
+	else
+	{
+		project = SproxelProjectPtr(new SproxelProject());
 
-	const QList<Importer*> &importers=get_importers();
+		const QList<Importer*> &importers=get_importers();
 
-	Importer* importer = NULL;
+		Importer* importer = NULL;
 
-	foreach (Importer *imp, importers) {
-		if (imp->filter() == "*.png") { // HACK FIXME
-			importer = imp;
-			break;
+		foreach (Importer *imp, importers) {
+			if (imp->filter() == "*.png") { // HACK FIXME
+				importer = imp;
+				break;
+			}
 		}
+		if (!importer || !importer->doImport(filename, &m_undoManager, project, m_glModelWidget->getSprite()))
+			project = SproxelProjectPtr();
 	}
-	importer->doImport(filename, &m_undoManager, project, m_glModelWidget->getSprite());
-#endif
 	if (project) { m_project=project; success=true; }
 
 	if (success)
@@ -856,7 +868,10 @@ void MainWindow::editPreferences()
 	PreferencesDialog dlg(this, &m_appSettings);
 	dlg.setModal(true);
 	QObject::connect(&dlg, SIGNAL(preferenceChanged()), m_glModelWidget, SLOT(updateGL()));
+	QObject::connect(&dlg, SIGNAL(preferenceChanged()), m_projectWidget, SLOT(update()));
 	dlg.exec();
+
+	m_undoManager.setMemoryBudget(size_t(m_appSettings.value("undoMemoryBudget", 1024).toInt())<<20);
 }
 
 
@@ -957,6 +972,32 @@ void MainWindow::downRes() {
 	m_glModelWidget->frame(true);
 }
 
+void MainWindow::convertToIndexed()
+{
+	VoxelGridGroupPtr spr = m_glModelWidget->getSprite();
+	if (!spr) return;
+
+	// Convert copies of the RGB layers and swap them in as one undo step,
+	// so layers shared with other sprites stay shared
+	QVector<VoxelGridLayerPtr> layers, rgb, converted;
+	for (int i = 0; i < spr->numLayers(); ++i) layers.push_back(spr->layer(i));
+
+	ColorPalettePtr pal = quantize_copies(layers, 256, rgb, converted);
+	if (!pal)
+	{
+		statusBar()->showMessage(tr("No RGB layers to convert"), 2000);
+		return;
+	}
+	pal->setName(spr->name());
+
+	m_undoManager.beginMacro("Convert to indexed");
+	m_undoManager.addPalette(m_project, pal);
+	for (int i = 0; i < rgb.size(); ++i)
+		m_undoManager.changeLayer(spr, rgb[i], converted[i]);
+	m_undoManager.endMacro();
+	m_glModelWidget->updateGL();
+}
+
 void MainWindow::setToolSplat(bool stat)   { if (stat) m_glModelWidget->setActiveTool(TOOL_SPLAT); }
 void MainWindow::setToolFlood(bool stat)   { if (stat) m_glModelWidget->setActiveTool(TOOL_FLOOD); }
 void MainWindow::setToolRay(bool stat)     { if (stat) m_glModelWidget->setActiveTool(TOOL_RAY); }
@@ -968,6 +1009,14 @@ void MainWindow::setToolLine(bool stat)    { if (stat) m_glModelWidget->setActiv
 void MainWindow::setToolBox(bool stat)     { if (stat) m_glModelWidget->setActiveTool(TOOL_BOX); }
 void MainWindow::setToolExtrude(bool stat) { if (stat) m_glModelWidget->setActiveTool(TOOL_EXTRUDE); }
 
+void MainWindow::reactToHistoryLost()
+{
+	QMessageBox::warning(this, "Sproxel Error",
+		"The undo history couldn't be read back from its temporary file and was cleared.\n"
+		"The last undo or redo may have been applied only in part.");
+}
+
+
 void MainWindow::reactToModified(bool clean)
 {
 	QString current = windowTitle();
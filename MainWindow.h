@@ -87,6 +87,7 @@ private:
     QAction* m_actContractDown;
     QAction* m_actUpRes;
     QAction* m_actDownRes;
+    QAction* m_actConvertToIndexed;
 
     QAction* m_actViewGrid;
     QAction* m_actViewVoxgrid;
@@ -156,6 +157,7 @@ public slots:
 
     void upRes();
     void downRes();
+    void convertToIndexed();
 
     void editPreferences();
 
@@ -171,6 +173,7 @@ public slots:
     void setToolExtrude(bool stat);
 
     void reactToModified(bool value);
+    void reactToHistoryLost();
 
     void updateSlice(int mino, int maxo, int range);
 };
@@ -4,6 +4,7 @@
 
 Imath::V3i NewGridDialog::lastSize(16);
 bool NewGridDialog::lastIndexed=false;
+bool NewGridDialog::lastCompact=false;
 
 
 NewGridDialog::NewGridDialog(QWidget *parent) :
@@ -17,6 +18,8 @@ NewGridDialog::NewGridDialog(QWidget *parent) :
 
 	if (lastIndexed)
 		ui->dataIndexed->setChecked(true);
+	else if (lastCompact)
+		ui->dataRGBA8->setChecked(true);
 	else
 		ui->dataRGBA->setChecked(true);
 }
@@ -34,6 +37,7 @@ int NewGridDialog::exec()
 	{
 		lastSize=getVoxelSize();
 		lastIndexed=isIndexed();
+		lastCompact=isCompact();
 	}
 
 	return r;
@@ -50,3 +54,8 @@ bool NewGridDialog::isIndexed()
 {
 	return ui->dataIndexed->isChecked();
 }
+
+bool NewGridDialog::isCompact()
+{
+	return ui->dataRGBA8->isChecked();
+}
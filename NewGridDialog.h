@@ -19,6 +19,7 @@ public:
 
     Imath::V3i getVoxelSize();
     bool isIndexed();
+    bool isCompact();
 
 public slots:
     int exec();
@@ -28,6 +29,7 @@ private:
 
     static Imath::V3i lastSize;
     static bool lastIndexed;
+    static bool lastCompact;
 };
 
 #endif // NEWGRIDDIALOG_H
@@ -0,0 +1,275 @@
+#ifndef __OCCUPANCY_MASK_H__
+#define __OCCUPANCY_MASK_H__
+
+#include <ImathBox.h>
+#include <ImathVec.h>
+
+#include "ChunkedVoxelGrid.h"
+
+
+//-*****************************************************************************
+// One bit per voxel, set for non-empty cells.
+// Bits are packed in 64-bit words running along Z: word (x, y, w) holds the
+// voxels (x, y, w*64) to (x, y, w*64+63), lowest bit first.  Words are kept
+// in a ChunkedVoxelGrid, so unallocated space reads as empty and copies share
+// storage until written.
+// A coarse pyramid counts the set bits of aligned 8^3 and 64^3 blocks, so
+// ray casts can step over empty space without looking at single voxels.
+class OccupancyMask
+{
+public:
+    typedef unsigned long long Word;
+
+    enum { WORD_BITS = 6,
+           WORD_SIZE = 1<<WORD_BITS,
+           WORD_MASK = WORD_SIZE-1 };
+
+    enum { BLOCK_LEVELS = 2 };
+
+    // Block size of a pyramid level is 1<<blockBits(level)
+    static int blockBits(int level) { return 3*(level+1); }
+
+    OccupancyMask() : m_words(0) {}
+
+    static Imath::V3i wordOf(const Imath::V3i& cell)
+    {
+        return Imath::V3i(cell.x, cell.y, cell.z>>WORD_BITS);
+    }
+
+    bool get(const Imath::V3i& cell) const
+    {
+        return (m_words.get(wordOf(cell)) >> (cell.z&WORD_MASK)) & 1;
+    }
+
+    void set(const Imath::V3i& cell, bool on)
+    {
+        const Imath::V3i w = wordOf(cell);
+        const Word bit = Word(1) << (cell.z&WORD_MASK);
+        const Word old = m_words.get(w);
+        if (((old&bit)!=0) == on) return;
+
+        m_words.set(w, on ? (old|bit) : (old&~bit));
+        for (int l=0; l<BLOCK_LEVELS; ++l) addCount(l, cell, on ? 1 : -1);
+    }
+
+    // The 64 cells (x, y, z) to (x, y, z+63), bit i for cell z+i
+    Word row(const Imath::V3i& cell) const
+    {
+        const Imath::V3i w = wordOf(cell);
+        const int shift = cell.z&WORD_MASK;
+        const Word lo = m_words.get(w);
+        if (!shift) return lo;
+        const Word hi = m_words.get(w+Imath::V3i(0, 0, 1));
+        return (lo>>shift) | (hi<<(WORD_SIZE-shift));
+    }
+
+    // Replaces n bits starting at cell with the low bits of bits,
+    // the bits must not cross a word boundary
+    void setBits(const Imath::V3i& cell, Word bits, int n)
+    {
+        const Imath::V3i w = wordOf(cell);
+        const int shift = cell.z&WORD_MASK;
+        const Word m = (n>=WORD_SIZE ? ~Word(0) : (Word(1)<<n)-1) << shift;
+        const Word old = m_words.get(w);
+        const Word now = (old&~m) | ((bits<<shift)&m);
+        if (now == old) return;
+
+        m_words.set(w, now);
+        countWord(w, old, -1);
+        countWord(w, now, 1);
+    }
+
+    void clear()
+    {
+        m_words.clear();
+        for (int l=0; l<BLOCK_LEVELS; ++l) m_counts[l].clear();
+    }
+
+    // True if no bit is set in the level blocks overlapping the cell box.
+    // Conservative, the box itself may be empty even if this is false.
+    bool blocksEmpty(int level, const Imath::Box3i& cells) const
+    {
+        const int bits = blockBits(level);
+        for (int x=cells.min.x>>bits; x<=cells.max.x>>bits; ++x)
+          for (int y=cells.min.y>>bits; y<=cells.max.y>>bits; ++y)
+            for (int z=cells.min.z>>bits; z<=cells.max.z>>bits; ++z)
+              if (m_counts[level].get(Imath::V3i(x, y, z))) return false;
+        return true;
+    }
+
+    // Clears all bits outside of the cell-space box.
+    // Only bricks that lose bits are unshared, and the block counts are
+    // adjusted for the changed words alone.
+    void crop(const Imath::Box3i& box)
+    {
+        if (box.isEmpty()) { clear(); return; }
+
+        const Imath::Box3i t = m_words.brickBounds();
+        if (t.isEmpty()) return;
+
+        for (int bx=t.min.x; bx<=t.max.x; ++bx)
+          for (int by=t.min.y; by<=t.max.y; ++by)
+            for (int bz=t.min.z; bz<=t.max.z; ++bz)
+            {
+              const Imath::V3i bc(bx, by, bz);
+              const Grid::Brick* b = m_words.constBrick(bc);
+              if (!b) continue;
+
+              const Imath::Box3i bb = Grid::brickBox(bc);
+              bool keep = false, drop = false;
+
+              for (int x=bb.min.x; x<=bb.max.x; ++x)
+                for (int y=bb.min.y; y<=bb.max.y; ++y)
+                  for (int w=bb.min.z; w<=bb.max.z; ++w)
+                  {
+                    const Word old = b->cells[Grid::cellIndex(Imath::V3i(x, y, w))];
+                    if (!old) continue;
+
+                    const Word m = cropMask(box, x, y, w);
+                    if (old&m) keep = true;
+                    if ((old&m) != old) drop = true;
+                  }
+
+              if (!drop) continue;
+
+              // a brick with nothing left is freed without unsharing it
+              Grid::Brick* wb = keep ? m_words.brick(bc) : NULL;
+              if (wb) b = wb;
+
+              for (int x=bb.min.x; x<=bb.max.x; ++x)
+                for (int y=bb.min.y; y<=bb.max.y; ++y)
+                  for (int w=bb.min.z; w<=bb.max.z; ++w)
+                  {
+                    const int i = Grid::cellIndex(Imath::V3i(x, y, w));
+                    const Word old = b->cells[i];
+                    const Word now = old & cropMask(box, x, y, w);
+                    if (now == old) continue;
+
+                    countWord(Imath::V3i(x, y, w), old, -1);
+                    countWord(Imath::V3i(x, y, w), now, 1);
+                    if (wb) wb->cells[i] = now;
+                  }
+
+              if (!keep) m_words.freeBrick(bc);
+            }
+    }
+
+    // Tight bounds of the set bits inside clip
+    Imath::Box3i bounds(const Imath::Box3i& clip) const
+    {
+        Imath::Box3i r;
+        const Imath::Box3i t = m_words.brickBounds();
+        if (t.isEmpty() || clip.isEmpty()) return r;
+
+        for (int bx=t.min.x; bx<=t.max.x; ++bx)
+          for (int by=t.min.y; by<=t.max.y; ++by)
+            for (int bz=t.min.z; bz<=t.max.z; ++bz)
+            {
+              const Imath::V3i bc(bx, by, bz);
+              const Grid::Brick* b = m_words.brick(bc);
+              if (!b) continue;
+
+              const Imath::Box3i bb = Grid::brickBox(bc);
+              for (int x=std::max(bb.min.x, clip.min.x); x<=std::min(bb.max.x, clip.max.x); ++x)
+                for (int y=std::max(bb.min.y, clip.min.y); y<=std::min(bb.max.y, clip.max.y); ++y)
+                  for (int w=bb.min.z; w<=bb.max.z; ++w)
+                  {
+                    const Word bits = b->cells[Grid::cellIndex(Imath::V3i(x, y, w))]
+                                      & rangeMask(w, clip.min.z, clip.max.z);
+                    if (!bits) continue;
+
+                    r.extendBy(Imath::V3i(x, y, w*WORD_SIZE+lowestBit(bits)));
+                    r.extendBy(Imath::V3i(x, y, w*WORD_SIZE+highestBit(bits)));
+                  }
+            }
+
+        return r;
+    }
+
+    size_t memoryUsage() const
+    {
+        return m_words.memoryUsage() + m_counts[0].memoryUsage() + m_counts[1].memoryUsage();
+    }
+
+    static int bitCount(Word w)
+    {
+        w = w - ((w>>1) & 0x5555555555555555ULL);
+        w = (w & 0x3333333333333333ULL) + ((w>>2) & 0x3333333333333333ULL);
+        w = (w + (w>>4)) & 0x0F0F0F0F0F0F0F0FULL;
+        return int((w*0x0101010101010101ULL) >> 56);
+    }
+
+    // Bit positions of non-zero words
+    static int lowestBit(Word w)
+    {
+        int n = 0;
+        if (!(w&0xFFFFFFFFULL)) { n += 32; w >>= 32; }
+        if (!(w&0xFFFF)) { n += 16; w >>= 16; }
+        if (!(w&0xFF)) { n += 8; w >>= 8; }
+        if (!(w&0xF)) { n += 4; w >>= 4; }
+        if (!(w&0x3)) { n += 2; w >>= 2; }
+        if (!(w&0x1)) n += 1;
+        return n;
+    }
+
+    static int highestBit(Word w)
+    {
+        int n = 0;
+        if (w>>32) { n += 32; w >>= 32; }
+        if (w>>16) { n += 16; w >>= 16; }
+        if (w>>8) { n += 8; w >>= 8; }
+        if (w>>4) { n += 4; w >>= 4; }
+        if (w>>2) { n += 2; w >>= 2; }
+        if (w>>1) n += 1;
+        return n;
+    }
+
+    // Bits of word w that fall into cells z0 to z1
+    static Word rangeMask(int w, int z0, int z1)
+    {
+        const int first = w*WORD_SIZE, last = first+WORD_MASK;
+        if (z1<first || z0>last) return 0;
+        Word m = ~Word(0);
+        if (z0>first) m &= ~Word(0) << (z0-first);
+        if (z1<last) m &= ~Word(0) >> (last-z1);
+        return m;
+    }
+
+private:
+    typedef ChunkedVoxelGrid<Word> Grid;
+    typedef ChunkedVoxelGrid<unsigned> CountGrid;
+
+    Grid m_words;
+    CountGrid m_counts[BLOCK_LEVELS]; // set bits per block of each level
+
+    // Bits of word (x, y, w) inside the cell box
+    static Word cropMask(const Imath::Box3i& box, int x, int y, int w)
+    {
+        if (x<box.min.x || x>box.max.x || y<box.min.y || y>box.max.y) return 0;
+        return rangeMask(w, box.min.z, box.max.z);
+    }
+
+    void addCount(int level, const Imath::V3i& cell, int n)
+    {
+        const int bits = blockBits(level);
+        const Imath::V3i b(cell.x>>bits, cell.y>>bits, cell.z>>bits);
+        m_counts[level].set(b, m_counts[level].get(b)+n);
+    }
+
+    // Adds the bits of word w to the block counts, sign is 1 or -1.
+    // A word spans eight level 0 blocks, one byte each, and one level 1 block.
+    void countWord(const Imath::V3i& w, Word bits, int sign)
+    {
+        if (!bits) return;
+
+        const int z0 = w.z*WORD_SIZE;
+        for (int i=0; i<8; ++i)
+        {
+            const int n = bitCount((bits>>(i*8)) & 0xFF);
+            if (n) addCount(0, Imath::V3i(w.x, w.y, z0+i*8), sign*n);
+        }
+        addCount(1, Imath::V3i(w.x, w.y, z0), sign*bitCount(bits));
+    }
+};
+
+#endif
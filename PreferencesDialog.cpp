@@ -149,10 +149,22 @@ GeneralPage::GeneralPage(QWidget* parent, QSettings* appSettings) :
 {
     QCheckBox* saveWindowPositions = new QCheckBox("Save Window Positions On Exit", this);
     QCheckBox* frameOnOpen = new QCheckBox("Frame Model On Open", this);
+    QCheckBox* shadedIcons = new QCheckBox("Shaded Sprite Icons", this);
+
+    QLabel* undoMemoryBudget = new QLabel("Undo Memory Budget (MB, 0 = unlimited)", this);
+    QSpinBox* undoMemorySpinBox = new QSpinBox;
+    undoMemorySpinBox->setRange(0, 65536);
+    undoMemorySpinBox->setSingleStep(64);
+
+    QHBoxLayout* undoLayout = new QHBoxLayout;
+    undoLayout->addWidget(undoMemoryBudget);
+    undoLayout->addWidget(undoMemorySpinBox);
 
     QVBoxLayout* stuffzLayout = new QVBoxLayout;
     stuffzLayout->addWidget(saveWindowPositions);
     stuffzLayout->addWidget(frameOnOpen);
+    stuffzLayout->addWidget(shadedIcons);
+    stuffzLayout->addLayout(undoLayout);
 
     QGroupBox* configGroup = new QGroupBox();
     configGroup->setLayout(stuffzLayout);
@@ -171,22 +183,35 @@ GeneralPage::GeneralPage(QWidget* parent, QSettings* appSettings) :
         frameOnOpen->setCheckState(Qt::Checked);
     else
         frameOnOpen->setCheckState(Qt::Unchecked);
+    if (m_pAppSettings->value("ProjectWidget/shadedIcons", false).toBool())
+        shadedIcons->setCheckState(Qt::Checked);
+    else
+        shadedIcons->setCheckState(Qt::Unchecked);
+    undoMemorySpinBox->setValue(m_pAppSettings->value("undoMemoryBudget", 1024).toInt());
 
     // Backup original values
     m_saveWindowPositionsOrig = saveWindowPositions->isChecked();
     m_frameOnOpenOrig = frameOnOpen->isChecked();
+    m_shadedIconsOrig = shadedIcons->isChecked();
+    m_undoMemoryBudgetOrig = undoMemorySpinBox->value();
 
     // Hook up the signals
     QObject::connect(saveWindowPositions, SIGNAL(stateChanged(int)),
                      this, SLOT(setSaveWindowPositions(int)));
     QObject::connect(frameOnOpen, SIGNAL(stateChanged(int)),
                      this, SLOT(setFrameOnOpen(int)));
+    QObject::connect(shadedIcons, SIGNAL(stateChanged(int)),
+                     this, SLOT(setShadedIcons(int)));
+    QObject::connect(undoMemorySpinBox, SIGNAL(valueChanged(int)),
+                     this, SLOT(setUndoMemoryBudget(int)));
 }
 
 void GeneralPage::restoreOriginals()
 {
     m_pAppSettings->setValue("saveUILayout", m_saveWindowPositionsOrig);
     m_pAppSettings->setValue("frameOnOpen", m_frameOnOpenOrig);
+    m_pAppSettings->setValue("ProjectWidget/shadedIcons", m_shadedIconsOrig);
+    m_pAppSettings->setValue("undoMemoryBudget", m_undoMemoryBudgetOrig);
 }
 
 void GeneralPage::setSaveWindowPositions(int state)
@@ -201,6 +226,18 @@ void GeneralPage::setFrameOnOpen(int state)
     emit preferenceChanged();
 }
 
+void GeneralPage::setShadedIcons(int state)
+{
+    m_pAppSettings->setValue("ProjectWidget/shadedIcons", state);
+    emit preferenceChanged();
+}
+
+void GeneralPage::setUndoMemoryBudget(int value)
+{
+    m_pAppSettings->setValue("undoMemoryBudget", value);
+    emit preferenceChanged();
+}
+
 
 // MODELVIEW PAGE //
 ModelViewPage::ModelViewPage(QWidget* parent, QSettings* appSettings) :
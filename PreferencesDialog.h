@@ -65,6 +65,8 @@ public:
     QSettings* m_pAppSettings;
     bool m_saveWindowPositionsOrig;
     bool m_frameOnOpenOrig;
+    bool m_shadedIconsOrig;
+    int m_undoMemoryBudgetOrig;
     void restoreOriginals();
 
 signals:
@@ -73,6 +75,8 @@ signals:
 public slots:
     void setSaveWindowPositions(int state);
     void setFrameOnOpen(int state);
+    void setShadedIcons(int state);
+    void setUndoMemoryBudget(int value);
 };
 
 
@@ -111,7 +115,7 @@ signals:
     void preferenceChanged();
 
 public slots:
-    void setDrawOutlines(int value);
+    void setDrawOutlines(int value);
     void setDrawSmooth(int value);
 };
 
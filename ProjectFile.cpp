@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <string.h>
+#include <QFile>
+#include <QBuffer>
+#include <QImage>
+#include <QVariant>
+#include <QStringList>
+#include "SproxelProject.h"
+#include "ZipArchive.h"
+
+
+// Project files (.sxl) are zip archives holding metadata.json and one PNG
+// per layer, named by layer index.  Same format as sproxel_utils.py used to
+// write.
+
+#define SXL_VERSION 1
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+// Minimal JSON support on top of QVariant: maps, lists, strings, numbers,
+// booleans and null.
+
+
+static void json_write_string(QByteArray &out, const QString &str)
+{
+  out+='"';
+  for (int i=0; i<str.length(); ++i)
+  {
+    const ushort c=str[i].unicode();
+    switch (c)
+    {
+      case '"':  out+="\\\""; break;
+      case '\\': out+="\\\\"; break;
+      case '\n': out+="\\n"; break;
+      case '\r': out+="\\r"; break;
+      case '\t': out+="\\t"; break;
+      default:
+        if (c<0x20 || c>0x7E)
+        {
+          char buf[8];
+          sprintf(buf, "\\u%04x", c);
+          out+=buf;
+        }
+        else
+          out+=char(c);
+    }
+  }
+  out+='"';
+}
+
+
+static void json_write(QByteArray &out, const QVariant &v, int indent)
+{
+  const QByteArray pad(indent+2, ' ');
+
+  switch (v.type())
+  {
+    case QVariant::Map:
+    {
+      const QVariantMap map=v.toMap();
+      if (map.isEmpty()) { out+="{}"; break; }
+
+      out+="{\n";
+      for (QVariantMap::const_iterator it=map.begin(); it!=map.end(); ++it)
+      {
+        if (it!=map.begin()) out+=",\n";
+        out+=pad;
+        json_write_string(out, it.key());
+        out+=": ";
+        json_write(out, it.value(), indent+2);
+      }
+      out+='\n';
+      out+=QByteArray(indent, ' ');
+      out+='}';
+      break;
+    }
+
+    case QVariant::List:
+    {
+      const QVariantList list=v.toList();
+      if (list.isEmpty()) { out+="[]"; break; }
+
+      out+="[\n";
+      for (int i=0; i<list.size(); ++i)
+      {
+        if (i) out+=",\n";
+        out+=pad;
+        json_write(out, list[i], indent+2);
+      }
+      out+='\n';
+      out+=QByteArray(indent, ' ');
+      out+=']';
+      break;
+    }
+
+    case QVariant::String:
+      json_write_string(out, v.toString());
+      break;
+
+    case QVariant::Bool:
+      out+=v.toBool() ? "true" : "false";
+      break;
+
+    case QVariant::Int:
+    case QVariant::LongLong:
+      out+=QByteArray::number(v.toLongLong());
+      break;
+
+    case QVariant::Double:
+      out+=QByteArray::number(v.toDouble(), 'g', 9);
+      break;
+
+    default:
+      out+="null";
+  }
+}
+
+
+class JsonParser
+{
+public:
+  JsonParser(const QByteArray &text) : m_p(text.constData()), m_end(text.constData()+text.size()), m_ok(true) {}
+
+  bool parse(QVariant &v)
+  {
+    v=value();
+    skipSpace();
+    return m_ok && m_p==m_end;
+  }
+
+private:
+  const char *m_p, *m_end;
+  bool m_ok;
+
+  QVariant fail() { m_ok=false; return QVariant(); }
+
+  void skipSpace()
+  {
+    while (m_p<m_end && (*m_p==' ' || *m_p=='\t' || *m_p=='\n' || *m_p=='\r')) ++m_p;
+  }
+
+  bool match(const char *word)
+  {
+    const int n=int(strlen(word));
+    if (m_end-m_p<n || strncmp(m_p, word, n)!=0) return false;
+    m_p+=n;
+    return true;
+  }
+
+  QVariant value()
+  {
+    skipSpace();
+    if (!m_ok || m_p>=m_end) return fail();
+
+    switch (*m_p)
+    {
+      case '{': return object();
+      case '[': return array();
+      case '"': { QString s; if (!string(s)) return fail(); return s; }
+    }
+
+    if (match("true")) return true;
+    if (match("false")) return false;
+    if (match("null")) return QVariant();
+    return number();
+  }
+
+  QVariant object()
+  {
+    QVariantMap map;
+    ++m_p;
+    skipSpace();
+    if (m_p<m_end && *m_p=='}') { ++m_p; return map; }
+
+    for (;;)
+    {
+      skipSpace();
+      QString key;
+      if (!string(key)) return fail();
+      skipSpace();
+      if (m_p>=m_end || *m_p!=':') return fail();
+      ++m_p;
+      map.insert(key, value());
+      if (!m_ok) return QVariant();
+
+      skipSpace();
+      if (m_p>=m_end) return fail();
+      if (*m_p==',') { ++m_p; continue; }
+      if (*m_p=='}') { ++m_p; return map; }
+      return fail();
+    }
+  }
+
+  QVariant array()
+  {
+    QVariantList list;
+    ++m_p;
+    skipSpace();
+    if (m_p<m_end && *m_p==']') { ++m_p; return list; }
+
+    for (;;)
+    {
+      list.append(value());
+      if (!m_ok) return QVariant();
+
+      skipSpace();
+      if (m_p>=m_end) return fail();
+      if (*m_p==',') { ++m_p; continue; }
+      if (*m_p==']') { ++m_p; return list; }
+      return fail();
+    }
+  }
+
+  bool hex4(ushort &c)
+  {
+    if (m_end-m_p<4) return false;
+    c=0;
+    for (int i=0; i<4; ++i)
+    {
+      const char h=*m_p++;
+      c<<=4;
+      if (h>='0' && h<='9') c|=h-'0';
+      else if (h>='a' && h<='f') c|=h-'a'+10;
+      else if (h>='A' && h<='F') c|=h-'A'+10;
+      else return false;
+    }
+    return true;
+  }
+
+  bool string(QString &str)
+  {
+    if (m_p>=m_end || *m_p!='"') return false;
+    ++m_p;
+
+    QByteArray utf8;
+    while (m_p<m_end && *m_p!='"')
+    {
+      if (*m_p!='\\') { utf8+=*m_p++; continue; }
+
+      if (++m_p>=m_end) return false;
+      const char e=*m_p++;
+      switch (e)
+      {
+        case 'b': utf8+='\b'; break;
+        case 'f': utf8+='\f'; break;
+        case 'n': utf8+='\n'; break;
+        case 'r': utf8+='\r'; break;
+        case 't': utf8+='\t'; break;
+        case 'u':
+        {
+          ushort c[2];
+          int n=1;
+          if (!hex4(c[0])) return false;
+          if (c[0]>=0xD800 && c[0]<0xDC00 && m_end-m_p>=6 && m_p[0]=='\\' && m_p[1]=='u')
+          {
+            m_p+=2;
+            if (!hex4(c[1])) return false;
+            n=2;
+          }
+          utf8+=QString::fromUtf16(c, n).toUtf8();
+          break;
+        }
+        default: utf8+=e;
+      }
+    }
+
+    if (m_p>=m_end) return false;
+    ++m_p;
+    str=QString::fromUtf8(utf8.constData(), utf8.size());
+    return true;
+  }
+
+  QVariant number()
+  {
+    const char *start=m_p;
+    bool real=false;
+    if (m_p<m_end && *m_p=='-') ++m_p;
+    while (m_p<m_end)
+    {
+      const char c=*m_p;
+      if (c>='0' && c<='9') { ++m_p; continue; }
+      if (c=='.' || c=='e' || c=='E' || c=='+' || c=='-') { real=true; ++m_p; continue; }
+      break;
+    }
+    if (m_p==start) return fail();
+
+    const QByteArray text(start, int(m_p-start));
+    bool ok=false;
+    QVariant v = real ? QVariant(text.toDouble(&ok)) : QVariant(text.toLongLong(&ok));
+    if (!ok) return fail();
+    return v;
+  }
+};
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+static QString layer_file_name(int i)
+{
+  return QString("%1.png").arg(i, 4, 10, QChar('0'));
+}
+
+
+static QVariantList v3i_to_variant(const Imath::V3i &v)
+{
+  QVariantList list;
+  list << v.x << v.y << v.z;
+  return list;
+}
+
+
+bool save_project(QString filename, SproxelProjectPtr project)
+{
+  if (!project) return false;
+
+  // deferred layers read as empty until loaded.  Layers only the undo
+  // history holds stay deferred, .sxb files are replaced rather than
+  // overwritten so their mapping stays valid.
+  foreach (VoxelGridGroupPtr spr, project->sprites) spr->load();
+
+  if (filename.endsWith(".sxb", Qt::CaseInsensitive)) return save_brick_project(filename, project);
+
+  // gather layers, they can be shared between sprites
+  QVector<VoxelGridLayerPtr> layers;
+  foreach (VoxelGridGroupPtr spr, project->sprites)
+    for (int i=0; i<spr->numLayers(); ++i)
+      if (!layers.contains(spr->layer(i))) layers.push_back(spr->layer(i));
+
+  QVector<ColorPalettePtr> palettes=project->palettes;
+  if (project->mainPalette && !palettes.contains(project->mainPalette))
+    palettes.push_back(project->mainPalette);
+  foreach (VoxelGridLayerPtr l, layers)
+    if (l->palette() && !palettes.contains(l->palette())) palettes.push_back(l->palette());
+
+  // prepare metadata
+  QVariantMap meta;
+  meta["version"]=SXL_VERSION;
+
+  QVariantList mlayers;
+  foreach (VoxelGridLayerPtr l, layers)
+  {
+    QVariantMap ml;
+    ml["name"]=l->name();
+    ml["offset"]=v3i_to_variant(l->offset());
+    ml["visible"]=l->isVisible();
+    ml["compact"]=l->isCompact();
+    ml["palette"]=l->palette() ? palettes.indexOf(l->palette()) : -1;
+    mlayers.append(ml);
+  }
+  meta["layers"]=mlayers;
+
+  QVariantList msprites;
+  foreach (VoxelGridGroupPtr spr, project->sprites)
+  {
+    QVariantMap ms;
+    ms["name"]=spr->name();
+    QVariantList li;
+    for (int i=0; i<spr->numLayers(); ++i) li.append(layers.indexOf(spr->layer(i)));
+    ms["layers"]=li;
+    ms["curLayer"]=spr->curLayerIndex();
+    msprites.append(ms);
+  }
+  meta["sprites"]=msprites;
+
+  QVariantList mpalettes;
+  foreach (ColorPalettePtr pal, palettes)
+  {
+    QVariantMap mp;
+    mp["name"]=pal->name();
+    QVariantList colors;
+    for (int i=0; i<pal->numColors(); ++i)
+    {
+      const SproxelColor c=pal->color(i);
+      QVariantList mc;
+      mc << double(c.r) << double(c.g) << double(c.b) << double(c.a);
+      colors.append(QVariant(mc));
+    }
+    mp["colors"]=colors;
+    mpalettes.append(mp);
+  }
+  meta["palettes"]=mpalettes;
+
+  meta["mainPalette"]=palettes.indexOf(project->mainPalette);
+
+  QByteArray json;
+  json_write(json, meta, 0);
+
+  // write zip file
+  QFile file(filename);
+  if (!file.open(QIODevice::WriteOnly)) return false;
+
+  ZipWriter zip(&file);
+  zip.addFile("metadata.json", json);
+
+  for (int i=0; i<layers.size(); ++i)
+  {
+    QByteArray png;
+    if (!layers[i]->bounds().isEmpty())
+    {
+      QBuffer buf(&png);
+      buf.open(QIODevice::WriteOnly);
+      if (!layers[i]->makeQImage().save(&buf, "PNG")) return false;
+    }
+
+    // PNG is deflated already
+    zip.addFile(layer_file_name(i), png, false);
+  }
+
+  return zip.close();
+}
+
+
+SproxelProjectPtr load_project(QString filename)
+{
+  if (filename.endsWith(".sxb", Qt::CaseInsensitive)) return load_brick_project(filename);
+
+  QFile file(filename);
+  if (!file.open(QIODevice::ReadOnly)) return SproxelProjectPtr();
+
+  const QByteArray data=file.readAll();
+  ZipReader zip(data.constData(), data.size());
+  if (!zip.isValid()) return SproxelProjectPtr();
+
+  QByteArray json;
+  if (!zip.fileData("metadata.json", json)) return SproxelProjectPtr();
+
+  QVariant metaVar;
+  if (!JsonParser(json).parse(metaVar)) return SproxelProjectPtr();
+  const QVariantMap meta=metaVar.toMap();
+
+  SproxelProjectPtr prj(new SproxelProject());
+
+  // load palettes
+  prj->palettes.clear();
+  foreach (const QVariant &vp, meta["palettes"].toList())
+  {
+    const QVariantMap mp=vp.toMap();
+    ColorPalettePtr pal(new ColorPalette());
+    pal->setName(mp["name"].toString());
+
+    const QVariantList colors=mp["colors"].toList();
+    pal->resize(colors.size());
+    for (int i=0; i<colors.size(); ++i)
+    {
+      const QVariantList c=colors[i].toList();
+      if (c.size()<4) continue;
+      pal->setColor(i, SproxelColor(c[0].toFloat(), c[1].toFloat(), c[2].toFloat(), c[3].toFloat()));
+    }
+
+    prj->palettes.push_back(pal);
+  }
+
+  const int mainPal=meta["mainPalette"].toInt();
+  if (mainPal>=0 && mainPal<prj->palettes.size())
+    prj->mainPalette=prj->palettes[mainPal];
+  else if (!prj->palettes.isEmpty())
+    prj->mainPalette=prj->palettes[0];
+  else
+    prj->mainPalette=new ColorPalette();
+
+  // load layers
+  QVector<VoxelGridLayerPtr> layers;
+  const QVariantList mlayers=meta["layers"].toList();
+  for (int i=0; i<mlayers.size(); ++i)
+  {
+    const QVariantMap ml=mlayers[i].toMap();
+
+    const int pi=ml["palette"].toInt();
+    ColorPalettePtr pal=(pi>=0 && pi<prj->palettes.size()) ? prj->palettes[pi] : ColorPalettePtr();
+    const bool compact=ml.value("compact", false).toBool();
+
+    QByteArray png;
+    if (!zip.fileData(layer_file_name(i), png)) return SproxelProjectPtr();
+
+    VoxelGridLayerPtr l;
+    QImage image;
+    if (!png.isEmpty() && image.loadFromData(png, "PNG"))
+      l=VoxelGridLayer::fromQImage(image, pal, compact);
+
+    if (!l)
+    {
+      // empty layer
+      l=new VoxelGridLayer();
+      l->setPalette(pal);
+      l->setCompact(compact);
+    }
+
+    const QVariantList o=ml["offset"].toList();
+    if (o.size()==3) l->setOffset(Imath::V3i(o[0].toInt(), o[1].toInt(), o[2].toInt()));
+    l->setName(ml["name"].toString());
+    l->setVisible(ml.value("visible", true).toBool());
+    l->takeDirtyBox();
+
+    layers.push_back(l);
+  }
+
+  // load sprites
+  prj->sprites.clear();
+  foreach (const QVariant &vs, meta["sprites"].toList())
+  {
+    const QVariantMap ms=vs.toMap();
+    VoxelGridGroupPtr spr(new VoxelGridGroup());
+    spr->setName(ms["name"].toString());
+
+    const QVariantList li=ms["layers"].toList();
+    for (int i=0; i<li.size(); ++i)
+    {
+      const int index=li[i].toInt();
+      if (index>=0 && index<layers.size()) spr->insertLayerAbove(spr->numLayers(), layers[index]);
+    }
+
+    spr->setCurLayer(ms["curLayer"].toInt());
+    spr->takeDirtyBox();
+    prj->sprites.push_back(spr);
+  }
+
+  return prj;
+}
@@ -2,8 +2,11 @@
 #include <QHBoxLayout>
 #include <QPushButton>
 #include <QMimeData>
+#include <QtConcurrentRun>
+#include <limits.h>
 #include "ProjectWidget.h"
 #include "NewGridDialog.h"
+#include "RayWalk.h"
 
 
 #define ICON_SIZE 60
@@ -14,66 +17,262 @@
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
-void SpriteListModel::updateIcon(int i)
+// Sprite column of each icon pixel, the same for all renders with the same
+// bounds
+static void icon_columns(const Imath::Box3i &bounds, float &scale, int &ox, int &oy)
 {
-  if (!m_project) return;
-
-  QImage img(ICON_SIZE, ICON_SIZE, QImage::Format_ARGB32_Premultiplied);
-
-  img.fill(p_appSettings->value("GLModelWidget/backgroundColor", QColor(0, 0, 0)).value<QColor>().rgb());
-
-  VoxelGridGroupPtr spr=m_project->sprites[i];
-  Imath::Box3i bounds=spr->bounds();
   Imath::V3i size=bounds.size()+Imath::V3i(1);
 
   float sx=size.x/float(ICON_SIZE);
   float sy=size.y/float(ICON_SIZE);
 
-  float scale=sx;
+  scale=sx;
   if (sy>scale) scale=sy;
   if (scale<0.25f) scale=0.25f;
 
-  int ox=bounds.min.x-int((ICON_SIZE*scale-size.x)*0.5f);
-  int oy=bounds.min.y-int((ICON_SIZE*scale-size.y)*0.5f);
+  ox=bounds.min.x-int((ICON_SIZE*scale-size.x)*0.5f);
+  oy=bounds.min.y-int((ICON_SIZE*scale-size.y)*0.5f);
+}
+
 
-  for (int y=0; y<ICON_SIZE; ++y)
+static QRgb icon_color(const SproxelColor &c, float shade=1)
+{
+  return qRgba(int(c.r*shade*255), int(c.g*shade*255), int(c.b*shade*255), int(c.a*255));
+}
+
+
+// Highest non-empty voxel of a column, 64 cells at a time
+static bool top_voxel(const VoxelGridGroup &spr, int x, int y, const Imath::Box3i &bounds, int &z)
+{
+  for (int z0=bounds.max.z-OccupancyMask::WORD_MASK; z0+OccupancyMask::WORD_MASK>=bounds.min.z;
+       z0-=OccupancyMask::WORD_SIZE)
   {
-    int gy=int(y*scale)+oy;
-    for (int x=0; x<ICON_SIZE; ++x)
+    OccupancyMask::Word bits=spr.occupiedRow(Imath::V3i(x, y, z0));
+    if (bits)
     {
-      int gx=int(x*scale)+ox;
+      z=z0+OccupancyMask::highestBit(bits);
+      return true;
+    }
+  }
+  return false;
+}
 
-      uint color=qRgba(0, 0, 0, 0);
-      for (int gz=bounds.max.z; gz>=bounds.min.z; --gz)
-      {
-        SproxelColor c=spr->get(Imath::V3i(gx, gy, gz));
-        if (c.a==0) continue;
 
-        color=qRgba(int(c.r*255), int(c.g*255), int(c.b*255), int(c.a*255));
-        break;
+// Front view, first voxel of every column.  Only columns with changes at or
+// above their current top voxel are scanned again.
+static void render_flat_icon(SpriteIconJob &job)
+{
+  const VoxelGridGroup &spr=*job.sprite;
+  const Imath::Box3i bounds=spr.bounds();
+  SpriteIconDepth &depth=job.depth;
+
+  const int numPixels=ICON_SIZE*ICON_SIZE;
+  if (job.full || depth.bounds!=bounds || depth.z.size()!=numPixels)
+  {
+    depth.bounds=bounds;
+    depth.z.fill(INT_MIN, numPixels);
+    depth.color.fill(0, numPixels);
+    job.dirty=bounds;
+  }
+
+  QImage img(ICON_SIZE, ICON_SIZE, QImage::Format_ARGB32_Premultiplied);
+  img.fill(job.background);
+
+  if (!bounds.isEmpty())
+  {
+    float scale;
+    int ox, oy;
+    icon_columns(bounds, scale, ox, oy);
+
+    for (int y=0; y<ICON_SIZE; ++y)
+    {
+      int gy=int(y*scale)+oy;
+      for (int x=0; x<ICON_SIZE; ++x)
+      {
+        int gx=int(x*scale)+ox;
+        const int i=y*ICON_SIZE+x;
+
+        if (gx>=job.dirty.min.x && gx<=job.dirty.max.x && gy>=job.dirty.min.y && gy<=job.dirty.max.y
+            && job.dirty.max.z>=depth.z[i])
+        {
+          int gz;
+          if (top_voxel(spr, gx, gy, bounds, gz))
+          {
+            depth.z[i]=gz;
+            depth.color[i]=icon_color(spr.get(Imath::V3i(gx, gy, gz)));
+          }
+          else
+          {
+            depth.z[i]=INT_MIN;
+            depth.color[i]=0;
+          }
+        }
+
+        if (depth.color[i]) img.setPixel(x, y, depth.color[i]);
       }
+    }
+  }
+
+  job.image=img.mirrored();
+}
+
+
+// Orthographic ray-cast from the front, above and to the right, lit by a
+// fixed light.  Always redrawn whole.
+static void render_shaded_icon(SpriteIconJob &job)
+{
+  const VoxelGridGroup &spr=*job.sprite;
+  const Imath::Box3i bounds=spr.bounds();
+  job.depth=SpriteIconDepth();
+
+  QImage img(ICON_SIZE, ICON_SIZE, QImage::Format_ARGB32_Premultiplied);
+  img.fill(job.background);
+
+  if (!bounds.isEmpty())
+  {
+    const Imath::V3d dir=Imath::V3d(-0.5, -0.6, -1).normalized();
+    const Imath::V3d right=dir.cross(Imath::V3d(0, 1, 0)).normalized();
+    const Imath::V3d up=right.cross(dir);
+    const Imath::V3d light=Imath::V3d(0.3, 0.8, 0.5).normalized();
+
+    const Imath::V3d bmin(bounds.min), bmax(bounds.max+Imath::V3i(1));
+    const Imath::V3d center=(bmin+bmax)*0.5;
 
-      if (color) img.setPixel(x, y, color);
+    // fit the bounds into the icon
+    double extent=0.5;
+    for (int c=0; c<8; ++c)
+    {
+      const Imath::V3d v=Imath::V3d((c&1) ? bmax.x : bmin.x, (c&2) ? bmax.y : bmin.y, (c&4) ? bmax.z : bmin.z)-center;
+      extent=std::max(extent, std::max(fabs(v.dot(right)), fabs(v.dot(up))));
     }
+    const double pixel=2*extent/ICON_SIZE;
+    const double back=(bmax-bmin).length();
+
+    for (int y=0; y<ICON_SIZE; ++y)
+      for (int x=0; x<ICON_SIZE; ++x)
+      {
+        Imath::Line3d ray;
+        ray.pos=center+right*((x+0.5)*pixel-extent)+up*(extent-(y+0.5)*pixel)-dir*back;
+        ray.dir=dir;
+
+        const RayHit hit=cast_ray(ray, bounds, spr);
+        if (!hit.hit) continue;
+
+        const float diffuse=float(std::max(0.0, Imath::V3d(hit.normal).dot(light)));
+        img.setPixel(x, y, icon_color(spr.get(hit.cell), 0.45f+0.55f*diffuse));
+      }
   }
 
-  img=img.mirrored();
+  job.image=img;
+}
 
-  m_icons[i].convertFromImage(img);
 
-  QModelIndex index=createIndex(i, 0);
-  emit dataChanged(index, index);
+static SpriteIconJob render_icon(SpriteIconJob job)
+{
+  if (job.shaded) render_shaded_icon(job);
+  else render_flat_icon(job);
+  return job;
 }
 
 
-void SpriteListModel::onSpriteChanged(VoxelGridGroupPtr spr)
+void SpriteListModel::updateIcon(int i)
+{
+  if (!m_project) return;
+
+  IconState &st=m_icons[i];
+  st.dirty=false;
+
+  const QRgb background=p_appSettings->value("GLModelWidget/backgroundColor", QColor(0, 0, 0)).value<QColor>().rgb();
+
+  VoxelGridGroupPtr spr=m_project->sprites[i];
+  if (!spr->isLoaded())
+  {
+    // don't decode the sprite just for the icon, it's redrawn when selected
+    QImage img(ICON_SIZE, ICON_SIZE, QImage::Format_ARGB32_Premultiplied);
+    img.fill(background);
+    st.icon.convertFromImage(img);
+    st.full=true;
+    return;
+  }
+
+  const bool shaded=p_appSettings->value("ProjectWidget/shadedIcons", false).toBool();
+
+  // the worker reads a snapshot sharing the voxel bricks, edits unshare them
+  SpriteIconJob job;
+  job.sprite=new VoxelGridGroup(*spr);
+  job.sprite->setUseComposite(false);
+  job.sprite->detachPalettes();
+  job.dirty=st.changed;
+  job.full=st.full || shaded!=st.shaded;
+  job.shaded=shaded;
+  job.background=background;
+  job.depth=st.depth;
+
+  st.changed.makeEmpty();
+  st.full=false;
+  st.shaded=shaded;
+
+  st.watcher=new QFutureWatcher<SpriteIconJob>(this);
+  connect(st.watcher, SIGNAL(finished()), this, SLOT(onIconRendered()));
+  st.watcher->setFuture(QtConcurrent::run(render_icon, job));
+}
+
+
+void SpriteListModel::onIconRendered()
+{
+  for (int i=0; i<m_icons.size(); ++i)
+  {
+    IconState &st=m_icons[i];
+    if (st.watcher!=sender()) continue;
+
+    SpriteIconJob job=st.watcher->result();
+    st.watcher->deleteLater();
+    st.watcher=NULL;
+
+    st.depth=job.depth;
+    st.icon.convertFromImage(job.image);
+
+    QModelIndex index=createIndex(i, 0);
+    emit dataChanged(index, index);
+
+    // changes made while rendering
+    if (st.dirty) updateIcon(i);
+    return;
+  }
+}
+
+
+void SpriteListModel::invalidateIcon(int i, const Imath::Box3i &box)
+{
+  IconState &st=m_icons[i];
+  if (box.isEmpty()) st.full=true;
+  else st.changed.extendBy(box);
+  st.dirty=true;
+}
+
+
+void SpriteListModel::clearIcons()
+{
+  for (int i=0; i<m_icons.size(); ++i) delete m_icons[i].watcher;
+  m_icons.clear();
+}
+
+
+void SpriteListModel::onSpriteChanged(VoxelGridGroupPtr spr, const Imath::Box3i &box)
 {
   if (!m_project) return;
 
   for (int i=0; i<m_project->sprites.size(); ++i)
     if (m_project->sprites[i]==spr)
     {
-      m_icons[i]=QPixmap();
+      if (!box.isEmpty())
+        invalidateIcon(i, box);
+      else
+      {
+        // voxels are unchanged, keep the icon
+        QModelIndex index=createIndex(i, 0);
+        emit dataChanged(index, index);
+      }
       break;
     }
 }
@@ -85,7 +284,7 @@ void SpriteListModel::onPaletteChanged(ColorPalettePtr pal)
 
   for (int i=0; i<m_project->sprites.size(); ++i)
     if (m_project->sprites[i]->hasPalette(pal))
-      m_icons[i]=QPixmap();
+      invalidateIcon(i, Imath::Box3i());
 }
 
 
@@ -101,7 +300,7 @@ void SpriteListModel::onSpriteAdded(SproxelProjectPtr proj, int at)
 {
   if (m_project!=proj) return;
 
-  m_icons.insert(at, QPixmap());
+  m_icons.insert(at, IconState());
   updateIcon(at);
   endInsertRows();
 }
@@ -119,6 +318,7 @@ void SpriteListModel::onSpriteRemoved(SproxelProjectPtr proj, int at, VoxelGridG
 {
   if (m_project!=proj) return;
 
+  delete m_icons[at].watcher;
   m_icons.remove(at);
   endRemoveRows();
 }
@@ -128,7 +328,9 @@ void SpriteListModel::currentChanged(const QModelIndex &current, const QModelInd
 {
   if (current.isValid())
   {
-    emit spriteSelected(m_project->sprites[current.row()]);
+    VoxelGridGroupPtr spr=m_project->sprites[current.row()];
+    if (spr->load()) invalidateIcon(current.row(), Imath::Box3i());
+    emit spriteSelected(spr);
   }
 }
 
@@ -222,9 +424,9 @@ ProjectWidget::ProjectWidget(QWidget* parent, UndoManager *um, QSettings *sett)
 
   layout->addWidget(m_sprListView);
 
-  connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr)),
-    m_sprListModel, SLOT(onSpriteChanged(VoxelGridGroupPtr)));
-  connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr)),
+  connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr, const Imath::Box3i&)),
+    m_sprListModel, SLOT(onSpriteChanged(VoxelGridGroupPtr, const Imath::Box3i&)));
+  connect(p_undoManager, SIGNAL(spriteChanged(VoxelGridGroupPtr, const Imath::Box3i&)),
     this, SLOT(update()));
 
   connect(p_undoManager, SIGNAL(paletteChanged(ColorPalettePtr)),
@@ -299,7 +501,7 @@ void ProjectWidget::newSprite()
   if (dlg.exec())
   {
     VoxelGridGroupPtr sprite(new VoxelGridGroup(dlg.getVoxelSize(),
-      dlg.isIndexed()?m_project->mainPalette:ColorPalettePtr()));
+      dlg.isIndexed()?m_project->mainPalette:ColorPalettePtr(), dlg.isCompact()));
     sprite->setName("unnamed");
 
     int at=m_sprListView->currentIndex().row();
@@ -8,6 +8,7 @@
 #include <QPixmap>
 #include <QVector>
 #include <QSettings>
+#include <QFutureWatcher>
 #include "UndoManager.h"
 #include "SproxelProject.h"
 
@@ -15,6 +16,34 @@
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
+// Top voxel of every icon pixel column, kept between renders so flat icons
+// only rescan the columns of changed voxels
+struct SpriteIconDepth
+{
+  Imath::Box3i bounds;  // sprite bounds the columns were picked for
+  QVector<int> z;       // top voxel, INT_MIN for empty columns
+  QVector<QRgb> color;
+};
+
+
+// One icon render, done on the global thread pool from a private snapshot
+struct SpriteIconJob
+{
+  VoxelGridGroupPtr sprite;
+  Imath::Box3i dirty;   // changed voxels since the last render
+  bool full;            // redraw everything
+  bool shaded;          // ray-cast with lighting instead of the flat front view
+  QRgb background;
+  SpriteIconDepth depth;
+  QImage image;
+
+  SpriteIconJob() : full(true), shaded(false), background(0) {}
+};
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
 class SpriteListModel : public QAbstractListModel
 {
   Q_OBJECT
@@ -25,27 +54,35 @@ public:
   {
   }
 
+  ~SpriteListModel() { clearIcons(); }
+
   void setProject(SproxelProjectPtr prj)
   {
     beginResetModel();
     m_project=prj;
-    m_icons.clear();
+    clearIcons();
     m_icons.resize(m_project->sprites.size());
     updateIcons();
     endResetModel();
   }
 
+  // Starts renders for the icons that need one
   void updateIcons()
   {
+    const bool shaded=p_appSettings->value("ProjectWidget/shadedIcons", false).toBool();
     for (int i=0; i<m_project->sprites.size(); ++i)
-      if (!m_icons[i]) updateIcon(i);
+    {
+      IconState &st=m_icons[i];
+      if (st.shaded!=shaded && m_project->sprites[i]->isLoaded()) st.dirty=true;
+      if (st.dirty && !st.watcher) updateIcon(i);
+    }
   }
 
 signals:
   void spriteSelected(VoxelGridGroupPtr);
 
 public slots:
-  void onSpriteChanged(VoxelGridGroupPtr spr);
+  void onSpriteChanged(VoxelGridGroupPtr spr, const Imath::Box3i &box);
   void onPaletteChanged(ColorPalettePtr pal);
   void onBeforeSpriteAdded(SproxelProjectPtr, int);
   void onSpriteAdded(SproxelProjectPtr, int);
@@ -54,14 +91,32 @@ public slots:
 
   void currentChanged(const QModelIndex &current, const QModelIndex &previous);
 
+private slots:
+  void onIconRendered();
+
 private:
+  struct IconState
+  {
+    QPixmap icon;
+    bool dirty;           // needs a render
+    bool full;            // the next render redraws everything
+    bool shaded;          // style of the last render
+    Imath::Box3i changed; // voxels changed since the last render started
+    SpriteIconDepth depth;
+    QFutureWatcher<SpriteIconJob> *watcher; // render in flight, changes wait for it
+
+    IconState() : dirty(true), full(true), shaded(false), watcher(NULL) {}
+  };
+
   SproxelProjectPtr m_project;
-  QVector<QPixmap> m_icons;
+  QVector<IconState> m_icons;
 
   QSettings *p_appSettings;
   UndoManager *p_undoManager;
 
   void updateIcon(int i);
+  void invalidateIcon(int i, const Imath::Box3i &box);
+  void clearIcons();
 
 public:
 
@@ -81,7 +136,7 @@ public:
     }
     else if (role == Qt::DecorationRole)
     {
-      return m_icons[index.row()];
+      return m_icons[index.row()].icon;
     }
     return QVariant();
   }
@@ -0,0 +1,428 @@
+#include <vector>
+#include <algorithm>
+#include <QtConcurrentMap>
+#include "Quantize.h"
+
+
+// Number of k-means passes after the median cut
+#define REFINE_PASSES 3
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+// Voxel data access for both RGB storage types
+
+
+static bool cell_empty(const SproxelColor &c) { return c.a==0; }
+static bool cell_empty(SproxelRgba8 c) { return !(c>>24); }
+
+static SproxelColor cell_color(const SproxelColor &c) { return c; }
+static SproxelColor cell_color(SproxelRgba8 c) { return unpack_color(c); }
+
+
+// Storage cells of brick bc that fall inside the layer bounds
+static Imath::Box3i cells_in_bounds(const VoxelGridLayer &layer, const Imath::V3i &bc)
+{
+  const Imath::Box3i bb=RgbBrickGrid::brickBox(bc);
+  const Imath::Box3i lb=layer.bounds();
+  const Imath::V3i &o=layer.dataOrigin();
+
+  Imath::Box3i r;
+  for (int a=0; a<3; ++a)
+  {
+    r.min[a]=std::max(bb.min[a], lb.min[a]-o[a]);
+    r.max[a]=std::min(bb.max[a], lb.max[a]-o[a]);
+  }
+  return r;
+}
+
+
+static void allocated_bricks(const VoxelGridLayer &layer, std::vector<Imath::V3i> &out)
+{
+  Imath::Box3i t;
+  if (layer.rgbData()) t=layer.rgbData()->brickBounds();
+  else if (layer.rgba8Data()) t=layer.rgba8Data()->brickBounds();
+  if (t.isEmpty()) return;
+
+  for (int x=t.min.x; x<=t.max.x; ++x)
+    for (int y=t.min.y; y<=t.max.y; ++y)
+      for (int z=t.min.z; z<=t.max.z; ++z)
+      {
+        const Imath::V3i bc(x, y, z);
+        const bool allocated=layer.rgbData() ? layer.rgbData()->brick(bc)!=NULL
+                                             : layer.rgba8Data()->brick(bc)!=NULL;
+        if (allocated && !cells_in_bounds(layer, bc).isEmpty()) out.push_back(bc);
+      }
+}
+
+
+template<class G> static void collect_colors(const VoxelGridLayer &layer, const G &g,
+  const std::vector<Imath::V3i> &bricks, std::vector<SproxelRgba8> &out)
+{
+  for (size_t i=0; i<bricks.size(); ++i)
+  {
+    const typename G::Brick *b=g.brick(bricks[i]);
+    const Imath::Box3i r=cells_in_bounds(layer, bricks[i]);
+
+    for (int x=r.min.x; x<=r.max.x; ++x)
+      for (int y=r.min.y; y<=r.max.y; ++y)
+      {
+        const int row=G::cellIndex(Imath::V3i(x, y, r.min.z));
+        for (int z=0; z<=r.max.z-r.min.z; ++z)
+          if (!cell_empty(b->cells[row+z])) out.push_back(pack_color(cell_color(b->cells[row+z])));
+      }
+  }
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+// Median cut
+
+
+namespace
+{
+  struct HistColor
+  {
+    float c[4];
+    float weight;
+  };
+
+  struct ChannelLess
+  {
+    int ch;
+    ChannelLess(int channel) : ch(channel) {}
+    bool operator()(const HistColor &a, const HistColor &b) const { return a.c[ch]<b.c[ch]; }
+  };
+
+  // A range of the histogram and its weighted squared error
+  struct CutBox
+  {
+    int begin, end;
+    float mean[4];
+    double error;
+    int axis;
+
+    void update(const std::vector<HistColor> &hist)
+    {
+      double w=0, sum[4]={0, 0, 0, 0}, sq[4]={0, 0, 0, 0};
+      for (int i=begin; i<end; ++i)
+      {
+        const HistColor &h=hist[i];
+        w+=h.weight;
+        for (int ch=0; ch<4; ++ch)
+        {
+          sum[ch]+=h.weight*h.c[ch];
+          sq[ch]+=h.weight*h.c[ch]*h.c[ch];
+        }
+      }
+
+      error=0;
+      axis=0;
+      double bestVar=-1;
+      for (int ch=0; ch<4; ++ch)
+      {
+        mean[ch]=float(sum[ch]/w);
+        const double var=std::max(0.0, sq[ch]-sum[ch]*sum[ch]/w);
+        error+=var;
+        if (var>bestVar) { bestVar=var; axis=ch; }
+      }
+
+      if (end-begin<2) error=0;
+    }
+  };
+}
+
+
+static SproxelColor hist_color(const float *c)
+{
+  return SproxelColor(c[0], c[1], c[2], c[3]);
+}
+
+
+// Splits the box with the largest error at the weighted median of its
+// widest channel until there are enough boxes
+static void median_cut(std::vector<HistColor> &hist, int num_boxes, std::vector<CutBox> &boxes)
+{
+  CutBox all;
+  all.begin=0;
+  all.end=hist.size();
+  all.update(hist);
+  boxes.assign(1, all);
+
+  while ((int)boxes.size()<num_boxes)
+  {
+    int bi=-1;
+    for (size_t i=0; i<boxes.size(); ++i)
+      if (boxes[i].error>0 && (bi<0 || boxes[i].error>boxes[bi].error)) bi=i;
+    if (bi<0) break;
+
+    CutBox &box=boxes[bi];
+    std::sort(hist.begin()+box.begin, hist.begin()+box.end, ChannelLess(box.axis));
+
+    double total=0;
+    for (int i=box.begin; i<box.end; ++i) total+=hist[i].weight;
+
+    int cut=box.begin+1;
+    double acc=hist[box.begin].weight;
+    while (cut<box.end-1 && acc+hist[cut].weight<=total*0.5) acc+=hist[cut++].weight;
+
+    CutBox upper=box;
+    upper.begin=cut;
+    box.end=cut;
+    box.update(hist);
+    upper.update(hist);
+    boxes.push_back(upper);
+  }
+}
+
+
+// Moves every palette color to the weighted mean of the histogram colors
+// nearest to it
+static void refine_palette(const std::vector<HistColor> &hist, std::vector<SproxelColor> &colors)
+{
+  for (int pass=0; pass<REFINE_PASSES; ++pass)
+  {
+    ColorPalette search(colors.begin(), colors.end());
+
+    std::vector<double> sum(colors.size()*4, 0.0), weight(colors.size(), 0.0);
+    for (size_t i=0; i<hist.size(); ++i)
+    {
+      const int k=search.bestMatch(hist_color(hist[i].c));
+      weight[k]+=hist[i].weight;
+      for (int ch=0; ch<4; ++ch) sum[k*4+ch]+=hist[i].weight*hist[i].c[ch];
+    }
+
+    bool moved=false;
+    for (size_t k=0; k<colors.size(); ++k)
+    {
+      if (weight[k]<=0) continue;
+      const SproxelColor c(float(sum[k*4]/weight[k]), float(sum[k*4+1]/weight[k]),
+                           float(sum[k*4+2]/weight[k]), float(sum[k*4+3]/weight[k]));
+      if (c!=colors[k]) { colors[k]=c; moved=true; }
+    }
+
+    if (!moved) break;
+  }
+}
+
+
+ColorPalettePtr make_palette(const QVector<VoxelGridLayerPtr> &layers, int max_colors)
+{
+  max_colors=std::max(2, std::min(max_colors, 256));
+
+  // packed colors of all non-empty voxels, counted by sorting
+  std::vector<SproxelRgba8> packed;
+  foreach (VoxelGridLayerPtr layer, layers)
+  {
+    if (!layer || layer->isIndexed()) continue;
+    layer->load();
+
+    std::vector<Imath::V3i> bricks;
+    allocated_bricks(*layer, bricks);
+    if (layer->rgbData()) collect_colors(*layer, *layer->rgbData(), bricks, packed);
+    else if (layer->rgba8Data()) collect_colors(*layer, *layer->rgba8Data(), bricks, packed);
+  }
+
+  std::sort(packed.begin(), packed.end());
+
+  std::vector<HistColor> hist;
+  for (size_t i=0; i<packed.size(); )
+  {
+    size_t j=i+1;
+    while (j<packed.size() && packed[j]==packed[i]) ++j;
+
+    const SproxelColor c=unpack_color(packed[i]);
+    HistColor h;
+    h.c[0]=c.r; h.c[1]=c.g; h.c[2]=c.b; h.c[3]=c.a;
+    h.weight=float(j-i);
+    hist.push_back(h);
+    i=j;
+  }
+
+  std::vector<SproxelColor> colors;
+  if ((int)hist.size()<=max_colors-1)
+  {
+    // few enough to keep them all, most used first
+    std::vector<std::pair<float, int> > order;
+    for (size_t i=0; i<hist.size(); ++i) order.push_back(std::make_pair(-hist[i].weight, int(i)));
+    std::sort(order.begin(), order.end());
+    for (size_t i=0; i<order.size(); ++i) colors.push_back(hist_color(hist[order[i].second].c));
+  }
+  else
+  {
+    std::vector<CutBox> boxes;
+    median_cut(hist, max_colors-1, boxes);
+    for (size_t i=0; i<boxes.size(); ++i) colors.push_back(hist_color(boxes[i].mean));
+    refine_palette(hist, colors);
+  }
+
+  ColorPalettePtr pal(new ColorPalette());
+  pal->resize(colors.size()+1);
+  for (size_t i=0; i<colors.size(); ++i) pal->setColor(i+1, colors[i]);
+  return pal;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+// Remapping
+
+
+namespace
+{
+  // One brick of indices, filled by a worker thread
+  struct RemapJob
+  {
+    const VoxelGridLayer *layer;
+    const ColorPalette *search; // palette colors from index 1 on
+    Imath::V3i bc;
+    IndBrickGrid::Brick *out;
+  };
+}
+
+
+template<class G> static void remap_cells(const RemapJob &job, const G &g)
+{
+  const typename G::Brick *b=g.brick(job.bc);
+  const Imath::Box3i r=cells_in_bounds(*job.layer, job.bc);
+
+  std::vector<SproxelColor> colors;
+  std::vector<int> cells, indices;
+  colors.reserve(G::BRICK_CELLS);
+  cells.reserve(G::BRICK_CELLS);
+
+  for (int x=r.min.x; x<=r.max.x; ++x)
+    for (int y=r.min.y; y<=r.max.y; ++y)
+      for (int z=r.min.z; z<=r.max.z; ++z)
+      {
+        const int i=G::cellIndex(Imath::V3i(x, y, z));
+        if (cell_empty(b->cells[i])) continue;
+        colors.push_back(cell_color(b->cells[i]));
+        cells.push_back(i);
+      }
+
+  std::fill(job.out->cells, job.out->cells+IndBrickGrid::BRICK_CELLS, SproxelIndex(0));
+  if (colors.empty()) return;
+
+  indices.resize(colors.size());
+  job.search->bestMatch(&colors[0], &indices[0], colors.size());
+  for (size_t i=0; i<cells.size(); ++i) job.out->cells[cells[i]]=SproxelIndex(indices[i]+1);
+}
+
+
+static void remap_brick(RemapJob &job)
+{
+  if (job.layer->rgbData()) remap_cells(job, *job.layer->rgbData());
+  else if (job.layer->rgba8Data()) remap_cells(job, *job.layer->rgba8Data());
+}
+
+
+bool convert_to_indexed(VoxelGridLayerPtr layer, ColorPalettePtr pal)
+{
+  if (!layer || !pal || pal->numColors()<2) return false;
+  layer->load();
+  if (layer->isIndexed()) return false;
+
+  std::vector<SproxelColor> colors;
+  for (int i=1; i<pal->numColors(); ++i) colors.push_back(pal->color(i));
+  const ColorPalette search(colors.begin(), colors.end());
+
+  std::vector<Imath::V3i> bricks;
+  allocated_bricks(*layer, bricks);
+
+  std::vector<IndBrickGrid::Brick> out(bricks.size());
+  QVector<RemapJob> jobs(bricks.size());
+  for (size_t i=0; i<bricks.size(); ++i)
+  {
+    jobs[i].layer=layer.data();
+    jobs[i].search=&search;
+    jobs[i].bc=bricks[i];
+    jobs[i].out=&out[i];
+  }
+
+  // the source is only read here, the layer changes after all jobs are done
+  QtConcurrent::blockingMap(jobs, remap_brick);
+
+  const Imath::Box3i box=layer->bounds();
+  const Imath::V3i origin=layer->dataOrigin();
+
+  layer->resetStorage(VoxelGridLayer::TYPE_IND, box, origin);
+  layer->setPalette(pal);
+
+  for (size_t i=0; i<bricks.size(); ++i)
+  {
+    bool used=false;
+    for (int c=0; c<IndBrickGrid::BRICK_CELLS && !used; ++c) used=(out[i].cells[c]!=0);
+    if (used) layer->writeBrick(bricks[i], &out[i]);
+  }
+
+  return true;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+static ColorPalettePtr quantize_layers(const QVector<VoxelGridLayerPtr> &layers, int max_colors)
+{
+  QVector<VoxelGridLayerPtr> rgb;
+  foreach (VoxelGridLayerPtr layer, layers)
+  {
+    layer->load();
+    if (!layer->isIndexed()) rgb.push_back(layer);
+  }
+  if (rgb.isEmpty()) return ColorPalettePtr();
+
+  ColorPalettePtr pal=make_palette(rgb, max_colors);
+  foreach (VoxelGridLayerPtr layer, rgb) convert_to_indexed(layer, pal);
+  return pal;
+}
+
+
+ColorPalettePtr quantize_copies(const QVector<VoxelGridLayerPtr> &layers, int max_colors,
+  QVector<VoxelGridLayerPtr> &rgb, QVector<VoxelGridLayerPtr> &converted)
+{
+  rgb.clear();
+  converted.clear();
+  foreach (VoxelGridLayerPtr layer, layers)
+  {
+    layer->load();
+    if (layer->isIndexed() || rgb.contains(layer)) continue;
+    rgb.push_back(layer);
+    converted.push_back(VoxelGridLayerPtr(new VoxelGridLayer(*layer)));
+  }
+  if (rgb.isEmpty()) return ColorPalettePtr();
+
+  ColorPalettePtr pal=make_palette(converted, max_colors);
+  foreach (VoxelGridLayerPtr layer, converted) convert_to_indexed(layer, pal);
+  return pal;
+}
+
+
+ColorPalettePtr quantize_sprite(VoxelGridGroupPtr spr, int max_colors)
+{
+  if (!spr) return ColorPalettePtr();
+
+  QVector<VoxelGridLayerPtr> layers;
+  for (int i=0; i<spr->numLayers(); ++i) layers.push_back(spr->layer(i));
+
+  ColorPalettePtr pal=quantize_layers(layers, max_colors);
+  if (pal) pal->setName(spr->name());
+  return pal;
+}
+
+
+ColorPalettePtr quantize_project(SproxelProjectPtr proj, int max_colors)
+{
+  if (!proj) return ColorPalettePtr();
+
+  QVector<VoxelGridLayerPtr> layers;
+  foreach (VoxelGridGroupPtr spr, proj->sprites)
+    for (int i=0; i<spr->numLayers(); ++i) layers.push_back(spr->layer(i));
+
+  ColorPalettePtr pal=quantize_layers(layers, max_colors);
+  if (pal)
+  {
+    pal->setName("quantized");
+    proj->palettes.push_back(pal);
+  }
+  return pal;
+}
@@ -0,0 +1,35 @@
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__
+
+
+#include "SproxelProject.h"
+
+
+// Palette generation and RGB to indexed conversion.
+// Palettes are built by median cut over the colors of the non-empty voxels
+// and refined with a few k-means passes.  Index 0 is always transparent, so
+// unallocated space in indexed layers stays empty.
+
+// Builds a palette of at most max_colors entries, index 0 included, for the
+// RGB layers of the list.  Exact if they use fewer colors.
+ColorPalettePtr make_palette(const QVector<VoxelGridLayerPtr> &layers, int max_colors=256);
+
+// Replaces the contents of an RGB layer with the nearest palette indices,
+// bricks are remapped in parallel.  Returns false for indexed layers.
+bool convert_to_indexed(VoxelGridLayerPtr layer, ColorPalettePtr pal);
+
+// Converts indexed copies of the RGB layers, shared ones once, so the
+// caller can swap them in as undo steps.  rgb gets the original layers and
+// converted their copies in the same order.  Returns NULL if there was
+// nothing to convert.
+ColorPalettePtr quantize_copies(const QVector<VoxelGridLayerPtr> &layers, int max_colors,
+  QVector<VoxelGridLayerPtr> &rgb, QVector<VoxelGridLayerPtr> &converted);
+
+// Convert all RGB layers of a sprite or project to one new palette.
+// The project version adds the palette to the project.  Both return NULL if
+// there was nothing to convert.
+ColorPalettePtr quantize_sprite(VoxelGridGroupPtr spr, int max_colors=256);
+ColorPalettePtr quantize_project(SproxelProjectPtr proj, int max_colors=256);
+
+
+#endif
@@ -6,112 +6,270 @@
 #include <ImathVec.h>
 #include <ImathLine.h>
 #include <ImathBox.h>
+#include "OccupancyMask.h"
 
 
-inline std::vector<Imath::V3i> walk_ray(const Imath::Line3d &ray, const Imath::Box3i &box)
+// Grid traversal of the cells of a box pierced by a ray, nearest first.
+class RayWalker
 {
-  std::vector<Imath::V3i> list;
+public:
+
+  RayWalker(const Imath::Line3d &ray, const Imath::Box3i &box) : m_valid(false)
+  {
+    if (box.isEmpty()) return;
+
+    // setup
+    Imath::V3d p0=ray.pos;
+    Imath::V3d dp=ray.dir;
 
-  if (box.isEmpty()) return list;
+    for (int a=0; a<3; ++a) m_step[a] = (dp[a]>=0) ? 1 : -1;
 
-  // setup
-  Imath::V3d p0=ray.pos;
-  Imath::V3d dp=ray.dir;
+    Imath::V3d tdelta(fabs(dp.x), fabs(dp.y), fabs(dp.z));
+    for (int a=0; a<3; ++a)
+      m_td[a] = ((tdelta[a]>tdelta.baseTypeEpsilon()) ? 1.0/tdelta[a] : 1e30);
 
-  int stepX = (dp.x>=0) ? 1 : -1;
-  int stepY = (dp.y>=0) ? 1 : -1;
-  int stepZ = (dp.z>=0) ? 1 : -1;
+    // move to box if outside
+    Imath::V3d p=p0;
 
-  Imath::V3d tdelta(fabs(dp.x), fabs(dp.y), fabs(dp.z));
-  tdelta.x = ((tdelta.x>tdelta.baseTypeEpsilon()) ? 1.0/tdelta.x : 1e30);
-  tdelta.y = ((tdelta.y>tdelta.baseTypeEpsilon()) ? 1.0/tdelta.y : 1e30);
-  tdelta.z = ((tdelta.z>tdelta.baseTypeEpsilon()) ? 1.0/tdelta.z : 1e30);
-  double tdx=tdelta.x;
-  double tdy=tdelta.y;
-  double tdz=tdelta.z;
+    Imath::V3d bmin=Imath::V3d(box.min)-p, bmax=p-Imath::V3d(box.max+Imath::V3i(1));
 
-  // move to box if outside
-  Imath::V3d p=p0;
+    double t=0, tout=1e300;
+    m_axis=-1;
+    for (int a=0; a<3; ++a)
+    {
+      const double tb=((dp[a]>=0) ? bmin[a] : bmax[a])*m_td[a];
+      const double te=((dp[a]>=0) ? -bmax[a] : -bmin[a])*m_td[a];
+      if (tb>t) { t=tb; m_axis=a; }
+      if (te<tout) tout=te;
+    }
 
-  Imath::V3d bmin=Imath::V3d(box.min)-p, bmax=p-Imath::V3d(box.max+Imath::V3i(1));
+    // missed, also keeps axis-parallel rays from jumping to huge coordinates
+    if (t>tout) return;
 
-  Imath::V3d tb;
-  tb.x = ((dp.x>=0) ? bmin.x : bmax.x);
-  tb.y = ((dp.y>=0) ? bmin.y : bmax.y);
-  tb.z = ((dp.z>=0) ? bmin.z : bmax.z);
-  tb*=tdelta;
+    p+=dp*t;
 
-  double t=0;
-  if (tb.x>t) t=tb.x;
-  if (tb.y>t) t=tb.y;
-  if (tb.z>t) t=tb.z;
+    // more setup
+    for (int a=0; a<3; ++a)
+    {
+      m_cell[a]=int(floor(p[a]));
+      const double f=p[a]-m_cell[a];
 
-  p+=dp*t;
+      m_end[a] = (dp[a]>=0) ? box.max[a]+1 : box.min[a]-1;
+      if ((dp[a]>=0 && m_cell[a]>=m_end[a]) || (dp[a]<0 && m_cell[a]<=m_end[a])) return;
 
-  // more setup
-  int ix=int(floor(p.x));
-  int iy=int(floor(p.y));
-  int iz=int(floor(p.z));
+      m_tm[a]=((dp[a]>=0) ? 1.0-f : f)*m_td[a];
+    }
 
-  double fx=p.x-ix;
-  double fy=p.y-iy;
-  double fz=p.z-iz;
+    m_valid=true;
+    m_prev=m_cell;
+    m_t0=m_t=t;
+    while (m_valid && !box.intersects(m_cell)) advance();
+  }
 
-  int endX = (dp.x>=0) ? box.max.x+1 : box.min.x-1;
-  int endY = (dp.y>=0) ? box.max.y+1 : box.min.y-1;
-  int endZ = (dp.z>=0) ? box.max.z+1 : box.min.z-1;
+  // False once the ray has left the box
+  bool valid() const { return m_valid; }
 
-  if ((dp.x>=0 && ix>=endX) || (dp.x<0 && ix<=endX)) return list;
-  if ((dp.y>=0 && iy>=endY) || (dp.y<0 && iy<=endY)) return list;
-  if ((dp.z>=0 && iz>=endZ) || (dp.z<0 && iz<=endZ)) return list;
+  // Current cell, always inside the box while valid()
+  const Imath::V3i& cell() const { return m_cell; }
 
-  double tmx=((dp.x>=0) ? 1.0-fx : fx)*tdelta.x;
-  double tmy=((dp.y>=0) ? 1.0-fy : fy)*tdelta.y;
-  double tmz=((dp.z>=0) ? 1.0-fz : fz)*tdelta.z;
+  // The cell visited before the current one, or skipped over last
+  const Imath::V3i& prev() const { return m_prev; }
 
-  // walk grid
-  for (;;)
+  // Ray parameter where the current cell was entered
+  double entryTime() const { return m_t; }
+
+  // Outward normal of the face the current cell was entered through,
+  // zero if the ray starts inside it
+  Imath::V3i entryNormal() const
   {
-    Imath::V3i ip(ix, iy, iz);
-    if (box.intersects(ip)) list.push_back(ip);
+    Imath::V3i n(0);
+    if (m_axis>=0) n[m_axis]=-m_step[m_axis];
+    return n;
+  }
+
+  void step()
+  {
+    m_prev=m_cell;
+    advance();
+  }
 
-    if (tmx<tmy)
+  // Moves to the first cell past the region, which must contain the current
+  // cell.  Lands exactly where step() would, without visiting the cells.
+  void skip(const Imath::Box3i &region)
+  {
+    // the walk is a merge of the plane crossings of the three axes, ordered
+    // by time and then Z, Y, X, see advance()
+    int left[3];
+    double exitTime[3];
+    for (int a=0; a<3; ++a)
     {
-      if (tmx<tmz)
+      left[a] = (m_step[a]>0) ? region.max[a]-m_cell[a] : m_cell[a]-region.min[a];
+      exitTime[a]=m_tm[a];
+      for (int i=0; i<left[a]; ++i) exitTime[a]+=m_td[a];
+    }
+
+    int e=2;
+    if (exitTime[1]<exitTime[e]) e=1;
+    if (exitTime[0]<exitTime[e]) e=0;
+
+    // crossings of the other axes before the exit one
+    for (int a=0; a<3; ++a)
+    {
+      int n=left[a];
+      if (a!=e)
+        for (n=0; n<left[a] && (m_tm[a]<exitTime[e] || (m_tm[a]==exitTime[e] && a>e)); ++n)
+          m_tm[a]+=m_td[a];
+      else
+        m_tm[a]=exitTime[a];
+
+      m_cell[a]+=m_step[a]*n;
+    }
+
+    step();
+  }
+
+protected:
+
+  bool m_valid;
+
+  Imath::V3i m_cell, m_prev;
+  Imath::V3i m_step, m_end;
+  Imath::V3d m_td, m_tm; // m_tm is relative to m_t0, where the box is entered
+  double m_t0, m_t;
+  int m_axis;            // axis of the last step, -1 before the first one
+
+  void advance()
+  {
+    int a;
+    if (m_tm.x<m_tm.y) a = (m_tm.x<m_tm.z) ? 0 : 2;
+    else a = (m_tm.y<m_tm.z) ? 1 : 2;
+
+    m_cell[a]+=m_step[a];
+    if (m_cell[a]==m_end[a]) { m_valid=false; return; }
+    m_t=m_t0+m_tm[a];
+    m_axis=a;
+    m_tm[a]+=m_td[a];
+  }
+};
+
+
+// Calls visit(cell) for the cells of the box pierced by the ray, nearest
+// first, until it returns true.  Returns true if the visitor stopped the walk.
+template<class F> bool walk_ray(const Imath::Line3d &ray, const Imath::Box3i &box, F &visit)
+{
+  for (RayWalker w(ray, box); w.valid(); w.step())
+    if (visit(w.cell())) return true;
+
+  return false;
+}
+
+
+namespace ray_walk_detail
+{
+  struct CollectCells
+  {
+    std::vector<Imath::V3i> &list;
+
+    CollectCells(std::vector<Imath::V3i> &l) : list(l) {}
+    bool operator()(const Imath::V3i &c) { list.push_back(c); return false; }
+  };
+}
+
+
+inline std::vector<Imath::V3i> walk_ray(const Imath::Line3d &ray, const Imath::Box3i &box)
+{
+  std::vector<Imath::V3i> list;
+  ray_walk_detail::CollectCells collect(list);
+  walk_ray(ray, box, collect);
+  return list;
+}
+
+
+// First non-empty cell along a ray
+struct RayHit
+{
+  bool valid;         // the ray passes through the box
+  bool hit;           // a non-empty cell was found
+  bool hasPrev;       // false if the hit is the first cell of the walk
+  Imath::V3i first;   // first cell of the walk
+  Imath::V3i cell;    // the hit cell
+  Imath::V3i prev;    // cell before the hit, or the last cell if nothing was hit
+  Imath::V3i normal;  // face of the hit cell the ray entered through, zero if it starts inside
+  double t;           // ray parameter of the hit point
+
+  RayHit() : valid(false), hit(false), hasPrev(false), normal(0), t(0) {}
+};
+
+
+// Casts a ray against grid.isOccupied(cell).  Blocks of the occupancy pyramid
+// that grid.isEmptyRegion(box, level) reports empty are stepped over whole,
+// so the cost grows with the distance to the hit and not with the cell count.
+template<class G> RayHit cast_ray(const Imath::Line3d &ray, const Imath::Box3i &box, const G &grid)
+{
+  RayHit r;
+  RayWalker w(ray, box);
+  if (!w.valid()) return r;
+
+  r.valid=true;
+  r.first=w.cell();
+
+  // the last block of each level found non-empty, to query every block once
+  Imath::V3i known[OccupancyMask::BLOCK_LEVELS];
+  bool haveKnown[OccupancyMask::BLOCK_LEVELS];
+  for (int l=0; l<OccupancyMask::BLOCK_LEVELS; ++l) haveKnown[l]=false;
+
+  bool visited=false;
+  while (w.valid())
+  {
+    const Imath::V3i &c=w.cell();
+
+    bool skipped=false;
+    for (int l=OccupancyMask::BLOCK_LEVELS-1; l>=0 && !skipped; --l)
+    {
+      const int bits=OccupancyMask::blockBits(l);
+      const Imath::V3i block(c.x>>bits, c.y>>bits, c.z>>bits);
+      if (haveKnown[l] && known[l]==block) continue;
+
+      Imath::Box3i region(block*(1<<bits), block*(1<<bits)+Imath::V3i((1<<bits)-1));
+      for (int a=0; a<3; ++a)
       {
-        ix+=stepX;
-        if (ix==endX) break;
-        t=tmx;
-        tmx+=tdx;
+        region.min[a]=std::max(region.min[a], box.min[a]);
+        region.max[a]=std::min(region.max[a], box.max[a]);
+      }
+
+      if (grid.isEmptyRegion(region, l))
+      {
+        w.skip(region);
+        skipped=true;
       }
       else
       {
-        iz+=stepZ;
-        if (iz==endZ) break;
-        t=tmz;
-        tmz+=tdz;
+        known[l]=block;
+        haveKnown[l]=true;
       }
     }
-    else
+
+    if (!skipped)
     {
-      if (tmy<tmz)
+      if (grid.isOccupied(c))
       {
-        iy+=stepY;
-        if (iy==endY) break;
-        t=tmy;
-        tmy+=tdy;
-      }
-      else
-      {
-        iz+=stepZ;
-        if (iz==endZ) break;
-        t=tmz;
-        tmz+=tdz;
+        r.hit=true;
+        r.cell=c;
+        r.prev=w.prev();
+        r.hasPrev=visited;
+        r.normal=w.entryNormal();
+        r.t=w.entryTime();
+        return r;
       }
+      w.step();
     }
+
+    visited=true;
   }
 
-  return list;
+  r.prev=w.prev();
+  r.hasPrev=true;
+  return r;
 }
 
 
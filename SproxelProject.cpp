@@ -1,4 +1,6 @@
+#include <string.h>
 #include <QImage>
+#include <QtConcurrentMap>
 #include "SproxelProject.h"
 
 static SproxelColor colorFromHSV(float h, float s, float v)
@@ -54,7 +56,7 @@ SproxelProject::SproxelProject()
   palettes.push_back(mainPalette);
 }
 
-VoxelGridLayerPtr VoxelGridLayer::fromQImage(QImage readMe, ColorPalettePtr pal)
+VoxelGridLayerPtr VoxelGridLayer::fromQImage(QImage readMe, ColorPalettePtr pal, bool compact)
 {
   QString tempStr;
   tempStr = readMe.text("VoxelGridDimX");
@@ -64,37 +66,55 @@ VoxelGridLayerPtr VoxelGridLayer::fromQImage(QImage readMe, ColorPalettePtr pal)
   tempStr = readMe.text("VoxelGridDimZ");
   int sizeZ = tempStr.toInt();
 
-  if (sizeX == 0 || sizeY == 0 || sizeZ == 0) return VoxelGridLayerPtr();
+  if (sizeX <= 0 || sizeY <= 0 || sizeZ <= 0) return VoxelGridLayerPtr();
+  if (readMe.width() < sizeX*sizeZ || readMe.height() < sizeY) return VoxelGridLayerPtr();
 
-  readMe = readMe.mirrored();
+  // Indices are only kept when there's a palette to go with them
+  const bool indexed = readMe.colorCount()>0 && pal;
 
-  VoxelGridLayerPtr layer(new VoxelGridLayer());
-
-  bool indexed=false;
-  if (readMe.colorCount()>0)
+  if (indexed)
   {
-    indexed=true;
-    layer->setPalette(pal);
+    if (readMe.format() != QImage::Format_Indexed8)
+      readMe = readMe.convertToFormat(QImage::Format_Indexed8);
   }
+  else if (readMe.format() != QImage::Format_ARGB32)
+    readMe = readMe.convertToFormat(QImage::Format_ARGB32);
+
+  VoxelGridLayerPtr layer(new VoxelGridLayer());
+  if (indexed) layer->setPalette(pal);
+  else layer->setCompact(compact);
 
   layer->resize(Imath::Box3i(Imath::V3i(0), Imath::V3i(sizeX, sizeY, sizeZ)-Imath::V3i(1)));
 
-  for (int slice = 0; slice < sizeZ; slice++)
+  // The image is stored upside down, storage origin is 0 after the resize
+  // so cells can be written to the grid directly.
+  for (int y = 0; y < sizeY; y++)
   {
-    const int sliceOffset = slice * sizeX;
-    for (int y = 0; y < sizeY; y++)
+    const uchar *line = readMe.constScanLine(sizeY-1-y);
+
+    for (int slice = 0; slice < sizeZ; slice++)
     {
-      for (int x = 0; x < sizeX; x++)
+      const int sliceOffset = slice * sizeX;
+
+      if (indexed)
       {
-        int index=-1;
-        if (indexed) index=readMe.pixelIndex(x+sliceOffset, y);
-        QRgb pixelValue = readMe.pixel(x+sliceOffset, y);
-        Imath::Color4f color(
-          (float)qRed  (pixelValue) / 255.0f,
-          (float)qGreen(pixelValue) / 255.0f,
-          (float)qBlue (pixelValue) / 255.0f,
-          (float)qAlpha(pixelValue) / 255.0f);
-        layer->set(Imath::V3i(x, y, slice), color, index);
+        for (int x = 0; x < sizeX; x++)
+          layer->m_ind->set(Imath::V3i(x, y, slice), line[x+sliceOffset]);
+      }
+      else
+      {
+        const QRgb *pixels = (const QRgb*)line + sliceOffset;
+
+        if (layer->m_rgba8)
+        {
+          for (int x = 0; x < sizeX; x++)
+            layer->m_rgba8->set(Imath::V3i(x, y, slice), pixels[x]);
+        }
+        else
+        {
+          for (int x = 0; x < sizeX; x++)
+            layer->m_rgb->set(Imath::V3i(x, y, slice), unpack_color(pixels[x]));
+        }
       }
     }
   }
@@ -113,50 +133,49 @@ QImage VoxelGridLayer::makeQImage() const
   const int width = cellDim.x * cellDim.z;
   QImage writeMe(QSize(width, height), m_ind?QImage::Format_Indexed8:QImage::Format_ARGB32);
 
-  if (m_ind)
+  if (m_ind && m_palette)
   {
-    if (m_palette)
-    {
-      writeMe.setColorCount(m_palette->numColors());
-      for (int i=0; i<m_palette->numColors(); ++i)
-      {
-        SproxelColor c=m_palette->color(i)*255.0f;
-        writeMe.setColor(i, qRgba(int(c.r), int(c.g), int(c.b), int(c.a)));
-      }
-    }
+    writeMe.setColorCount(m_palette->numColors());
+    for (int i=0; i<m_palette->numColors(); ++i)
+      writeMe.setColor(i, m_palette->packedColor(i));
+  }
+
+  // Rows are written bottom up, cells are read from storage directly
+  const Imath::V3i base = dim.min-m_origin;
+
+  for (int y = 0; y < cellDim.y; y++)
+  {
+    uchar *line = writeMe.scanLine(cellDim.y-1-y);
 
     for (int slice = 0; slice < cellDim.z; slice++)
     {
       const int sliceOffset = slice * cellDim.x;
-      for (int y = 0; y < cellDim.y; y++)
+
+      if (m_ind)
       {
         for (int x = 0; x < cellDim.x; x++)
-          writeMe.setPixel(x+sliceOffset, y, getInd(Imath::V3i(x, y, slice)+dim.min));
+          line[x+sliceOffset] = uchar(m_ind->get(base+Imath::V3i(x, y, slice)));
       }
-    }
-  }
-  else
-  {
-    for (int slice = 0; slice < cellDim.z; slice++)
-    {
-      const int sliceOffset = slice * cellDim.x;
-      for (int y = 0; y < cellDim.y; y++)
+      else
       {
-        for (int x = 0; x < cellDim.x; x++)
+        QRgb *pixels = (QRgb*)line + sliceOffset;
+
+        if (m_rgba8)
+        {
+          for (int x = 0; x < cellDim.x; x++)
+            pixels[x] = m_rgba8->get(base+Imath::V3i(x, y, slice));
+        }
+        else if (m_rgb)
         {
-          const Imath::Color4f colorScaled = getColor(Imath::V3i(x, y, slice)+dim.min) * 255.0f;
-          writeMe.setPixel(x+sliceOffset, y, qRgba(
-            (int)colorScaled.r,
-            (int)colorScaled.g,
-            (int)colorScaled.b,
-            (int)colorScaled.a));
+          for (int x = 0; x < cellDim.x; x++)
+            pixels[x] = pack_color(m_rgb->get(base+Imath::V3i(x, y, slice)));
         }
+        else
+          memset(pixels, 0, cellDim.x*sizeof(QRgb));
       }
     }
   }
 
-  writeMe = writeMe.mirrored();   // QT Bug: mirrored() doesn't preserve text.
-
   QString tempStr;
   writeMe.setText("SproxelFileVersion", "1");
   writeMe.setText("VoxelGridDimX", tempStr.setNum(cellDim.x));
@@ -170,14 +189,192 @@ QImage VoxelGridLayer::makeQImage() const
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
+namespace
+{
+  // Per-cell compositing rules of getLayers() and getLayersInd().  Layers are
+  // applied top first, a cell is done once a layer fills it.
+  struct BakeColor
+  {
+    SproxelColor *out;
+    const ColorPalette *pal;
+
+    bool fills(const SproxelColor &c) const { return c.a!=0; }
+    bool fills(SproxelRgba8 c) const { return (c>>24)!=0; }
+    bool fills(SproxelIndex i) const { return pal->color(i).a!=0; }
+
+    void put(int i, const SproxelColor &c) { out[i]=c; }
+    void put(int i, SproxelRgba8 c) { out[i]=unpack_color(c); }
+    void put(int i, SproxelIndex c) { out[i]=pal->color(c); }
+  };
+
+  struct BakeIndex
+  {
+    SproxelIndex *out;
+
+    bool fills(SproxelIndex i) const { return i!=0; }
+    void put(int i, SproxelIndex c) { out[i]=c; }
+  };
+
+
+  // Copies the cells of box r (layer space) from a layer grid into an output
+  // brick at outOrigin, reading a source brick at a time.  Returns the number
+  // of cells filled.
+  template<class T, class P> int bake_scan(const ChunkedVoxelGrid<T> &g, const Imath::V3i &origin,
+    const Imath::Box3i &r, const Imath::V3i &outOrigin, unsigned char *done, P &put)
+  {
+    typedef ChunkedVoxelGrid<T> G;
+    const Imath::V3i b0=G::brickOf(r.min-origin), b1=G::brickOf(r.max-origin);
+    const bool emptyFills=put.fills(g.emptyValue());
+    int filled=0;
+
+    for (int bx=b0.x; bx<=b1.x; ++bx)
+      for (int by=b0.y; by<=b1.y; ++by)
+        for (int bz=b0.z; bz<=b1.z; ++bz)
+        {
+          const typename G::Brick *b=g.brick(Imath::V3i(bx, by, bz));
+          if (!b && !emptyFills) continue;
+
+          const Imath::Box3i bb=G::brickBox(Imath::V3i(bx, by, bz));
+          Imath::Box3i sub;
+          for (int a=0; a<3; ++a)
+          {
+            sub.min[a]=std::max(r.min[a], bb.min[a]+origin[a]);
+            sub.max[a]=std::min(r.max[a], bb.max[a]+origin[a]);
+          }
+
+          for (int x=sub.min.x; x<=sub.max.x; ++x)
+            for (int y=sub.min.y; y<=sub.max.y; ++y)
+              for (int z=sub.min.z; z<=sub.max.z; ++z)
+              {
+                const Imath::V3i at(x, y, z);
+                const int oi=G::cellIndex(at-outOrigin);
+                if (done[oi]) continue;
+
+                const T v = b ? b->cells[G::cellIndex(at-origin)] : g.emptyValue();
+                if (!put.fills(v)) continue;
+
+                put.put(oi, v);
+                done[oi]=1;
+                ++filled;
+              }
+        }
+
+    return filled;
+  }
+
+
+  // A column of output bricks along Z, composited on a worker
+  struct BakeColumn
+  {
+    const QVector<const VoxelGridLayer*> *layers; // visible layers, top first
+    Imath::Box3i box;       // baked bounds
+    int bx, by;             // output brick column, storage space
+    bool indexed, compact;
+
+    std::vector<Imath::V3i> bricks;   // non-empty output bricks
+    std::vector<IndBrickGrid::Brick> ind;
+    std::vector<RgbBrickGrid::Brick> rgb;
+    std::vector<Rgba8BrickGrid::Brick> rgba8;
+  };
+
+
+  void bake_column(BakeColumn &col)
+  {
+    const Imath::V3i origin=col.box.min;
+    const int bz1=RgbBrickGrid::brickOf(col.box.max-origin).z;
+
+    unsigned char done[RgbBrickGrid::BRICK_CELLS];
+    IndBrickGrid::Brick indOut;
+    RgbBrickGrid::Brick rgbOut;
+
+    for (int bz=0; bz<=bz1; ++bz)
+    {
+      const Imath::V3i bc(col.bx, col.by, bz);
+      const Imath::Box3i bb=RgbBrickGrid::brickBox(bc);
+
+      Imath::Box3i r;
+      for (int a=0; a<3; ++a)
+      {
+        r.min[a]=std::max(bb.min[a]+origin[a], col.box.min[a]);
+        r.max[a]=std::min(bb.max[a]+origin[a], col.box.max[a]);
+      }
+
+      const Imath::V3i rs=r.size()+Imath::V3i(1);
+      const int numCells=rs.x*rs.y*rs.z;
+
+      memset(done, 0, sizeof(done));
+      std::fill(indOut.cells, indOut.cells+IndBrickGrid::BRICK_CELLS, SproxelIndex(0));
+      std::fill(rgbOut.cells, rgbOut.cells+RgbBrickGrid::BRICK_CELLS, SproxelColor(0, 0, 0, 0));
+
+      BakeIndex putInd={indOut.cells};
+      BakeColor putColor={rgbOut.cells, NULL};
+
+      int filled=0;
+      for (int i=0; i<col.layers->size() && filled<numCells; ++i)
+      {
+        const VoxelGridLayer &layer=*(*col.layers)[i];
+
+        const Imath::Box3i lb=layer.bounds();
+        Imath::Box3i lr;
+        for (int a=0; a<3; ++a)
+        {
+          lr.min[a]=std::max(r.min[a], lb.min[a]);
+          lr.max[a]=std::min(r.max[a], lb.max[a]);
+        }
+        if (lr.isEmpty()) continue;
+
+        const Imath::V3i lo=layer.dataOrigin();
+
+        // the shared palette makes indices valid as they are
+        if (col.indexed)
+        {
+          if (layer.indData()) filled+=bake_scan(*layer.indData(), lo, lr, origin, done, putInd);
+        }
+        else if (layer.indData())
+        {
+          if (!layer.palette()) continue;
+          putColor.pal=layer.palette().data();
+          filled+=bake_scan(*layer.indData(), lo, lr, origin, done, putColor);
+        }
+        else if (layer.rgbData())
+          filled+=bake_scan(*layer.rgbData(), lo, lr, origin, done, putColor);
+        else if (layer.rgba8Data())
+          filled+=bake_scan(*layer.rgba8Data(), lo, lr, origin, done, putColor);
+      }
+
+      if (!filled) continue;
+
+      col.bricks.push_back(bc);
+      if (col.indexed)
+        col.ind.push_back(indOut);
+      else if (col.compact)
+      {
+        col.rgba8.push_back(Rgba8BrickGrid::Brick());
+        for (int c=0; c<RgbBrickGrid::BRICK_CELLS; ++c) col.rgba8.back().cells[c]=pack_color(rgbOut.cells[c]);
+      }
+      else
+        col.rgb.push_back(rgbOut);
+    }
+  }
+}
+
+
+// Composited in parallel, one job per column of output bricks, straight
+// from the layer bricks.  Layers sharing one palette are baked as indices.
 VoxelGridLayerPtr VoxelGridGroup::bakeLayers() const
 {
   VoxelGridLayerPtr grid(new VoxelGridLayer());
 
+  // hidden layers add nothing to the result, so they don't decide its type
+  QVector<const VoxelGridLayer*> visible;
+  foreach (VoxelGridLayerPtr layer, m_layers)
+    if (layer->isVisible()) visible.append(layer.data());
+
   ColorPalettePtr palette;
-  bool hasRgb=false, hasMultiPal=false;
+  bool hasRgb=false, hasMultiPal=false, allCompact=true;
 
-  foreach (VoxelGridLayerPtr layer, m_layers)
+  foreach (const VoxelGridLayer *layer, visible)
+  {
     if (layer->palette())
     {
       if (!palette) palette=layer->palette();
@@ -186,20 +383,162 @@ VoxelGridLayerPtr VoxelGridGroup::bakeLayers() const
     else
       hasRgb=true;
 
+    if (!layer->isCompact()) allCompact=false;
+  }
+
   if (hasRgb || hasMultiPal) palette=NULL;
 
   grid->setPalette(palette);
+  grid->setCompact(allCompact && !palette);
 
   Imath::Box3i ext=bounds();
+  if (ext.isEmpty()) return grid;
   grid->resize(ext);
 
-  for (int z=ext.min.z; z<=ext.max.z; ++z)
-    for (int y=ext.min.y; y<=ext.max.y; ++y)
-      for (int x=ext.min.x; x<=ext.max.x; ++x)
+  const Imath::V3i b1=RgbBrickGrid::brickOf(ext.max-ext.min);
+
+  QVector<BakeColumn> columns;
+  columns.reserve((b1.x+1)*(b1.y+1));
+  for (int bx=0; bx<=b1.x; ++bx)
+    for (int by=0; by<=b1.y; ++by)
+    {
+      BakeColumn col;
+      col.layers=&visible;
+      col.box=ext;
+      col.bx=bx;
+      col.by=by;
+      col.indexed=bool(palette);
+      col.compact=grid->isCompact();
+      columns.append(col);
+    }
+
+  QtConcurrent::blockingMap(columns, bake_column);
+
+  // the new storage starts at ext.min, see VoxelGridLayer::resize()
+  foreach (const BakeColumn &col, columns)
+    for (size_t i=0; i<col.bricks.size(); ++i)
+    {
+      if (col.indexed) grid->writeBrick(col.bricks[i], &col.ind[i]);
+      else if (col.compact) grid->writeBrick(col.bricks[i], &col.rgba8[i]);
+      else grid->writeBrick(col.bricks[i], &col.rgb[i]);
+    }
+
+  return grid;
+}
+
+
+void VoxelGridGroup::rebuildComposite() const
+{
+  Imath::Box3i box=m_compDirty;
+  m_compDirty.makeEmpty();
+  foreach (VoxelGridLayerPtr layer, m_layers) box.extendBy(layer->takeCompositeDirtyBox());
+
+  if (!m_compColor)
+  {
+    m_compColor=new RgbBrickGrid(SproxelColor(0, 0, 0, 0));
+    m_compInd=new IndBrickGrid(0);
+    box=bounds();
+  }
+
+  if (box.isEmpty()) return;
+
+  const int numLayers=m_layers.size();
+  const Imath::V3i b0=RgbBrickGrid::brickOf(box.min), b1=RgbBrickGrid::brickOf(box.max);
+
+  for (int bx=b0.x; bx<=b1.x; ++bx)
+    for (int by=b0.y; by<=b1.y; ++by)
+      for (int bz=b0.z; bz<=b1.z; ++bz)
       {
-        Imath::V3i at(x, y, z);
-        grid->set(at, get(at), getInd(at));
+        const Imath::V3i bc(bx, by, bz);
+        const Imath::Box3i bb=RgbBrickGrid::brickBox(bc);
+
+        Imath::Box3i r=bb;
+        for (int a=0; a<3; ++a)
+        {
+          r.min[a]=std::max(r.min[a], box.min[a]);
+          r.max[a]=std::min(r.max[a], box.max[a]);
+        }
+
+        bool anyColor=false, anyInd=false;
+
+        for (int x=r.min.x; x<=r.max.x; ++x)
+          for (int y=r.min.y; y<=r.max.y; ++y)
+            for (int z=r.min.z; z<=r.max.z; ++z)
+            {
+              const Imath::V3i at(x, y, z);
+              SproxelColor color(0, 0, 0, 0);
+              int ind=0;
+              bool hasColor=false;
+
+              // same rules as getLayers() and getLayersInd()
+              for (int i=0; i<numLayers && !(hasColor && ind>0); ++i)
+              {
+                const VoxelGridLayer &layer=*m_layers[i];
+                if (!layer.isVisible()) continue;
+
+                if (!hasColor)
+                {
+                  color=layer.getColor(at);
+                  hasColor=(color.a!=0);
+                }
+
+                if (ind<=0) ind=layer.getInd(at);
+              }
+
+              if (!hasColor) color=SproxelColor(0, 0, 0, 0);
+              if (ind<0) ind=0;
+
+              m_compColor->set(at, color);
+              m_compInd->set(at, ind);
+              if (hasColor) anyColor=true;
+              if (ind) anyInd=true;
+            }
+
+        // drop bricks that were emptied as a whole
+        if (r==bb)
+        {
+          if (!anyColor) m_compColor->freeBrick(bc);
+          if (!anyInd) m_compInd->freeBrick(bc);
+        }
       }
+}
 
-  return grid;
+
+namespace
+{
+  // A slice of a castRays() batch
+  struct RayBatch
+  {
+    const VoxelGridGroup *spr;
+    const Imath::Line3d *rays;
+    RayHit *hits;
+    int n;
+  };
+
+  void cast_ray_batch(RayBatch &b)
+  {
+    for (int i=0; i<b.n; ++i) b.hits[i]=b.spr->castRay(b.rays[i]);
+  }
+}
+
+
+void VoxelGridGroup::castRays(const Imath::Line3d *worldRays, RayHit *hits, int n) const
+{
+  // lazy caches aren't safe to build from the workers
+  updateComposite();
+
+  const int sliceSize=256;
+  QVector<RayBatch> batches;
+  for (int i=0; i<n; i+=sliceSize)
+  {
+    RayBatch b;
+    b.spr=this;
+    b.rays=worldRays+i;
+    b.hits=hits+i;
+    b.n=std::min(sliceSize, n-i);
+    batches.push_back(b);
+  }
+
+  if (batches.size()==1) cast_ray_batch(batches[0]);
+  else QtConcurrent::blockingMap(batches, cast_ray_batch);
 }
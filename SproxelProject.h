@@ -19,8 +19,13 @@ public:
 typedef QExplicitlySharedDataPointer<SproxelProject> SproxelProjectPtr;
 
 
+// Both formats are chosen by the file extension: .sxl is a zip archive of
+// PNG slices, .sxb stores voxel bricks and loads layers lazily.
 bool save_project(QString filename, SproxelProjectPtr project);
 SproxelProjectPtr load_project(QString filename);
 
+bool save_brick_project(QString filename, SproxelProjectPtr project);
+SproxelProjectPtr load_brick_project(QString filename);
+
 
 #endif
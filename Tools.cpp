@@ -1,56 +1,131 @@
 #include "Tools.h"
 #include "RayWalk.h"
+#include "FloodFill.h"
 #include "GLModelWidget.h"
 
+#include <algorithm>
+
+////////////////////////////////////////
+static bool same_hit(const RayHit& a, const RayHit& b)
+{
+    if (a.valid != b.valid || a.hit != b.hit || a.hasPrev != b.hasPrev) return false;
+    if (!a.valid) return true;
+    return a.first == b.first && a.prev == b.prev && (!a.hit || a.cell == b.cell);
+}
+
+
+// Serial of the last preview list made by any tool
+static unsigned s_lastPreviewSerial = 0;
+
+
+const std::vector<Imath::V3i>& ToolState::preview()
+{
+    PreviewKey key;
+    key.sprite = p_gvg.data();
+    key.transform = p_gvg->transform();
+    key.editBounds = m_editBounds;
+    key.clicksRemain = m_clicksRemain;
+    if (previewFollowsRay())
+        key.ray = m_ray;
+    else
+        key.hit = castRay(m_ray);
+
+    if (m_previewValid &&
+        key.sprite == m_previewKey.sprite &&
+        key.transform == m_previewKey.transform &&
+        key.editBounds.min == m_previewKey.editBounds.min &&
+        key.editBounds.max == m_previewKey.editBounds.max &&
+        key.clicksRemain == m_previewKey.clicksRemain &&
+        same_hit(key.hit, m_previewKey.hit) &&
+        (!previewFollowsRay() || (key.ray.pos == m_previewKey.ray.pos && key.ray.dir == m_previewKey.ray.dir)))
+        return m_preview;
+
+    m_previewRemoved.clear();
+    m_previewAdded.clear();
+    m_previewDelta = updatePreview(key.hit, m_preview);
+    m_previewBase = m_previewSerial;
+    m_previewSerial = ++s_lastPreviewSerial;
+
+    m_previewKey = key;
+    m_previewValid = true;
+    return m_preview;
+}
+
+
 ////////////////////////////////////////
 void SplatToolState::execute()
 {
-    p_undoManager->beginMacro("Splat");
+    VoxelRegionEdit edit(p_gvg);
     std::vector<Imath::V3i> voxels = voxelsAffected();
     for (size_t i = 0; i < voxels.size(); i++)
     {
-        p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+        edit.set(voxels[i], m_color, m_index);
     }
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Splat");
     decrementClicks();
 }
 
 
-std::vector<Imath::V3i> SplatToolState::voxelsAffected()
+void SplatToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-    std::vector<Imath::V3i> voxels;
+    // The voxel in front of the first hit, or the last one if nothing was
+    // hit.  Nothing if the hit is at the close edge of the grid.
+    if (hit.valid && hit.hasPrev)
+        voxels.push_back(hit.prev);
+}
 
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
 
-    for (size_t i = 0; i < intersects.size(); i++)
+////////////////////////////////////////
+namespace
+{
+    // Cells with exactly the color being replaced
+    struct SameColor
     {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            // Hit a voxel at the close edge of the grid?  Abort.
-            if (i == 0)
-                break;
+        VoxelGridGroupPtr spr;
+        Imath::Color4f color;
 
-            // Hit a voxel in the middle?  Return previous voxel.
-            voxels.push_back(intersects[i-1]);
-            break;
+        SameColor(VoxelGridGroupPtr s, const Imath::Color4f& c) : spr(s), color(c) {}
+        bool operator()(const Imath::V3i& at) const { return spr->get(at) == color; }
+    };
+
+    // Ray cells up to and including the end cell
+    struct CollectUntil
+    {
+        std::vector<Imath::V3i>& cells;
+        Imath::V3i end;
+
+        CollectUntil(std::vector<Imath::V3i>& c, const Imath::V3i& e) : cells(c), end(e) {}
+        bool operator()(const Imath::V3i& at)
+        {
+            cells.push_back(at);
+            return at == end;
         }
+    };
 
-        // Didn't hit anything?  Just return the last voxel.
-        if (i == intersects.size()-1)
+    // Empty cells in front of a filled one
+    struct Extrudable
+    {
+        VoxelGridGroupPtr spr;
+        Imath::V3i dir;
+
+        Extrudable(VoxelGridGroupPtr s, const Imath::V3i& d) : spr(s), dir(d) {}
+        bool operator()(const Imath::V3i& at) const
         {
-            voxels.push_back(intersects[i]);
-            break;
+            return !spr->isOccupied(at) && spr->isOccupied(at-dir);
         }
-    }
+    };
+
+    // Cells a box preview no longer covers
+    struct OutsideBox
+    {
+        Imath::Box3i box;
 
-    return voxels;
+        OutsideBox(const Imath::Box3i& b) : box(b) {}
+        bool operator()(const Imath::V3i& at) const { return !box.intersects(at); }
+    };
 }
 
 
-////////////////////////////////////////
 void FloodToolState::execute()
 {
     std::vector<Imath::V3i> voxels = voxelsAffected();
@@ -64,142 +139,72 @@ void FloodToolState::execute()
     if (repColor == m_color)
         return;
 
-    // Recurse
-    p_undoManager->beginMacro("Flood Fill");
-    p_undoManager->setVoxelColor(p_gvg, hit, m_color, m_index);
-    setNeighborsRecurse(hit, repColor, m_color, m_index);
-    p_undoManager->endMacro();
-    decrementClicks();
-}
-
+    std::vector<Imath::V3i> filled;
+    flood_fill(p_gvg->bounds(), hit, SameColor(p_gvg, repColor), filled, m_scratch.flood);
 
-void FloodToolState::setNeighborsRecurse(const Imath::V3i& alreadySet,
-                                         const Imath::Color4f& repColor,
-                                         const Imath::Color4f& newColor,
-                                         int newIndex)
-{
-    // Directions
-    Imath::V3i doUs[6];
-    doUs[0] = Imath::V3i(alreadySet.x+1, alreadySet.y,   alreadySet.z);
-    doUs[3] = Imath::V3i(alreadySet.x-1, alreadySet.y,   alreadySet.z);
-    doUs[1] = Imath::V3i(alreadySet.x,   alreadySet.y+1, alreadySet.z);
-    doUs[4] = Imath::V3i(alreadySet.x,   alreadySet.y-1, alreadySet.z);
-    doUs[2] = Imath::V3i(alreadySet.x,   alreadySet.y,   alreadySet.z+1);
-    doUs[5] = Imath::V3i(alreadySet.x,   alreadySet.y,   alreadySet.z-1);
-
-    for (int i = 0; i < 6; i++)
+    VoxelRegionEdit edit(p_gvg);
+    for (size_t i = 0; i < filled.size(); i++)
     {
-        // Bounds protection
-        if (!p_gvg->bounds().intersects(doUs[i])) continue;
-
-        // Recurse
-        if (p_gvg->get(doUs[i]) == repColor)
-        {
-            p_undoManager->setVoxelColor(p_gvg, doUs[i], newColor, newIndex);
-            setNeighborsRecurse(doUs[i], repColor, newColor, newIndex);
-        }
+        edit.set(filled[i], m_color, m_index);
     }
+    p_undoManager->commitRegion(edit, "Flood Fill");
+    decrementClicks();
 }
 
 
-std::vector<Imath::V3i> FloodToolState::voxelsAffected()
+void FloodToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
     // TODO: It may make the most sense to recurse in here, but it could be slow
-    std::vector<Imath::V3i> voxels;
-
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
 
     // Get the first voxel hit
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            voxels.push_back(intersects[i]);
-            break;
-        }
-    }
-
-    return voxels;
+    if (hit.hit)
+        voxels.push_back(hit.cell);
 }
 
 
 ////////////////////////////////////////
 void EraserToolState::execute()
 {
-    p_undoManager->beginMacro("Eraser");
+    VoxelRegionEdit edit(p_gvg);
     std::vector<Imath::V3i> voxels = voxelsAffected();
     for (size_t i = 0; i < voxels.size(); i++)
     {
-        p_undoManager->setVoxelColor(p_gvg, voxels[i],
-                                     Imath::Color4f(0.0f, 0.0f, 0.0f, 0.0f), 0);
+        edit.set(voxels[i], Imath::Color4f(0.0f, 0.0f, 0.0f, 0.0f), 0);
     }
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Eraser");
     decrementClicks();
 }
 
 
-std::vector<Imath::V3i> EraserToolState::voxelsAffected()
+void EraserToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-    std::vector<Imath::V3i> voxels;
-
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
-
     // Get the first voxel hit
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            voxels.push_back(intersects[i]);
-            break;
-        }
-    }
-
-    return voxels;
+    if (hit.hit)
+        voxels.push_back(hit.cell);
 }
 
 
 ////////////////////////////////////////
 void ReplaceToolState::execute()
 {
-    p_undoManager->beginMacro("Replace");
+    VoxelRegionEdit edit(p_gvg);
     std::vector<Imath::V3i> voxels = voxelsAffected();
     for (size_t i = 0; i < voxels.size(); i++)
     {
         // Don't replace if you're already identical
         if (p_gvg->get(voxels[i]) != m_color)
-            p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+            edit.set(voxels[i], m_color, m_index);
     }
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Replace");
     decrementClicks();
 }
 
 
-std::vector<Imath::V3i> ReplaceToolState::voxelsAffected()
+void ReplaceToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-    std::vector<Imath::V3i> voxels;
-
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
-
     // Get the first voxel hit
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            voxels.push_back(intersects[i]);
-            break;
-        }
-    }
-
-    return voxels;
+    if (hit.hit)
+        voxels.push_back(hit.cell);
 }
 
 
@@ -208,12 +213,12 @@ void RayToolState::execute()
 {
     std::vector<Imath::V3i> voxels = voxelsAffected();
 
-    p_undoManager->beginMacro("Ray Blast");
+    VoxelRegionEdit edit(p_gvg);
     for (size_t i = 0; i < voxels.size(); i++)
     {
-        p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+        edit.set(voxels[i], m_color, m_index);
     }
-    p_undoManager->endMacro();
+    p_undoManager->commitRegion(edit, "Ray Blast");
     decrementClicks();
 }
 
@@ -224,57 +229,48 @@ std::vector<Imath::V3i> RayToolState::voxelsAffected()
 }
 
 
+// The whole ray, the hit doesn't matter
+void RayToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
+{
+    (void)hit;
+    ray_walk_detail::CollectCells collect(voxels);
+    walk_ray(m_ray * p_gvg->transform().inverse(), m_editBounds, collect);
+}
+
+
 ////////////////////////////////////////
 void SlabToolState::execute()
 {
     std::vector<Imath::V3i> voxels = voxelsAffected();
 
-    switch (m_workingAxis)
+    VoxelRegionEdit edit(p_gvg);
+    for (size_t i = 0; i < voxels.size(); i++)
     {
-        case X_AXIS: p_undoManager->beginMacro("Fill X Slice"); break;
-        case Y_AXIS: p_undoManager->beginMacro("Fill Y Slice"); break;
-        case Z_AXIS: p_undoManager->beginMacro("Fill Z Slice"); break;
+        edit.set(voxels[i], m_color, m_index);
     }
-    for (size_t i = 0; i < voxels.size(); i++)
+
+    switch (m_workingAxis)
     {
-        p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+        case X_AXIS: p_undoManager->commitRegion(edit, "Fill X Slice"); break;
+        case Y_AXIS: p_undoManager->commitRegion(edit, "Fill Y Slice"); break;
+        case Z_AXIS: p_undoManager->commitRegion(edit, "Fill Z Slice"); break;
     }
-    p_undoManager->endMacro();
     decrementClicks();
 }
 
 
-std::vector<Imath::V3i> SlabToolState::voxelsAffected()
+void SlabToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-    std::vector<Imath::V3i> voxels;
-
     // TODO: Should this do an intersection at all, or maybe just fill in the
     //       row based on the first hit?
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
+    if (!hit.valid)
+        return;
 
-    // Get the position to fill from
-    Imath::V3i fillPos=intersects[0];
-
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            // Hit a voxel at the near edge of the grid?  Start there.
-            if (i == 0)
-            {
-                fillPos = intersects[0];
-                break;
-            }
-            else
-            {
-                // Hit a voxel in the middle?
-                fillPos = intersects[i-1];
-                break;
-            }
-        }
-    }
+    // Get the position to fill from, in front of the hit voxel if there is
+    // one and it isn't at the near edge of the grid
+    Imath::V3i fillPos = hit.first;
+    if (hit.hit && hit.hasPrev)
+        fillPos = hit.prev;
 
     // Fill out the slab
     Imath::Box3i dim=p_gvg->bounds();
@@ -309,7 +305,6 @@ std::vector<Imath::V3i> SlabToolState::voxelsAffected()
             }
             break;
     }
-    return voxels;
 }
 
 
@@ -324,6 +319,7 @@ void LineToolState::execute()
         if (voxels.size())
         {
             m_startPoint = voxels[0];
+            invalidatePreview();
             decrementClicks();
         }
     }
@@ -331,47 +327,46 @@ void LineToolState::execute()
     // Second click fills in the line
     else if (m_clicksRemain == 1)
     {
-        p_undoManager->beginMacro("Line");
+        VoxelRegionEdit edit(p_gvg);
         for (size_t i = 0; i < voxels.size(); i++)
         {
-            p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+            edit.set(voxels[i], m_color, m_index);
         }
-        p_undoManager->endMacro();
+        p_undoManager->commitRegion(edit, "Line");
         decrementClicks();
     }
 }
 
 
-std::vector<Imath::V3i> LineToolState::voxelsAffected()
+// Every line starts at the same cell, so a new end point only changes the
+// cells after the first one where the walks part
+bool LineToolState::updatePreview(const RayHit& hit, std::vector<Imath::V3i>& cells)
 {
-    std::vector<Imath::V3i> voxels;
+    std::vector<Imath::V3i>& walk = m_scratch.cells;
+    walk.clear();
+    affectedCells(hit, walk);
 
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
+    size_t same = 0;
+    while (same < walk.size() && same < cells.size() && walk[same] == cells[same])
+        same++;
 
-    Imath::V3i intersect;
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            // Hit a voxel at the close edge of the grid?  Abort.
-            if (i == 0)
-                return voxels;
+    m_previewRemoved.assign(cells.begin() + same, cells.end());
+    m_previewAdded.assign(walk.begin() + same, walk.end());
 
-            // Hit a voxel in the middle?  Return previous voxel.
-            intersect = intersects[i-1];
-            break;
-        }
+    cells.resize(same);
+    cells.insert(cells.end(), m_previewAdded.begin(), m_previewAdded.end());
+    return true;
+}
 
-        // Didn't hit anything?  Just return the last voxel.
-        if (i == intersects.size()-1)
-        {
-            intersect = intersects[i];
-            break;
-        }
-    }
+
+void LineToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
+{
+    // The voxel in front of the first hit, or the last one if nothing was
+    // hit.  Abort if the hit is at the close edge of the grid.
+    if (!hit.valid || !hit.hasPrev)
+        return;
+
+    const Imath::V3i intersect = hit.prev;
 
     if (m_clicksRemain == 2)
     {
@@ -391,17 +386,10 @@ std::vector<Imath::V3i> LineToolState::voxelsAffected()
         else
         {
             // Trim off the end, making it a ray segment instead of an entire ray
-            std::vector<Imath::V3i> initialInts = rayIntersection(ray);
-            for (size_t i = 0; i < initialInts.size(); i++)
-            {
-                voxels.push_back(initialInts[i]);
-                if (initialInts[i] == intersect)
-                    break;
-            }
+            CollectUntil collect(voxels, intersect);
+            walk_ray(ray * p_gvg->transform().inverse(), m_editBounds, collect);
         }
     }
-
-    return voxels;
 }
 
 
@@ -416,6 +404,7 @@ void BoxToolState::execute()
         if (voxels.size())
         {
             m_startPoint = voxels[0];
+            invalidatePreview();
             decrementClicks();
         }
     }
@@ -423,64 +412,104 @@ void BoxToolState::execute()
     // Second click fills in the box
     else if (m_clicksRemain == 1)
     {
-        p_undoManager->beginMacro("Box");
+        VoxelRegionEdit edit(p_gvg);
         for (size_t i = 0; i < voxels.size(); i++)
         {
-            p_undoManager->setVoxelColor(p_gvg, voxels[i], m_color, m_index);
+            edit.set(voxels[i], m_color, m_index);
         }
-        p_undoManager->endMacro();
+        p_undoManager->commitRegion(edit, "Box");
         decrementClicks();
     }
 }
 
 
-std::vector<Imath::V3i> BoxToolState::voxelsAffected()
+// Cells of the preview, a single cell before the first click
+bool BoxToolState::boxOf(const RayHit& hit, Imath::Box3i& box)
 {
-    std::vector<Imath::V3i> voxels;
+    // The voxel in front of the first hit, or the last one if nothing was
+    // hit.  Abort if the hit is at the close edge of the grid.
+    if (!hit.valid || !hit.hasPrev)
+        return false;
 
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
+    const Imath::V3i intersect = hit.prev;
 
-    Imath::V3i intersect;
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            // Hit a voxel at the close edge of the grid?  Abort.
-            if (i == 0)
-                return voxels;
+    box = Imath::Box3i(intersect);
+    if (m_clicksRemain == 1)
+        box.extendBy(m_startPoint);
 
-            // Hit a voxel in the middle?  Return previous voxel.
-            intersect = intersects[i-1];
-            break;
-        }
+    return true;
+}
 
-        // Didn't hit anything?  Just return the last voxel.
-        if (i == intersects.size()-1)
-        {
-            intersect = intersects[i];
-            break;
-        }
-    }
 
-    if (m_clicksRemain == 2)
+static void append_box_cells(const Imath::Box3i& box, std::vector<Imath::V3i>& voxels)
+{
+  for (int z=box.min.z; z<=box.max.z; ++z)
+    for (int y=box.min.y; y<=box.max.y; ++y)
+      for (int x=box.min.x; x<=box.max.x; ++x)
+        voxels.push_back(Imath::V3i(x, y, z));
+}
+
+
+// Cells of box that aren't in other: the slabs sticking out of other on X,
+// then those on Y within its X range, then those on Z
+static void append_box_difference(const Imath::Box3i& box, const Imath::Box3i& other, std::vector<Imath::V3i>& voxels)
+{
+  Imath::Box3i rest=box;
+  for (int a=0; a<3; ++a)
+  {
+    if (rest.min[a]<other.min[a])
     {
-        voxels.push_back(intersect);
+      Imath::Box3i slab=rest;
+      slab.max[a]=std::min(rest.max[a], other.min[a]-1);
+      append_box_cells(slab, voxels);
     }
-    else if (m_clicksRemain == 1)
+    if (rest.max[a]>other.max[a])
     {
-      Imath::Box3i box(m_startPoint);
-      box.extendBy(intersect);
+      Imath::Box3i slab=rest;
+      slab.min[a]=std::max(rest.min[a], other.max[a]+1);
+      append_box_cells(slab, voxels);
+    }
 
-      for (int z=box.min.z; z<=box.max.z; ++z)
-        for (int y=box.min.y; y<=box.max.y; ++y)
-          for (int x=box.min.x; x<=box.max.x; ++x)
-            voxels.push_back(Imath::V3i(x, y, z));
+    rest.min[a]=std::max(rest.min[a], other.min[a]);
+    rest.max[a]=std::min(rest.max[a], other.max[a]);
+    if (rest.min[a]>rest.max[a]) return;
+  }
+}
+
+
+
+void BoxToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
+{
+    Imath::Box3i box;
+    if (boxOf(hit, box))
+        append_box_cells(box, voxels);
+}
+
+
+// Only the slabs between the old and the new box are walked.  Cells that
+// left are dropped in one pass over the list, new ones go at the end.
+bool BoxToolState::updatePreview(const RayHit& hit, std::vector<Imath::V3i>& cells)
+{
+    const Imath::Box3i old = m_previewBox;
+    if (!boxOf(hit, m_previewBox))
+        m_previewBox.makeEmpty();
+
+    const Imath::Box3i& box = m_previewBox;
+    if (old.isEmpty() || box.isEmpty() || !old.intersects(box))
+    {
+        cells.clear();
+        if (!box.isEmpty())
+            append_box_cells(box, cells);
+        return false;
     }
 
-    return voxels;
+    append_box_difference(old, box, m_previewRemoved);
+    append_box_difference(box, old, m_previewAdded);
+
+    if (!m_previewRemoved.empty())
+        cells.erase(std::remove_if(cells.begin(), cells.end(), OutsideBox(box)), cells.end());
+    cells.insert(cells.end(), m_previewAdded.begin(), m_previewAdded.end());
+    return true;
 }
 
 
@@ -501,14 +530,14 @@ void ExtrudeToolState::doExtrude(bool is_erase)
 {
   std::vector<Imath::V3i> voxels = voxelsAffected();
 
-  p_undoManager->beginMacro(is_erase?"Extrude erase":"Extrude");
+  VoxelRegionEdit edit(p_gvg);
 
   if (is_erase)
   {
     for (size_t i=0; i<voxels.size(); i++)
     {
       Imath::V3i sp=voxels[i]-m_dir;
-      p_undoManager->setVoxelColor(p_gvg, sp, SproxelColor(0, 0, 0, 0), 0);
+      edit.set(sp, SproxelColor(0, 0, 0, 0), 0);
     }
   }
   else
@@ -518,75 +547,29 @@ void ExtrudeToolState::doExtrude(bool is_erase)
       Imath::V3i sp=voxels[i]-m_dir;
       SproxelColor color=p_gvg->get(sp);
       int index=p_gvg->getInd(sp);
-      p_undoManager->setVoxelColor(p_gvg, voxels[i], color, index);
+      edit.set(voxels[i], color, index);
     }
   }
 
-  p_undoManager->endMacro();
+  p_undoManager->commitRegion(edit, is_erase?"Extrude erase":"Extrude");
 
   decrementClicks();
 }
 
 
-void ExtrudeToolState::fillExtrudeMap(GameVoxelGrid<char> &map, const Imath::V3i &mapOfs,
-  const Imath::V3i &pos, int axis)
+void ExtrudeToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-  Imath::V3i mp=pos+mapOfs;
-  if (mp.x<0 || mp.y<0 || mp.z<0) return;
-
-  const Imath::V3i &size=map.cellDimensions();
-  if (mp.x>=size.x || mp.y>=size.y || mp.z>=size.z) return;
-
-  if (map.get(mp)!=0) return; // already marked
-
-  if (p_gvg->get(pos).a!=0 || p_gvg->get(pos-m_dir).a==0)
-  {
-    // out of extruded area, mark and stop
-    map.set(mp, 2);
-    return;
-  }
-
-  int paxis=1, saxis=2;
-  if (axis==1) paxis=0;
-  else if (axis==2) saxis=0;
-
-  // mark area
-  map.set(mp, 1);
-
-  //== TODO: use linear fill instead, for less recursion depth
-  Imath::V3i newPos=pos;
-  newPos[paxis]--;
-  fillExtrudeMap(map, mapOfs, newPos, axis);
-  newPos[paxis]+=2;
-  fillExtrudeMap(map, mapOfs, newPos, axis);
-  newPos[paxis]--;
-  newPos[saxis]--;
-  fillExtrudeMap(map, mapOfs, newPos, axis);
-  newPos[saxis]+=2;
-  fillExtrudeMap(map, mapOfs, newPos, axis);
-}
-
-
-std::vector<Imath::V3i> ExtrudeToolState::voxelsAffected()
-{
-  std::vector<Imath::V3i> voxels;
-
-  std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-  if (intersects.size() == 0) return voxels;
+  if (!hit.valid) return;
 
   // Get the position to fill from
-  Imath::V3i fillPos=intersects[0];
+  Imath::V3i fillPos=hit.first;
 
-  for (size_t i = 0; i < intersects.size(); i++)
+  if (hit.hit)
   {
-    if (p_gvg->get(intersects[i]).a != 0.0f)
-    {
-      if (i==0) return voxels; // can't extrude beyond bounds
+    if (!hit.hasPrev) return; // can't extrude beyond bounds
 
-      fillPos=intersects[i-1];
-      m_dir=fillPos-intersects[i];
-      break;
-    }
+    fillPos=hit.prev;
+    m_dir=fillPos-hit.cell;
   }
 
   // determine axis
@@ -594,28 +577,11 @@ std::vector<Imath::V3i> ExtrudeToolState::voxelsAffected()
   if (m_dir.y!=0) axis=1;
   else if (m_dir.z!=0) axis=2;
 
-  // allocate map
-  Imath::Box3i bounds=p_gvg->bounds();
-  Imath::V3i mapSize=bounds.size()+Imath::V3i(1);
-  mapSize[axis]=1;
-  Imath::V3i mapOfs=-bounds.min;
-  mapOfs[axis]=-fillPos[axis];
-
-  GameVoxelGrid<char> map(mapSize);
-  map.setAll(0);
-
-  fillExtrudeMap(map, mapOfs, fillPos, axis);
+  // fill the slice of the bounds containing fillPos
+  Imath::Box3i slice=p_gvg->bounds();
+  slice.min[axis]=slice.max[axis]=fillPos[axis];
 
-  // get voxels from map
-  for (int z=0; z<mapSize.z; ++z)
-    for (int y=0; y<mapSize.y; ++y)
-      for (int x=0; x<mapSize.x; ++x)
-      {
-        if (map.get(Imath::V3i(x, y, z))!=1) continue;
-        voxels.push_back(Imath::V3i(x, y, z)-mapOfs);
-      }
-
-  return voxels;
+  flood_fill(slice, fillPos, Extrudable(p_gvg, m_dir), voxels, m_scratch.flood);
 }
 
 
@@ -626,26 +592,11 @@ void DropperToolState::execute()
 }
 
 
-std::vector<Imath::V3i> DropperToolState::voxelsAffected()
+void DropperToolState::affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels)
 {
-    std::vector<Imath::V3i> voxels;
-
-    // Intersect and check
-    std::vector<Imath::V3i> intersects = rayIntersection(m_ray);
-    if (intersects.size() == 0)
-        return voxels;
-
     // Get the first voxel hit
-    for (size_t i = 0; i < intersects.size(); i++)
-    {
-        if (p_gvg->get(intersects[i]).a != 0.0f)
-        {
-            voxels.push_back(intersects[i]);
-            break;
-        }
-    }
-
-    return voxels;
+    if (hit.hit)
+        voxels.push_back(hit.cell);
 }
 
 
@@ -3,6 +3,7 @@
 
 #include "Global.h"
 #include "UndoManager.h"
+#include "FloodFill.h"
 
 #include <ImathVec.h>
 #include <ImathColor.h>
@@ -19,16 +20,42 @@ public:
                                  m_color(Imath::Color4f(0.0f, 0.0f, 0.0f, 0.0f)),
                                  m_index(0),
                                  p_gvg(NULL),
-                                 m_supportsDrag(false) {}
+                                 m_supportsDrag(false),
+                                 m_previewValid(false),
+                                 m_previewSerial(0),
+                                 m_previewBase(0),
+                                 m_previewDelta(false) {}
 
     virtual ~ToolState() {}
 
     virtual void execute() = 0;
     virtual SproxelTool type() = 0;
-    virtual std::vector<Imath::V3i> voxelsAffected() = 0;
+
+    // Cells the tool acts on for the current ray
+    virtual std::vector<Imath::V3i> voxelsAffected()
+    {
+        std::vector<Imath::V3i> voxels;
+        affectedCells(castRay(m_ray), voxels);
+        return voxels;
+    }
 
     virtual void executeErase() {}
 
+    // The cells voxelsAffected() would give, for drawing.  Kept until the
+    // ray hits another cell or the tool state changes.  Call
+    // invalidatePreview() when the sprite contents change.
+    const std::vector<Imath::V3i>& preview();
+    void invalidatePreview() { m_previewValid = false; }
+
+    // Each list preview() makes gets a serial, unique over all tools.  If
+    // previewIsDelta(), the list was made from the one of previewBase() by
+    // removing previewRemoved() and adding previewAdded().
+    unsigned previewSerial() const { return m_previewSerial; }
+    unsigned previewBase() const { return m_previewBase; }
+    bool previewIsDelta() const { return m_previewDelta; }
+    const std::vector<Imath::V3i>& previewRemoved() const { return m_previewRemoved; }
+    const std::vector<Imath::V3i>& previewAdded() const { return m_previewAdded; }
+
     const Imath::Line3d& ray() const { return m_ray; }
 
     void set(VoxelGridGroupPtr gvg, const Imath::Box3i &edit_bounds,
@@ -64,12 +91,66 @@ protected:
     VoxelGridGroupPtr p_gvg;
     bool m_supportsDrag;
 
+    // What the cached preview was made for
+    struct PreviewKey
+    {
+        const VoxelGridGroup* sprite;
+        Imath::M44d transform;
+        Imath::Box3i editBounds;
+        int clicksRemain;
+        RayHit hit;
+        Imath::Line3d ray;     // only compared if previewFollowsRay()
+    };
+
+    bool m_previewValid;
+    PreviewKey m_previewKey;
+    std::vector<Imath::V3i> m_preview;
+    unsigned m_previewSerial;
+    unsigned m_previewBase;
+    bool m_previewDelta;
+    std::vector<Imath::V3i> m_previewRemoved;
+    std::vector<Imath::V3i> m_previewAdded;
+
+    // Working memory kept for the life of the tool, so mouse moves don't
+    // allocate it again
+    struct Scratch
+    {
+        FloodFillScratch flood;
+        std::vector<Imath::V3i> cells;
+    };
+    Scratch m_scratch;
+
+    // Appends the cells the tool acts on for hit, the first hit of the
+    // current ray
+    virtual void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels) = 0;
+
+    // Recomputes the preview for the hit of the current ray.  cells holds
+    // the previous preview.  Tools that change it in place fill
+    // m_previewRemoved and m_previewAdded and return true, the default
+    // rebuilds it and returns false.
+    virtual bool updatePreview(const RayHit& hit, std::vector<Imath::V3i>& cells)
+    {
+        cells.clear();
+        affectedCells(hit, cells);
+        return false;
+    }
+
+    // True if the preview depends on the whole ray and not just the hit
+    virtual bool previewFollowsRay() const { return false; }
+
 
     std::vector<Imath::V3i> rayIntersection(const Imath::Line3d &worldRay)
     {
       Imath::Line3d localRay = worldRay * p_gvg->transform().inverse();
       return walk_ray(localRay, m_editBounds);
     }
+
+    // First non-empty voxel along the ray, stops at the hit
+    RayHit castRay(const Imath::Line3d &worldRay)
+    {
+      Imath::Line3d localRay = worldRay * p_gvg->transform().inverse();
+      return cast_ray(localRay, m_editBounds, *p_gvg);
+    }
 };
 
 
@@ -87,7 +168,9 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_SPLAT; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 };
 
 
@@ -105,13 +188,9 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_FLOOD; }
-    std::vector<Imath::V3i> voxelsAffected();
 
-private:
-    void setNeighborsRecurse(const Imath::V3i& alreadySet,
-                             const Imath::Color4f& repColor,
-                             const Imath::Color4f& newColor,
-                             int newIndex);
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 };
 
 
@@ -129,7 +208,9 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_ERASER; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 };
 
 
@@ -148,7 +229,9 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_REPLACE; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 };
 
 
@@ -167,6 +250,10 @@ public:
     void execute();
     SproxelTool type() { return TOOL_RAY; }
     std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
+    bool previewFollowsRay() const { return true; }
 };
 
 
@@ -185,12 +272,15 @@ public:
 
     virtual void setAxis(SproxelAxis axis)
     {
+        if (axis != m_workingAxis) invalidatePreview();
         m_workingAxis = axis;
     }
 
     void execute();
     SproxelTool type() { return TOOL_SLAB; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 
 private:
     SproxelAxis m_workingAxis;
@@ -211,7 +301,10 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_LINE; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
+    bool updatePreview(const RayHit& hit, std::vector<Imath::V3i>& cells);
 
 private:
     Imath::V3i m_startPoint;
@@ -232,10 +325,16 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_BOX; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
+    bool updatePreview(const RayHit& hit, std::vector<Imath::V3i>& cells);
 
 private:
     Imath::V3i m_startPoint;
+    Imath::Box3i m_previewBox; // box held by the preview cells, empty if none
+
+    bool boxOf(const RayHit& hit, Imath::Box3i& box);
 };
 
 
@@ -254,15 +353,14 @@ public:
     void execute();
     void executeErase();
     SproxelTool type() { return TOOL_EXTRUDE; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 
 private:
     Imath::V3i m_dir;
 
     void doExtrude(bool is_erase);
-
-    void fillExtrudeMap(GameVoxelGrid<char> &map, const Imath::V3i &mapOfs,
-      const Imath::V3i &pos, int axis);
 };
 
 
@@ -281,7 +379,9 @@ public:
 
     void execute();
     SproxelTool type() { return TOOL_DROPPER; }
-    std::vector<Imath::V3i> voxelsAffected();
+
+protected:
+    void affectedCells(const RayHit& hit, std::vector<Imath::V3i>& voxels);
 };
 
 
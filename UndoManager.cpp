@@ -1,16 +1,35 @@
 #include "UndoManager.h"
 
+#include <string.h>
+
+#include <QTemporaryFile>
+#include <QDataStream>
+#include <QDir>
+#include <QTimer>
+
 
 UndoManager::UndoManager()
+  : m_dataBytes(0), m_memoryBudget(0), m_damaged(false), m_lostChanges(false)
 {
     QObject::connect(&m_undoStack, SIGNAL(cleanChanged(bool)),
-                     this, SIGNAL(cleanChanged(bool)));
+                     this, SLOT(onStackCleanChanged(bool)));
+
+    // pushes, undo and redo all move the index, and may page data back in
+    QObject::connect(&m_undoStack, SIGNAL(indexChanged(int)),
+                     this, SLOT(enforceMemoryBudget()));
+}
+
+
+void UndoManager::onStackCleanChanged(bool clean)
+{
+  // after a lost history the project stays modified whatever the stack says
+  if (!m_lostChanges) emit cleanChanged(clean);
 }
 
 
 void UndoManager::onSpriteChanged(VoxelGridGroupPtr spr)
 {
-  emit spriteChanged(spr);
+  emit spriteChanged(spr, spr->takeDirtyBox());
 }
 
 
@@ -51,6 +70,15 @@ void UndoManager::changeEntireVoxelGrid(VoxelGridGroupPtr origGrid,
 }
 
 
+void UndoManager::changeLayer(VoxelGridGroupPtr spr, VoxelGridLayerPtr layer,
+                              const VoxelGridLayerPtr newLayer)
+{
+    if (!layer || !newLayer) return;
+
+    m_undoStack.push(new CmdChangeLayer(this, spr, layer, newLayer));
+}
+
+
 void UndoManager::setVoxelColor(VoxelGridGroupPtr sprite,
                                 const Imath::V3i& pos,
                                 const Imath::Color4f& color,
@@ -66,6 +94,121 @@ void UndoManager::setVoxelColor(VoxelGridGroupPtr sprite,
 }
 
 
+void UndoManager::setVoxelColors(VoxelGridGroupPtr sprite,
+                                 const std::vector<Imath::V3i>& voxels,
+                                 const Imath::Color4f& color,
+                                 int index)
+{
+    // Validity check
+    if (!sprite || voxels.empty()) return;
+
+    VoxelRegionEdit edit(sprite);
+    for (size_t i=0; i<voxels.size(); ++i)
+      edit.set(voxels[i], color, index);
+
+    commitRegion(edit, "Set voxels");
+}
+
+
+void UndoManager::commitRegion(VoxelRegionEdit &edit, const QString &name)
+{
+    if (edit.isEmpty()) return;
+
+    m_undoStack.push(new CmdSetVoxelRegion(this, edit, name));
+}
+
+
+static int countSpilled(const QUndoCommand *cmd)
+{
+  int n=0;
+
+  const CmdSetVoxelRegion *c=dynamic_cast<const CmdSetVoxelRegion*>(cmd);
+  if (c && c->isSpilled()) ++n;
+
+  for (int i=0; i<cmd->childCount(); ++i)
+    n+=countSpilled(cmd->child(i));
+
+  return n;
+}
+
+
+// Spills the command and its children while over budget, returns false when done.
+// Spilled commands take their data off the manager's running total.
+static bool spillCommand(const QUndoCommand *cmd, UndoManager &um)
+{
+  if (um.dataBytes()<=um.memoryBudget()) return false;
+
+  CmdSetVoxelRegion *c=dynamic_cast<CmdSetVoxelRegion*>(const_cast<QUndoCommand*>(cmd));
+  if (c && !c->isSpilled()) c->spill(um.spillFile());
+
+  for (int i=0; i<cmd->childCount(); ++i)
+    if (!spillCommand(cmd->child(i), um)) return false;
+
+  return um.dataBytes()>um.memoryBudget();
+}
+
+
+UndoManager::Stats UndoManager::stats() const
+{
+  Stats st;
+  st.numCommands=m_undoStack.count();
+  st.index=m_undoStack.index();
+
+  st.dataBytes=m_dataBytes;
+  for (int i=0; i<st.numCommands; ++i)
+    st.numSpilled+=countSpilled(m_undoStack.command(i));
+
+  st.spilledBytes=m_spillFile.size();
+  return st;
+}
+
+
+void UndoManager::setMemoryBudget(size_t budget)
+{
+  m_memoryBudget=budget;
+  enforceMemoryBudget();
+}
+
+
+void UndoManager::enforceMemoryBudget()
+{
+  if (!m_memoryBudget || m_dataBytes<=m_memoryBudget) return;
+
+  // oldest first
+  for (int i=0; i<m_undoStack.count(); ++i)
+    if (!spillCommand(m_undoStack.command(i), *this)) break;
+}
+
+
+void UndoManager::historyDamaged()
+{
+  if (m_damaged) return;
+  m_damaged=true;
+
+  // the stack is in the middle of undo or redo, it can't be cleared here
+  QTimer::singleShot(0, this, SLOT(dropDamagedHistory()));
+}
+
+
+void UndoManager::dropDamagedHistory()
+{
+  if (!m_damaged) return;
+
+  qWarning("Undo: failed to read the undo history back, it was cleared");
+  m_undoStack.clear();
+  m_spillFile.reset();
+  m_damaged=false;
+
+  if (!m_lostChanges)
+  {
+    m_lostChanges=true;
+    emit cleanChanged(false);
+  }
+
+  emit historyLost();
+}
+
+
 void UndoManager::setPaletteColor(ColorPalettePtr pal, int index, const SproxelColor &color)
 {
   if (!pal) return;
@@ -74,6 +217,14 @@ void UndoManager::setPaletteColor(ColorPalettePtr pal, int index, const SproxelC
 }
 
 
+void UndoManager::addPalette(SproxelProjectPtr proj, ColorPalettePtr pal)
+{
+  if (!proj || !pal) return;
+
+  m_undoStack.push(new CmdAddPalette(proj, pal));
+}
+
+
 void UndoManager::addSprite(SproxelProjectPtr proj, int at, VoxelGridGroupPtr spr)
 {
   if (!proj || !spr) return;
@@ -114,18 +265,25 @@ void UndoManager::endMacro()
 void UndoManager::clear()
 {
     m_undoStack.clear();
+    m_spillFile.reset();
+    m_damaged=false;
+    m_lostChanges=false;
 }
 
 
 void UndoManager::setClean()
 {
+    // the stack only says so if it wasn't clean already
+    const bool wasLost=m_lostChanges && m_undoStack.isClean();
+    m_lostChanges=false;
     m_undoStack.setClean();
+    if (wasLost) emit cleanChanged(true);
 }
 
 
 bool UndoManager::isClean() const
 {
-    return m_undoStack.isClean();
+    return !m_lostChanges && m_undoStack.isClean();
 }
 
 
@@ -139,3 +297,405 @@ void UndoManager::redo()
 {
     m_undoStack.redo();
 }
+
+
+//-*****************************************************************************
+// Brick encoding: one header byte, 0 for raw cells, 1 for runs of
+// (quint16 count, cell bytes).  Raw is used when runs would not be smaller.
+
+static QByteArray encodeBrick(const char *data, int size, int cellSize)
+{
+  QByteArray out;
+  out.reserve(size/8+16);
+  out.append(char(1));
+
+  const int numCells=size/cellSize;
+  for (int i=0; i<numCells; )
+  {
+    const char *cell=data+i*cellSize;
+    int n=1;
+    while (i+n<numCells && n<0xFFFF && memcmp(cell, data+(i+n)*cellSize, cellSize)==0) ++n;
+
+    const quint16 count=quint16(n);
+    out.append((const char*)&count, sizeof(count));
+    out.append(cell, cellSize);
+    i+=n;
+
+    if (out.size()>size) break;
+  }
+
+  if (out.size()>size)
+  {
+    out.resize(0);
+    out.append(char(0));
+    out.append(data, size);
+  }
+
+  out.squeeze();
+  return out;
+}
+
+
+static void decodeBrick(const QByteArray &in, char *data, int size, int cellSize)
+{
+  if (in.isEmpty()) { memset(data, 0, size); return; }
+
+  const char *p=in.constData()+1;
+  if (in[0]==0) { memcpy(data, p, size); return; }
+
+  const char *end=in.constData()+in.size();
+  char *dst=data, *dstEnd=data+size;
+  while (p<end && dst<dstEnd)
+  {
+    quint16 count;
+    memcpy(&count, p, sizeof(count));
+    p+=sizeof(count);
+    for (int i=0; i<count && dst<dstEnd; ++i, dst+=cellSize)
+      memcpy(dst, p, cellSize);
+    p+=cellSize;
+  }
+}
+
+
+static void xorBytes(char *dst, const char *src, int size)
+{
+  for (int i=0; i<size; ++i) dst[i]^=src[i];
+}
+
+
+//-*****************************************************************************
+UndoSpillFile::UndoSpillFile()
+  : m_file(NULL)
+{
+}
+
+
+UndoSpillFile::~UndoSpillFile()
+{
+  delete m_file;
+}
+
+
+bool UndoSpillFile::store(const QByteArray &data, qint64 &offset, int &size)
+{
+  if (!m_file)
+  {
+    m_file=new QTemporaryFile(QDir::tempPath()+"/sproxel_undo_XXXXXX");
+    if (!m_file->open()) { delete m_file; m_file=NULL; return false; }
+  }
+
+  QByteArray packed=qCompress(data);
+
+  // first free range that fits, or the end of the file
+  offset=m_file->size();
+  for (QMap<qint64, qint64>::iterator it=m_free.begin(); it!=m_free.end(); ++it)
+    if (it.value()>=packed.size())
+    {
+      offset=it.key();
+      const qint64 rest=it.value()-packed.size();
+      m_free.erase(it);
+      if (rest>0) m_free.insert(offset+packed.size(), rest);
+      break;
+    }
+
+  if (!m_file->seek(offset) || m_file->write(packed)!=packed.size())
+  {
+    release(offset, packed.size());
+    return false;
+  }
+
+  size=packed.size();
+  return true;
+}
+
+
+void UndoSpillFile::release(qint64 offset, int size)
+{
+  if (!m_file || size<=0) return;
+
+  // join the free neighbours
+  qint64 end=offset+size;
+  QMap<qint64, qint64>::iterator next=m_free.find(end);
+  if (next!=m_free.end())
+  {
+    end+=next.value();
+    m_free.erase(next);
+  }
+
+  QMap<qint64, qint64>::iterator prev=m_free.lowerBound(offset);
+  if (prev!=m_free.begin())
+  {
+    --prev;
+    if (prev.key()+prev.value()==offset)
+    {
+      offset=prev.key();
+      m_free.erase(prev);
+    }
+  }
+
+  if (end>=m_file->size())
+    m_file->resize(offset);
+  else
+    m_free.insert(offset, end-offset);
+}
+
+
+bool UndoSpillFile::load(qint64 offset, int size, QByteArray &data)
+{
+  if (!m_file || !m_file->seek(offset)) return false;
+
+  const QByteArray packed=m_file->read(size);
+  if (packed.size()!=size) return false;
+
+  // qUncompress gives an empty array on errors; the first four bytes hold
+  // the unpacked size, so an empty payload is told apart by that
+  data=qUncompress(packed);
+  if (data.isEmpty() && (packed.size()<4 || packed[0] || packed[1] || packed[2] || packed[3]))
+    return false;
+
+  return true;
+}
+
+
+qint64 UndoSpillFile::size() const
+{
+  return m_file ? m_file->size() : 0;
+}
+
+
+void UndoSpillFile::reset()
+{
+  delete m_file;
+  m_file=NULL;
+  m_free.clear();
+}
+
+
+static quint64 brickKey(const Imath::V3i &bc)
+{
+  const quint64 m=(1<<21)-1;
+  return ((quint64(bc.x)&m)<<42) | ((quint64(bc.y)&m)<<21) | (quint64(bc.z)&m);
+}
+
+
+//-*****************************************************************************
+VoxelRegionEdit::VoxelRegionEdit(VoxelGridGroupPtr spr)
+  : m_sprite(spr), m_dataType(VoxelGridLayer::TYPE_RGB), m_brickSize(0)
+{
+  if (m_sprite) m_layer=m_sprite->curLayer();
+  if (m_layer) m_oldBounds=m_layer->bounds();
+}
+
+
+void VoxelRegionEdit::set(const Imath::V3i &at, const SproxelColor &color, int index)
+{
+  if (!m_layer) return;
+
+  // grow first, so the grid exists and its origin is fixed
+  Imath::Box3i box=m_layer->bounds();
+  if (!box.intersects(at))
+  {
+    box.extendBy(at);
+    m_layer->resize(box);
+  }
+
+  touch(m_layer->storageBrickOf(at));
+  m_layer->set(at, color, index);
+}
+
+
+void VoxelRegionEdit::touch(const Imath::V3i &bc)
+{
+  const quint64 key=brickKey(bc);
+  if (m_brickIndex.contains(key)) return;
+
+  if (!m_brickSize)
+  {
+    m_dataType=m_layer->dataType();
+    m_brickSize=m_layer->brickDataSize();
+  }
+
+  Snapshot snap;
+  snap.brick=bc;
+  snap.cells.resize(m_brickSize);
+  snap.allocated=m_layer->readBrick(bc, snap.cells.data());
+
+  m_brickIndex.insert(key, m_bricks.size());
+  m_bricks.push_back(snap);
+}
+
+
+//-*****************************************************************************
+CmdSetVoxelRegion::CmdSetVoxelRegion(UndoManager *mgr, VoxelRegionEdit &edit, const QString &name)
+  : m_manager(mgr), m_sprite(edit.m_sprite), m_layer(edit.m_layer),
+    m_oldBounds(edit.m_oldBounds), m_dataType(edit.m_dataType), m_brickSize(edit.m_brickSize), m_applied(true),
+    m_spilled(false), m_spillOffset(-1), m_spillSize(0), m_counted(0)
+{
+  m_newBounds=m_layer->bounds();
+
+  const int cellSize=m_brickSize/RgbBrickGrid::BRICK_CELLS;
+  QByteArray after(m_brickSize, 0);
+
+  m_bricks.reserve(edit.m_bricks.size());
+  for (int i=0; i<edit.m_bricks.size(); ++i)
+  {
+    VoxelRegionEdit::Snapshot &snap=edit.m_bricks[i];
+
+    BrickDelta d;
+    d.brick=snap.brick;
+    d.hadBefore=snap.allocated;
+    d.hasAfter=m_layer->readBrick(snap.brick, after.data());
+    d.before=encodeBrick(snap.cells.constData(), m_brickSize, cellSize);
+
+    xorBytes(snap.cells.data(), after.constData(), m_brickSize);
+    d.delta=encodeBrick(snap.cells.constData(), m_brickSize, cellSize);
+
+    m_bricks.push_back(d);
+  }
+
+  edit.m_bricks.clear();
+  edit.m_brickIndex.clear();
+
+  setText(name);
+  m_manager->countBytes(m_counted, memoryUsage());
+}
+
+
+CmdSetVoxelRegion::~CmdSetVoxelRegion()
+{
+  m_manager->countBytes(m_counted, 0);
+  if (m_spillOffset>=0) m_manager->spillFile().release(m_spillOffset, m_spillSize);
+}
+
+
+bool CmdSetVoxelRegion::spill(UndoSpillFile &file)
+{
+  if (m_spilled) return true;
+
+  // data paged back in keeps its place in the file until the command goes
+  if (m_spillOffset<0)
+  {
+    QByteArray data;
+    QDataStream out(&data, QIODevice::WriteOnly);
+    for (int i=0; i<m_bricks.size(); ++i)
+      out << m_bricks[i].before << m_bricks[i].delta;
+
+    if (!file.store(data, m_spillOffset, m_spillSize)) { m_spillOffset=-1; return false; }
+  }
+
+  for (int i=0; i<m_bricks.size(); ++i)
+  {
+    m_bricks[i].before=QByteArray();
+    m_bricks[i].delta=QByteArray();
+  }
+
+  m_spilled=true;
+  m_manager->countBytes(m_counted, memoryUsage());
+  return true;
+}
+
+
+bool CmdSetVoxelRegion::pageIn()
+{
+  if (!m_spilled) return true;
+
+  QByteArray data;
+  if (!m_manager->spillFile().load(m_spillOffset, m_spillSize, data)) return false;
+
+  // encoded bricks are never empty, an empty one would decode to zeros
+  QVector<QByteArray> arrays(m_bricks.size()*2);
+  QDataStream in(data);
+  for (int i=0; i<arrays.size(); ++i)
+  {
+    in >> arrays[i];
+    if (in.status()!=QDataStream::Ok || arrays[i].isEmpty()) return false;
+  }
+
+  for (int i=0; i<m_bricks.size(); ++i)
+  {
+    m_bricks[i].before=arrays[i*2];
+    m_bricks[i].delta=arrays[i*2+1];
+  }
+
+  m_spilled=false;
+  m_manager->countBytes(m_counted, memoryUsage());
+  return true;
+}
+
+
+void CmdSetVoxelRegion::apply(bool after)
+{
+  // Bricks of another type would be misread.  Conversions are undo steps
+  // of their own, so this only happens after the layer was changed behind
+  // the stack's back; the change is dropped rather than corrupting it.
+  if (m_layer->dataType()!=m_dataType || m_layer->brickDataSize()!=m_brickSize)
+  {
+    qWarning("Undo: layer data type changed, voxel change skipped");
+    return;
+  }
+
+  // Applying without the data would wipe the bricks, so the command stays
+  // spilled and the history is dropped instead
+  if (!pageIn())
+  {
+    qWarning("Undo: can't read the voxel change back from the spill file");
+    m_manager->historyDamaged();
+    return;
+  }
+
+  const int cellSize=m_brickSize/RgbBrickGrid::BRICK_CELLS;
+  QByteArray cells(m_brickSize, 0), delta(m_brickSize, 0);
+
+  if (after) m_layer->restoreBounds(m_newBounds);
+
+  for (int i=0; i<m_bricks.size(); ++i)
+  {
+    const BrickDelta &d=m_bricks[i];
+
+    if (after ? !d.hasAfter : !d.hadBefore)
+    {
+      m_layer->writeBrick(d.brick, NULL);
+      continue;
+    }
+
+    decodeBrick(d.before, cells.data(), m_brickSize, cellSize);
+    if (after)
+    {
+      decodeBrick(d.delta, delta.data(), m_brickSize, cellSize);
+      xorBytes(cells.data(), delta.constData(), m_brickSize);
+    }
+
+    m_layer->writeBrick(d.brick, cells.constData());
+  }
+
+  if (!after) m_layer->restoreBounds(m_oldBounds);
+}
+
+
+size_t CmdSetVoxelRegion::memoryUsage() const
+{
+  size_t bytes=m_bricks.size()*sizeof(BrickDelta);
+  for (int i=0; i<m_bricks.size(); ++i)
+    bytes+=m_bricks[i].before.size()+m_bricks[i].delta.size();
+  return bytes;
+}
+
+
+void CmdSetVoxelRegion::redo()
+{
+  // the edit has already been written when the command is pushed
+  if (m_applied)
+    m_applied=false;
+  else
+    apply(true);
+
+  m_manager->onSpriteChanged(m_sprite);
+}
+
+
+void CmdSetVoxelRegion::undo()
+{
+  apply(false);
+
+  m_manager->onSpriteChanged(m_sprite);
+}
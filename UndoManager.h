@@ -7,10 +7,45 @@
 #include <QString>
 #include <QObject>
 #include <QVector>
+#include <QHash>
+#include <QMap>
+#include <QByteArray>
 #include <QUndoStack>
 #include <QUndoCommand>
 
 
+class VoxelRegionEdit;
+class QTemporaryFile;
+
+
+// Temporary file holding compressed undo payloads.  Space of released
+// payloads is reused, and cut off when it is at the end of the file.
+class UndoSpillFile
+{
+public:
+  UndoSpillFile();
+  ~UndoSpillFile();
+
+  // Compresses and writes data, returns false if the file can't be written
+  bool store(const QByteArray &data, qint64 &offset, int &size);
+  // Reads back what store() wrote, false if it can't be read or unpacked
+  bool load(qint64 offset, int size, QByteArray &data);
+
+  // The payload isn't needed any more
+  void release(qint64 offset, int size);
+
+  qint64 size() const;
+  void reset();
+
+private:
+  QTemporaryFile *m_file;
+  QMap<qint64, qint64> m_free; // unused ranges, offset to size
+
+  UndoSpillFile(const UndoSpillFile&);
+  UndoSpillFile& operator=(const UndoSpillFile&);
+};
+
+
 // A wrapper class for Sproxel.
 // Allows for an easy subset of undo/redo operations.
 class UndoManager : public QObject
@@ -27,13 +62,30 @@ public:
     void changeEntireVoxelGrid(VoxelGridGroupPtr origGrid,
                                const VoxelGridGroupPtr newGrid);
 
+    // Replaces the contents of layer with those of newLayer, e.g. after a
+    // change of the data type.  spr gets the change signal, it may be NULL
+    // for layers that aren't part of a sprite.
+    void changeLayer(VoxelGridGroupPtr spr, VoxelGridLayerPtr layer,
+                     const VoxelGridLayerPtr newLayer);
+
     void setVoxelColor(VoxelGridGroupPtr origGrid,
                        const Imath::V3i& at,
                        const Imath::Color4f& color,
                        int index);
 
+    // Same color for many voxels, as a single region command
+    void setVoxelColors(VoxelGridGroupPtr origGrid,
+                        const std::vector<Imath::V3i>& voxels,
+                        const Imath::Color4f& color,
+                        int index);
+
+    // Pushes the changes collected by edit as one undo step
+    void commitRegion(VoxelRegionEdit &edit, const QString &name);
+
     void setPaletteColor(ColorPalettePtr pal, int index, const SproxelColor &color);
 
+    void addPalette(SproxelProjectPtr proj, ColorPalettePtr pal);
+
     void addSprite(SproxelProjectPtr proj, int at, VoxelGridGroupPtr spr);
     void removeSprite(SproxelProjectPtr proj, int at);
 
@@ -49,6 +101,44 @@ public:
     void setClean();
     bool isClean() const;
 
+    struct Stats
+    {
+      int numCommands;     // top-level commands on the stack
+      int index;           // commands currently applied
+      size_t dataBytes;    // voxel data held in memory by the commands
+      int numSpilled;      // commands with their payload on disk
+      qint64 spilledBytes; // size of the spill file
+
+      Stats() : numCommands(0), index(0), dataBytes(0), numSpilled(0), spilledBytes(0) {}
+    };
+
+    // Memory held by the undo history.  Voxel bricks shared with live
+    // sprites or other commands are counted proportionally, as they were
+    // shared when the command was made.
+    Stats stats() const;
+
+    size_t dataBytes() const { return m_dataBytes; }
+
+    // Keeps the running total of command data up to date.  counted is what
+    // the command added so far, it's set to now.
+    void countBytes(size_t &counted, size_t now)
+    {
+      m_dataBytes+=now-counted;
+      counted=now;
+    }
+
+    // When the history holds more than budget bytes, payloads of the oldest
+    // commands are moved to a temporary file until it fits.  0 disables it.
+    void setMemoryBudget(size_t budget);
+    size_t memoryBudget() const { return m_memoryBudget; }
+
+    UndoSpillFile& spillFile() { return m_spillFile; }
+
+    // A command couldn't read its data back, so the stack no longer matches
+    // the sprites.  The history is cleared once the current step is done,
+    // and the project stays modified until setClean().
+    void historyDamaged();
+
     QAction* createUndoAction(QObject *parent, const QString &prefix)
       { return m_undoStack.createUndoAction(parent, prefix); }
 
@@ -64,15 +154,31 @@ public:
 
 signals:
     void cleanChanged(bool);
-    void spriteChanged(VoxelGridGroupPtr);
+    // box is the changed region in sprite voxel coordinates, empty when
+    // only non-voxel properties changed
+    void spriteChanged(VoxelGridGroupPtr, const Imath::Box3i &box);
     void paletteChanged(ColorPalettePtr);
     void beforeSpriteAdded(SproxelProjectPtr, int);
     void spriteAdded(SproxelProjectPtr, int);
     void beforeSpriteRemoved(SproxelProjectPtr, int, VoxelGridGroupPtr);
     void spriteRemoved(SproxelProjectPtr, int, VoxelGridGroupPtr);
+    // emitted after the history was cleared because of a spill file error
+    void historyLost();
+
+private slots:
+    void enforceMemoryBudget();
+    void dropDamagedHistory();
+    void onStackCleanChanged(bool);
 
 private:
+    // Commands count their data and release spilled payloads when they are
+    // deleted, so the stack has to go first
+    UndoSpillFile m_spillFile;
+    size_t m_dataBytes;
     QUndoStack m_undoStack;
+    size_t m_memoryBudget;
+    bool m_damaged;
+    bool m_lostChanges; // sprites hold changes the cleared stack knew about
 
 };
 
@@ -211,16 +317,54 @@ private:
 };
 
 
+// Add palette to project
+class CmdAddPalette : public QUndoCommand
+{
+public:
+
+  CmdAddPalette(SproxelProjectPtr proj, ColorPalettePtr pal)
+    : m_project(proj), m_palette(pal)
+  {
+    setText("Add palette");
+  }
+
+  virtual void redo()
+  {
+    m_project->palettes.push_back(m_palette);
+  }
+
+  virtual void undo()
+  {
+    const int i=m_project->palettes.lastIndexOf(m_palette);
+    if (i>=0) m_project->palettes.remove(i);
+  }
+
+private:
+  SproxelProjectPtr m_project;
+  ColorPalettePtr m_palette;
+};
+
+
 // ChangeEntireVoxelGrid (which cannot be Macro'ed)
 class CmdChangeEntireVoxelGrid : public QUndoCommand
 {
 public:
+    // Layer bricks are shared copy-on-write, so the snapshots only copy
+    // brick tables and share the voxel data until somebody edits it.
     CmdChangeEntireVoxelGrid(UndoManager *mgr, VoxelGridGroupPtr gvg, const VoxelGridGroupPtr newGrid) :
         m_manager(mgr), m_pGvg(gvg)
     {
         m_newGrid = new VoxelGridGroup(*newGrid);
         m_oldGrid = new VoxelGridGroup(*gvg);
         setText("Change grid");
+
+        m_counted = 0;
+        m_manager->countBytes(m_counted, memoryUsage());
+    }
+
+    ~CmdChangeEntireVoxelGrid()
+    {
+        m_manager->countBytes(m_counted, 0);
     }
 
     virtual void redo()
@@ -235,11 +379,66 @@ public:
         m_manager->onSpriteChanged(m_pGvg);
     }
 
+    size_t memoryUsage() const
+    {
+        return m_newGrid->memoryUsage()+m_oldGrid->memoryUsage();
+    }
+
 private:
     UndoManager *m_manager;
     VoxelGridGroupPtr m_pGvg;
     VoxelGridGroupPtr m_newGrid;
     VoxelGridGroupPtr m_oldGrid;
+    size_t m_counted;
+};
+
+
+// ChangeLayer, whole layer contents including the data type
+class CmdChangeLayer : public QUndoCommand
+{
+public:
+    // Bricks are shared with the snapshots as in CmdChangeEntireVoxelGrid
+    CmdChangeLayer(UndoManager *mgr, VoxelGridGroupPtr spr, VoxelGridLayerPtr layer,
+                   const VoxelGridLayerPtr newLayer) :
+        m_manager(mgr), m_sprite(spr), m_layer(layer)
+    {
+        m_newLayer = new VoxelGridLayer(*newLayer);
+        m_oldLayer = new VoxelGridLayer(*layer);
+        setText("Change layer");
+
+        m_counted = 0;
+        m_manager->countBytes(m_counted, memoryUsage());
+    }
+
+    ~CmdChangeLayer()
+    {
+        m_manager->countBytes(m_counted, 0);
+    }
+
+    virtual void redo()
+    {
+        *m_layer = *m_newLayer;
+        if (m_sprite) m_manager->onSpriteChanged(m_sprite);
+    }
+
+    virtual void undo()
+    {
+        *m_layer = *m_oldLayer;
+        if (m_sprite) m_manager->onSpriteChanged(m_sprite);
+    }
+
+    size_t memoryUsage() const
+    {
+        return m_newLayer->memoryUsage()+m_oldLayer->memoryUsage();
+    }
+
+private:
+    UndoManager *m_manager;
+    VoxelGridGroupPtr m_sprite;
+    VoxelGridLayerPtr m_layer;
+    VoxelGridLayerPtr m_newLayer;
+    VoxelGridLayerPtr m_oldLayer;
+    size_t m_counted;
 };
 
 
@@ -250,12 +449,19 @@ public:
 
   CmdSetVoxelColor(UndoManager *mgr, VoxelGridGroupPtr spr, VoxelGridLayerPtr layer,
     const Imath::V3i& pos, const Imath::Color4f &color, int index)
-    : m_manager(mgr), m_sprite(spr), m_layer(layer)
+    : m_manager(mgr), m_sprite(spr), m_layer(layer), m_counted(0)
   {
     m_changes.push_back(Change(pos, m_layer->getColor(pos), m_layer->getInd(pos), color, index));
     setText("Set voxel");
+    m_manager->countBytes(m_counted, memoryUsage());
   }
 
+  ~CmdSetVoxelColor()
+  {
+    m_manager->countBytes(m_counted, 0);
+  }
+
+
   virtual void redo()
   {
     for (int i=0; i<m_changes.size(); ++i)
@@ -280,6 +486,8 @@ public:
 
   virtual int id() const { return UndoManager::ID_SETVOXEL; }
 
+  size_t memoryUsage() const { return m_changes.size()*sizeof(Change); }
+
 protected:
 
   struct Change
@@ -301,6 +509,7 @@ protected:
     if (otherSet->m_layer!=m_layer || otherSet->m_sprite!=m_sprite) return false;
 
     m_changes+=otherSet->m_changes;
+    m_manager->countBytes(m_counted, memoryUsage());
     return true;
   }
 
@@ -309,6 +518,91 @@ private:
   VoxelGridGroupPtr m_sprite;
   VoxelGridLayerPtr m_layer;
   QVector<Change> m_changes;
+  size_t m_counted;
+};
+
+// Writes voxels of the current sprite layer directly, remembering every
+// touched brick as it was before the first write.  The changes must be
+// handed to UndoManager::commitRegion() afterwards.
+class VoxelRegionEdit
+{
+public:
+
+  VoxelRegionEdit(VoxelGridGroupPtr spr);
+
+  void set(const Imath::V3i &at, const SproxelColor &color, int index);
+
+  bool isEmpty() const { return m_bricks.isEmpty(); }
+
+  VoxelGridGroupPtr sprite() const { return m_sprite; }
+  VoxelGridLayerPtr layer() const { return m_layer; }
+
+private:
+  friend class CmdSetVoxelRegion;
+
+  struct Snapshot
+  {
+    Imath::V3i brick;
+    bool allocated;
+    QByteArray cells;
+  };
+
+  VoxelGridGroupPtr m_sprite;
+  VoxelGridLayerPtr m_layer;
+  Imath::Box3i m_oldBounds;
+  VoxelGridLayer::DataType m_dataType;
+  int m_brickSize;
+  QVector<Snapshot> m_bricks;
+  QHash<quint64, int> m_brickIndex;
+
+  void touch(const Imath::V3i &bc);
+};
+
+
+// Region change stored as RLE-compressed bricks: the old contents and the
+// XOR delta to the new ones.  Applied with whole-brick copies, so the layer
+// must still hold the data type the bricks were read from.  Type changes go
+// through CmdChangeLayer, which keeps the stack in order.
+class CmdSetVoxelRegion : public QUndoCommand
+{
+public:
+
+  CmdSetVoxelRegion(UndoManager *mgr, VoxelRegionEdit &edit, const QString &name);
+  ~CmdSetVoxelRegion();
+
+  virtual void redo();
+  virtual void undo();
+
+  size_t memoryUsage() const;
+
+  // Moves the brick data to the spill file, it's loaded back when needed
+  bool spill(UndoSpillFile &file);
+  bool isSpilled() const { return m_spilled; }
+
+private:
+  struct BrickDelta
+  {
+    Imath::V3i brick;
+    bool hadBefore, hasAfter;
+    QByteArray before; // RLE of the old cells
+    QByteArray delta;  // RLE of old XOR new
+  };
+
+  UndoManager *m_manager;
+  VoxelGridGroupPtr m_sprite;
+  VoxelGridLayerPtr m_layer;
+  Imath::Box3i m_oldBounds, m_newBounds;
+  VoxelGridLayer::DataType m_dataType;
+  int m_brickSize;
+  QVector<BrickDelta> m_bricks;
+  bool m_applied; // the edit already wrote the new data
+  bool m_spilled;
+  qint64 m_spillOffset; // -1 if never written to the spill file
+  int m_spillSize;
+  size_t m_counted;
+
+  void apply(bool after);
+  bool pageIn();
 };
 
 #endif
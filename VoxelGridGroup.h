@@ -2,6 +2,7 @@
 #define __VOXEL_GRID_GROUP_H__
 
 
+#include <string.h>
 #include <ImathBox.h>
 #include <ImathVec.h>
 #include <ImathColor.h>
@@ -11,6 +12,8 @@
 #include <QExplicitlySharedDataPointer>
 
 #include "GameVoxelGrid.h"
+#include "ChunkedVoxelGrid.h"
+#include "OccupancyMask.h"
 #include "RayWalk.h"
 
 
@@ -19,15 +22,50 @@
 
 typedef Imath::Color4f SproxelColor;
 typedef unsigned char  SproxelIndex;
+typedef unsigned int   SproxelRgba8; // 0xAARRGGBB, same layout as QRgb
 
 
 typedef GameVoxelGrid<SproxelColor> RgbVoxelGrid;
 typedef GameVoxelGrid<SproxelIndex> IndVoxelGrid;
 
+typedef ChunkedVoxelGrid<SproxelColor> RgbBrickGrid;
+typedef ChunkedVoxelGrid<SproxelIndex> IndBrickGrid;
+typedef ChunkedVoxelGrid<SproxelRgba8> Rgba8BrickGrid;
+
+
+// Bumped by every layer and palette change anywhere.  Caches built from
+// several layers compare it to skip checking each layer when nothing changed.
+inline QAtomicInt& voxel_edit_count()
+{
+	static QAtomicInt count(0);
+	return count;
+}
+
 
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
+inline unsigned pack_channel(float f)
+{
+	if (!(f>0)) return 0;
+	if (f>=1) return 255;
+	return unsigned(f*255.0f+0.5f);
+}
+
+
+inline SproxelRgba8 pack_color(const SproxelColor &c)
+{
+	return (pack_channel(c.a)<<24) | (pack_channel(c.r)<<16) | (pack_channel(c.g)<<8) | pack_channel(c.b);
+}
+
+
+inline SproxelColor unpack_color(SproxelRgba8 p)
+{
+	const float s=1.0f/255.0f;
+	return SproxelColor(((p>>16)&0xFF)*s, ((p>>8)&0xFF)*s, (p&0xFF)*s, (p>>24)*s);
+}
+
+
 inline float color_diff(const SproxelColor &a, const SproxelColor &b)
 {
 	SproxelColor d=a-b; d*=d;
@@ -39,13 +77,115 @@ class ColorPalette : public QSharedData
 {
 protected:
 	std::vector<SproxelColor> m_colors;
+	std::vector<SproxelRgba8> m_packed;
 	QString m_name;
+	unsigned m_revision; // bumped on every color change, for caches of palette colors
+
+	// bestMatch() search tree: an implicit k-d tree over the color indices,
+	// the node of range [lo,hi) is at (lo+hi)/2 and splits on m_searchAxis
+	std::vector<int> m_searchOrder;
+	std::vector<unsigned char> m_searchAxis;
+	std::vector<SproxelColor> m_searchColors; // colors in tree order
+
+	void updatePacked()
+	{
+		m_packed.resize(m_colors.size());
+		for (size_t i=0; i<m_colors.size(); ++i) m_packed[i]=pack_color(m_colors[i]);
+		updateSearch();
+	}
+
+	struct AxisLess
+	{
+		const std::vector<SproxelColor> &colors;
+		int axis;
+
+		AxisLess(const std::vector<SproxelColor> &c, int a) : colors(c), axis(a) {}
+
+		bool operator()(int a, int b) const
+		{
+			if (colors[a][axis]!=colors[b][axis]) return colors[a][axis]<colors[b][axis];
+			return a<b;
+		}
+	};
+
+	void buildSearch(int lo, int hi)
+	{
+		if (hi-lo<1) return;
+
+		// split on the channel with the widest spread
+		int axis=0;
+		float bestSpread=-1;
+		for (int ch=0; ch<4; ++ch)
+		{
+			float mn=m_colors[m_searchOrder[lo]][ch], mx=mn;
+			for (int i=lo+1; i<hi; ++i)
+			{
+				mn=std::min(mn, m_colors[m_searchOrder[i]][ch]);
+				mx=std::max(mx, m_colors[m_searchOrder[i]][ch]);
+			}
+			if (mx-mn>bestSpread) { bestSpread=mx-mn; axis=ch; }
+		}
+
+		const int mid=(lo+hi)/2;
+		std::nth_element(m_searchOrder.begin()+lo, m_searchOrder.begin()+mid, m_searchOrder.begin()+hi,
+			AxisLess(m_colors, axis));
+		m_searchAxis[mid]=axis;
+
+		buildSearch(lo, mid);
+		buildSearch(mid+1, hi);
+	}
+
+	void updateSearch()
+	{
+		const int n=m_colors.size();
+		m_searchOrder.resize(n);
+		m_searchAxis.resize(n);
+		for (int i=0; i<n; ++i) m_searchOrder[i]=i;
+		buildSearch(0, n);
+
+		m_searchColors.resize(n);
+		for (int i=0; i<n; ++i) m_searchColors[i]=m_colors[m_searchOrder[i]];
+	}
+
+	// Nearest neighbour search.  A single channel difference never exceeds
+	// color_diff(), also after rounding, so the pruning gives exact results.
+	void searchBest(int lo, int hi, const SproxelColor &c, int &bi, float &bd) const
+	{
+		while (lo<hi)
+		{
+			const int mid=(lo+hi)/2;
+			const SproxelColor &p=m_searchColors[mid];
+			const float d=color_diff(p, c);
+			if (d<=bd)
+			{
+				const int i=m_searchOrder[mid];
+				if (d<bd || i<bi) { bd=d; bi=i; }
+			}
+
+			const int axis=m_searchAxis[mid];
+			const float diff=c[axis]-p[axis];
+
+			// near side first, then the far one if it can still match
+			if (diff<0)
+			{
+				searchBest(lo, mid, c, bi, bd);
+				if (diff*diff>bd) return;
+				lo=mid+1;
+			}
+			else
+			{
+				searchBest(mid+1, hi, c, bi, bd);
+				if (diff*diff>bd) return;
+				hi=mid;
+			}
+		}
+	}
 
 public:
 
-	ColorPalette() {}
+	ColorPalette() : m_revision(0) {}
 
-	template<class I> ColorPalette(I first, I last) : m_colors(first, last) {}
+	template<class I> ColorPalette(I first, I last) : m_colors(first, last), m_revision(0) { updatePacked(); }
 
 
 	QString name() const { return m_name; }
@@ -53,10 +193,16 @@ public:
 
 	int numColors() const { return m_colors.size(); }
 
+	unsigned revision() const { return m_revision; }
+
 	void resize(int new_size)
 	{
 		if (new_size<0) new_size=0;
 		m_colors.resize(new_size, SproxelColor(0, 0, 0, 0));
+		m_packed.resize(new_size, 0);
+		++m_revision;
+		voxel_edit_count().ref();
+		updateSearch();
 	}
 
 	SproxelColor color(int i) const
@@ -65,25 +211,61 @@ public:
 		return m_colors[i];
 	}
 
+	SproxelRgba8 packedColor(int i) const
+	{
+		if (i<0 || i>=(int)m_packed.size()) return 0;
+		return m_packed[i];
+	}
+
 	void setColor(int i, const SproxelColor &c)
 	{
 		if (i<0) return;
 		if (i>=(int)m_colors.size()) resize(i+1);
 		m_colors[i]=c;
+		m_packed[i]=pack_color(c);
+		++m_revision;
+		voxel_edit_count().ref();
+		updateSearch();
 	}
 
+	// Index of the nearest color by color_diff(), the lowest one on ties
 	int bestMatch(const SproxelColor &c) const
 	{
 		int bi=-1;
 		float bd=FLT_MAX;
+		searchBest(0, m_searchOrder.size(), c, bi, bd);
+		return bi;
+	}
+
+	// Batch version of bestMatch().  Voxel data repeats a few colors a lot,
+	// so results are remembered in a small table for the duration of the call.
+	void bestMatch(const SproxelColor *colors, int *indices, int n) const
+	{
+		enum { MEMO_BITS=12, MEMO_SIZE=1<<MEMO_BITS };
+
+		struct Memo { SproxelColor color; int index; };
+		std::vector<Memo> memo(MEMO_SIZE);
+		for (int i=0; i<MEMO_SIZE; ++i) memo[i].index=-2;
 
-		for (size_t i=0; i<m_colors.size(); ++i)
+		for (int i=0; i<n; ++i)
 		{
-			float d=color_diff(m_colors[i], c);
-			if (d<bd) { bd=d; bi=i; }
-		}
+			const SproxelColor &c=colors[i];
 
-		return bi;
+			unsigned bits[4];
+			memcpy(bits, &c, sizeof(bits));
+			unsigned h=bits[0]*0x9E3779B1u;
+			h=(h^bits[1])*0x9E3779B1u;
+			h=(h^bits[2])*0x9E3779B1u;
+			h=(h^bits[3])*0x9E3779B1u;
+
+			Memo &m=memo[h>>(32-MEMO_BITS)];
+			if (m.index==-2 || memcmp(&m.color, &c, sizeof(c))!=0)
+			{
+				m.color=c;
+				m.index=bestMatch(c);
+			}
+			indices[i]=m.index;
+		}
 	}
 };
 
@@ -97,30 +279,190 @@ typedef QExplicitlySharedDataPointer<ColorPalette> ColorPalettePtr;
 typedef QExplicitlySharedDataPointer<class VoxelGridLayer> VoxelGridLayerPtr;
 
 
+// Deferred layer contents, e.g. bricks of a memory-mapped project file.
+// load() fills an empty layer, it is called at most once per layer.
+class VoxelLayerSource : public QSharedData
+{
+public:
+	virtual ~VoxelLayerSource() {}
+	virtual void load(VoxelGridLayer &layer)=0;
+};
+
+typedef QExplicitlySharedDataPointer<VoxelLayerSource> VoxelLayerSourcePtr;
+
+
 class VoxelGridLayer : public QSharedData
 {
 protected:
-	RgbVoxelGrid *m_rgb;
-	IndVoxelGrid *m_ind;
+	RgbBrickGrid *m_rgb;
+	IndBrickGrid *m_ind;
+	Rgba8BrickGrid *m_rgba8;
 	ColorPalettePtr m_palette;
+	VoxelLayerSourcePtr m_source; // contents not loaded yet
 
 	Imath::V3i m_offset;
+	Imath::V3i m_size;
+	Imath::V3i m_origin; // layer position of storage cell (0,0,0), moves with setOffset()
 	QString m_name;
 	bool m_visible;
+	bool m_compact;
+	Imath::Box3i m_dirty; // changed since the last takeDirtyBox(), in layer coordinates
+	Imath::Box3i m_compDirty; // same for takeCompositeDirtyBox()
+	unsigned m_compPalRev; // palette revision seen by takeCompositeDirtyBox()
+
+	// Non-empty cells in storage space.  Indexed layers depend on palette
+	// alpha, so their mask is rebuilt when the palette changes.
+	mutable OccupancyMask m_occupied;
+	mutable const ColorPalette *m_occPal;
+	mutable unsigned m_occPalRev;
+
+	void touch(const Imath::Box3i &box) { m_dirty.extendBy(box); m_compDirty.extendBy(box); voxel_edit_count().ref(); }
+	void touch(const Imath::V3i &at) { m_dirty.extendBy(at); m_compDirty.extendBy(at); voxel_edit_count().ref(); }
 
 	void init()
 	{
 		m_rgb=NULL;
 		m_ind=NULL;
+		m_rgba8=NULL;
 		m_palette=NULL;
+		m_source=NULL;
 		m_offset=Imath::V3i(0);
+		m_size=Imath::V3i(0);
+		m_origin=Imath::V3i(0);
 		m_name="layer";
 		m_visible=true;
+		m_compact=false;
+		m_compPalRev=0;
+		m_occupied.clear();
+		m_occPal=NULL;
+		m_occPalRev=0;
+	}
+
+	template<class G, class D> static void copyDense(G &dst, const D &src)
+	{
+		const Imath::V3i &cd=src.cellDimensions();
+		for (int x=0; x<cd.x; ++x)
+			for (int y=0; y<cd.y; ++y)
+				for (int z=0; z<cd.z; ++z)
+					dst.set(Imath::V3i(x, y, z), src.get(Imath::V3i(x, y, z)));
+	}
+
+	// Bounding box of the part of old that falls outside of new_box
+	static Imath::Box3i droppedBox(const Imath::Box3i &old, const Imath::Box3i &new_box)
+	{
+		Imath::Box3i r;
+		if (old.isEmpty()) return r;
+
+		for (int a=0; a<3; ++a)
+		{
+			if (old.min[a]<new_box.min[a])
+			{
+				Imath::Box3i s=old;
+				s.max[a]=std::min(old.max[a], new_box.min[a]-1);
+				r.extendBy(s);
+			}
+
+			if (old.max[a]>new_box.max[a])
+			{
+				Imath::Box3i s=old;
+				s.min[a]=std::max(old.min[a], new_box.max[a]+1);
+				r.extendBy(s);
+			}
+		}
+
+		return r;
+	}
+
+	template<class D, class S, class F> static void convertBricks(D &dst, const S &src, F conv)
+	{
+		const Imath::Box3i &t=src.brickBounds();
+		if (t.isEmpty()) return;
+
+		for (int x=t.min.x; x<=t.max.x; ++x)
+			for (int y=t.min.y; y<=t.max.y; ++y)
+				for (int z=t.min.z; z<=t.max.z; ++z)
+				{
+					const Imath::V3i bc(x, y, z);
+					const typename S::Brick *sb=src.brick(bc);
+					if (!sb) continue;
+
+					typename D::Brick *db=dst.allocBrick(bc);
+					for (int i=0; i<S::BRICK_CELLS; ++i) db->cells[i]=conv(sb->cells[i]);
+				}
+	}
+
+	template<class G> static bool readBrickOf(const G *g, const Imath::V3i &bc, void *dst)
+	{
+		typename G::Brick *d=reinterpret_cast<typename G::Brick*>(dst);
+		const typename G::Brick *b=g->brick(bc);
+		if (b) { *d=*b; return true; }
+		std::fill(d->cells, d->cells+G::BRICK_CELLS, g->emptyValue());
+		return false;
+	}
+
+	template<class G> static void writeBrickOf(G *g, const Imath::V3i &bc, const void *src)
+	{
+		if (!src) { g->freeBrick(bc); return; }
+		*g->allocBrick(bc)=*reinterpret_cast<const typename G::Brick*>(src);
+	}
+
+	bool occupiedValue(const SproxelColor &c) const { return c.a!=0; }
+	bool occupiedValue(SproxelRgba8 c) const { return (c>>24)!=0; }
+	bool occupiedValue(SproxelIndex i) const { return m_palette && m_palette->color(i).a!=0; }
+
+	bool storageOccupied(const Imath::V3i &c) const
+	{
+		if (m_ind) return occupiedValue(m_ind->get(c));
+		if (m_rgb) return occupiedValue(m_rgb->get(c));
+		if (m_rgba8) return occupiedValue(m_rgba8->get(c));
+		return false;
+	}
+
+	// Sets the mask bits of one brick, one Z row of cells at a time
+	template<class G> void updateBrickOccupancy(const G &g, const Imath::V3i &bc) const
+	{
+		const Imath::Box3i bb=G::brickBox(bc);
+		const typename G::Brick *b=g.brick(bc);
+
+		for (int x=bb.min.x; x<=bb.max.x; ++x)
+			for (int y=bb.min.y; y<=bb.max.y; ++y)
+			{
+				OccupancyMask::Word bits=0;
+				if (b)
+				{
+					const int row=G::cellIndex(Imath::V3i(x, y, bb.min.z));
+					for (int z=0; z<G::BRICK_SIZE; ++z)
+						if (occupiedValue(b->cells[row+z])) bits|=OccupancyMask::Word(1)<<z;
+				}
+				m_occupied.setBits(Imath::V3i(x, y, bb.min.z), bits, G::BRICK_SIZE);
+			}
+	}
+
+	template<class G> void rebuildOccupancyOf(const G &g) const
+	{
+		const Imath::Box3i &t=g.brickBounds();
+		if (t.isEmpty()) return;
+
+		for (int x=t.min.x; x<=t.max.x; ++x)
+			for (int y=t.min.y; y<=t.max.y; ++y)
+				for (int z=t.min.z; z<=t.max.z; ++z)
+					if (g.brick(Imath::V3i(x, y, z))) updateBrickOccupancy(g, Imath::V3i(x, y, z));
+	}
+
+	void rebuildOccupancy() const
+	{
+		m_occupied.clear();
+		m_occPal=m_palette.data();
+		m_occPalRev=m_palette ? m_palette->revision() : 0;
+
+		if (m_ind) rebuildOccupancyOf(*m_ind);
+		else if (m_rgb) rebuildOccupancyOf(*m_rgb);
+		else if (m_rgba8) rebuildOccupancyOf(*m_rgba8);
 	}
 
 public:
 
-	enum DataType { TYPE_RGB, TYPE_IND };
+	enum DataType { TYPE_RGB, TYPE_IND, TYPE_RGBA8 };
 
 
 	VoxelGridLayer() { init(); }
@@ -128,22 +470,31 @@ public:
 	VoxelGridLayer(const RgbVoxelGrid &grid, const Imath::V3i ofs=Imath::V3i(0))
 	{
 		init();
-		m_rgb=new RgbVoxelGrid(grid);
-		m_offset=ofs;
+		m_rgb=new RgbBrickGrid(SproxelColor(0, 0, 0, 0));
+		copyDense(*m_rgb, grid);
+		m_offset=m_origin=ofs;
+		m_size=grid.cellDimensions();
+		rebuildOccupancy();
 	}
 
 	VoxelGridLayer(const IndVoxelGrid &grid, ColorPalette *pal=NULL, const Imath::V3i ofs=Imath::V3i(0))
 	{
 		init();
-		m_ind=new IndVoxelGrid(grid);
+		m_ind=new IndBrickGrid(0);
+		copyDense(*m_ind, grid);
 		m_palette=pal;
-		m_offset=ofs;
+		m_offset=m_origin=ofs;
+		m_size=grid.cellDimensions();
+		rebuildOccupancy();
 	}
 
 	void clear()
 	{
+		touch(bounds());
+
 		if (m_rgb) { delete m_rgb; m_rgb=NULL; }
 		if (m_ind) { delete m_ind; m_ind=NULL; }
+		if (m_rgba8) { delete m_rgba8; m_rgba8=NULL; }
 		init();
 	}
 
@@ -155,13 +506,23 @@ public:
 	VoxelGridLayer(const VoxelGridLayer &from) :
 		m_rgb    (from.m_rgb    ),
 		m_ind    (from.m_ind    ),
+		m_rgba8  (from.m_rgba8  ),
 		m_palette(from.m_palette),
+		m_source (from.m_source ),
 		m_offset (from.m_offset ),
+		m_size   (from.m_size   ),
+		m_origin (from.m_origin ),
 		m_name   (from.m_name   ),
-		m_visible(from.m_visible)
+		m_visible(from.m_visible),
+		m_compact(from.m_compact),
+		m_compPalRev(0),
+		m_occupied(from.m_occupied),
+		m_occPal(from.m_occPal),
+		m_occPalRev(from.m_occPalRev)
 	{
-		if (m_rgb) m_rgb=new RgbVoxelGrid(*m_rgb);
-		if (m_ind) m_ind=new IndVoxelGrid(*m_ind);
+		if (m_rgb) m_rgb=new RgbBrickGrid(*m_rgb);
+		if (m_ind) m_ind=new IndBrickGrid(*m_ind);
+		if (m_rgba8) m_rgba8=new Rgba8BrickGrid(*m_rgba8);
 	}
 
 	VoxelGridLayer& operator = (const VoxelGridLayer &from)
@@ -169,33 +530,88 @@ public:
 		if (&from==this) return *this;
 
 		clear();
+		touch(from.bounds());
 
-		if (from.m_rgb) m_rgb=new RgbVoxelGrid(*from.m_rgb);
-		if (from.m_ind) m_ind=new IndVoxelGrid(*from.m_ind);
+		if (from.m_rgb) m_rgb=new RgbBrickGrid(*from.m_rgb);
+		if (from.m_ind) m_ind=new IndBrickGrid(*from.m_ind);
+		if (from.m_rgba8) m_rgba8=new Rgba8BrickGrid(*from.m_rgba8);
 		m_palette=from.m_palette;
+		m_source =from.m_source ;
 		m_offset =from.m_offset ;
+		m_size   =from.m_size   ;
+		m_origin =from.m_origin ;
 		m_name   =from.m_name   ;
 		m_visible=from.m_visible;
+		m_compact=from.m_compact;
+		m_occupied=from.m_occupied;
+		m_occPal=from.m_occPal;
+		m_occPalRev=from.m_occPalRev;
 
 		return *this;
 	}
 
 	const Imath::V3i& offset() const { return m_offset; }
-	void setOffset(const Imath::V3i &o) { m_offset=o; }
+
+	void setOffset(const Imath::V3i &o)
+	{
+		touch(bounds());
+
+		// move the contents along with the bounds
+		m_origin+=o-m_offset;
+		m_offset=o;
+
+		touch(bounds());
+	}
 
 	bool isVisible() const { return m_visible; }
-	void setVisible(bool v) { m_visible=v; }
+	void setVisible(bool v) { if (v!=m_visible) touch(bounds()); m_visible=v; }
 
 	QString name() const { return m_name; }
 	void setName(const QString n) { m_name=n; }
 
 	ColorPalettePtr palette() const { return m_palette; }
-	void setPalette(ColorPalettePtr p) { m_palette=p; }
+	void setPalette(ColorPalettePtr p) { if (p!=m_palette) touch(bounds()); m_palette=p; }
+
+	// Replaces the palette by a private copy with the same colors, for
+	// snapshots read by other threads.  Keeps the occupancy mask valid.
+	void detachPalette()
+	{
+		if (!m_palette) return;
+		const bool current=(m_occPal==m_palette.data() && m_occPalRev==m_palette->revision());
+		m_palette=new ColorPalette(*m_palette);
+		if (current) m_occPal=m_palette.data();
+	}
+
+	// Compact layers keep RGB data packed as 8 bits per channel
+	bool isCompact() const { return m_compact; }
+
+	void setCompact(bool c)
+	{
+		m_compact=c;
+		if (c==(m_rgba8!=NULL) || m_ind) return;
+
+		// colors get quantized, so the contents may change slightly
+		touch(bounds());
+
+		if (c && m_rgb)
+		{
+			m_rgba8=new Rgba8BrickGrid(0);
+			convertBricks(*m_rgba8, *m_rgb, pack_color);
+			delete m_rgb; m_rgb=NULL;
+		}
+		else if (!c && m_rgba8)
+		{
+			m_rgb=new RgbBrickGrid(SproxelColor(0, 0, 0, 0));
+			convertBricks(*m_rgb, *m_rgba8, unpack_color);
+			delete m_rgba8; m_rgba8=NULL;
+		}
+
+		rebuildOccupancy();
+	}
 
 	Imath::V3i size() const
 	{
-		if (m_ind) return m_ind->cellDimensions();
-		if (m_rgb) return m_rgb->cellDimensions();
+		if (m_ind || m_rgb || m_rgba8) return m_size;
 		return Imath::V3i(0);
 	}
 
@@ -208,51 +624,148 @@ public:
 	{
 		Q_ASSERT(!new_box.isEmpty());
 
-		// expand grid and adjust offset to match new box
-		Imath::Box3i curBox=bounds();
+		const Imath::Box3i old_box=bounds();
+		touch(droppedBox(old_box, new_box));
+
+		// bricks stay where they are, only data outside the new box is dropped
+		Imath::Box3i storageBox(new_box.min-m_origin, new_box.max-m_origin);
+		m_occupied.crop(storageBox);
 
 		if (m_ind)
 		{
-			m_ind->resize(new_box.size()+Imath::V3i(1), new_box.min-curBox.min, 0);
-			m_offset=new_box.min;
+			m_ind->crop(storageBox);
 		}
 		else if (m_rgb)
 		{
-			m_rgb->resize(new_box.size()+Imath::V3i(1), new_box.min-curBox.min, SproxelColor(0, 0, 0, 0));
-			m_offset=new_box.min;
+			m_rgb->crop(storageBox);
+		}
+		else if (m_rgba8)
+		{
+			m_rgba8->crop(storageBox);
 		}
 		else if (!new_box.isEmpty())
 		{
 			// no grids yet - create a new one
 			if (m_palette)
-			{
-				m_ind=new IndVoxelGrid(new_box.size()+Imath::V3i(1));
-				m_ind->setAll(0);
-			}
+				m_ind=new IndBrickGrid(0);
+			else if (m_compact)
+				m_rgba8=new Rgba8BrickGrid(0);
 			else
-			{
-				m_rgb=new RgbVoxelGrid(new_box.size()+Imath::V3i(1));
-				m_rgb->setAll(SproxelColor(0, 0, 0, 0));
-			}
-			m_offset=new_box.min;
+				m_rgb=new RgbBrickGrid(SproxelColor(0, 0, 0, 0));
+			m_origin=new_box.min;
 		}
+
+		m_offset=new_box.min;
+		m_size=new_box.size()+Imath::V3i(1);
+
+		// added cells read as palette color 0, which may be visible
+		if (emptyOccupied()) touch(droppedBox(new_box, old_box));
 	}
 
 	int getInd(const Imath::V3i &at) const
 	{
 		if (!m_ind) return -1;
 		if (!bounds().intersects(at)) return -1;
-		return m_ind->get(at-m_offset);
+		return m_ind->get(at-m_origin);
 	}
 
 	SproxelColor getColor(const Imath::V3i &at) const
 	{
 		if (!bounds().intersects(at)) return SproxelColor(0, 0, 0, 0);
-		if (m_ind && m_palette) return m_palette->color(m_ind->get(at-m_offset));
-		if (m_rgb) return m_rgb->get(at-m_offset);
+		if (m_ind && m_palette) return m_palette->color(m_ind->get(at-m_origin));
+		if (m_rgb) return m_rgb->get(at-m_origin);
+		if (m_rgba8) return unpack_color(m_rgba8->get(at-m_origin));
 		return SproxelColor(0, 0, 0, 0);
 	}
 
+	SproxelRgba8 getPacked(const Imath::V3i &at) const
+	{
+		if (!bounds().intersects(at)) return 0;
+		if (m_rgba8) return m_rgba8->get(at-m_origin);
+		if (m_ind && m_palette) return m_palette->packedColor(m_ind->get(at-m_origin));
+		if (m_rgb) return pack_color(m_rgb->get(at-m_origin));
+		return 0;
+	}
+
+	// Occupancy mask in storage space, see dataOrigin()
+	const OccupancyMask& occupancy() const
+	{
+		if (m_ind && (m_palette.data()!=m_occPal || (m_palette && m_palette->revision()!=m_occPalRev)))
+			rebuildOccupancy();
+		return m_occupied;
+	}
+
+	// Indexed layers with a visible palette color 0 are filled even where no
+	// bricks are allocated.  The mask can't tell, so queries fall back to
+	// reading the voxels.
+	bool emptyOccupied() const { return m_ind && occupiedValue(SproxelIndex(0)); }
+
+	// Same as getColor(at).a!=0, from the occupancy mask
+	bool isOccupied(const Imath::V3i &at) const
+	{
+		if (!bounds().intersects(at)) return false;
+		if (emptyOccupied()) return getColor(at).a!=0;
+		return occupancy().get(at-m_origin);
+	}
+
+	// Occupancy of the 64 cells at+(0,0,i), bit i set if non-empty
+	OccupancyMask::Word occupiedRow(const Imath::V3i &at) const
+	{
+		const Imath::Box3i b=bounds();
+		if (at.x<b.min.x || at.x>b.max.x || at.y<b.min.y || at.y>b.max.y) return 0;
+		if (at.z>b.max.z || at.z+OccupancyMask::WORD_MASK<b.min.z) return 0;
+
+		OccupancyMask::Word bits=0;
+		if (emptyOccupied())
+		{
+			for (int i=0; i<OccupancyMask::WORD_SIZE; ++i)
+				if (getColor(at+Imath::V3i(0, 0, i)).a!=0) bits|=OccupancyMask::Word(1)<<i;
+			return bits;
+		}
+
+		bits=occupancy().row(at-m_origin);
+		if (at.z<b.min.z) bits&=~OccupancyMask::Word(0)<<(b.min.z-at.z);
+		if (at.z+OccupancyMask::WORD_MASK>b.max.z) bits&=~OccupancyMask::Word(0)>>(OccupancyMask::WORD_MASK-(b.max.z-at.z));
+		return bits;
+	}
+
+	// True if the box may be skipped by ray casts: no non-empty cell in the
+	// occupancy pyramid blocks of the level that overlap it
+	bool isEmptyRegion(const Imath::Box3i &box, int level) const
+	{
+		const Imath::Box3i b=bounds();
+		Imath::Box3i r;
+		for (int a=0; a<3; ++a)
+		{
+			r.min[a]=std::max(box.min[a], b.min[a]);
+			r.max[a]=std::min(box.max[a], b.max[a]);
+		}
+		if (r.isEmpty()) return true;
+		if (emptyOccupied()) return false;
+
+		return occupancy().blocksEmpty(level, Imath::Box3i(r.min-m_origin, r.max-m_origin));
+	}
+
+	// Tight bounds of the non-empty cells
+	Imath::Box3i occupiedBounds() const
+	{
+		const Imath::Box3i b=bounds();
+
+		if (emptyOccupied())
+		{
+			Imath::Box3i r;
+			for (int x=b.min.x; x<=b.max.x; ++x)
+				for (int y=b.min.y; y<=b.max.y; ++y)
+					for (int z=b.min.z; z<=b.max.z; ++z)
+						if (getColor(Imath::V3i(x, y, z)).a!=0) r.extendBy(Imath::V3i(x, y, z));
+			return r;
+		}
+
+		Imath::Box3i r=occupancy().bounds(Imath::Box3i(b.min-m_origin, b.max-m_origin));
+		if (r.isEmpty()) return r;
+		return Imath::Box3i(r.min+m_origin, r.max+m_origin);
+	}
+
 	void set(const Imath::V3i &at, const SproxelColor &color, int index=-1)
 	{
 		// expand grid to include target voxel
@@ -277,21 +790,160 @@ public:
 			}
 
 			// set voxel index
-			m_ind->set(at-m_offset, index);
+			m_ind->set(at-m_origin, index);
 		}
 		else if (m_rgb)
 		{
 			// set voxel color
-			m_rgb->set(at-m_offset, color);
+			m_rgb->set(at-m_origin, color);
+		}
+		else if (m_rgba8)
+		{
+			m_rgba8->set(at-m_origin, pack_color(color));
+		}
+
+		m_occupied.set(at-m_origin, storageOccupied(at-m_origin));
+		touch(at);
+	}
+
+	// Region touched since the last call, cleared on return
+	const Imath::Box3i& dirtyBox() const { return m_dirty; }
+	void markDirty(const Imath::Box3i &box) { touch(box); }
+
+	Imath::Box3i takeDirtyBox()
+	{
+		Imath::Box3i box=m_dirty;
+		m_dirty.makeEmpty();
+		return box;
+	}
+
+	// Separate change tracking for the composite cache of the owning group,
+	// also reports palette color edits
+	bool compositeChanged() const
+	{
+		return !m_compDirty.isEmpty() || (m_palette && m_palette->revision()!=m_compPalRev);
+	}
+
+	Imath::Box3i takeCompositeDirtyBox()
+	{
+		if (m_palette && m_palette->revision()!=m_compPalRev)
+		{
+			m_compPalRev=m_palette->revision();
+			m_compDirty.extendBy(bounds());
 		}
+
+		Imath::Box3i box=m_compDirty;
+		m_compDirty.makeEmpty();
+		return box;
 	}
 
-	DataType dataType() const { return m_ind ? TYPE_IND : TYPE_RGB; }
+	DataType dataType() const { return m_ind ? TYPE_IND : (m_rgba8 ? TYPE_RGBA8 : TYPE_RGB); }
 	bool isIndexed() const { return m_ind!=NULL; }
 
+	// Raw storage, cell c of the grid is at layer position c+dataOrigin()
+	const RgbBrickGrid* rgbData() const { return m_rgb; }
+	const IndBrickGrid* indData() const { return m_ind; }
+	const Rgba8BrickGrid* rgba8Data() const { return m_rgba8; }
+	const Imath::V3i& dataOrigin() const { return m_origin; }
+
+	// Voxel data bytes, bricks shared with copies of the layer are split
+	// between them
+	size_t memoryUsage() const
+	{
+		if (m_ind) return m_ind->memoryUsage();
+		if (m_rgb) return m_rgb->memoryUsage();
+		if (m_rgba8) return m_rgba8->memoryUsage();
+		return 0;
+	}
+
+	// Raw brick snapshots for undo.  Bricks are addressed in storage space,
+	// all grid types share the same brick layout.
+	Imath::V3i storageBrickOf(const Imath::V3i &at) const { return RgbBrickGrid::brickOf(at-m_origin); }
+
+	int brickDataSize() const
+	{
+		if (m_ind) return sizeof(IndBrickGrid::Brick);
+		if (m_rgb) return sizeof(RgbBrickGrid::Brick);
+		if (m_rgba8) return sizeof(Rgba8BrickGrid::Brick);
+		return 0;
+	}
+
+	// Copies brick cells to dst, returns false (and empty cells) if not allocated
+	bool readBrick(const Imath::V3i &bc, void *dst) const
+	{
+		if (m_ind) return readBrickOf(m_ind, bc, dst);
+		if (m_rgb) return readBrickOf(m_rgb, bc, dst);
+		if (m_rgba8) return readBrickOf(m_rgba8, bc, dst);
+		return false;
+	}
+
+	// Replaces brick cells with src, NULL frees the brick
+	void writeBrick(const Imath::V3i &bc, const void *src)
+	{
+		if (m_ind) { writeBrickOf(m_ind, bc, src); updateBrickOccupancy(*m_ind, bc); }
+		else if (m_rgb) { writeBrickOf(m_rgb, bc, src); updateBrickOccupancy(*m_rgb, bc); }
+		else if (m_rgba8) { writeBrickOf(m_rgba8, bc, src); updateBrickOccupancy(*m_rgba8, bc); }
+		else return;
+
+		Imath::Box3i box=RgbBrickGrid::brickBox(bc);
+		touch(Imath::Box3i(box.min+m_origin, box.max+m_origin));
+	}
+
+	// Lazy loading.  Until load() is called the layer reads as empty.
+	bool isLoaded() const { return !m_source; }
+	void setSource(VoxelLayerSourcePtr src) { m_source=src; }
+
+	// Returns true if the contents were loaded by this call
+	bool load()
+	{
+		if (!m_source) return false;
+		VoxelLayerSourcePtr src=m_source;
+		m_source=NULL;
+		src->load(*this);
+		return true;
+	}
+
+	// Replaces the contents with an empty grid of the given type covering
+	// box, storage cell (0,0,0) is at layer position origin.  For loaders
+	// that fill the layer with writeBrick().
+	void resetStorage(DataType type, const Imath::Box3i &box, const Imath::V3i &origin)
+	{
+		touch(bounds());
+
+		if (m_rgb) { delete m_rgb; m_rgb=NULL; }
+		if (m_ind) { delete m_ind; m_ind=NULL; }
+		if (m_rgba8) { delete m_rgba8; m_rgba8=NULL; }
+		m_occupied.clear();
+
+		m_size=Imath::V3i(0);
+		if (box.isEmpty()) return;
+
+		switch (type)
+		{
+			case TYPE_IND: m_ind=new IndBrickGrid(0); break;
+			case TYPE_RGBA8: m_rgba8=new Rgba8BrickGrid(0); break;
+			default: m_rgb=new RgbBrickGrid(SproxelColor(0, 0, 0, 0));
+		}
+
+		m_origin=origin;
+		m_offset=box.min;
+		m_size=box.size()+Imath::V3i(1);
+		touch(box);
+	}
+
+	// Sets the bounds without touching the data, for undoing growth
+	void restoreBounds(const Imath::Box3i &box)
+	{
+		const Imath::Box3i old_box=bounds();
+		touch(droppedBox(old_box, box));
+		m_offset=box.isEmpty() ? Imath::V3i(0) : box.min;
+		m_size=box.isEmpty() ? Imath::V3i(0) : box.size()+Imath::V3i(1);
+		if (emptyOccupied()) touch(droppedBox(box, old_box));
+	}
+
 	class QImage makeQImage() const;
 
-	static VoxelGridLayerPtr fromQImage(class QImage, ColorPalettePtr);
+	static VoxelGridLayerPtr fromQImage(class QImage, ColorPalettePtr, bool compact=false);
 };
 
 
@@ -305,11 +957,48 @@ private:
 	QVector<VoxelGridLayerPtr> m_layers;
 	int m_curLayer;
 	QString m_name;
+	Imath::Box3i m_dirty; // layers added, removed or replaced
+
+	// Flattened composite of the visible layers, built on demand for
+	// multi-layer sprites and updated per region from the layer change boxes
+	bool m_useComposite;
+	mutable RgbBrickGrid *m_compColor;
+	mutable IndBrickGrid *m_compInd;
+	mutable Imath::Box3i m_compDirty; // layers added, removed or replaced
+	mutable QAtomicInt m_compEdits; // voxel_edit_count() at the last updateComposite()
+
+	void initComposite()
+	{
+		m_useComposite=true;
+		m_compColor=NULL;
+		m_compInd=NULL;
+		m_compEdits=int(voxel_edit_count())-1;
+	}
+
+	bool compositeActive() const { return m_useComposite && m_layers.size()>1; }
+
+	bool compositeChanged() const
+	{
+		if (!m_compColor || !m_compDirty.isEmpty()) return true;
+		for (int i=0; i<m_layers.size(); ++i) if (m_layers[i]->compositeChanged()) return true;
+		return false;
+	}
+
+	void rebuildComposite() const;
+
+	void freeComposite() const
+	{
+		delete m_compColor; m_compColor=NULL;
+		delete m_compInd; m_compInd=NULL;
+		m_compDirty.makeEmpty();
+	}
 
 public:
 
 	VoxelGridGroup(VoxelGridLayerPtr layer=VoxelGridLayerPtr()) : m_transform(), m_curLayer(-1)
 	{
+		initComposite();
+
 		if (layer)
 		{
 			m_layers.push_back(layer);
@@ -317,10 +1006,13 @@ public:
 		}
 	}
 
-	VoxelGridGroup(const Imath::V3i &size, ColorPalettePtr palette) : m_transform()
+	VoxelGridGroup(const Imath::V3i &size, ColorPalettePtr palette, bool compact=false) : m_transform()
 	{
+		initComposite();
+
 		VoxelGridLayerPtr layer(new VoxelGridLayer());
 		layer->setPalette(palette);
+		layer->setCompact(compact);
 		layer->resize(Imath::Box3i(Imath::V3i(0), size-Imath::V3i(1)));
 		layer->setName("main layer");
 
@@ -330,6 +1022,9 @@ public:
 
 	VoxelGridGroup(const VoxelGridGroup &from)
 	{
+		initComposite();
+		m_useComposite=from.m_useComposite;
+
 		m_transform=from.m_transform;
 		m_curLayer =from.m_curLayer ;
 		m_name     =from.m_name     ;
@@ -344,9 +1039,11 @@ public:
 		if (&from==this) return *this;
 
 		clear();
+		m_dirty.extendBy(from.bounds());
 
 		m_transform=from.m_transform;
 		m_curLayer =from.m_curLayer ;
+		m_useComposite=from.m_useComposite;
 
 		m_layers.reserve(from.m_layers.size());
 		for (int i=0; i<from.m_layers.size(); ++i)
@@ -357,9 +1054,12 @@ public:
 
 	void clear()
 	{
+		m_dirty.extendBy(bounds());
 		m_transform.makeIdentity();
 		m_curLayer=-1;
 		m_layers.clear();
+		freeComposite();
+		voxel_edit_count().ref();
 	}
 
 	~VoxelGridGroup() { clear(); }
@@ -395,6 +1095,29 @@ public:
 	}
 
 
+	size_t memoryUsage() const
+	{
+		size_t bytes=0;
+		for (int i=0; i<m_layers.size(); ++i) bytes+=m_layers[i]->memoryUsage();
+		return bytes;
+	}
+
+
+	bool isLoaded() const
+	{
+		for (int i=0; i<m_layers.size(); ++i) if (!m_layers[i]->isLoaded()) return false;
+		return true;
+	}
+
+	// Loads the contents of all deferred layers, returns true if any were loaded
+	bool load()
+	{
+		bool loaded=false;
+		for (int i=0; i<m_layers.size(); ++i) if (m_layers[i]->load()) loaded=true;
+		return loaded;
+	}
+
+
 	// Layer accessors
 	int numLayers() const { return m_layers.size(); }
 
@@ -408,6 +1131,9 @@ public:
 	{
 		if (!layer) layer=new VoxelGridLayer();
 		m_layers.insert(m_layers.begin()+i, VoxelGridLayerPtr(layer));
+		m_dirty.extendBy(layer->bounds());
+		m_compDirty.extendBy(layer->bounds());
+		voxel_edit_count().ref();
 		if (m_curLayer>=i) ++m_curLayer;
 		return VoxelGridLayerPtr(layer);
 	}
@@ -417,6 +1143,10 @@ public:
 		if (i<0 || i>=(int)m_layers.size()) return VoxelGridLayerPtr(NULL);
 		VoxelGridLayerPtr layer=m_layers[i];
 		m_layers.erase(m_layers.begin()+i);
+		m_dirty.extendBy(layer->bounds());
+		m_compDirty.extendBy(layer->bounds());
+		voxel_edit_count().ref();
+		if (!compositeActive()) freeComposite();
 
 		if (m_curLayer>i) --m_curLayer;
 		if (m_curLayer>=(int)m_layers.size()) m_curLayer=m_layers.size()-1;
@@ -451,6 +1181,17 @@ public:
 	}
 
 
+	// Union of everything changed in the layers since the last call.
+	// Boxes are in sprite voxel coordinates and may be empty.
+	Imath::Box3i takeDirtyBox()
+	{
+		Imath::Box3i box=m_dirty;
+		m_dirty.makeEmpty();
+		for (int i=0; i<m_layers.size(); ++i) box.extendBy(m_layers[i]->takeDirtyBox());
+		return box;
+	}
+
+
 	VoxelGridLayerPtr bakeLayers() const;
 
 
@@ -480,31 +1221,140 @@ public:
 	}
 
 
+	// Composite cache control.  Reads bring the cache up to date, so before
+	// reading from several threads call updateComposite() once up front.
+	bool usesComposite() const { return m_useComposite; }
+
+	void setUseComposite(bool use)
+	{
+		m_useComposite=use;
+		if (!use) freeComposite();
+	}
+
+	void updateComposite() const
+	{
+		// layers are only looked at after some edit, here or elsewhere
+		const int edits=voxel_edit_count();
+		if (edits==int(m_compEdits) && m_compDirty.isEmpty() && (m_compColor || !compositeActive())) return;
+
+		if (compositeActive() && compositeChanged()) rebuildComposite();
+		for (int i=0; i<m_layers.size(); ++i) m_layers[i]->occupancy();
+		m_compEdits=edits;
+	}
+
+	// Private palette copies for all layers, see VoxelGridLayer::detachPalette()
+	void detachPalettes()
+	{
+		for (int i=0; i<m_layers.size(); ++i) m_layers[i]->detachPalette();
+	}
+
+
+	// Voxel accessors, hidden layers are skipped
 	int getInd(const Imath::V3i &at) const
 	{
-		int result=0;
+		if (compositeActive())
+		{
+			updateComposite();
+			return m_compInd->get(at);
+		}
+
+		return getLayersInd(at);
+	}
+
+
+	SproxelColor get(const Imath::V3i &at) const
+	{
+		if (compositeActive())
+		{
+			updateComposite();
+			return m_compColor->get(at);
+		}
+
+		return getLayers(at);
+	}
+
+
+	// Same as get(), as packed 8-bit colors
+	SproxelRgba8 getPacked(const Imath::V3i &at) const
+	{
+		if (compositeActive())
+		{
+			updateComposite();
+			return pack_color(m_compColor->get(at));
+		}
 
 		for (int i=0; i<m_layers.size(); ++i)
 		{
-			int ind=m_layers[i]->getInd(at);
-			if (ind>0) { result=ind; break; }
+			if (!m_layers[i]->isVisible()) continue;
+			SproxelRgba8 c=m_layers[i]->getPacked(at);
+			if (c>>24) return c;
 		}
 
-		return result;
+		return 0;
 	}
 
 
-	SproxelColor get(const Imath::V3i &at) const
+	// Emptiness queries from the layer occupancy masks, hidden layers are skipped
+	bool isOccupied(const Imath::V3i &at) const
 	{
-		SproxelColor result(0, 0, 0, 0);
+		for (int i=0; i<m_layers.size(); ++i)
+			if (m_layers[i]->isVisible() && m_layers[i]->isOccupied(at)) return true;
 
+		return false;
+	}
+
+	// Occupancy of the 64 cells at+(0,0,i), bit i set if non-empty
+	OccupancyMask::Word occupiedRow(const Imath::V3i &at) const
+	{
+		OccupancyMask::Word bits=0;
+		for (int i=0; i<m_layers.size(); ++i)
+			if (m_layers[i]->isVisible()) bits|=m_layers[i]->occupiedRow(at);
+
+		return bits;
+	}
+
+	bool isEmptyRegion(const Imath::Box3i &box, int level) const
+	{
+		for (int i=0; i<m_layers.size(); ++i)
+			if (m_layers[i]->isVisible() && !m_layers[i]->isEmptyRegion(box, level)) return false;
+
+		return true;
+	}
+
+	// Tight bounds of the non-empty cells
+	Imath::Box3i occupiedBounds() const
+	{
+		Imath::Box3i box;
+		for (int i=0; i<m_layers.size(); ++i)
+			if (m_layers[i]->isVisible()) box.extendBy(m_layers[i]->occupiedBounds());
+
+		return box;
+	}
+
+
+	// Uncached versions, composited from the layers on every call
+	int getLayersInd(const Imath::V3i &at) const
+	{
+		for (int i=0; i<m_layers.size(); ++i)
+		{
+			if (!m_layers[i]->isVisible()) continue;
+			int ind=m_layers[i]->getInd(at);
+			if (ind>0) return ind;
+		}
+
+		return 0;
+	}
+
+	SproxelColor getLayers(const Imath::V3i &at) const
+	{
 		for (int i=0; i<m_layers.size(); ++i)
 		{
+			if (!m_layers[i]->isVisible()) continue;
 			SproxelColor c=m_layers[i]->getColor(at);
-			if (c.a!=0) { result=c; break; }
+			if (c.a!=0) return c;
 		}
 
-		return result;
+		return SproxelColor(0, 0, 0, 0);
 	}
 
 
@@ -523,6 +1373,25 @@ public:
 		return walk_ray(localRay, bounds());
 	}
 
+
+	// First non-empty voxel along the ray.  hit.t is the parameter of the
+	// hit point on worldRay, so the distance for a normalized direction.
+	RayHit castRay(const Imath::Line3d &worldRay) const
+	{
+		const Imath::Line3d localRay = worldRay * m_transform.inverse();
+		RayHit hit=cast_ray(localRay, bounds(), *this);
+		if (hit.hit)
+		{
+			const Imath::V3d p=(localRay.pos+localRay.dir*hit.t)*m_transform;
+			hit.t=(p-worldRay.pos).dot(worldRay.dir)/worldRay.dir.length2();
+		}
+		return hit;
+	}
+
+	// castRay() for many rays, spread over the global thread pool.
+	// The sprite must not change until it returns.
+	void castRays(const Imath::Line3d *worldRays, RayHit *hits, int n) const;
+
 };
 
 
@@ -0,0 +1,206 @@
+#include "VoxelMesher.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+VoxelMesher::VoxelMesher()
+    : m_greedy(true),
+      m_smooth(false),
+      m_chunk(0),
+      m_samples(SAMPLES, 0)
+{
+}
+
+
+void VoxelMesher::clearSamples()
+{
+    std::fill(m_samples.begin(), m_samples.end(), 0);
+}
+
+
+void VoxelMesher::sample(const VoxelGridGroup& spr, const Imath::V3i& chunk, const Imath::Box3i& clip)
+{
+    m_chunk = chunk;
+
+    const Imath::V3i base = chunkBox(chunk).min;
+    SproxelRgba8* p = &m_samples[0];
+
+    // a padded row fits in one occupancy word, only filled cells are read
+    for (int x = -1; x <= CHUNK_SIZE; x++)
+        for (int y = -1; y <= CHUNK_SIZE; y++)
+        {
+            const Imath::V3i rowStart = base+Imath::V3i(x, y, -1);
+            OccupancyMask::Word occ = spr.occupiedRow(rowStart);
+
+            if (!occ)
+            {
+                std::fill(p, p+PADDED, 0);
+                p += PADDED;
+                continue;
+            }
+
+            for (int z = 0; z < PADDED; z++, occ >>= 1)
+            {
+                const Imath::V3i at = rowStart+Imath::V3i(0, 0, z);
+                *p++ = (occ&1) && clip.intersects(at) ? spr.getPacked(at) : 0;
+            }
+        }
+}
+
+
+bool VoxelMesher::samplesEmpty() const
+{
+    for (int x = 0; x < CHUNK_SIZE; x++)
+        for (int y = 0; y < CHUNK_SIZE; y++)
+        {
+            const SproxelRgba8* row = &m_samples[sampleIndex(Imath::V3i(x, y, 0))];
+            for (int z = 0; z < CHUNK_SIZE; z++)
+                if (row[z]>>24) return false;
+        }
+
+    return true;
+}
+
+
+unsigned long long VoxelMesher::samplesHash() const
+{
+    // FNV-1a over the packed words
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < m_samples.size(); i++)
+    {
+        h ^= m_samples[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+void VoxelMesher::emitQuad(VoxelMesh& mesh, int d, bool positive, const Imath::V3i& corner,
+                           int w, int h, SproxelRgba8 color) const
+{
+    const int u = (d+1)%3;
+    const int v = (d+2)%3;
+
+    // corners in (u,v), counter-clockwise when seen from the +d side
+    static const int cu[4] = { 0, 1, 1, 0 };
+    static const int cv[4] = { 0, 0, 1, 1 };
+
+    const float ns = 0.07f, nf = sqrtf(1.0f-ns*ns*2);
+    const float sign = positive ? 1.0f : -1.0f;
+    const bool smooth = m_smooth && w == 1 && h == 1;
+
+    const unsigned int base = (unsigned int)mesh.vertices.size();
+
+    for (int i = 0; i < 4; i++)
+    {
+        // negative faces are wound the other way round
+        const int k = positive ? i : 3-i;
+
+        VoxelMeshVertex vert;
+        vert.pos[d] = float(corner[d] + (positive ? 1 : 0));
+        vert.pos[u] = float(corner[u] + cu[k]*w);
+        vert.pos[v] = float(corner[v] + cv[k]*h);
+
+        if (smooth)
+        {
+            vert.normal[d] = sign*nf;
+            vert.normal[u] = cu[k] ? ns : -ns;
+            vert.normal[v] = cv[k] ? ns : -ns;
+        }
+        else
+        {
+            vert.normal[d] = sign;
+            vert.normal[u] = 0.0f;
+            vert.normal[v] = 0.0f;
+        }
+
+        vert.color[0] = (color>>16)&0xFF;
+        vert.color[1] = (color>> 8)&0xFF;
+        vert.color[2] = (color    )&0xFF;
+        vert.color[3] = 0xFF;
+
+        mesh.vertices.push_back(vert);
+    }
+
+    for (unsigned int i = 0; i < 4; i++)
+        mesh.indices.push_back(base+i);
+}
+
+
+void VoxelMesher::build(VoxelMesh& mesh) const
+{
+    mesh.clear();
+
+    const Imath::V3i base = chunkBox(m_chunk).min;
+
+    // face mask for one slice, 0 means no face, otherwise RGB plus a marker bit
+    SproxelRgba8 mask[CHUNK_SIZE*CHUNK_SIZE];
+
+    for (int d = 0; d < 3; d++)
+    {
+        const int u = (d+1)%3;
+        const int v = (d+2)%3;
+
+        for (int s = 0; s < 2; s++)
+        {
+            const bool positive = (s == 0);
+
+            for (int i = 0; i < CHUNK_SIZE; i++)
+            {
+                // collect visible faces of this slice
+                for (int b = 0; b < CHUNK_SIZE; b++)
+                    for (int a = 0; a < CHUNK_SIZE; a++)
+                    {
+                        Imath::V3i p;
+                        p[d] = i; p[u] = a; p[v] = b;
+
+                        const SproxelRgba8 c = m_samples[sampleIndex(p)];
+                        SproxelRgba8 m = 0;
+
+                        if (c>>24)
+                        {
+                            p[d] += positive ? 1 : -1;
+                            if (!(m_samples[sampleIndex(p)]>>24)) m = (c & 0xFFFFFF) | 0x01000000;
+                        }
+
+                        mask[b*CHUNK_SIZE+a] = m;
+                    }
+
+                // merge into rectangles
+                for (int b = 0; b < CHUNK_SIZE; b++)
+                    for (int a = 0; a < CHUNK_SIZE; )
+                    {
+                        const SproxelRgba8 m = mask[b*CHUNK_SIZE+a];
+                        if (!m) { a++; continue; }
+
+                        int w = 1, h = 1;
+
+                        if (m_greedy)
+                        {
+                            while (a+w < CHUNK_SIZE && mask[b*CHUNK_SIZE+a+w] == m) w++;
+
+                            for (; b+h < CHUNK_SIZE; h++)
+                            {
+                                const SproxelRgba8* row = &mask[(b+h)*CHUNK_SIZE+a];
+                                int k = 0;
+                                while (k < w && row[k] == m) k++;
+                                if (k < w) break;
+                            }
+                        }
+
+                        for (int y = 0; y < h; y++)
+                            std::fill(&mask[(b+y)*CHUNK_SIZE+a], &mask[(b+y)*CHUNK_SIZE+a+w], 0u);
+
+                        Imath::V3i corner;
+                        corner[d] = base[d]+i;
+                        corner[u] = base[u]+a;
+                        corner[v] = base[v]+b;
+                        emitQuad(mesh, d, positive, corner, w, h, m);
+
+                        a += w;
+                    }
+            }
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef __VOXEL_MESHER_H__
+#define __VOXEL_MESHER_H__
+
+#include <vector>
+
+#include <ImathBox.h>
+#include <ImathVec.h>
+
+#include "VoxelGridGroup.h"
+
+
+//-*****************************************************************************
+// Vertex layout used by the viewport buffers: position, normal, RGBA bytes.
+struct VoxelMeshVertex
+{
+    float pos[3];
+    float normal[3];
+    unsigned char color[4];
+};
+
+
+// Faces are quads, four indices each, so outlines drawn with glPolygonMode
+// follow voxel edges.
+struct VoxelMesh
+{
+    std::vector<VoxelMeshVertex> vertices;
+    std::vector<unsigned int> indices;
+
+    void clear() { vertices.clear(); indices.clear(); }
+    bool isEmpty() const { return indices.empty(); }
+};
+
+
+// Strict weak ordering of chunk coordinates, for use as a map key
+struct VoxelChunkLess
+{
+    bool operator()(const Imath::V3i& a, const Imath::V3i& b) const
+    {
+        if (a.x != b.x) return a.x < b.x;
+        if (a.y != b.y) return a.y < b.y;
+        return a.z < b.z;
+    }
+};
+
+
+//-*****************************************************************************
+// Builds quad meshes for cubic chunks of a sprite.
+// The mesher works on a padded block of packed colors covering the chunk plus
+// one voxel on every side, so faces on chunk borders can be culled against the
+// neighbours without touching the sprite again.  Only faces between an opaque
+// and an empty voxel are emitted; in greedy mode coplanar faces of the same
+// color are merged into rectangles.
+// Positions are in sprite voxel space, voxel (x,y,z) spans [x, x+1].
+class VoxelMesher
+{
+public:
+    enum { CHUNK_BITS = 4,
+           CHUNK_SIZE = 1<<CHUNK_BITS,
+           PADDED     = CHUNK_SIZE+2,
+           SAMPLES    = PADDED*PADDED*PADDED };
+
+    VoxelMesher();
+
+    // Greedy merging of faces, on by default
+    void setGreedy(bool g) { m_greedy = g; }
+    bool greedy() const { return m_greedy; }
+
+    // Bevelled per-vertex normals like the old immediate-mode cubes.
+    // Only applies to unmerged faces.
+    void setSmooth(bool s) { m_smooth = s; }
+    bool smooth() const { return m_smooth; }
+
+    // Chunk coordinate containing the voxel
+    static Imath::V3i chunkOf(const Imath::V3i& v)
+    {
+        return Imath::V3i(v.x>>CHUNK_BITS, v.y>>CHUNK_BITS, v.z>>CHUNK_BITS);
+    }
+
+    // Voxel-space box covered by the chunk, without padding
+    static Imath::Box3i chunkBox(const Imath::V3i& chunk)
+    {
+        Imath::V3i mn(chunk.x<<CHUNK_BITS, chunk.y<<CHUNK_BITS, chunk.z<<CHUNK_BITS);
+        return Imath::Box3i(mn, mn+Imath::V3i(CHUNK_SIZE-1));
+    }
+
+    // Fill the padded block from a sprite.  Voxels outside of clip read empty.
+    void sample(const VoxelGridGroup& spr, const Imath::V3i& chunk, const Imath::Box3i& clip);
+
+    // Direct access to the padded block, cell (-1,-1,-1) is at index 0
+    void setSample(const Imath::V3i& local, SproxelRgba8 c) { m_samples[sampleIndex(local)] = c; }
+    SproxelRgba8 getSample(const Imath::V3i& local) const { return m_samples[sampleIndex(local)]; }
+    void clearSamples();
+
+    const Imath::V3i& chunk() const { return m_chunk; }
+    void setChunk(const Imath::V3i& c) { m_chunk = c; }
+
+    // True if no voxel inside the chunk itself is opaque
+    bool samplesEmpty() const;
+
+    // Hash of the padded block, used to skip re-meshing unchanged chunks
+    unsigned long long samplesHash() const;
+
+    // Build the mesh for the current samples, mesh is cleared first
+    void build(VoxelMesh& mesh) const;
+
+    static int sampleIndex(const Imath::V3i& local)
+    {
+        return ((local.x+1)*PADDED + (local.y+1))*PADDED + (local.z+1);
+    }
+
+private:
+    bool m_greedy;
+    bool m_smooth;
+    Imath::V3i m_chunk;
+    std::vector<SproxelRgba8> m_samples;
+
+    void emitQuad(VoxelMesh& mesh, int d, bool positive, const Imath::V3i& corner,
+                  int w, int h, SproxelRgba8 color) const;
+};
+
+#endif
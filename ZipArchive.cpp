@@ -0,0 +1,581 @@
+#include <string.h>
+#include <QIODevice>
+#include <QDateTime>
+#include "ZipArchive.h"
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+namespace
+{
+  struct Crc32Table
+  {
+    quint32 t[256];
+
+    Crc32Table()
+    {
+      for (quint32 i=0; i<256; ++i)
+      {
+        quint32 c=i;
+        for (int k=0; k<8; ++k) c = (c&1) ? (0xEDB88320u^(c>>1)) : (c>>1);
+        t[i]=c;
+      }
+    }
+  };
+}
+
+
+quint32 zip_crc32(const char *data, int size, quint32 crc)
+{
+  // built once, also when several threads load projects at the same time
+  static const Crc32Table table;
+
+  crc=~crc;
+  for (int i=0; i<size; ++i) crc=table.t[(crc^quint8(data[i]))&0xFF]^(crc>>8);
+  return ~crc;
+}
+
+
+static void put16(QByteArray &b, quint16 v)
+{
+  b.append(char(v&0xFF));
+  b.append(char(v>>8));
+}
+
+
+static void put32(QByteArray &b, quint32 v)
+{
+  put16(b, quint16(v&0xFFFF));
+  put16(b, quint16(v>>16));
+}
+
+
+static quint16 get16(const char *p)
+{
+  const quint8 *u=(const quint8*)p;
+  return quint16(u[0] | (u[1]<<8));
+}
+
+
+static quint32 get32(const char *p)
+{
+  return quint32(get16(p)) | (quint32(get16(p+2))<<16);
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// Raw deflate decoder (RFC 1951), after zlib's puff.c.
+// Codes of up to FASTBITS bits are decoded with one table lookup, longer
+// ones bit by bit.  Output goes into a buffer of the expected size, the
+// stream must fill it exactly.
+class Inflater
+{
+public:
+  Inflater(const char *in, quint32 inSize, char *out, quint32 outSize)
+    : m_in((const quint8*)in), m_inSize(inSize), m_pos(0), m_bitBuf(0), m_bitCount(0), m_pad(0),
+      m_out((quint8*)out), m_outSize(outSize), m_outPos(0) {}
+
+  bool run()
+  {
+    int last;
+    do
+    {
+      if (!bits(1, last)) return false;
+      int type;
+      if (!bits(2, type)) return false;
+
+      bool ok=false;
+      switch (type)
+      {
+        case 0: ok=stored(); break;
+        case 1: ok=fixed(); break;
+        case 2: ok=dynamic(); break;
+      }
+      if (!ok) return false;
+    } while (!last);
+
+    return m_outPos==m_outSize;
+  }
+
+private:
+  enum { MAXBITS=15, MAXLCODES=286, MAXDCODES=30, FIXLCODES=288 };
+  enum { FASTBITS=10, FASTSIZE=1<<FASTBITS };
+
+  struct Huffman
+  {
+    quint16 fast[FASTSIZE]; // (length<<9)|symbol by the next FASTBITS bits, 0 for longer codes
+    short count[MAXBITS+1];
+    short symbol[FIXLCODES];
+  };
+
+  struct FixedTables
+  {
+    Huffman lencode, distcode;
+
+    FixedTables()
+    {
+      short lengths[FIXLCODES];
+      int s=0;
+      for (; s<144; ++s) lengths[s]=8;
+      for (; s<256; ++s) lengths[s]=9;
+      for (; s<280; ++s) lengths[s]=7;
+      for (; s<FIXLCODES; ++s) lengths[s]=8;
+      construct(lencode, lengths, FIXLCODES);
+
+      for (s=0; s<MAXDCODES; ++s) lengths[s]=5;
+      construct(distcode, lengths, MAXDCODES);
+    }
+  };
+
+  const quint8 *m_in;
+  quint32 m_inSize, m_pos;
+
+  // Bits are used from the bottom.  Past the end of the input zero bytes
+  // are shifted in, m_pad counts those bits, which are always on top.
+  quint64 m_bitBuf;
+  int m_bitCount, m_pad;
+
+  quint8 *m_out;
+  quint32 m_outSize, m_outPos;
+
+  // At least 57 bits in the buffer afterwards
+  void refill()
+  {
+    while (m_bitCount<=56)
+    {
+      if (m_pos<m_inSize) m_bitBuf|=quint64(m_in[m_pos++])<<m_bitCount;
+      else m_pad+=8;
+      m_bitCount+=8;
+    }
+  }
+
+  // False if that used up padding, i.e. ran past the end of the input
+  bool drop(int n)
+  {
+    m_bitBuf>>=n;
+    m_bitCount-=n;
+    return m_bitCount>=m_pad;
+  }
+
+  bool bits(int need, int &val)
+  {
+    refill();
+    val=int(m_bitBuf&((quint64(1)<<need)-1));
+    return drop(need);
+  }
+
+  bool stored()
+  {
+    // skip to the next byte boundary of the input
+    const quint32 bytePos=m_pos-quint32(m_bitCount-m_pad)/8;
+    m_pos=bytePos;
+    m_bitBuf=0;
+    m_bitCount=0;
+    m_pad=0;
+
+    if (m_pos+4>m_inSize) return false;
+    const quint32 len=m_in[m_pos] | (m_in[m_pos+1]<<8);
+    const quint32 nlen=m_in[m_pos+2] | (m_in[m_pos+3]<<8);
+    m_pos+=4;
+    if (len!=(~nlen&0xFFFF) || m_pos+len>m_inSize || len>m_outSize-m_outPos) return false;
+
+    memcpy(m_out+m_outPos, m_in+m_pos, len);
+    m_outPos+=len;
+    m_pos+=len;
+    return true;
+  }
+
+  int decode(const Huffman &h)
+  {
+    refill();
+
+    const int e=h.fast[m_bitBuf&(FASTSIZE-1)];
+    if (e) return drop(e>>9) ? (e&511) : -1;
+
+    // canonical decoding, one bit at a time
+    int code=0, first=0, index=0;
+    for (int len=1; len<=MAXBITS; ++len)
+    {
+      code|=int((m_bitBuf>>(len-1))&1);
+      const int count=h.count[len];
+      if (code-count<first) return drop(len) ? h.symbol[index+(code-first)] : -1;
+      index+=count;
+      first+=count;
+      first<<=1;
+      code<<=1;
+    }
+    return -1;
+  }
+
+  // Returns false for over-subscribed code sets, incomplete ones are allowed
+  static bool construct(Huffman &h, const short *length, int n)
+  {
+    memset(h.fast, 0, sizeof(h.fast));
+
+    for (int len=0; len<=MAXBITS; ++len) h.count[len]=0;
+    for (int s=0; s<n; ++s) h.count[length[s]]++;
+    if (h.count[0]==n) return true;
+
+    int left=1;
+    for (int len=1; len<=MAXBITS; ++len)
+    {
+      left<<=1;
+      left-=h.count[len];
+      if (left<0) return false;
+    }
+
+    short offs[MAXBITS+1];
+    offs[1]=0;
+    for (int len=1; len<MAXBITS; ++len) offs[len+1]=offs[len]+h.count[len];
+
+    for (int s=0; s<n; ++s)
+      if (length[s]!=0) h.symbol[offs[length[s]]++]=short(s);
+
+    // codes are assigned in symbol table order, and sent first bit first,
+    // so table slots are indexed by the bit-reversed code
+    int code=0, index=0;
+    for (int len=1; len<=FASTBITS; ++len)
+    {
+      for (int i=0; i<h.count[len]; ++i, ++code)
+      {
+        int rev=0;
+        for (int b=0; b<len; ++b) rev|=((code>>b)&1)<<(len-1-b);
+
+        const quint16 e=quint16((len<<9) | h.symbol[index++]);
+        for (int j=rev; j<FASTSIZE; j+=1<<len) h.fast[j]=e;
+      }
+      code<<=1;
+    }
+
+    return true;
+  }
+
+  bool codes(const Huffman &lencode, const Huffman &distcode)
+  {
+    static const short lbase[29]={
+      3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const short lext[29]={
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const short dbase[30]={
+      1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577};
+    static const short dext[30]={
+      0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+      7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+      12, 12, 13, 13};
+
+    for (;;)
+    {
+      int symbol=decode(lencode);
+      if (symbol<0) return false;
+      if (symbol<256)
+      {
+        if (m_outPos>=m_outSize) return false;
+        m_out[m_outPos++]=quint8(symbol);
+        continue;
+      }
+      if (symbol==256) return true;
+
+      symbol-=257;
+      if (symbol>=29) return false;
+      int extra;
+      if (!bits(lext[symbol], extra)) return false;
+      const quint32 len=lbase[symbol]+extra;
+
+      symbol=decode(distcode);
+      if (symbol<0 || symbol>=30) return false;
+      if (!bits(dext[symbol], extra)) return false;
+      const quint32 dist=dbase[symbol]+extra;
+      if (dist>m_outPos || len>m_outSize-m_outPos) return false;
+
+      // the source may overlap the destination, then bytes repeat
+      quint8 *to=m_out+m_outPos;
+      const quint8 *from=to-dist;
+      if (dist>=len) memcpy(to, from, len);
+      else for (quint32 i=0; i<len; ++i) to[i]=from[i];
+      m_outPos+=len;
+    }
+  }
+
+  bool fixed()
+  {
+    // built once, also when several threads load projects at the same time
+    static const FixedTables tables;
+    return codes(tables.lencode, tables.distcode);
+  }
+
+  bool dynamic()
+  {
+    static const short order[19]={16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    int nlen, ndist, ncode;
+    if (!bits(5, nlen) || !bits(5, ndist) || !bits(4, ncode)) return false;
+    nlen+=257;
+    ndist+=1;
+    ncode+=4;
+    if (nlen>MAXLCODES || ndist>MAXDCODES) return false;
+
+    short lengths[MAXLCODES+MAXDCODES];
+    int index=0;
+    for (; index<ncode; ++index)
+    {
+      int b;
+      if (!bits(3, b)) return false;
+      lengths[order[index]]=short(b);
+    }
+    for (; index<19; ++index) lengths[order[index]]=0;
+
+    Huffman lencode, distcode;
+    if (!construct(lencode, lengths, 19)) return false;
+
+    index=0;
+    while (index<nlen+ndist)
+    {
+      int symbol=decode(lencode);
+      if (symbol<0) return false;
+
+      if (symbol<16)
+      {
+        lengths[index++]=short(symbol);
+        continue;
+      }
+
+      short len=0;
+      int rep;
+      if (symbol==16)
+      {
+        if (index==0) return false;
+        len=lengths[index-1];
+        if (!bits(2, rep)) return false;
+        rep+=3;
+      }
+      else if (symbol==17)
+      {
+        if (!bits(3, rep)) return false;
+        rep+=3;
+      }
+      else
+      {
+        if (!bits(7, rep)) return false;
+        rep+=11;
+      }
+
+      if (index+rep>nlen+ndist) return false;
+      while (rep--) lengths[index++]=len;
+    }
+
+    if (lengths[256]==0) return false;
+
+    if (!construct(lencode, lengths, nlen)) return false;
+    if (!construct(distcode, lengths+nlen, ndist)) return false;
+
+    return codes(lencode, distcode);
+  }
+};
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+static void dosDateTime(quint16 &time, quint16 &date)
+{
+  const QDateTime now=QDateTime::currentDateTime();
+  const QDate d=now.date();
+  const QTime t=now.time();
+  time=quint16((t.hour()<<11) | (t.minute()<<5) | (t.second()/2));
+  date=quint16(((d.year()-1980)<<9) | (d.month()<<5) | d.day());
+}
+
+
+ZipWriter::ZipWriter(QIODevice *dev)
+  : m_dev(dev), m_ok(dev!=NULL)
+{
+}
+
+
+bool ZipWriter::addFile(const QString &name, const QByteArray &data, bool compress)
+{
+  if (!m_ok) return false;
+
+  Entry e;
+  e.name=name.toUtf8();
+  e.crc=zip_crc32(data.constData(), data.size());
+  e.size=data.size();
+  e.offset=quint32(m_dev->pos());
+
+  // qCompress gives a 4 byte size, a 2 byte zlib header, raw deflate data
+  // and a 4 byte checksum, zip wants just the raw data
+  QByteArray packed;
+  if (compress && data.size()>0)
+  {
+    packed=qCompress(data);
+    if (packed.size()>=10) packed=packed.mid(6, packed.size()-10);
+    if (packed.size()>=data.size()) packed.clear();
+  }
+
+  e.method = packed.isEmpty() ? 0 : 8;
+  const QByteArray &payload = packed.isEmpty() ? data : packed;
+  e.compressedSize=payload.size();
+
+  quint16 time, date;
+  dosDateTime(time, date);
+
+  QByteArray header;
+  put32(header, 0x04034b50);
+  put16(header, 20);
+  put16(header, 0x0800); // UTF-8 names
+  put16(header, e.method);
+  put16(header, time);
+  put16(header, date);
+  put32(header, e.crc);
+  put32(header, e.compressedSize);
+  put32(header, e.size);
+  put16(header, quint16(e.name.size()));
+  put16(header, 0);
+  header.append(e.name);
+
+  if (m_dev->write(header)!=header.size() || m_dev->write(payload)!=payload.size())
+  {
+    m_ok=false;
+    return false;
+  }
+
+  m_entries.push_back(e);
+  return true;
+}
+
+
+bool ZipWriter::close()
+{
+  if (!m_ok) return false;
+
+  quint16 time, date;
+  dosDateTime(time, date);
+
+  const quint32 dirOffset=quint32(m_dev->pos());
+
+  QByteArray dir;
+  for (int i=0; i<m_entries.size(); ++i)
+  {
+    const Entry &e=m_entries[i];
+    put32(dir, 0x02014b50);
+    put16(dir, 20);
+    put16(dir, 20);
+    put16(dir, 0x0800);
+    put16(dir, e.method);
+    put16(dir, time);
+    put16(dir, date);
+    put32(dir, e.crc);
+    put32(dir, e.compressedSize);
+    put32(dir, e.size);
+    put16(dir, quint16(e.name.size()));
+    put16(dir, 0);
+    put16(dir, 0);
+    put16(dir, 0);
+    put16(dir, 0);
+    put32(dir, 0);
+    put32(dir, e.offset);
+    dir.append(e.name);
+  }
+
+  const quint32 dirSize=dir.size();
+
+  put32(dir, 0x06054b50);
+  put16(dir, 0);
+  put16(dir, 0);
+  put16(dir, quint16(m_entries.size()));
+  put16(dir, quint16(m_entries.size()));
+  put32(dir, dirSize);
+  put32(dir, dirOffset);
+  put16(dir, 0);
+
+  if (m_dev->write(dir)!=dir.size()) m_ok=false;
+  return m_ok;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+ZipReader::ZipReader(const char *data, qint64 size)
+  : m_data(data), m_size(size), m_valid(false)
+{
+  if (!data || size<22) return;
+
+  // find the end of central directory record, it may be followed by a comment
+  qint64 eocd=-1;
+  for (qint64 p=size-22; p>=0 && p>=size-22-0xFFFF; --p)
+    if (get32(data+p)==0x06054b50) { eocd=p; break; }
+  if (eocd<0) return;
+
+  const int numEntries=get16(data+eocd+10);
+  const quint32 dirOffset=get32(data+eocd+16);
+
+  qint64 p=dirOffset;
+  for (int i=0; i<numEntries; ++i)
+  {
+    if (p+46>size || get32(data+p)!=0x02014b50) return;
+
+    const quint16 flags=get16(data+p+8);
+    const quint16 nameLen=get16(data+p+28);
+    const quint16 extraLen=get16(data+p+30);
+    const quint16 commentLen=get16(data+p+32);
+    if (p+46+nameLen>size) return;
+
+    Entry e;
+    e.method=get16(data+p+10);
+    e.crc=get32(data+p+16);
+    e.compressedSize=get32(data+p+20);
+    e.size=get32(data+p+24);
+    e.headerOffset=get32(data+p+42);
+
+    const char *name=data+p+46;
+    m_entries.insert((flags&0x0800) ? QString::fromUtf8(name, nameLen) : QString::fromLocal8Bit(name, nameLen), e);
+
+    p+=46+nameLen+extraLen+commentLen;
+  }
+
+  m_valid=true;
+}
+
+
+bool ZipReader::fileData(const QString &name, QByteArray &out) const
+{
+  out.clear();
+
+  QHash<QString, Entry>::const_iterator it=m_entries.constFind(name);
+  if (it==m_entries.constEnd()) return false;
+  const Entry &e=it.value();
+
+  const qint64 h=e.headerOffset;
+  if (h+30>m_size || get32(m_data+h)!=0x04034b50) return false;
+
+  const qint64 start=h+30+get16(m_data+h+26)+get16(m_data+h+28);
+  if (start+e.compressedSize>m_size) return false;
+
+  const char *src=m_data+start;
+
+  if (e.method==0)
+  {
+    if (e.compressedSize!=e.size) return false;
+    out=QByteArray(src, int(e.size));
+  }
+  else if (e.method==8)
+  {
+    out.resize(int(e.size));
+    Inflater inf(src, e.compressedSize, out.data(), e.size);
+    if (!inf.run()) { out.clear(); return false; }
+  }
+  else
+    return false;
+
+  if (zip_crc32(out.constData(), out.size())!=e.crc) { out.clear(); return false; }
+
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef __ZIP_ARCHIVE_H__
+#define __ZIP_ARCHIVE_H__
+
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QHash>
+
+
+class QIODevice;
+
+
+quint32 zip_crc32(const char *data, int size, quint32 crc=0);
+
+
+// Writes a zip archive sequentially to a device.
+// Entries are either stored or deflated, the central directory is written
+// by close().
+class ZipWriter
+{
+public:
+  ZipWriter(QIODevice *dev);
+
+  bool addFile(const QString &name, const QByteArray &data, bool compress=true);
+  bool close();
+
+  bool isOk() const { return m_ok; }
+
+private:
+  struct Entry
+  {
+    QByteArray name;
+    quint16 method;
+    quint32 crc, compressedSize, size, offset;
+  };
+
+  QIODevice *m_dev;
+  QVector<Entry> m_entries;
+  bool m_ok;
+};
+
+
+// Reads zip archives held in memory, the data must outlive the reader.
+// Supports stored and deflated entries, no zip64 or encryption.
+class ZipReader
+{
+public:
+  ZipReader(const char *data, qint64 size);
+
+  bool isValid() const { return m_valid; }
+
+  bool contains(const QString &name) const { return m_entries.contains(name); }
+  QList<QString> fileNames() const { return m_entries.keys(); }
+
+  // Returns false if the entry is missing or damaged
+  bool fileData(const QString &name, QByteArray &out) const;
+
+private:
+  struct Entry
+  {
+    quint16 method;
+    quint32 crc, compressedSize, size, headerOffset;
+  };
+
+  const char *m_data;
+  qint64 m_size;
+  QHash<QString, Entry> m_entries;
+  bool m_valid;
+};
+
+
+#endif
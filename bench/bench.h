@@ -0,0 +1,46 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+
+#include <stdio.h>
+#include <QElapsedTimer>
+
+
+// Best of a few runs, in milliseconds.  Use as
+//   BenchTimer t; do { t.start(); ...; } while (t.next());
+class BenchTimer
+{
+public:
+  BenchTimer(int runs=3) : m_runs(runs), m_best(-1) {}
+
+  void start() { m_timer.start(); }
+
+  bool next()
+  {
+    const double ms=m_timer.nsecsElapsed()*1e-6;
+    if (m_best<0 || ms<m_best) m_best=ms;
+    return --m_runs>0;
+  }
+
+  double ms() const { return m_best; }
+
+private:
+  QElapsedTimer m_timer;
+  int m_runs;
+  double m_best;
+};
+
+
+inline void print_result(const char *name, double oldMs, double newMs)
+{
+  printf("%-28s %10.2f ms %10.2f ms %8.1fx\n", name, oldMs, newMs, newMs>0 ? oldMs/newMs : 0.0);
+}
+
+
+inline void print_header(const char *oldName, const char *newName)
+{
+  printf("%-28s %13s %13s %9s\n", "", oldName, newName, "speedup");
+}
+
+
+#endif
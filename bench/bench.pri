@@ -0,0 +1,45 @@
+# Shared settings of the benchmark programs, included by each .pro
+
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle
+QT -= gui
+
+INCLUDEPATH += $$PWD $$PWD/.. $$PWD/../Imath
+
+win32 {
+  DEFINES += NOMINMAX
+  QMAKE_CXXFLAGS += -wd4996
+}
+
+SOURCES += \
+    $$PWD/../Imath/ImathVec.cpp \
+    $$PWD/../Imath/ImathColorAlgo.cpp \
+    $$PWD/../Imath/ImathFun.cpp \
+    $$PWD/../Imath/ImathBox.cpp \
+    $$PWD/../Imath/IexBaseExc.cpp
+
+HEADERS += \
+    $$PWD/bench.h
+
+# Benchmarks of sprites, projects and file formats set CONFIG += sproxel_core
+# before including this file.  These are the editor sources without widgets.
+sproxel_core {
+  QT += gui
+
+  SOURCES += \
+      $$PWD/../SproxelProject.cpp \
+      $$PWD/../ProjectFile.cpp \
+      $$PWD/../BrickProjectFile.cpp \
+      $$PWD/../ZipArchive.cpp \
+      $$PWD/../ImportExport.cpp \
+      $$PWD/../UndoManager.cpp \
+      $$PWD/../VoxelMesher.cpp \
+      $$PWD/../Quantize.cpp \
+      $$PWD/../Imath/ImathMatrixAlgo.cpp \
+      $$PWD/../Imath/ImathShear.cpp
+
+  HEADERS += \
+      $$PWD/terrain.h \
+      $$PWD/../UndoManager.h
+}
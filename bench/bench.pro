@@ -0,0 +1,14 @@
+# SPROXEL standalone benchmarks
+#
+# Each subdirectory is a console program timing one subsystem against
+# the code it replaced.  Build all with "qmake && make" here, or one
+# from its own directory.
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    gamevoxelgrid \
+    mesher \
+    csv \
+    obj \
+    projectfile
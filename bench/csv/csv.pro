@@ -0,0 +1,8 @@
+# CSV import and export throughput against the old fscanf/fprintf code
+
+CONFIG += sproxel_core
+include(../bench.pri)
+
+TARGET = bench_csv
+
+SOURCES += main.cpp
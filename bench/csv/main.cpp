@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include "ImportExport.h"
+#include "bench.h"
+
+
+// The importer and exporter as they were before the buffered versions
+
+static VoxelGridGroupPtr old_csv_import(const QString &filename)
+{
+  FILE* fp = fopen(qPrintable(filename), "rb");
+  if (!fp) return VoxelGridGroupPtr();
+
+  Imath::V3i size(0);
+  if (fscanf(fp, "%d,%d,%d\n", &size.x, &size.y, &size.z)!=3) { fclose(fp); return VoxelGridGroupPtr(); }
+
+  VoxelGridGroupPtr spr(new VoxelGridGroup(size, ColorPalettePtr()));
+
+  Imath::Color4f color;
+  for (int y = size.y-1; y >= 0; y--)
+  {
+    for (int z = 0; z < size.z; z++)
+    {
+      for (int x = 0; x < size.x; x++)
+      {
+        int r, g, b, a;
+        if (fscanf(fp, "#%02X%02X%02X%02X,", &r, &g, &b, &a)!=4) r=g=b=a=0;
+
+        color.r = r / (float)0xff;
+        color.g = g / (float)0xff;
+        color.b = b / (float)0xff;
+        color.a = a / (float)0xff;
+        spr->set(Imath::V3i(x,y,z), color);
+
+        if (x != size.x-1)
+          if (fscanf(fp, ",")<0) break;
+      }
+      if (fscanf(fp, "\n")<0) break;
+    }
+    if (fscanf(fp, "\n")<0) break;
+  }
+  fclose(fp);
+
+  return spr;
+}
+
+
+static bool old_csv_export(const QString &filename, VoxelGridGroupPtr spr)
+{
+  FILE* fp = fopen(qPrintable(filename), "wb");
+  if (!fp) return false;
+
+  const Imath::Box3i dim=spr->bounds();
+  const Imath::V3i cellDim = dim.size()+Imath::V3i(1);
+  fprintf(fp, "%d,%d,%d\n", cellDim.x, cellDim.y, cellDim.z);
+
+  for (int y = cellDim.y-1; y >= 0; y--)
+  {
+    for (int z = 0; z < cellDim.z; z++)
+    {
+      for (int x = 0; x < cellDim.x; x++)
+      {
+        const Imath::V3i curLoc=Imath::V3i(x,y,z)+dim.min;
+        Imath::Color4f col = spr->get(curLoc);
+        fprintf(fp, "#%02X%02X%02X%02X",
+                (int)(col.r*0xff),
+                (int)(col.g*0xff),
+                (int)(col.b*0xff),
+                (int)(col.a*0xff));
+        if (x != cellDim.x-1)
+          fprintf(fp, ",");
+      }
+      fprintf(fp, "\n");
+    }
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+  return true;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// Random 8-bit colors, about a third of the cells empty
+static VoxelGridGroupPtr make_sprite(int n)
+{
+  VoxelGridGroupPtr spr(new VoxelGridGroup(Imath::V3i(n), ColorPalettePtr()));
+  srand(1);
+  for (int x=0; x<n; ++x)
+    for (int y=0; y<n; ++y)
+      for (int z=0; z<n; ++z)
+        if (rand()%3)
+          spr->set(Imath::V3i(x, y, z), unpack_color(0xFF000000u | (rand()&0xFFFF) | ((rand()&0xFF)<<16)));
+  return spr;
+}
+
+
+static bool same_voxels(const VoxelGridGroup &a, const VoxelGridGroup &b)
+{
+  const Imath::Box3i box=a.bounds();
+  if (box!=b.bounds()) return false;
+
+  for (int x=box.min.x; x<=box.max.x; ++x)
+    for (int y=box.min.y; y<=box.max.y; ++y)
+      for (int z=box.min.z; z<=box.max.z; ++z)
+        if (a.getPacked(Imath::V3i(x, y, z))!=b.getPacked(Imath::V3i(x, y, z))) return false;
+
+  return true;
+}
+
+
+template <class T> static T* find_by_name(const QList<T*> &list, const QString &name)
+{
+  foreach (T *p, list) if (p->name()==name) return p;
+  return NULL;
+}
+
+
+static void print_rate(const char *name, double oldMs, double newMs, double mb)
+{
+  printf("%-10s %8.2f s %8.1f MB/s %8.2f s %8.1f MB/s %7.1fx\n", name,
+    oldMs*1e-3, mb/(oldMs*1e-3), newMs*1e-3, mb/(newMs*1e-3), oldMs/newMs);
+}
+
+
+int main(int argc, char **argv)
+{
+  const int n=argc>1 ? atoi(argv[1]) : 128;
+  if (n<1)
+  {
+    fprintf(stderr, "usage: bench_csv [size]\n");
+    return 2;
+  }
+
+  register_builtin_importers_exporters();
+  Importer *importer=find_by_name(get_importers(), QString("Sproxel CSV files"));
+  Exporter *exporter=find_by_name(get_exporters(), QString("Sproxel CSV files"));
+  if (!importer || !exporter)
+  {
+    fprintf(stderr, "CSV importer or exporter not registered\n");
+    return 1;
+  }
+
+  const QString oldFile=QDir::temp().filePath("bench_csv_old.csv");
+  const QString newFile=QDir::temp().filePath("bench_csv_new.csv");
+
+  VoxelGridGroupPtr spr=make_sprite(n);
+  printf("%d^3 sprite of random colors, one run each\n\n", n);
+
+  BenchTimer t(1);
+  t.start(); old_csv_export(oldFile, spr); t.next();
+  const double oldExport=t.ms();
+
+  t=BenchTimer(1);
+  t.start(); const bool exported=exporter->doExport(newFile, SproxelProjectPtr(new SproxelProject()), spr); t.next();
+  const double newExport=t.ms();
+
+  t=BenchTimer(1);
+  t.start(); VoxelGridGroupPtr oldSpr=old_csv_import(newFile); t.next();
+  const double oldImport=t.ms();
+
+  SproxelProjectPtr project(new SproxelProject());
+  UndoManager um;
+  t=BenchTimer(1);
+  t.start(); const bool imported=importer->doImport(newFile, &um, project, VoxelGridGroupPtr()); t.next();
+  const double newImport=t.ms();
+
+  const double mb=QFileInfo(newFile).size()/(1024.0*1024.0);
+  printf("%.1f MB file\n\n", mb);
+  printf("%-10s %21s %21s %8s\n", "", "old", "new", "speedup");
+  print_rate("export", oldExport, newExport, mb);
+  print_rate("import", oldImport, newImport, mb);
+
+  const bool ok=exported && imported && project->sprites.size()==1
+    && same_voxels(*spr, *project->sprites[0]) && oldSpr && same_voxels(*spr, *oldSpr);
+  printf("\nround trip %s\n", ok ? "matches" : "FAILED");
+
+  QFile::remove(oldFile);
+  QFile::remove(newFile);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+# GameVoxelGrid flat buffer against the old nested vectors
+
+include(../bench.pri)
+
+TARGET = bench_gamevoxelgrid
+
+SOURCES += main.cpp
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <vector>
+#include <ImathColor.h>
+#include "GameVoxelGrid.h"
+#include "bench.h"
+
+
+typedef Imath::Color4f Color;
+
+
+// The vector-of-vector-of-vector layout GameVoxelGrid used before,
+// reduced to what is timed here
+template <class T>
+class NestedVoxelGrid
+{
+public:
+  NestedVoxelGrid(const Imath::V3i &dim) : m_dim(dim) { resizeData(); }
+
+  const Imath::V3i& cellDimensions() const { return m_dim; }
+
+  void set(const Imath::V3i &c, const T &v) { m_data[c.x][c.y][c.z]=v; }
+  T get(const Imath::V3i &c) const { return m_data[c.x][c.y][c.z]; }
+
+  void setAll(const T &v)
+  {
+    for (int x=0; x<m_dim.x; ++x)
+      for (int y=0; y<m_dim.y; ++y)
+        for (int z=0; z<m_dim.z; ++z)
+          m_data[x][y][z]=v;
+  }
+
+  NestedVoxelGrid& operator=(const NestedVoxelGrid &other)
+  {
+    if (this!=&other)
+    {
+      m_dim=other.m_dim;
+      resizeData();
+      for (int x=0; x<m_dim.x; ++x)
+        for (int y=0; y<m_dim.y; ++y)
+          for (int z=0; z<m_dim.z; ++z)
+            m_data[x][y][z]=other.m_data[x][y][z];
+    }
+    return *this;
+  }
+
+  void resize(const Imath::V3i &size, const Imath::V3i &offset, const T &value)
+  {
+    NestedVoxelGrid<T> newGrid(size);
+    newGrid.setAll(value);
+
+    int x0=offset.x; if (x0<0) x0=0;
+    int y0=offset.y; if (y0<0) y0=0;
+    int z0=offset.z; if (z0<0) z0=0;
+
+    int x1=offset.x+m_dim.x; if (x1>size.x) x1=size.x;
+    int y1=offset.y+m_dim.y; if (y1>size.y) y1=size.y;
+    int z1=offset.z+m_dim.z; if (z1>size.z) z1=size.z;
+
+    for (int x=x0; x<x1; ++x)
+      for (int y=y0; y<y1; ++y)
+        for (int z=z0; z<z1; ++z)
+          newGrid.set(Imath::V3i(x, y, z), get(Imath::V3i(x, y, z)-offset));
+
+    *this=newGrid;
+  }
+
+private:
+  Imath::V3i m_dim;
+  std::vector< std::vector< std::vector<T> > > m_data;
+
+  void resizeData()
+  {
+    m_data.resize(m_dim.x);
+    for (int x=0; x<m_dim.x; ++x)
+    {
+      m_data[x].resize(m_dim.y);
+      for (int y=0; y<m_dim.y; ++y) m_data[x][y].resize(m_dim.z);
+    }
+  }
+};
+
+
+// The same steps for both layouts, results are stored in ms
+template <class G>
+struct GridRun
+{
+  double alloc, setAll, copy, resize, get, set;
+  float sum;
+
+  void run(int n, const std::vector<Imath::V3i> &cells)
+  {
+    const Imath::V3i dim(n);
+    const Color red(1, 0, 0, 1);
+    BenchTimer t;
+
+    // the flat buffer is not touched until written, so fill it too
+    do { t.start(); G g(dim); g.setAll(red); } while (t.next());
+    alloc=t.ms();
+
+    G grid(dim);
+    t=BenchTimer();
+    do { t.start(); grid.setAll(red); } while (t.next());
+    setAll=t.ms();
+
+    t=BenchTimer();
+    do { t.start(); G copy(Imath::V3i(1)); copy=grid; } while (t.next());
+    copy=t.ms();
+
+    t=BenchTimer();
+    do
+    {
+      G g(dim);
+      t.start();
+      g.resize(dim+Imath::V3i(8), Imath::V3i(4), Color(0, 0, 0, 0));
+    } while (t.next());
+    resize=t.ms();
+
+    t=BenchTimer();
+    do
+    {
+      t.start();
+      for (size_t i=0; i<cells.size(); ++i) grid.set(cells[i], Color(float(i&255), 0, 0, 1));
+    } while (t.next());
+    set=t.ms();
+
+    sum=0;
+    t=BenchTimer();
+    do
+    {
+      t.start();
+      for (size_t i=0; i<cells.size(); ++i) sum+=grid.get(cells[i]).r;
+    } while (t.next());
+    get=t.ms();
+  }
+};
+
+
+int main(int argc, char **argv)
+{
+  const int n=argc>1 ? atoi(argv[1]) : 128;
+  if (n<1)
+  {
+    fprintf(stderr, "usage: bench_gamevoxelgrid [size]\n");
+    return 2;
+  }
+
+  std::vector<Imath::V3i> cells(4*1024*1024);
+  srand(1);
+  for (size_t i=0; i<cells.size(); ++i) cells[i]=Imath::V3i(rand()%n, rand()%n, rand()%n);
+
+  printf("%d^3 grid of Color4f, %d random cells, best of 3\n\n", n, int(cells.size()));
+
+  GridRun< NestedVoxelGrid<Color> > a;
+  a.run(n, cells);
+  GridRun< GameVoxelGrid<Color> > b;
+  b.run(n, cells);
+
+  print_header("nested", "flat");
+  print_result("construct and fill", a.alloc, b.alloc);
+  print_result("setAll", a.setAll, b.setAll);
+  print_result("copy", a.copy, b.copy);
+  print_result("resize +8", a.resize, b.resize);
+  print_result("random set", a.set, b.set);
+  print_result("random get", a.get, b.get);
+
+  // keeps the reads from being optimized away
+  if (a.sum!=b.sum) printf("\nget results differ\n");
+  return 0;
+}
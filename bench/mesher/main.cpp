@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include "VoxelMesher.h"
+#include "bench.h"
+#include "terrain.h"
+
+
+// What paintGL did per frame before the chunk buffers, without the GL
+// calls: every voxel of the bounds, its transform, and the six neighbour
+// lookups of computeVoxelFaceMask() for the filled ones
+static int old_face_walk(const VoxelGridGroup &spr)
+{
+  const Imath::Box3i dim=spr.bounds();
+  static const int dirs[6][3]={{1,0,0},{0,1,0},{0,0,1},{-1,0,0},{0,-1,0},{0,0,-1}};
+  int faces=0;
+  double sink=0;
+
+  for (int x=dim.min.x; x<=dim.max.x; ++x)
+    for (int y=dim.min.y; y<=dim.max.y; ++y)
+      for (int z=dim.min.z; z<=dim.max.z; ++z)
+      {
+        const Imath::V3i index(x, y, z);
+        const SproxelColor c=spr.getLayers(index);
+        const Imath::M44d mat=spr.voxelTransform(index);
+        sink+=mat[3][0];
+        if (c.a==0) continue;
+
+        for (int d=0; d<6; ++d)
+        {
+          const Imath::V3i at=index+Imath::V3i(dirs[d][0], dirs[d][1], dirs[d][2]);
+          if (!dim.intersects(at) || spr.getLayers(at).a==0) ++faces;
+        }
+      }
+
+  return sink<0 ? -1 : faces;
+}
+
+
+// Meshes every chunk overlapping box, returns the number of quads
+static int mesh_chunks(VoxelMesher &mesher, const VoxelGridGroup &spr, const Imath::Box3i &box)
+{
+  const Imath::Box3i clip=spr.bounds();
+  const Imath::V3i c0=VoxelMesher::chunkOf(box.min), c1=VoxelMesher::chunkOf(box.max);
+  VoxelMesh mesh;
+  int quads=0;
+
+  for (int x=c0.x; x<=c1.x; ++x)
+    for (int y=c0.y; y<=c1.y; ++y)
+      for (int z=c0.z; z<=c1.z; ++z)
+      {
+        mesher.sample(spr, Imath::V3i(x, y, z), clip);
+        if (mesher.samplesEmpty()) continue;
+        mesher.build(mesh);
+        quads+=int(mesh.indices.size()/4);
+      }
+
+  return quads;
+}
+
+
+int main(int argc, char **argv)
+{
+  const int n=argc>1 ? atoi(argv[1]) : 128;
+  if (n<2)
+  {
+    fprintf(stderr, "usage: bench_mesher [size]\n");
+    return 2;
+  }
+
+  VoxelGridGroupPtr spr=make_terrain(n);
+  const Imath::Box3i all=spr->bounds();
+  printf("%d^3 terrain sprite, best of 3\n\n", n);
+
+  int oldFaces=0;
+  BenchTimer t;
+  do { t.start(); oldFaces=old_face_walk(*spr); } while (t.next());
+  const double oldMs=t.ms();
+
+  VoxelMesher mesher;
+  int faceQuads=0, greedyQuads=0;
+
+  mesher.setGreedy(false);
+  t=BenchTimer();
+  do { t.start(); faceQuads=mesh_chunks(mesher, *spr, all); } while (t.next());
+  const double faceMs=t.ms();
+
+  mesher.setGreedy(true);
+  t=BenchTimer();
+  do { t.start(); greedyQuads=mesh_chunks(mesher, *spr, all); } while (t.next());
+  const double greedyMs=t.ms();
+
+  // a single voxel edit re-meshes the chunks its neighbourhood touches
+  const Imath::V3i at(n/2, n/2, n/2);
+  spr->set(at, SproxelColor(1, 1, 1, 1));
+  t=BenchTimer(20);
+  do
+  {
+    t.start();
+    mesh_chunks(mesher, *spr, Imath::Box3i(at-Imath::V3i(1), at+Imath::V3i(1)));
+  } while (t.next());
+  const double editMs=t.ms();
+
+  printf("old face walk, per frame    %10.2f ms  %9d faces\n", oldMs, oldFaces);
+  printf("mesh all chunks, per face   %10.2f ms  %9d quads\n", faceMs, faceQuads);
+  printf("mesh all chunks, greedy     %10.2f ms  %9d quads\n", greedyMs, greedyQuads);
+  printf("re-mesh after one edit      %10.2f ms\n", editMs);
+  printf("\nOnce meshed, frames only draw the cached buffers.  Greedy merging\n"
+         "sends %.1fx fewer quads than the per-voxel faces.\n", greedyQuads ? double(oldFaces)/greedyQuads : 0.0);
+
+  if (faceQuads!=oldFaces)
+  {
+    printf("\nper-face mesh and old face walk disagree\n");
+    return 1;
+  }
+
+  return 0;
+}
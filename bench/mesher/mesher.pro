@@ -0,0 +1,8 @@
+# Chunked viewport meshing against the old per-voxel face walk
+
+CONFIG += sproxel_core
+include(../bench.pri)
+
+TARGET = bench_mesher
+
+SOURCES += main.cpp
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include "ImportExport.h"
+#include "bench.h"
+#include "terrain.h"
+
+
+// The exporter as it was before the snapshot based one: composited get()
+// calls for every lattice vertex and voxel, a string map of materials and
+// fprintf for every line
+
+static void old_obj_write_poly(FILE* fp, bool asTriangles,
+  int v0, int v1, int v2, int v3)
+{
+  if (!asTriangles)
+  {
+    fprintf(fp, "f %d %d %d %d\n", v0, v1, v2, v3);
+  }
+  else
+  {
+    fprintf(fp, "f %d %d %d\n", v0, v1, v2);
+    fprintf(fp, "f %d %d %d\n", v2, v3, v0);
+  }
+}
+
+
+static bool old_obj_export(const QString &filename, VoxelGridGroupPtr spr, bool asTriangles)
+{
+  // Get file basename and extension
+  QFileInfo fi(filename);
+  QString basename = fi.completeBaseName();
+  QString basedir = fi.absolutePath();
+
+  // Shorthand
+  const Imath::Box3i dim=spr->bounds();
+  const Imath::V3i cellDim=dim.size()+Imath::V3i(1);
+  const int sx = cellDim.x;
+  const int sy = cellDim.y;
+  const int sz = cellDim.z;
+
+  // Create and write the material file
+  std::map<std::string, std::string> mtlMap;
+
+  // Build up the material lists
+  for (int y = 0; y < sy; y++)
+  {
+      for (int z = 0; z < sz; z++)
+      {
+          for (int x = 0; x < sx; x++)
+          {
+              const Imath::Color4f& color = spr->get(Imath::V3i(x, y, z)+dim.min);
+
+              if (color.a == 0.0f) continue;
+
+              char mtlName[64];
+              sprintf(mtlName, "mtl%d", (int)mtlMap.size());
+
+              char colorString[64];
+              sprintf(colorString, "Kd %.4f %.4f %.4f", color.r, color.g, color.b);
+              mtlMap.insert(std::pair<std::string, std::string>(std::string(colorString), std::string(mtlName)));
+          }
+      }
+  }
+
+  // Write .mtl file
+  QString mtlFilename = basedir + "/" + basename + ".mtl";
+  FILE* fp = fopen(mtlFilename.toLocal8Bit().constData(), "wb");
+  if (!fp) return false;
+
+  for(std::map<std::string, std::string>::iterator p = mtlMap.begin();
+      p != mtlMap.end();
+      ++p)
+  {
+      fprintf(fp, "newmtl %s\n", p->second.c_str());
+      fprintf(fp, "illum 4\n");
+      fprintf(fp, "%s\n", p->first.c_str());
+      fprintf(fp, "Ka 0.00 0.00 0.00\n");
+      fprintf(fp, "Tf 1.00 1.00 1.00\n");
+      fprintf(fp, "Ni 1.00\n");
+      fprintf(fp, "\n");
+  }
+  fclose(fp);
+
+
+  // Create and write the obj file
+  fp = fopen(filename.toLocal8Bit().constData(), "wb");
+  if (!fp) return false;
+
+  // Geometry
+  const int vertListLength = (sx+1) * (sy+1) * (sz+1);
+  int* vertList = new int[vertListLength];
+  memset(vertList, 0, sizeof(int)*vertListLength);
+
+  // Material library
+  fprintf(fp, "mtllib %s.mtl\n", basename.toLocal8Bit().constData());
+
+  // The object's name
+  fprintf(fp, "g %s\n", basename.toLocal8Bit().constData());
+
+  // Populate the vert list
+  int vertIndex = 1;
+  for (int y = 0; y < (sy+1); y++)
+  {
+      for (int z = 0; z < (sz+1); z++)
+      {
+          for (int x = 0; x < (sx+1); x++)
+          {
+              int neighbors = 0;
+              if ((x!=0)  && (y!=0)  && (z!=0)  && (spr->get(Imath::V3i(x-1, y-1, z-1)+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=0)  && (y!=0)  && (z!=sz) && (spr->get(Imath::V3i(x-1, y-1, z  )+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=0)  && (y!=sy) && (z!=0)  && (spr->get(Imath::V3i(x-1, y,   z-1)+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=0)  && (y!=sy) && (z!=sz) && (spr->get(Imath::V3i(x-1, y,   z  )+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=sx) && (y!=0)  && (z!=0)  && (spr->get(Imath::V3i(x,   y-1, z-1)+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=sx) && (y!=0)  && (z!=sz) && (spr->get(Imath::V3i(x,   y-1, z  )+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=sx) && (y!=sy) && (z!=0)  && (spr->get(Imath::V3i(x,   y,   z-1)+dim.min).a != 0.0f)) neighbors++;
+              if ((x!=sx) && (y!=sy) && (z!=sz) && (spr->get(Imath::V3i(x,   y,   z  )+dim.min).a != 0.0f)) neighbors++;
+
+              if (neighbors == 0 || neighbors == 8)
+                  continue;
+
+              const int vlIndex = (y*(sz+1)*(sx+1)) + (z*(sx+1)) + (x);
+              vertList[vlIndex] = vertIndex;
+              vertIndex++;
+          }
+      }
+  }
+
+  // Write the verts to the OBJ
+  for (int y = 0; y < (sy+1); y++)
+  {
+      for (int z = 0; z < (sz+1); z++)
+      {
+          for (int x = 0; x < (sx+1); x++)
+          {
+              Imath::V3i voxelToCheck = Imath::V3i(x,y,z);
+              if (x == sx) voxelToCheck.x--;
+              if (y == sy) voxelToCheck.y--;
+              if (z == sz) voxelToCheck.z--;
+
+              const Imath::M44d mat = spr->voxelTransform(voxelToCheck+dim.min);
+
+              Imath::V3d vert;
+              mat.multVecMatrix(Imath::V3d((x == sx) ? 0.5f : -0.5f,
+                                           (y == sy) ? 0.5f : -0.5f,
+                                           (z == sz) ? 0.5f : -0.5f), vert);
+
+              const int vlIndex = (y*(sz+1)*(sx+1)) + (z*(sx+1)) + (x);
+              if (vertList[vlIndex] != 0)
+              {
+                  fprintf(fp, "v %f %f %f\n", vert.x, vert.y, vert.z);
+              }
+          }
+      }
+  }
+
+  // Create all faces
+  for (int y = 0; y < sy; y++)
+  {
+      for (int z = 0; z < sz; z++)
+      {
+          for (int x = 0; x < sx; x++)
+          {
+              const Imath::Color4f& color = spr->get(Imath::V3i(x, y, z)+dim.min);
+              if (color.a == 0.0f)
+                  continue;
+
+              // Check for crossings
+              bool crossNegX = false;
+              bool crossPosX = false;
+              if (x == 0)
+                  crossNegX = true;
+              else if (color.a != spr->get(Imath::V3i(x-1,y,z)+dim.min).a)
+                  crossNegX = true;
+
+              if (x == sx-1)
+                  crossPosX = true;
+              else if (color.a != spr->get(Imath::V3i(x+1,y,z)+dim.min).a)
+                  crossPosX = true;
+
+              bool crossNegY = false;
+              bool crossPosY = false;
+              if (y == 0)
+                  crossNegY = true;
+              else if (color.a != spr->get(Imath::V3i(x,y-1,z)+dim.min).a)
+                  crossNegY = true;
+
+              if (y == sy-1)
+                  crossPosY = true;
+              else if (color.a != spr->get(Imath::V3i(x,y+1,z)+dim.min).a)
+                  crossPosY = true;
+
+              bool crossNegZ = false;
+              bool crossPosZ = false;
+              if (z == 0)
+                  crossNegZ = true;
+              else if (color.a != spr->get(Imath::V3i(x,y,z-1)+dim.min).a)
+                  crossNegZ = true;
+
+              if (z == sz-1)
+                  crossPosZ = true;
+              else if (color.a != spr->get(Imath::V3i(x,y,z+1)+dim.min).a)
+                  crossPosZ = true;
+
+              // If there are any crossings, you will need a material
+              if (crossNegX || crossPosX || crossNegY || crossPosY || crossNegZ || crossPosZ)
+              {
+                  char colorString[64];
+                  sprintf(colorString, "Kd %.4f %.4f %.4f", color.r, color.g, color.b);
+                  const std::string mtl = mtlMap.find(colorString)->second;
+                  fprintf(fp, "usemtl %s\n", mtl.c_str());
+              }
+
+              // Fill in the voxels
+              const int* vl = vertList;
+              const int  vi       = ((y)  *(sz+1)*(sx+1)) + ((z)  *(sx+1)) + (x);
+              const int  viNextZ  = ((y)  *(sz+1)*(sx+1)) + ((z+1)*(sx+1)) + (x);
+              const int  viNextY  = ((y+1)*(sz+1)*(sx+1)) + ((z)  *(sx+1)) + (x);
+              const int  viNextZY = ((y+1)*(sz+1)*(sx+1)) + ((z+1)*(sx+1)) + (x);
+
+              if (crossNegX)
+                  old_obj_write_poly(fp, asTriangles, vl[vi],   vl[viNextZ],   vl[viNextZY],   vl[viNextY]);
+              if (crossPosX)
+                  old_obj_write_poly(fp, asTriangles, vl[vi+1], vl[viNextY+1], vl[viNextZY+1], vl[viNextZ+1]);
+
+              if (crossNegY)
+                  old_obj_write_poly(fp, asTriangles, vl[vi],      vl[vi+1],     vl[viNextZ+1],  vl[viNextZ]);
+              if (crossPosY)
+                  old_obj_write_poly(fp, asTriangles, vl[viNextY], vl[viNextZY], vl[viNextZY+1], vl[viNextY+1]);
+
+              if (crossNegZ)
+                  old_obj_write_poly(fp, asTriangles, vl[vi],      vl[viNextY],  vl[viNextY+1],  vl[vi+1]);
+              if (crossPosZ)
+                  old_obj_write_poly(fp, asTriangles, vl[viNextZ], vl[viNextZ+1], vl[viNextZY+1], vl[viNextZY]);
+          }
+      }
+  }
+
+  delete[] vertList;
+  fclose(fp);
+  return true;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+struct ObjStats
+{
+  int verts, faces;
+  double mb;
+};
+
+
+static ObjStats count_lines(const QString &filename)
+{
+  ObjStats s={ 0, 0, QFileInfo(filename).size()/(1024.0*1024.0) };
+  FILE *fp=fopen(qPrintable(filename), "rb");
+  if (!fp) return s;
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp))
+  {
+    if (line[0]=='v' && line[1]==' ') ++s.verts;
+    else if (line[0]=='f' && line[1]==' ') ++s.faces;
+  }
+  fclose(fp);
+  return s;
+}
+
+
+static void remove_obj(const QString &filename)
+{
+  QFile::remove(filename);
+  QFile::remove(QFileInfo(filename).absolutePath()+"/"+QFileInfo(filename).completeBaseName()+".mtl");
+}
+
+
+static Exporter* find_exporter(const QString &name)
+{
+  foreach (Exporter *p, get_exporters()) if (p->name()==name) return p;
+  return NULL;
+}
+
+
+static void print_stats(const char *name, const ObjStats &s)
+{
+  printf("%-28s %10d v %10d f %8.1f MB\n", name, s.verts, s.faces, s.mb);
+}
+
+
+int main(int argc, char **argv)
+{
+  const int n=argc>1 ? atoi(argv[1]) : 256;
+  if (n<1)
+  {
+    fprintf(stderr, "usage: bench_obj [size]\n");
+    return 2;
+  }
+
+  register_builtin_importers_exporters();
+  Exporter *quadExporter=find_exporter("OBJ files");
+  Exporter *triExporter=find_exporter("OBJ triangle files");
+  Exporter *mergedExporter=find_exporter("OBJ files with merged faces");
+  if (!quadExporter || !triExporter || !mergedExporter)
+  {
+    fprintf(stderr, "OBJ exporters not registered\n");
+    return 1;
+  }
+
+  const QString oldFile=QDir::temp().filePath("bench_obj_old.obj");
+  const QString newFile=QDir::temp().filePath("bench_obj_new.obj");
+  SproxelProjectPtr project(new SproxelProject());
+
+  VoxelGridGroupPtr spr=make_terrain(n);
+  printf("%d^3 terrain, one run each\n\n", n);
+  print_header("old", "new");
+
+  BenchTimer t(1);
+  t.start(); bool ok=old_obj_export(oldFile, spr, false); t.next();
+  const double oldQuads=t.ms();
+  const ObjStats oldQuadStats=count_lines(oldFile);
+
+  t=BenchTimer(1);
+  t.start(); ok=quadExporter->doExport(newFile, project, spr) && ok; t.next();
+  print_result("quads", oldQuads, t.ms());
+  const ObjStats newQuadStats=count_lines(newFile);
+
+  t=BenchTimer(1);
+  t.start(); ok=old_obj_export(oldFile, spr, true) && ok; t.next();
+  const double oldTris=t.ms();
+  const ObjStats oldTriStats=count_lines(oldFile);
+
+  t=BenchTimer(1);
+  t.start(); ok=triExporter->doExport(newFile, project, spr) && ok; t.next();
+  print_result("triangles", oldTris, t.ms());
+  const ObjStats newTriStats=count_lines(newFile);
+
+  t=BenchTimer(1);
+  t.start(); ok=mergedExporter->doExport(newFile, project, spr) && ok; t.next();
+  print_result("merged quads (vs old quads)", oldQuads, t.ms());
+  const ObjStats mergedStats=count_lines(newFile);
+
+  printf("\n");
+  print_stats("old quads", oldQuadStats);
+  print_stats("new quads", newQuadStats);
+  print_stats("old triangles", oldTriStats);
+  print_stats("new triangles", newTriStats);
+  print_stats("merged quads", mergedStats);
+
+  // Welding keeps exactly the surface vertices, so both counts must agree
+  ok=ok && oldQuadStats.faces==newQuadStats.faces && oldQuadStats.verts==newQuadStats.verts
+        && oldTriStats.faces==newTriStats.faces;
+  printf("\nface and vertex counts %s\n", ok ? "match" : "DIFFER");
+
+  remove_obj(oldFile);
+  remove_obj(newFile);
+  return ok ? 0 : 1;
+}
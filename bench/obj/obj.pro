@@ -0,0 +1,8 @@
+# OBJ export against the old per-voxel fprintf exporter
+
+CONFIG += sproxel_core
+include(../bench.pri)
+
+TARGET = bench_obj
+
+SOURCES += main.cpp
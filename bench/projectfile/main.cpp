@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QBuffer>
+#include "SproxelProject.h"
+#include "bench.h"
+
+
+// Layer images as they were built when projects were saved and loaded by
+// sproxel_utils.py: setPixel() and pixel() per voxel, a mirrored() copy, and
+// set() per voxel on load.  The zip and JSON handling the script did around
+// them is timed by old_sxl.py with Python 2, add its figures to these for
+// the old totals.
+
+static QImage old_make_image(const VoxelGridLayer &layer)
+{
+  const Imath::Box3i dim=layer.bounds();
+  const Imath::V3i cellDim = dim.size()+Imath::V3i(1);
+
+  const int height = cellDim.y;
+  const int width = cellDim.x * cellDim.z;
+  QImage writeMe(QSize(width, height), layer.isIndexed()?QImage::Format_Indexed8:QImage::Format_ARGB32);
+
+  if (layer.isIndexed())
+  {
+    ColorPalettePtr pal=layer.palette();
+    if (pal)
+    {
+      writeMe.setColorCount(pal->numColors());
+      for (int i=0; i<pal->numColors(); ++i)
+      {
+        SproxelColor c=pal->color(i)*255.0f;
+        writeMe.setColor(i, qRgba(int(c.r), int(c.g), int(c.b), int(c.a)));
+      }
+    }
+
+    for (int slice = 0; slice < cellDim.z; slice++)
+    {
+      const int sliceOffset = slice * cellDim.x;
+      for (int y = 0; y < cellDim.y; y++)
+      {
+        for (int x = 0; x < cellDim.x; x++)
+          writeMe.setPixel(x+sliceOffset, y, layer.getInd(Imath::V3i(x, y, slice)+dim.min));
+      }
+    }
+  }
+  else
+  {
+    for (int slice = 0; slice < cellDim.z; slice++)
+    {
+      const int sliceOffset = slice * cellDim.x;
+      for (int y = 0; y < cellDim.y; y++)
+      {
+        for (int x = 0; x < cellDim.x; x++)
+        {
+          const Imath::Color4f colorScaled = layer.getColor(Imath::V3i(x, y, slice)+dim.min) * 255.0f;
+          writeMe.setPixel(x+sliceOffset, y, qRgba(
+            (int)colorScaled.r,
+            (int)colorScaled.g,
+            (int)colorScaled.b,
+            (int)colorScaled.a));
+        }
+      }
+    }
+  }
+
+  writeMe = writeMe.mirrored();
+
+  QString tempStr;
+  writeMe.setText("SproxelFileVersion", "1");
+  writeMe.setText("VoxelGridDimX", tempStr.setNum(cellDim.x));
+  writeMe.setText("VoxelGridDimY", tempStr.setNum(cellDim.y));
+  writeMe.setText("VoxelGridDimZ", tempStr.setNum(cellDim.z));
+
+  return writeMe;
+}
+
+
+static VoxelGridLayerPtr old_from_image(QImage readMe, ColorPalettePtr pal)
+{
+  const int sizeX = readMe.text("VoxelGridDimX").toInt();
+  const int sizeY = readMe.text("VoxelGridDimY").toInt();
+  const int sizeZ = readMe.text("VoxelGridDimZ").toInt();
+
+  if (sizeX == 0 || sizeY == 0 || sizeZ == 0) return VoxelGridLayerPtr();
+
+  readMe = readMe.mirrored();
+
+  VoxelGridLayerPtr layer(new VoxelGridLayer());
+
+  bool indexed=false;
+  if (readMe.colorCount()>0)
+  {
+    indexed=true;
+    layer->setPalette(pal);
+  }
+
+  layer->resize(Imath::Box3i(Imath::V3i(0), Imath::V3i(sizeX, sizeY, sizeZ)-Imath::V3i(1)));
+
+  for (int slice = 0; slice < sizeZ; slice++)
+  {
+    const int sliceOffset = slice * sizeX;
+    for (int y = 0; y < sizeY; y++)
+    {
+      for (int x = 0; x < sizeX; x++)
+      {
+        int index=-1;
+        if (indexed) index=readMe.pixelIndex(x+sliceOffset, y);
+        QRgb pixelValue = readMe.pixel(x+sliceOffset, y);
+        Imath::Color4f color(
+          (float)qRed  (pixelValue) / 255.0f,
+          (float)qGreen(pixelValue) / 255.0f,
+          (float)qBlue (pixelValue) / 255.0f,
+          (float)qAlpha(pixelValue) / 255.0f);
+        layer->set(Imath::V3i(x, y, slice), color, index);
+      }
+    }
+  }
+
+  return layer;
+}
+
+
+//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+
+
+// Balls of n^3 cells, by turns indexed, full color and compact full color.
+// Colors are 8-bit, so the old images keep them exactly.
+static SproxelProjectPtr make_project(int sprites, int n)
+{
+  SproxelProjectPtr project(new SproxelProject());
+  const float r2=n*n*0.25f;
+
+  for (int s=0; s<sprites; ++s)
+  {
+    const bool indexed=(s%3==0);
+    VoxelGridGroupPtr spr(new VoxelGridGroup(Imath::V3i(n),
+      indexed ? project->mainPalette : ColorPalettePtr(), s%3==2));
+    spr->setName(QString("sprite %1").arg(s));
+    VoxelGridLayerPtr layer=spr->curLayer();
+
+    for (int x=0; x<n; ++x)
+      for (int y=0; y<n; ++y)
+        for (int z=0; z<n; ++z)
+        {
+          const Imath::V3f d=Imath::V3f(x, y, z)-Imath::V3f(n*0.5f-0.5f);
+          if (d.length2()>r2) continue;
+
+          const int index=1+((x+y*3+z*5+s)&127);
+          layer->set(Imath::V3i(x, y, z), unpack_color(project->mainPalette->packedColor(index)), indexed ? index : -1);
+        }
+
+    layer->takeDirtyBox();
+    project->sprites.push_back(spr);
+  }
+
+  return project;
+}
+
+
+static bool same_layer(const VoxelGridLayer &a, const VoxelGridLayer &b)
+{
+  const Imath::Box3i box=a.bounds();
+  if (box!=b.bounds() || a.isIndexed()!=b.isIndexed()) return false;
+
+  for (int x=box.min.x; x<=box.max.x; ++x)
+    for (int y=box.min.y; y<=box.max.y; ++y)
+      for (int z=box.min.z; z<=box.max.z; ++z)
+      {
+        const Imath::V3i at(x, y, z);
+        if (a.getPacked(at)!=b.getPacked(at)) return false;
+        if (a.isIndexed() && a.getInd(at)!=b.getInd(at)) return false;
+      }
+
+  return true;
+}
+
+
+static bool same_project(SproxelProjectPtr a, SproxelProjectPtr b)
+{
+  if (!a || !b || a->sprites.size()!=b->sprites.size()) return false;
+
+  for (int s=0; s<a->sprites.size(); ++s)
+  {
+    VoxelGridGroupPtr sa=a->sprites[s], sb=b->sprites[s];
+    sb->load();
+    if (sa->numLayers()!=sb->numLayers() || sa->name()!=sb->name()) return false;
+    for (int i=0; i<sa->numLayers(); ++i)
+      if (!same_layer(*sa->layer(i), *sb->layer(i))) return false;
+  }
+
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{
+  const int sprites=50;
+  const int n=argc>1 ? atoi(argv[1]) : 64;
+  if (n<1)
+  {
+    fprintf(stderr, "usage: bench_projectfile [sprite size]\n");
+    return 2;
+  }
+
+  const QString sxlFile=QDir::temp().filePath("bench_projectfile.sxl");
+  const QString sxbFile=QDir::temp().filePath("bench_projectfile.sxb");
+
+  SproxelProjectPtr project=make_project(sprites, n);
+  printf("%d sprites of %d^3, one run each\n\n", sprites, n);
+
+  // Old: layer images and PNG coding only
+  QVector<QByteArray> pngs;
+  BenchTimer t(1);
+  t.start();
+  foreach (VoxelGridGroupPtr spr, project->sprites)
+  {
+    QByteArray png;
+    QBuffer buf(&png);
+    buf.open(QIODevice::WriteOnly);
+    old_make_image(*spr->curLayer()).save(&buf, "PNG");
+    pngs.push_back(png);
+  }
+  t.next();
+  const double oldSave=t.ms();
+
+  QVector<VoxelGridLayerPtr> oldLayers;
+  t=BenchTimer(1);
+  t.start();
+  for (int s=0; s<pngs.size(); ++s)
+  {
+    QImage image;
+    image.loadFromData(pngs[s], "PNG");
+    oldLayers.push_back(old_from_image(image, project->sprites[s]->curLayer()->palette()));
+  }
+  t.next();
+  const double oldLoad=t.ms();
+
+  // New: whole project files
+  t=BenchTimer(1);
+  t.start(); bool ok=save_project(sxlFile, project); t.next();
+  const double sxlSave=t.ms();
+
+  t=BenchTimer(1);
+  t.start(); SproxelProjectPtr sxl=load_project(sxlFile); t.next();
+  const double sxlLoad=t.ms();
+
+  t=BenchTimer(1);
+  t.start(); ok=save_project(sxbFile, project) && ok; t.next();
+  const double sxbSave=t.ms();
+
+  // .sxb layers load on first use, so that's timed too
+  t=BenchTimer(1);
+  t.start();
+  SproxelProjectPtr sxb=load_project(sxbFile);
+  if (sxb) foreach (VoxelGridGroupPtr spr, sxb->sprites) spr->load();
+  t.next();
+  const double sxbLoad=t.ms();
+
+  print_header("old images", "new");
+  print_result("save .sxl", oldSave, sxlSave);
+  print_result("load .sxl", oldLoad, sxlLoad);
+  print_result("save .sxb", oldSave, sxbSave);
+  print_result("load .sxb", oldLoad, sxbLoad);
+
+  printf("\n.sxl %.1f MB, .sxb %.1f MB\n",
+    QFileInfo(sxlFile).size()/(1024.0*1024.0), QFileInfo(sxbFile).size()/(1024.0*1024.0));
+
+  // Old images lost the compact flag, only the voxels are compared
+  bool oldOk=oldLayers.size()==project->sprites.size();
+  for (int s=0; oldOk && s<oldLayers.size(); ++s)
+    oldOk=oldLayers[s] && same_layer(*project->sprites[s]->curLayer(), *oldLayers[s]);
+
+  ok=ok && same_project(project, sxl) && same_project(project, sxb);
+  printf("\nnew round trips %s, old round trip %s\n", ok ? "match" : "FAILED", oldOk ? "matches" : "FAILED");
+
+  QFile::remove(sxlFile);
+  QFile::remove(sxbFile);
+  return ok && oldOk ? 0 : 1;
+}
@@ -0,0 +1,266 @@
+"""Times the Python .sxl code that sproxel_utils.py had before .sxl files
+moved to C++: zipfile, json and the Python objects around the layer images.
+
+The sproxel module is replaced by a stand-in, layer images are encoded as
+PNG up front and not decoded on load.  That part is timed by
+bench_projectfile as "old images", add its figures to these for the old
+total.  Same project as bench_projectfile: 50 balls of n^3 cells, by turns
+indexed, full color and compact full color.
+
+  python2 old_sxl.py [sprite size]
+"""
+
+import os, sys, time, types, struct, zlib, tempfile
+
+
+#ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ#
+# stand-in for the sproxel module, only what the old code touched
+
+class Palette(object):
+  def __init__(self):
+    self.name=''
+    self.colors=[]
+
+
+class Layer(object):
+  def __init__(self, png='', palette=None):
+    self.name='main layer'
+    self.offset=(0, 0, 0)
+    self.visible=True
+    self.compact=False
+    self.palette=palette
+    self.dataType='IND' if palette!=None else 'RGB'
+    self.png=png
+
+  def toPNG(self):
+    return self.png
+
+
+class Sprite(object):
+  def __init__(self):
+    self.name=''
+    self.layers=[]
+    self.curLayerIndex=0
+
+  def insertLayerAbove(self, i, l):
+    self.layers.insert(i, l)
+
+
+class Project(object):
+  def __init__(self):
+    self.sprites=[]
+    self.palettes=[]
+    self.mainPalette=None
+
+
+def layer_from_png(data, pal):
+  return Layer(data, pal)
+
+
+sproxel=types.ModuleType('sproxel')
+sproxel.Palette=Palette
+sproxel.Sprite=Sprite
+sproxel.Project=Project
+sproxel.layer_from_png=layer_from_png
+sys.modules['sproxel']=sproxel
+
+
+#ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ#
+# sproxel_utils.py before the .sxl code moved to C++, unchanged
+
+from zipfile import ZipFile, ZIP_DEFLATED
+import json
+
+
+CUR_VERSION=1
+
+
+def save_project(filename, proj):
+  # gather layers
+  layers=[]
+  for spr in proj.sprites:
+    for l in spr.layers:
+      if l not in layers: layers.append(l)
+
+  # prepare metadata
+  meta={}
+  meta['version']=CUR_VERSION
+
+  meta['layers']=[
+    dict(name=l.name, offset=l.offset, visible=l.visible, compact=l.compact,
+      palette = proj.palettes.index(l.palette) if l.palette!=None else -1)
+    for l in layers]
+
+  meta['sprites']=[
+    dict(name=s.name, layers=[layers.index(l) for l in s.layers], curLayer=s.curLayerIndex)
+    for s in proj.sprites]
+
+  meta['palettes']=[
+    dict(name=p.name, colors=p.colors)
+    for p in proj.palettes]
+
+  meta['mainPalette']=proj.palettes.index(proj.mainPalette)
+
+  # write zip file
+  with ZipFile(filename, 'w', ZIP_DEFLATED) as zf:
+    zf.writestr('metadata.json', json.dumps(meta, sort_keys=True, indent=2))
+    for i, l in enumerate(layers): zf.writestr('%04d.png' % i, l.toPNG())
+
+  return True
+
+
+
+def load_project(filename):
+  prj=sproxel.Project()
+
+  with ZipFile(filename, 'r') as zf:
+    meta=json.loads(zf.read('metadata.json'))
+
+    # load palettes
+    palettes=[]
+    for mp in meta['palettes']:
+      p=sproxel.Palette()
+      p.name=mp['name']
+      p.colors=[tuple(c) for c in mp['colors']]
+      palettes.append(p)
+
+    prj.palettes=palettes
+
+    try:
+      prj.mainPalette=palettes[meta['mainPalette']]
+    except IndexError:
+      try:
+        prj.mainPalette=palettes[0]
+      except IndexError:
+        prj.mainPalette=sproxel.Palette()
+
+    # load layers
+    layers=[]
+    for i, ml in enumerate(meta['layers']):
+      l=sproxel.layer_from_png(zf.read('%04d.png' % i),
+        prj.palettes[ml['palette']] if ml['palette']>=0 else None)
+      l.name   =ml['name'   ]
+      l.offset =tuple(ml['offset'])
+      l.visible=ml['visible']
+      l.compact=ml.get('compact', False)
+      print 'layer', i, 'type', l.dataType
+      layers.append(l)
+
+    # load sprites
+    sprites=[]
+    for ms in meta['sprites']:
+      s=sproxel.Sprite()
+      s.name=ms['name']
+      for i, li in enumerate(ms['layers']):
+        l=layers[li]
+        s.insertLayerAbove(i, l)
+      s.curLayerIndex=ms['curLayer']
+      sprites.append(s)
+
+    prj.sprites=sprites
+
+  #print prj.sprites
+  return prj
+
+
+#ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ#
+
+
+def png_chunk(kind, data):
+  return struct.pack('>I', len(data))+kind+data+struct.pack('>I', zlib.crc32(kind+data) & 0xffffffff)
+
+
+# Layer image as the old code laid it out: slices side by side, flipped
+def layer_png(n, s, colors, indexed):
+  r2=n*n*0.25
+  c=n*0.5-0.5
+  rows=[]
+  for y in xrange(n-1, -1, -1):
+    row=bytearray('\0')
+    for z in xrange(n):
+      for x in xrange(n):
+        dx, dy, dz = x-c, y-c, z-c
+        index=0
+        if dx*dx+dy*dy+dz*dz<=r2: index=1+((x+y*3+z*5+s)&127)
+        if indexed: row.append(index)
+        else: row.extend(colors[index] if index else '\0\0\0\0')
+    rows.append(str(row))
+
+  text=''.join(png_chunk('tEXt', k+'\0'+v) for k, v in (
+    ('SproxelFileVersion', '1'), ('VoxelGridDimX', str(n)),
+    ('VoxelGridDimY', str(n)), ('VoxelGridDimZ', str(n))))
+
+  if indexed:
+    ihdr=struct.pack('>IIBBBBB', n*n, n, 8, 3, 0, 0, 0)
+    plte=png_chunk('PLTE', ''.join(col[:3] for col in colors))+png_chunk('tRNS', ''.join(col[3] for col in colors))
+  else:
+    ihdr=struct.pack('>IIBBBBB', n*n, n, 8, 6, 0, 0, 0)
+    plte=''
+
+  return ('\x89PNG\r\n\x1a\n'+png_chunk('IHDR', ihdr)+plte+text+
+    png_chunk('IDAT', zlib.compress(''.join(rows), 6))+png_chunk('IEND', ''))
+
+
+def make_project(sprites, n):
+  prj=Project()
+  pal=Palette()
+  pal.name='main'
+  pal.colors=[(((i*37)&255)/255.0, ((i*91)&255)/255.0, ((i*53)&255)/255.0, 1.0) for i in xrange(256)]
+  pal.colors[0]=(0.0, 0.0, 0.0, 0.0)
+  prj.palettes=[pal]
+  prj.mainPalette=pal
+
+  colors=[''.join(chr(int(round(v*255))) for v in col) for col in pal.colors]
+
+  for s in xrange(sprites):
+    indexed=(s%3==0)
+    l=Layer(layer_png(n, s, colors, indexed), pal if indexed else None)
+    l.compact=(s%3==2)
+    spr=Sprite()
+    spr.name='sprite %d' % s
+    spr.layers=[l]
+    prj.sprites.append(spr)
+
+  return prj
+
+
+def best_of(runs, f):
+  best=None
+  for i in xrange(runs):
+    t=time.time()
+    f()
+    t=time.time()-t
+    if best==None or t<best: best=t
+  return best*1000.0
+
+
+def main():
+  n=int(sys.argv[1]) if len(sys.argv)>1 else 64
+  prj=make_project(50, n)
+  fn=os.path.join(tempfile.gettempdir(), 'bench_old_sxl.sxl')
+
+  print '50 sprites of %d^3, best of 5' % n
+  save_ms=best_of(5, lambda: save_project(fn, prj))
+
+  # the per-layer print is part of the old load, keep it off the console
+  out=sys.stdout
+  sys.stdout=open(os.devnull, 'w')
+  try:
+    load_ms=best_of(5, lambda: load_project(fn))
+    loaded=load_project(fn)
+  finally:
+    sys.stdout.close()
+    sys.stdout=out
+
+  ok=(len(loaded.sprites)==len(prj.sprites) and
+    all(a.layers[0].png==b.layers[0].png for a, b in zip(prj.sprites, loaded.sprites)))
+
+  print 'save zip+json  %10.2f ms' % save_ms
+  print 'load zip+json  %10.2f ms' % load_ms
+  print '.sxl %.1f MB, round trip %s' % (os.path.getsize(fn)/(1024.0*1024.0), 'matches' if ok else 'FAILED')
+  os.remove(fn)
+  return 0 if ok else 1
+
+
+if __name__=='__main__':
+  sys.exit(main())
@@ -0,0 +1,8 @@
+# Native .sxl and .sxb project files against the old per-pixel layer images
+
+CONFIG += sproxel_core
+include(../bench.pri)
+
+TARGET = bench_projectfile
+
+SOURCES += main.cpp
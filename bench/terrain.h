@@ -0,0 +1,34 @@
+#ifndef __BENCH_TERRAIN_H__
+#define __BENCH_TERRAIN_H__
+
+
+#include <math.h>
+#include <algorithm>
+#include "VoxelGridGroup.h"
+
+
+// Rolling terrain with colored height bands, so greedy merging has both
+// flat areas and steps to deal with, and material lists more than one entry
+inline VoxelGridGroupPtr make_terrain(int n)
+{
+  VoxelGridGroupPtr spr(new VoxelGridGroup(Imath::V3i(n), ColorPalettePtr()));
+  VoxelGridLayerPtr layer=spr->curLayer();
+
+  for (int x=0; x<n; ++x)
+    for (int z=0; z<n; ++z)
+    {
+      const double h=0.5+0.25*sin(x*0.11)*cos(z*0.07)+0.1*sin((x+z)*0.31);
+      const int top=std::min(n-1, int(h*n));
+      for (int y=0; y<=top; ++y)
+      {
+        const int band=y*8/n;
+        layer->set(Imath::V3i(x, y, z), SproxelColor(band/7.0f, 1-band/7.0f, (band&1) ? 0.8f : 0.2f, 1));
+      }
+    }
+
+  spr->takeDirtyBox();
+  return spr;
+}
+
+
+#endif
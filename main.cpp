@@ -1,11 +1,14 @@
 #include "MainWindow.h"
 #include "ImportExport.h"
+#include "Batch.h"
 #include "script.h"
 #include "ConsoleWidget.h"
 #include "pyConsole.h"
 
 #include <QtGui>
 #include <QApplication>
+#include <QCoreApplication>
+#include <string.h>
 
 
 MainWindow *main_window=NULL;
@@ -13,6 +16,18 @@ MainWindow *main_window=NULL;
 
 int main(int argc, char *argv[])
 {
+    // Headless conversion, no display or GL context needed.
+    // Python plugins are not loaded, the script console needs the GUI.
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--batch") == 0)
+        {
+            QCoreApplication a(argc, argv);
+            register_builtin_importers_exporters();
+            return run_batch(a.arguments());
+        }
+    }
+
     QString filename = "";
     if (argc > 1)
         filename = argv[1];
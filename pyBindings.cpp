@@ -7,6 +7,7 @@
 #include "VoxelGridGroup.h"
 #include "SproxelProject.h"
 #include "MainWindow.h"
+#include "Quantize.h"
 
 
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
@@ -65,6 +66,32 @@ bool py_to_color(PyObject *o, SproxelColor &c)
 }
 
 
+// Read-only data of an object with the new or the old style buffer interface
+struct PyReadBuffer
+{
+  Py_buffer view;
+  bool hasView;
+  const void *data;
+  Py_ssize_t size;
+
+  PyReadBuffer() : hasView(false), data(NULL), size(0) {}
+  ~PyReadBuffer() { if (hasView) PyBuffer_Release(&view); }
+
+  bool get(PyObject *o)
+  {
+    if (PyObject_CheckBuffer(o) && PyObject_GetBuffer(o, &view, PyBUF_C_CONTIGUOUS)==0)
+    {
+      hasView=true;
+      data=view.buf;
+      size=view.len;
+      return true;
+    }
+    PyErr_Clear();
+    return PyObject_AsReadBuffer(o, &data, &size)==0;
+  }
+};
+
+
 //  Palette  ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
@@ -423,6 +450,27 @@ static int PyLayer_init(PyLayer *self, PyObject *args, PyObject *kwds)
   if (!self->layer) { PyErr_SetString(PyExc_TypeError, "NULL Layer"); return -1; }
 
 
+// First sprite of the project using the layer
+static VoxelGridGroupPtr layer_owner(SproxelProjectPtr project, VoxelGridLayerPtr layer)
+{
+  if (project)
+    foreach (VoxelGridGroupPtr spr, project->sprites)
+      for (int i=0; i<spr->numLayers(); ++i)
+        if (spr->layer(i)==layer) return spr;
+  return VoxelGridGroupPtr();
+}
+
+
+// Replaces the layer contents by changed as an undo step.  Region undo
+// steps store raw bricks, so data type changes must not bypass the stack.
+static void change_layer(VoxelGridLayerPtr layer, VoxelGridLayerPtr changed)
+{
+  if (!main_window) { *layer=*changed; return; }
+
+  main_window->undoManager()->changeLayer(layer_owner(main_window->project(), layer), layer, changed);
+}
+
+
 static PyObject* PyLayer_getOffset(PyLayer *self, void*)
 {
   CHECK_PYLAYER
@@ -518,12 +566,33 @@ static PyObject* PyLayer_getDataType(PyLayer *self, void*)
   {
     case VoxelGridLayer::TYPE_IND: s="IND"; break;
     case VoxelGridLayer::TYPE_RGB: s="RGB"; break;
+    case VoxelGridLayer::TYPE_RGBA8: s="RGBA8"; break;
     default: s="UNK";
   }
   return PyString_FromString(s);
 }
 
 
+static PyObject* PyLayer_getCompact(PyLayer *self, void*)
+{
+  CHECK_PYLAYER
+  return PyBool_FromLong(self->layer->isCompact());
+}
+
+
+static int PyLayer_setCompact(PyLayer *self, PyObject *value, void*)
+{
+  CHECK_PYLAYER_S
+  const bool compact=PyObject_IsTrue(value);
+  if (compact==self->layer->isCompact()) return 0;
+
+  VoxelGridLayerPtr changed(new VoxelGridLayer(*self->layer));
+  changed->setCompact(compact);
+  change_layer(self->layer, changed);
+  return 0;
+}
+
+
 static PyGetSetDef pyLayer_getsets[]=
 {
   {"offset", (getter)PyLayer_getOffset, (setter)PyLayer_setOffset, "Grid offset", NULL},
@@ -533,6 +602,7 @@ static PyGetSetDef pyLayer_getsets[]=
   {"size", (getter)PyLayer_getSize, NULL, "Grid size", NULL},
   {"bounds", (getter)PyLayer_getBounds, NULL, "Grid bounds", NULL},
   {"dataType", (getter)PyLayer_getDataType, NULL, "Grid data type", NULL},
+  {"compact", (getter)PyLayer_getCompact, (setter)PyLayer_setCompact, "Store RGB data as packed 8-bit color", NULL},
   {NULL, NULL, NULL, NULL, NULL}
 };
 
@@ -628,6 +698,19 @@ static PyObject* PyLayer_toPNG(PyLayer *self)
 }
 
 
+static PyObject* PyLayer_toIndexed(PyLayer *self, PyObject *args)
+{
+  CHECK_PYLAYER
+  PyPalette *pal;
+  if (!PyArg_ParseTuple(args, "O!", &sproxelPyPaletteType, &pal)) return NULL;
+
+  VoxelGridLayerPtr converted(new VoxelGridLayer(*self->layer));
+  if (!convert_to_indexed(converted, pal->pal)) Py_RETURN_FALSE;
+  change_layer(self->layer, converted);
+  Py_RETURN_TRUE;
+}
+
+
 static PyMethodDef pyLayer_methods[]=
 {
   { "reset", (PyCFunction)PyLayer_reset, METH_NOARGS, "Reset layer to the default blank state." },
@@ -637,6 +720,8 @@ static PyMethodDef pyLayer_methods[]=
   { "set", (PyCFunction)PyLayer_set, METH_VARARGS|METH_KEYWORDS,
       "Set color and/or index value of the specified voxel. Will expand grid if necessary." },
   { "toPNG", (PyCFunction)PyLayer_toPNG, METH_NOARGS, "Save layer as PNG with text fields and return PNG data as string." },
+  { "toIndexed", (PyCFunction)PyLayer_toIndexed, METH_VARARGS,
+      "Convert RGB layer to the nearest colors of the palette. Returns False for indexed layers." },
   { NULL, NULL, 0, NULL }
 };
 
@@ -709,6 +794,7 @@ PyTypeObject sproxelPyLayerType=
 static PyObject* layer_to_py(VoxelGridLayerPtr layer)
 {
   if (!layer) Py_RETURN_NONE;
+  layer->load();
   PyLayer *pyl=PyObject_New(PyLayer, &sproxelPyLayerType);
   if (!pyl) return PyErr_NoMemory();
   *((void**)&pyl->layer)=NULL; // reset memory
@@ -1022,6 +1108,70 @@ static PyObject* PySprite_traceRay(PySprite *self, PyObject *args)
 }
 
 
+static PyObject* PySprite_castRays(PySprite *self, PyObject *args)
+{
+  CHECK_PYSPR
+  PyObject *po, *dobj;
+  if (!PyArg_ParseTuple(args, "OO", &po, &dobj)) return NULL;
+
+  PyReadBuffer pb, db;
+  if (!pb.get(po) || !db.get(dobj)) return NULL;
+
+  const Py_ssize_t raySize=3*sizeof(double);
+  if (pb.size!=db.size || pb.size%raySize)
+  {
+    PyErr_SetString(PyExc_ValueError, "expected origins and directions as the same number of packed float64 triples");
+    return NULL;
+  }
+  const int n=int(pb.size/raySize);
+
+  std::vector<Imath::Line3d> rays(n);
+  for (int i=0; i<n; ++i)
+  {
+    Imath::V3d p, d;
+    memcpy(&p[0], (const char*)pb.data+i*raySize, raySize);
+    memcpy(&d[0], (const char*)db.data+i*raySize, raySize);
+    rays[i].pos=p;
+    rays[i].dir=d.normalized();
+  }
+
+  PyObject *cells=PyByteArray_FromStringAndSize(NULL, n*3*sizeof(int));
+  PyObject *normals=PyByteArray_FromStringAndSize(NULL, n*3*sizeof(int));
+  PyObject *dists=PyByteArray_FromStringAndSize(NULL, n*sizeof(double));
+  if (!cells || !normals || !dists)
+  {
+    Py_XDECREF(cells); Py_XDECREF(normals); Py_XDECREF(dists);
+    return PyErr_NoMemory();
+  }
+
+  int *cp=(int*)PyByteArray_AS_STRING(cells);
+  int *np=(int*)PyByteArray_AS_STRING(normals);
+  double *dp=(double*)PyByteArray_AS_STRING(dists);
+
+  std::vector<RayHit> hits(n);
+  if (n)
+  {
+    Py_BEGIN_ALLOW_THREADS
+    self->spr->castRays(&rays[0], &hits[0], n);
+    Py_END_ALLOW_THREADS
+  }
+
+  for (int i=0; i<n; ++i)
+  {
+    const RayHit &h=hits[i];
+    const bool hit=h.hit && rays[i].dir!=Imath::V3d(0);
+    for (int a=0; a<3; ++a)
+    {
+      cp[i*3+a]=hit ? h.cell[a] : 0;
+      np[i*3+a]=hit ? h.normal[a] : 0;
+    }
+    dp[i]=hit ? h.t : -1.0;
+  }
+
+  return Py_BuildValue("(NNN)", cells, normals, dists);
+}
+
+
 static PyObject* PySprite_bakeLayers(PySprite *self)
 {
   CHECK_PYSPR
@@ -1029,6 +1179,38 @@ static PyObject* PySprite_bakeLayers(PySprite *self)
 }
 
 
+static PyObject* PySprite_toIndexed(PySprite *self, PyObject *args)
+{
+  CHECK_PYSPR
+  int maxColors=256;
+  if (!PyArg_ParseTuple(args, "|i", &maxColors)) return NULL;
+
+  if (!main_window)
+  {
+    ColorPalettePtr pal=quantize_sprite(self->spr, maxColors);
+    if (!pal) Py_RETURN_NONE;
+    return palette_to_py(pal);
+  }
+
+  // Convert copies of the RGB layers and swap them in as one undo step with
+  // the new palette, layers shared with other sprites stay shared
+  QVector<VoxelGridLayerPtr> layers, rgb, converted;
+  for (int i=0; i<self->spr->numLayers(); ++i) layers.push_back(self->spr->layer(i));
+
+  ColorPalettePtr pal=quantize_copies(layers, maxColors, rgb, converted);
+  if (!pal) Py_RETURN_NONE;
+  pal->setName(self->spr->name());
+
+  UndoManager *um=main_window->undoManager();
+  um->beginMacro("Convert to indexed");
+  um->addPalette(main_window->project(), pal);
+  for (int i=0; i<rgb.size(); ++i) um->changeLayer(self->spr, rgb[i], converted[i]);
+  um->endMacro();
+
+  return palette_to_py(pal);
+}
+
+
 static PyMethodDef pySprite_methods[]=
 {
   { "reset", (PyCFunction)PySprite_reset, METH_NOARGS, "Reset sprite to the default empty state." },
@@ -1041,6 +1223,12 @@ static PyMethodDef pySprite_methods[]=
     "Set color and/or index value of the specified voxel in the current layer." },
   { "traceRay", (PyCFunction)PySprite_traceRay, METH_VARARGS, "Trace ray and return tuple of affected grid cells." },
   { "bakeLayers", (PyCFunction)PySprite_bakeLayers, METH_NOARGS, "Bake all layers and return new resulting layer." },
+  { "castRays", (PyCFunction)PySprite_castRays, METH_VARARGS,
+    "Cast rays in parallel and return the first hit of each. Takes origins and directions as buffers "
+    "of packed float64 x, y, z triples (e.g. array.array('d')), returns bytearrays of int32 hit cells, "
+    "int32 face normals and float64 distances, -1 for rays that hit nothing." },
+  { "toIndexed", (PyCFunction)PySprite_toIndexed, METH_VARARGS,
+    "Convert all RGB layers to one new palette of at most max_colors entries and return it." },
   { NULL, NULL, 0, NULL }
 };
 
@@ -1115,6 +1303,7 @@ PyTypeObject sproxelPySpriteType=
 PyObject* sprite_to_py(VoxelGridGroupPtr sprite)
 {
   if (!sprite) Py_RETURN_NONE;
+  sprite->load();
   PySprite *pys=PyObject_New(PySprite, &sproxelPySpriteType);
   if (!pys) return PyErr_NoMemory();
   *((void**)&pys->spr)=NULL; // reset memory
@@ -1439,6 +1628,44 @@ static PyObject* PyUndoManager_setVoxelColor(PyUndoManager *self, PyObject *args
 }
 
 
+static PyObject* PyUndoManager_setVoxelColors(PyUndoManager *self, PyObject *args)
+{
+  CHECK_PYUNDO
+  PySprite *spr;
+  PyObject *vo, *co;
+  int index=-1;
+  if (!PyArg_ParseTuple(args, "O!OO|i", &sproxelPySpriteType, &spr, &vo, &co, &index)) return NULL;
+  SproxelColor c;
+  if (!py_to_color(co, c)) return NULL;
+
+  if (!PySequence_Check(vo))
+  {
+    PyErr_SetString(PyExc_TypeError, "Expected sequence of (x, y, z) tuples");
+    return NULL;
+  }
+
+  Py_ssize_t num=PySequence_Size(vo);
+  if (num<0) return NULL;
+
+  std::vector<Imath::V3i> voxels;
+  voxels.reserve(num);
+
+  for (Py_ssize_t i=0; i<num; ++i)
+  {
+    PyObject *o=PySequence_GetItem(vo, i);
+    if (!o) return NULL;
+    Imath::V3i v;
+    bool ok=PyArg_ParseTuple(o, "iii", &v.x, &v.y, &v.z);
+    Py_DECREF(o);
+    if (!ok) return NULL;
+    voxels.push_back(v);
+  }
+
+  self->undo->setVoxelColors(spr->spr, voxels, c, index);
+  Py_RETURN_NONE;
+}
+
+
 static PyObject* PyUndoManager_setPaletteColor(PyUndoManager *self, PyObject *args)
 {
   CHECK_PYUNDO
@@ -1534,10 +1761,31 @@ static PyObject* PyUndoManager_redo(PyUndoManager *self)
 }
 
 
+static PyObject* PyUndoManager_stats(PyUndoManager *self)
+{
+  CHECK_PYUNDO
+  UndoManager::Stats st=self->undo->stats();
+  return Py_BuildValue("{s:i,s:i,s:K,s:i,s:L,s:K}", "numCommands", st.numCommands, "index", st.index,
+    "dataBytes", (unsigned long long)st.dataBytes, "numSpilled", st.numSpilled,
+    "spilledBytes", (long long)st.spilledBytes, "memoryBudget", (unsigned long long)self->undo->memoryBudget());
+}
+
+
+static PyObject* PyUndoManager_setMemoryBudget(PyUndoManager *self, PyObject *args)
+{
+  CHECK_PYUNDO
+  unsigned long long budget;
+  if (!PyArg_ParseTuple(args, "K", &budget)) return NULL;
+  self->undo->setMemoryBudget(size_t(budget));
+  Py_RETURN_NONE;
+}
+
+
 static PyMethodDef pyUndoManager_methods[]=
 {
   { "changeEntireSprite", (PyCFunction)PyUndoManager_changeEntireSprite, METH_VARARGS, "Change entire sprite." },
   { "setVoxelColor", (PyCFunction)PyUndoManager_setVoxelColor, METH_VARARGS, "Set single voxel color/index." },
+  { "setVoxelColors", (PyCFunction)PyUndoManager_setVoxelColors, METH_VARARGS, "Set color/index of a list of voxels as a single undo step." },
   { "setPaletteColor", (PyCFunction)PyUndoManager_setPaletteColor, METH_VARARGS, "Set palette color." },
   { "addSprite", (PyCFunction)PyUndoManager_addSprite, METH_VARARGS, "Add sprite to project." },
   { "removeSprite", (PyCFunction)PyUndoManager_removeSprite, METH_VARARGS, "Remove sprite from project." },
@@ -1547,6 +1795,8 @@ static PyMethodDef pyUndoManager_methods[]=
   { "clear", (PyCFunction)PyUndoManager_clear, METH_NOARGS, "Clear all undo history." },
   { "undo", (PyCFunction)PyUndoManager_undo, METH_NOARGS, "Undo." },
   { "redo", (PyCFunction)PyUndoManager_redo, METH_NOARGS, "Redo." },
+  { "stats", (PyCFunction)PyUndoManager_stats, METH_NOARGS, "Undo history size: dict with numCommands, index, dataBytes, numSpilled, spilledBytes and memoryBudget." },
+  { "setMemoryBudget", (PyCFunction)PyUndoManager_setMemoryBudget, METH_VARARGS, "Set undo memory budget in bytes, 0 for unlimited." },
   { NULL, NULL, 0, NULL }
 };
 
@@ -1646,75 +1896,125 @@ static PyObject* PySproxel_layerFromPng(PyObject *, PyObject *args)
 }
 
 
-static PyMethodDef moduleMethods[]=
+static PyObject* PySproxel_saveProject(PyObject *, PyObject *args)
 {
-  { "get_project", (PyCFunction)PySproxel_getProject, METH_NOARGS, "Get current Sproxel project." },
-  { "get_undo_manager", (PyCFunction)PySproxel_getUndoManager, METH_NOARGS, "Get current Sproxel undo manager." },
-  { "layer_from_png", (PyCFunction)PySproxel_layerFromPng, METH_VARARGS, "Create layer from PNG data." },
-  { "register_importer", (PyCFunction)PySproxel_registerImporter, METH_O, "Register custom importer object." },
-  { "unregister_importer", (PyCFunction)PySproxel_unregisterImporter, METH_O, "Unregister custom importer object." },
-  { "register_exporter", (PyCFunction)PySproxel_registerExporter, METH_O, "Register custom exporter object." },
-  { "unregister_exporter", (PyCFunction)PySproxel_unregisterExporter, METH_O, "Unregister custom exporter object." },
-  { NULL, NULL, 0, NULL }
-};
+  PyObject *fo;
+  PyProject *pr;
+  if (!PyArg_ParseTuple(args, "OO!", &fo, &sproxelPyProjectType, &pr)) return NULL;
 
+  QString filename;
+  if (!py_to_qstr(fo, filename)) return NULL;
 
-//ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
+  if (save_project(filename, pr->proj)) Py_RETURN_TRUE;
+  Py_RETURN_FALSE;
+}
 
 
-bool save_project(QString filename, SproxelProjectPtr project)
+static PyObject* PySproxel_loadProject(PyObject *, PyObject *arg)
 {
-  if (!py_save_project) return false;
-  PyObject *fn=qstr_to_py(filename);
-  PyObject *pr=project_to_py(project);
-  if (!fn || !pr)
+  QString filename;
+  if (!py_to_qstr(arg, filename)) return NULL;
+
+  SproxelProjectPtr proj=load_project(filename);
+  if (!proj)
   {
-    PyErr_Print();
-    Py_XDECREF(fn);
-    Py_XDECREF(pr);
-    return false;
+    PyErr_SetString(PyExc_IOError, "error loading project");
+    return NULL;
   }
+  return project_to_py(proj);
+}
+
 
-  PyObject *res=PyObject_CallFunctionObjArgs(py_save_project, fn, pr, NULL);
-  Py_XDECREF(fn);
-  Py_XDECREF(pr);
+static PyObject* PySproxel_makePalette(PyObject *, PyObject *args)
+{
+  PyObject *lo;
+  int maxColors=256;
+  if (!PyArg_ParseTuple(args, "O|i", &lo, &maxColors)) return NULL;
 
-  if (!res)
+  QVector<VoxelGridLayerPtr> layers;
+  if (PyObject_TypeCheck(lo, &sproxelPyLayerType))
+    layers.push_back(((PyLayer*)lo)->layer);
+  else if (PyObject_TypeCheck(lo, &sproxelPySpriteType))
   {
-    PyErr_Print();
-    return false;
+    VoxelGridGroupPtr spr=((PySprite*)lo)->spr;
+    for (int i=0; i<spr->numLayers(); ++i) layers.push_back(spr->layer(i));
   }
+  else
+  {
+    PyObject *seq=PySequence_Fast(lo, "expected Layer, Sprite or sequence of Layers");
+    if (!seq) return NULL;
 
-  bool result=PyObject_IsTrue(res);
-  Py_DECREF(res);
+    for (Py_ssize_t i=0; i<PySequence_Fast_GET_SIZE(seq); ++i)
+    {
+      PyObject *o=PySequence_Fast_GET_ITEM(seq, i);
+      if (!PyObject_TypeCheck(o, &sproxelPyLayerType))
+      {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_TypeError, "expected sequence of Layers");
+        return NULL;
+      }
+      layers.push_back(((PyLayer*)o)->layer);
+    }
+    Py_DECREF(seq);
+  }
 
-  return result;
+  return palette_to_py(make_palette(layers, maxColors));
 }
 
 
-SproxelProjectPtr load_project(QString filename)
+static PyObject* PySproxel_quantizeProject(PyObject *, PyObject *args)
 {
-  if (!py_load_project) return SproxelProjectPtr();
-
-  PyObject *fn=qstr_to_py(filename);
-  if (!fn) { PyErr_Print(); return SproxelProjectPtr(); }
+  PyProject *pr;
+  int maxColors=256;
+  if (!PyArg_ParseTuple(args, "O!|i", &sproxelPyProjectType, &pr, &maxColors)) return NULL;
 
-  PyObject *res=PyObject_CallFunctionObjArgs(py_load_project, fn, NULL);
-  Py_XDECREF(fn);
-
-  if (!res || !PyObject_TypeCheck(res, &sproxelPyProjectType))
+  if (!main_window)
   {
-    PyErr_Print();
-    Py_XDECREF(res);
-    return SproxelProjectPtr();
+    ColorPalettePtr pal=quantize_project(pr->proj, maxColors);
+    if (!pal) Py_RETURN_NONE;
+    return palette_to_py(pal);
   }
 
-  SproxelProjectPtr result=((PyProject*)res)->proj;
-  Py_DECREF(res);
-  return result;
+  // Convert copies of the RGB layers, shared ones once, and swap them in
+  // as one undo step
+  QVector<VoxelGridLayerPtr> layers, rgb, converted;
+  foreach (VoxelGridGroupPtr spr, pr->proj->sprites)
+    for (int i=0; i<spr->numLayers(); ++i) layers.push_back(spr->layer(i));
+
+  ColorPalettePtr pal=quantize_copies(layers, maxColors, rgb, converted);
+  if (!pal) Py_RETURN_NONE;
+  pal->setName("quantized");
+
+  UndoManager *um=main_window->undoManager();
+  um->beginMacro("Quantize project");
+  um->addPalette(pr->proj, pal);
+  for (int i=0; i<rgb.size(); ++i)
+    um->changeLayer(layer_owner(pr->proj, rgb[i]), rgb[i], converted[i]);
+  um->endMacro();
+
+  return palette_to_py(pal);
 }
 
 
+static PyMethodDef moduleMethods[]=
+{
+  { "get_project", (PyCFunction)PySproxel_getProject, METH_NOARGS, "Get current Sproxel project." },
+  { "get_undo_manager", (PyCFunction)PySproxel_getUndoManager, METH_NOARGS, "Get current Sproxel undo manager." },
+  { "layer_from_png", (PyCFunction)PySproxel_layerFromPng, METH_VARARGS, "Create layer from PNG data." },
+  { "save_project", (PyCFunction)PySproxel_saveProject, METH_VARARGS, "Save project to .sxl file." },
+  { "load_project", (PyCFunction)PySproxel_loadProject, METH_O, "Load project from .sxl file." },
+  { "make_palette", (PyCFunction)PySproxel_makePalette, METH_VARARGS,
+    "Build palette of at most max_colors entries for RGB layers, index 0 is transparent." },
+  { "quantize_project", (PyCFunction)PySproxel_quantizeProject, METH_VARARGS,
+    "Convert all RGB layers of the project to one new palette, add it to the project and return it." },
+  { "register_importer", (PyCFunction)PySproxel_registerImporter, METH_O, "Register custom importer object." },
+  { "unregister_importer", (PyCFunction)PySproxel_unregisterImporter, METH_O, "Unregister custom importer object." },
+  { "register_exporter", (PyCFunction)PySproxel_registerExporter, METH_O, "Register custom exporter object." },
+  { "unregister_exporter", (PyCFunction)PySproxel_unregisterExporter, METH_O, "Unregister custom exporter object." },
+  { NULL, NULL, 0, NULL }
+};
+
+
 //ZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZZ//
 
 
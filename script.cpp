@@ -22,7 +22,7 @@ QDir exe_dir;
 
 static PyObject *glue=NULL;
 
-PyObject *py_save_project=NULL, *py_load_project=NULL, *py_init_plugin_pathes=NULL,
+PyObject *py_init_plugin_pathes=NULL,
   *py_scan_plugins=NULL, *py_register_plugins=NULL, *py_unregister_plugins=NULL;
 
 
@@ -126,12 +126,6 @@ void init_script(const char *exe_path)
     // check required methods
     bool gotErrors=false;
 
-    py_save_project=PyObject_GetAttrString(mod, "save_project");
-    if (PyErr_Occurred()) { PyErr_Print(); gotErrors=true; }
-
-    py_load_project=PyObject_GetAttrString(mod, "load_project");
-    if (PyErr_Occurred()) { PyErr_Print(); gotErrors=true; }
-
     py_init_plugin_pathes=PyObject_GetAttrString(mod, "init_plugin_pathes");
     if (PyErr_Occurred()) { PyErr_Print(); gotErrors=true; }
 
@@ -160,8 +154,6 @@ void close_script()
   Py_XDECREF(py_register_plugins); py_register_plugins=NULL;
   Py_XDECREF(py_scan_plugins); py_scan_plugins=NULL;
   Py_XDECREF(py_init_plugin_pathes); py_init_plugin_pathes=NULL;
-  Py_XDECREF(py_save_project); py_save_project=NULL;
-  Py_XDECREF(py_load_project); py_load_project=NULL;
 
   #define TOPYT(cls) Py_XDECREF(GLUE(cls, _toPy_py )); GLUE(cls, _toPy_py ) = NULL;
   #define TOCPP(cls) Py_XDECREF(GLUE(cls, _toCpp_py)); GLUE(cls, _toCpp_py) = NULL;
@@ -31,9 +31,6 @@ bool run_script(const class QString &filename);
 
 extern class QDir exe_dir;
 
-extern PyObject *py_save_project, *py_load_project;
-
-
 PyObject* qstr_to_py(const QString &str);
 
 bool py_to_qstr(PyObject *o, QString &str);
@@ -42,6 +42,12 @@ SOURCES += \
     UndoManager.cpp \
     ImportExport.cpp \
     SproxelProject.cpp \
+    ProjectFile.cpp \
+    BrickProjectFile.cpp \
+    ZipArchive.cpp \
+    VoxelMesher.cpp \
+    Quantize.cpp \
+    Batch.cpp \
     script.cpp \
     pyConsole.cpp \
     pyBindings.cpp \
@@ -60,8 +66,15 @@ HEADERS  += \
     GLCamera.h \
     GLModelWidget.h \
     GameVoxelGrid.h \
+    ChunkedVoxelGrid.h \
+    OccupancyMask.h \
+    FloodFill.h \
     VoxelGridGroup.h \
+    VoxelMesher.h \
+    Quantize.h \
+    Batch.h \
     SproxelProject.h \
+    ZipArchive.h \
     MainWindow.h \
     NewGridDialog.h \
     PreferencesDialog.h \